@@ -0,0 +1,6 @@
+AC_DEFUN([DOVECOT_PTHREAD], [
+  dnl o_stream_create_worker() runs compression in a separate thread
+  AC_SEARCH_LIBS(pthread_create, pthread, [
+    AC_DEFINE(HAVE_PTHREAD,, [Define if you have POSIX threads])
+  ])
+])
@@ -0,0 +1,20 @@
+AC_DEFUN([DOVECOT_WANT_ZSTD], [
+  if test "$want_zstd" != "no"; then
+    AC_CHECK_HEADER(zstd.h, [
+      AC_CHECK_LIB(zstd, ZSTD_compress2, [
+        have_zstd=yes
+        have_compress_lib=yes
+        AC_DEFINE(HAVE_ZSTD,, [Define if you have zstd library])
+        COMPRESS_LIBS="$COMPRESS_LIBS -lzstd"
+      ], [
+        if test "$want_zstd" = "yes"; then
+          AC_ERROR([Can't build with zstd support: libzstd not found])
+        fi
+      ])
+    ], [
+      if test "$want_zstd" = "yes"; then
+        AC_ERROR([Can't build with zstd support: zstd.h not found])
+      fi
+    ])
+  fi
+])
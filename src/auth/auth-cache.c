@@ -2,7 +2,7 @@
 
 #include "auth-common.h"
 #include "lib-signals.h"
-#include "hash.h"
+#include "hash-flat.h"
 #include "str.h"
 #include "strescape.h"
 #include "var-expand.h"
@@ -12,7 +12,8 @@
 #include <time.h>
 
 struct auth_cache {
-	HASH_TABLE(char *, struct auth_cache_node *) hash;
+	pool_t node_pool;
+	HASH_FLAT(char *, struct auth_cache_node *) hash;
 	struct auth_cache_node *head, *tail;
 
 	size_t max_size, size_left;
@@ -183,8 +184,8 @@ auth_cache_node_destroy(struct auth_cache *cache, struct auth_cache_node *node)
 	auth_cache_node_unlink(cache, node);
 
 	cache->size_left += node->alloc_size;
-	hash_table_remove(cache->hash, key);
-	i_free(node);
+	hash_flat_remove(cache->hash, key);
+	p_free(cache->node_pool, node);
 }
 
 static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
@@ -198,6 +199,7 @@ static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
 static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
+	struct pool_slab_stats slab_stats;
 	unsigned int total_count;
 	size_t cache_used;
 
@@ -218,6 +220,13 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	       cache_used, cache->max_size,
 	       (unsigned int)(cache_used * 100ULL / cache->max_size));
 
+	pool_slab_get_stats(cache->node_pool, &slab_stats);
+	i_info("Authentication cache memory: "
+	       "%"PRIuSIZE_T" bytes allocated in %u slabs and %u large blocks, "
+	       "%"PRIuSIZE_T" bytes in use",
+	       slab_stats.alloc_size, slab_stats.slab_count,
+	       slab_stats.large_count, slab_stats.used_size);
+
 	/* reset counters */
 	cache->hit_count = cache->miss_count = 0;
 	cache->pos_entries = cache->neg_entries = 0;
@@ -231,7 +240,8 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 	struct auth_cache *cache;
 
 	cache = i_new(struct auth_cache, 1);
-	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	cache->node_pool = pool_slab_create("auth cache nodes");
+	hash_flat_create(&cache->hash, 0, str_hash, strcmp);
 	cache->max_size = max_size;
 	cache->size_left = max_size;
 	cache->ttl_secs = ttl_secs;
@@ -253,17 +263,18 @@ void auth_cache_free(struct auth_cache **_cache)
 	lib_signals_unset_handler(SIGUSR2, sig_auth_cache_stats, cache);
 
 	auth_cache_clear(cache);
-	hash_table_destroy(&cache->hash);
+	hash_flat_destroy(&cache->hash);
+	pool_unref(&cache->node_pool);
 	i_free(cache);
 }
 
 unsigned int auth_cache_clear(struct auth_cache *cache)
 {
-	unsigned int ret = hash_table_count(cache->hash);
+	unsigned int ret = hash_flat_count(cache->hash);
 
 	while (cache->tail != NULL)
 		auth_cache_node_destroy(cache, cache->tail);
-	hash_table_clear(cache->hash, FALSE);
+	hash_flat_clear(cache->hash);
 	return ret;
 }
 
@@ -378,7 +389,7 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	*neg_expired_r = FALSE;
 
 	key = auth_request_expand_cache_key(request, key);
-	node = hash_table_lookup(cache->hash, key);
+	node = hash_flat_lookup(cache->hash, key);
 	if (node == NULL) {
 		cache->miss_count++;
 		return NULL;
@@ -442,14 +453,14 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 	while (cache->size_left < alloc_size && cache->tail != NULL)
 		auth_cache_node_destroy(cache, cache->tail);
 
-	node = hash_table_lookup(cache->hash, key);
+	node = hash_flat_lookup(cache->hash, key);
 	if (node != NULL) {
 		/* key is already in cache (probably expired), remove it */
 		auth_cache_node_destroy(cache, node);
 	}
 
 	/* @UNSAFE */
-	node = i_malloc(alloc_size);
+	node = p_malloc(cache->node_pool, alloc_size);
 	node->created = time(NULL);
 	node->alloc_size = alloc_size;
 	node->last_success = last_success;
@@ -460,7 +471,7 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 
 	cache->size_left -= alloc_size;
 	hash_key = node->data;
-	hash_table_insert(cache->hash, hash_key, node);
+	hash_flat_insert(cache->hash, hash_key, node);
 
 	if (*value != '\0') {
 		cache->pos_entries++;
@@ -477,7 +488,7 @@ void auth_cache_remove(struct auth_cache *cache,
 	struct auth_cache_node *node;
 
 	key = auth_request_expand_cache_key(request, key);
-	node = hash_table_lookup(cache->hash, key);
+	node = hash_flat_lookup(cache->hash, key);
 	if (node == NULL)
 		return;
 
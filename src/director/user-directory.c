@@ -3,7 +3,7 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "array.h"
-#include "hash.h"
+#include "hash-flat.h"
 #include "llist.h"
 #include "mail-host.h"
 
@@ -21,8 +21,10 @@ struct user_directory_iter {
 };
 
 struct user_directory {
+	/* users */
+	pool_t user_pool;
 	/* unsigned int username_hash => user */
-	HASH_TABLE(void *, struct user *) hash;
+	HASH_FLAT(void *, struct user *) hash;
 	/* sorted by time. may be unsorted while handshakes are going on. */
 	struct user *head, *tail;
 
@@ -62,9 +64,9 @@ static void user_free(struct user_directory *dir, struct user *user)
 		dir->user_free_hook(user);
 	user_move_iters(dir, user);
 
-	hash_table_remove(dir->hash, POINTER_CAST(user->username_hash));
+	hash_flat_remove(dir->hash, POINTER_CAST(user->username_hash));
 	DLLIST2_REMOVE(&dir->head, &dir->tail, user);
-	i_free(user);
+	p_free(dir->user_pool, user);
 }
 
 static bool user_directory_user_has_connections(struct user_directory *dir,
@@ -122,7 +124,7 @@ static void user_directory_drop_expired(struct user_directory *dir)
 
 unsigned int user_directory_count(struct user_directory *dir)
 {
-	return hash_table_count(dir->hash);
+	return hash_flat_count(dir->hash);
 }
 
 struct user *user_directory_lookup(struct user_directory *dir,
@@ -132,7 +134,7 @@ struct user *user_directory_lookup(struct user_directory *dir,
 	time_t expire_timestamp;
 
 	user_directory_drop_expired(dir);
-	user = hash_table_lookup(dir->hash, POINTER_CAST(username_hash));
+	user = hash_flat_lookup(dir->hash, POINTER_CAST(username_hash));
 	if (user != NULL && !user_directory_user_has_connections(dir, user, &expire_timestamp)) {
 		user_free(dir, user);
 		user = NULL;
@@ -150,7 +152,7 @@ user_directory_add(struct user_directory *dir, unsigned int username_hash,
 	if (timestamp > ioloop_time)
 		timestamp = ioloop_time;
 
-	user = i_new(struct user, 1);
+	user = p_new(dir->user_pool, struct user, 1);
 	user->username_hash = username_hash;
 	user->host = host;
 	user->host->user_count++;
@@ -162,7 +164,7 @@ user_directory_add(struct user_directory *dir, unsigned int username_hash,
 		dir->to_expire_timestamp = tv.tv_sec;
 		dir->to_expire = timeout_add_absolute(&tv, user_directory_drop_expired, dir);
 	}
-	hash_table_insert(dir->hash, POINTER_CAST(user->username_hash), user);
+	hash_flat_insert(dir->hash, POINTER_CAST(user->username_hash), user);
 	return user;
 }
 
@@ -202,7 +204,7 @@ void user_directory_sort(struct user_directory *dir)
 {
 	ARRAY(struct user *) users;
 	struct user *user, *const *userp;
-	unsigned int i, users_count = hash_table_count(dir->hash);
+	unsigned int i, users_count = hash_flat_count(dir->hash);
 
 	dir->sort_pending = FALSE;
 
@@ -271,7 +273,8 @@ user_directory_init(unsigned int timeout_secs,
 	i_assert(dir->timeout_secs/2 > dir->user_near_expiring_secs);
 
 	dir->user_free_hook = user_free_hook;
-	hash_table_create_direct(&dir->hash, default_pool, 0);
+	dir->user_pool = pool_slab_create("director users");
+	hash_flat_create_direct(&dir->hash, 0);
 	i_array_init(&dir->iters, 8);
 	return dir;
 }
@@ -287,7 +290,8 @@ void user_directory_deinit(struct user_directory **_dir)
 	while (dir->head != NULL)
 		user_free(dir, dir->head);
 	timeout_remove(&dir->to_expire);
-	hash_table_destroy(&dir->hash);
+	hash_flat_destroy(&dir->hash);
+	pool_unref(&dir->user_pool);
 	array_free(&dir->iters);
 	i_free(dir);
 }
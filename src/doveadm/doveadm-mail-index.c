@@ -1,16 +1,21 @@
 /* Copyright (c) 2010-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
 #include "strescape.h"
+#include "crc32.h"
 #include "net.h"
 #include "write-full.h"
+#include "time-util.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
+#include "mail-user.h"
 #include "mail-search-build.h"
 #include "mailbox-list-iter.h"
 #include "doveadm-settings.h"
 #include "doveadm-mail.h"
+#include "doveadm-mail-parallel.h"
 
 #include <stdio.h>
 
@@ -22,20 +27,25 @@ struct index_cmd_context {
 
 	int queue_fd;
 	unsigned int max_recent_msgs;
+	/* number of mails indexed by this process */
+	unsigned int indexed_count;
 	bool queue:1;
 	bool have_wildcards:1;
 };
 
-static int cmd_index_box_precache(struct mailbox *box)
+static int
+cmd_index_box_precache(struct index_cmd_context *ctx, struct mailbox *box)
 {
 	struct mailbox_status status;
 	struct mailbox_transaction_context *trans;
 	struct mail_search_args *search_args;
-	struct mail_search_context *ctx;
+	struct mail_search_context *search_ctx;
 	struct mail *mail;
 	struct mailbox_metadata metadata;
+	struct timeval start_time;
 	uint32_t seq;
 	unsigned int counter = 0, max;
+	bool show_progress = doveadm_verbose && ctx->ctx.parallel_count <= 1;
 	int ret = 0;
 
 	if (mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS,
@@ -65,25 +75,28 @@ static int cmd_index_box_precache(struct mailbox *box)
 		       mailbox_get_vname(box), seq, status.messages);
 	}
 
+	io_loop_time_refresh();
+	start_time = ioloop_timeval;
 	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC,
 					  __func__);
 	search_args = mail_search_build_init();
 	mail_search_build_add_seqset(search_args, seq, status.messages);
-	ctx = mailbox_search_init(trans, search_args, NULL,
-				  metadata.precache_fields, NULL);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 metadata.precache_fields, NULL);
 	mail_search_args_unref(&search_args);
 
 	max = status.messages - seq + 1;
-	while (mailbox_search_next(ctx, &mail)) {
+	while (mailbox_search_next(search_ctx, &mail)) {
 		mail_precache(mail);
-		if (doveadm_verbose && ++counter % 100 == 0) {
+		if (++counter % 100 == 0 && show_progress) {
 			printf("\r%u/%u", counter, max);
 			fflush(stdout);
 		}
 	}
-	if (doveadm_verbose)
+	if (show_progress)
 		printf("\r%u/%u\n", counter, max);
-	if (mailbox_search_deinit(&ctx) < 0) {
+	ctx->indexed_count += counter;
+	if (mailbox_search_deinit(&search_ctx) < 0) {
 		i_error("Mailbox %s: Mail search failed: %s",
 			mailbox_get_vname(box),
 			mailbox_get_last_internal_error(box, NULL));
@@ -95,6 +108,12 @@ static int cmd_index_box_precache(struct mailbox *box)
 			mailbox_get_last_internal_error(box, NULL));
 		ret = -1;
 	}
+	if (doveadm_verbose && ctx->ctx.parallel_count > 1) {
+		io_loop_time_refresh();
+		i_info("%s: Cached %u mails in %d msecs",
+		       mailbox_get_vname(box), counter,
+		       timeval_diff_msecs(&ioloop_timeval, &start_time));
+	}
 	return ret;
 }
 
@@ -133,7 +152,7 @@ cmd_index_box(struct index_cmd_context *ctx, const struct mailbox_info *info)
 		doveadm_mail_failed_mailbox(&ctx->ctx, box);
 		ret = -1;
 	} else {
-		if (cmd_index_box_precache(box) < 0) {
+		if (cmd_index_box_precache(ctx, box) < 0) {
 			doveadm_mail_failed_mailbox(&ctx->ctx, box);
 			ret = -1;
 		}
@@ -176,6 +195,48 @@ static void cmd_index_queue(struct index_cmd_context *ctx,
 	} T_END;
 }
 
+static bool
+cmd_index_box_is_mine(struct index_cmd_context *ctx,
+		      const struct mailbox_info *info)
+{
+	if (ctx->ctx.parallel_count <= 1)
+		return TRUE;
+	/* Each process lists the mailboxes independently, so split them by
+	   the name rather than by the listing order. This way each mailbox is
+	   indexed by exactly one process, even if mailboxes are created or
+	   deleted while indexing.
+
+	   A single mailbox can't be split between processes: FTS always
+	   indexes the mails in order starting from the backend's last indexed
+	   UID, so a process given a later UID range would index all the
+	   earlier mails too. */
+	return crc32_str(info->vname) % ctx->ctx.parallel_count ==
+		ctx->ctx.parallel_idx;
+}
+
+static int
+cmd_index_prerun(struct doveadm_mail_cmd_context *_ctx,
+		 struct mail_storage_service_user *service_user,
+		 const char **error_r)
+{
+	const struct mail_user_settings *user_set;
+	const char *fts;
+
+	if (_ctx->parallel_count <= 1)
+		return 0;
+
+	/* fts-lucene has a single index for all the user's mailboxes, which
+	   only one process can write to. */
+	user_set = mail_storage_service_user_get_set(service_user)[0];
+	fts = mail_user_set_plugin_getenv(user_set, "fts");
+	if (fts != NULL && strcmp(fts, "lucene") == 0) {
+		*error_r = "-j parameter can't be used with fts-lucene";
+		_ctx->exit_code = EX_USAGE;
+		return -1;
+	}
+	return 0;
+}
+
 static int
 cmd_index_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 {
@@ -187,7 +248,8 @@ cmd_index_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 	const enum mail_namespace_type ns_mask = MAIL_NAMESPACE_TYPE_MASK_ALL;
 	struct mailbox_list_iterate_context *iter;
 	const struct mailbox_info *info;
-	unsigned int i;
+	struct timeval start_time;
+	unsigned int i, msecs;
 	int ret = 0;
 
 	if (ctx->queue && !ctx->have_wildcards) {
@@ -197,6 +259,9 @@ cmd_index_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 		return 0;
 	}
 
+	io_loop_time_refresh();
+	start_time = ioloop_timeval;
+	ctx->indexed_count = 0;
 	iter = mailbox_list_iter_init_namespaces(user->namespaces, _ctx->args,
 						 ns_mask, iter_flags);
 	while ((info = mailbox_list_iter_next(iter)) != NULL) {
@@ -204,7 +269,9 @@ cmd_index_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 				    MAILBOX_NONEXISTENT)) == 0) T_BEGIN {
 			if (ctx->queue)
 				cmd_index_queue(ctx, user, info->vname);
-			else {
+			else if (!cmd_index_box_is_mine(ctx, info)) {
+				/* another process indexes this */
+			} else {
 				if (cmd_index_box(ctx, info) < 0)
 					ret = -1;
 			}
@@ -216,6 +283,17 @@ cmd_index_run(struct doveadm_mail_cmd_context *_ctx, struct mail_user *user)
 		doveadm_mail_failed_error(_ctx, MAIL_ERROR_TEMP);
 		ret = -1;
 	}
+	if (doveadm_verbose && !ctx->queue) {
+		io_loop_time_refresh();
+		msecs = timeval_diff_msecs(&ioloop_timeval, &start_time);
+		i_info("%sCached %u mails in %u.%03u secs (%u mails/sec)",
+		       _ctx->parallel_count <= 1 ? "" :
+		       t_strdup_printf("Process %u/%u: ", _ctx->parallel_idx + 1,
+				       _ctx->parallel_count),
+		       ctx->indexed_count, msecs/1000, msecs%1000,
+		       msecs == 0 ? ctx->indexed_count :
+		       (unsigned int)(ctx->indexed_count * 1000ULL / msecs));
+	}
 	return ret;
 }
 
@@ -227,6 +305,10 @@ static void cmd_index_init(struct doveadm_mail_cmd_context *_ctx,
 
 	if (args[0] == NULL)
 		doveadm_mail_help_name("index");
+	if (ctx->queue) {
+		/* the indexer service does the work */
+		_ctx->parallel_count = 0;
+	}
 	for (i = 0; args[i] != NULL; i++) {
 		if (strchr(args[i], '*') != NULL ||
 		    strchr(args[i], '%') != NULL) {
@@ -261,6 +343,9 @@ cmd_index_parse_arg(struct doveadm_mail_cmd_context *_ctx, int c)
 				"Invalid -n parameter number: %s", optarg);
 		}
 		break;
+	case 'j':
+		doveadm_mail_parse_parallel_count(_ctx, optarg);
+		break;
 	default:
 		return FALSE;
 	}
@@ -273,9 +358,10 @@ static struct doveadm_mail_cmd_context *cmd_index_alloc(void)
 
 	ctx = doveadm_mail_cmd_alloc(struct index_cmd_context);
 	ctx->queue_fd = -1;
-	ctx->ctx.getopt_args = "qn:";
+	ctx->ctx.getopt_args = "qn:j:";
 	ctx->ctx.v.parse_arg = cmd_index_parse_arg;
 	ctx->ctx.v.init = cmd_index_init;
+	ctx->ctx.v.prerun = cmd_index_prerun;
 	ctx->ctx.v.deinit = cmd_index_deinit;
 	ctx->ctx.v.run = cmd_index_run;
 	return &ctx->ctx;
@@ -283,12 +369,13 @@ static struct doveadm_mail_cmd_context *cmd_index_alloc(void)
 
 struct doveadm_cmd_ver2 doveadm_cmd_index_ver2 = {
 	.name = "index",
-	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-q] [-n <max recent>] <mailbox mask>",
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-q] [-n <max recent>] [-j <max parallel>] <mailbox mask>",
 	.mail_cmd = cmd_index_alloc,
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
 DOVEADM_CMD_PARAM('q',"queue",CMD_PARAM_BOOL,0)
 DOVEADM_CMD_PARAM('n',"max-recent",CMD_PARAM_STR,0)
+DOVEADM_CMD_PARAM('j',"max-parallel",CMD_PARAM_STR,0)
 DOVEADM_CMD_PARAM('\0',"mailbox-mask",CMD_PARAM_STR,CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 };
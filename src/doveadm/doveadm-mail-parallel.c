@@ -0,0 +1,85 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hostpid.h"
+#include "doveadm-mail.h"
+#include "doveadm-mail-parallel.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+void doveadm_mail_parse_parallel_count(struct doveadm_mail_cmd_context *ctx,
+				       const char *value)
+{
+	if (str_to_uint(value, &ctx->parallel_count) < 0) {
+		i_fatal_status(EX_USAGE,
+			"Invalid -j parameter number: %s", value);
+	}
+	if (ctx->parallel_count > DOVEADM_MAIL_MAX_PARALLEL) {
+		i_fatal_status(EX_USAGE,
+			"-j parameter can't be larger than %u",
+			DOVEADM_MAIL_MAX_PARALLEL);
+	}
+}
+
+static void ATTR_NORETURN
+doveadm_mail_run_user_child(struct doveadm_mail_cmd_context *ctx,
+			    doveadm_mail_run_user_func_t *run_user,
+			    unsigned int idx)
+{
+	const char *error;
+
+	/* update my_pid, it's used in temp filenames */
+	hostpid_init();
+	ctx->parallel_idx = idx;
+	if (run_user(ctx, &error) < 0) {
+		i_error("%s", error);
+		if (ctx->exit_code == 0)
+			ctx->exit_code = EX_TEMPFAIL;
+	}
+	mail_storage_service_user_unref(&ctx->cur_service_user);
+	fflush(stdout);
+	_exit(ctx->exit_code);
+}
+
+static void
+doveadm_mail_wait_child(struct doveadm_mail_cmd_context *ctx, pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		i_error("waitpid(%s) failed: %m", dec2str(pid));
+		ctx->exit_code = EX_TEMPFAIL;
+	} else if (WIFSIGNALED(status)) {
+		i_error("Child process %s killed by signal %d",
+			dec2str(pid), WTERMSIG(status));
+		ctx->exit_code = EX_TEMPFAIL;
+	} else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+		if (ctx->exit_code == 0 ||
+		    WEXITSTATUS(status) == EX_TEMPFAIL)
+			ctx->exit_code = WEXITSTATUS(status);
+	}
+}
+
+void doveadm_mail_run_user_parallel(struct doveadm_mail_cmd_context *ctx,
+				    doveadm_mail_run_user_func_t *run_user)
+{
+	unsigned int i;
+	pid_t *pids;
+
+	/* The storage code isn't thread-safe, so use separate processes.
+	   Fork before the mail user is created, so that the processes don't
+	   share any index or lock fds. */
+	pids = t_new(pid_t, ctx->parallel_count);
+	fflush(stdout);
+	for (i = 0; i < ctx->parallel_count; i++) {
+		pids[i] = fork();
+		if (pids[i] == (pid_t)-1)
+			i_fatal("fork() failed: %m");
+		if (pids[i] == 0)
+			doveadm_mail_run_user_child(ctx, run_user, i);
+	}
+	for (i = 0; i < ctx->parallel_count; i++)
+		doveadm_mail_wait_child(ctx, pids[i]);
+}
@@ -0,0 +1,24 @@
+#ifndef DOVEADM_MAIL_PARALLEL_H
+#define DOVEADM_MAIL_PARALLEL_H
+
+struct doveadm_mail_cmd_context;
+
+/* Maximum number of processes that a parallel command can use per user */
+#define DOVEADM_MAIL_MAX_PARALLEL 32
+
+typedef int
+doveadm_mail_run_user_func_t(struct doveadm_mail_cmd_context *ctx,
+			     const char **error_r);
+
+/* Parse -j parameter into parallel_count. Fails with EX_USAGE if the value
+   is invalid or larger than DOVEADM_MAIL_MAX_PARALLEL. */
+void doveadm_mail_parse_parallel_count(struct doveadm_mail_cmd_context *ctx,
+				       const char *value);
+
+/* Fork ctx->parallel_count processes, which each call run_user() for
+   ctx->cur_service_user with their own parallel_idx. Waits until all of
+   them have finished and updates ctx->exit_code from their exit codes. */
+void doveadm_mail_run_user_parallel(struct doveadm_mail_cmd_context *ctx,
+				    doveadm_mail_run_user_func_t *run_user);
+
+#endif
@@ -27,6 +27,7 @@
 #include "doveadm-print.h"
 #include "doveadm-dsync.h"
 #include "doveadm-mail.h"
+#include "doveadm-mail-parallel.h"
 
 #include <stdio.h>
 
@@ -140,6 +141,10 @@ cmd_purge_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
 	struct mail_storage *storage;
 	int ret = 0;
 
+	/* With -j this is run by multiple processes. They all go through the
+	   same files, but each file is try-locked while it's being purged, so
+	   the processes skip over the files that some other process is
+	   already handling. */
 	for (ns = user->namespaces; ns != NULL; ns = ns->next) {
 		if (ns->type != MAIL_NAMESPACE_TYPE_PRIVATE ||
 		    ns->alias_for != NULL)
@@ -156,11 +161,25 @@ cmd_purge_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
 	return ret;
 }
 
+static bool cmd_purge_parse_arg(struct doveadm_mail_cmd_context *ctx, int c)
+{
+	switch (c) {
+	case 'j':
+		doveadm_mail_parse_parallel_count(ctx, optarg);
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
 static struct doveadm_mail_cmd_context *cmd_purge_alloc(void)
 {
 	struct doveadm_mail_cmd_context *ctx;
 
 	ctx = doveadm_mail_cmd_alloc(struct doveadm_mail_cmd_context);
+	ctx->getopt_args = "j:";
+	ctx->v.parse_arg = cmd_purge_parse_arg;
 	ctx->v.run = cmd_purge_run;
 	return ctx;
 }
@@ -378,6 +397,25 @@ doveadm_cctx_to_storage_service_input(const struct doveadm_cmd_context *cctx,
 	input_r->username = cctx->username;
 }
 
+static int
+doveadm_mail_run_user(struct doveadm_mail_cmd_context *ctx,
+		      const char **error_r)
+{
+	int ret;
+
+	ret = mail_storage_service_next(ctx->storage_service,
+					ctx->cur_service_user,
+					&ctx->cur_mail_user, error_r);
+	if (ret < 0)
+		return ret;
+
+	if (ctx->v.run(ctx, ctx->cur_mail_user) < 0) {
+		i_assert(ctx->exit_code != 0);
+	}
+	mail_user_unref(&ctx->cur_mail_user);
+	return 1;
+}
+
 static int
 doveadm_mail_next_user(struct doveadm_mail_cmd_context *ctx,
 		       const char **error_r)
@@ -421,20 +459,13 @@ doveadm_mail_next_user(struct doveadm_mail_cmd_context *ctx,
 		}
 	}
 
-	ret = mail_storage_service_next(ctx->storage_service,
-					ctx->cur_service_user,
-					&ctx->cur_mail_user, error_r);
-	if (ret < 0) {
-		mail_storage_service_user_unref(&ctx->cur_service_user);
-		return ret;
-	}
-
-	if (ctx->v.run(ctx, ctx->cur_mail_user) < 0) {
-		i_assert(ctx->exit_code != 0);
-	}
-	mail_user_unref(&ctx->cur_mail_user);
+	if (ctx->parallel_count > 1) {
+		doveadm_mail_run_user_parallel(ctx, doveadm_mail_run_user);
+		ret = 1;
+	} else
+		ret = doveadm_mail_run_user(ctx, error_r);
 	mail_storage_service_user_unref(&ctx->cur_service_user);
-	return 1;
+	return ret;
 }
 
 static void sig_die(const siginfo_t *si, void *context ATTR_UNUSED)
@@ -876,9 +907,10 @@ DOVEADM_CMD_PARAMS_END
 static struct doveadm_cmd_ver2 doveadm_cmd_purge_ver2 = {
 	.name = "purge",
 	.mail_cmd = cmd_purge_alloc,
-	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-j <max parallel>]",
 DOVEADM_CMD_PARAMS_START
 DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('j',"max-parallel",CMD_PARAM_STR,0)
 DOVEADM_CMD_PARAMS_END
 };
 
@@ -88,6 +88,14 @@ struct doveadm_mail_cmd_context {
 	/* if non-zero, exit with this code */
 	int exit_code;
 
+	/* If larger than 1, each user's run() is called by this many child
+	   processes. They're forked before the mail user is created, so each
+	   process has its own storage and doesn't share any of its fds with
+	   the other processes. parallel_idx is the current process's index
+	   (0..parallel_count-1). The run() can't use doveadm_print*(), because
+	   the child processes' output isn't merged. */
+	unsigned int parallel_count, parallel_idx;
+
 	/* This command is being called by a remote doveadm client. */
 	bool proxying:1;
 	/* We're handling only a single user */
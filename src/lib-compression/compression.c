@@ -5,6 +5,7 @@
 #include "istream-zlib.h"
 #include "ostream-zlib.h"
 #include "iostream-lz4.h"
+#include "iostream-zstd.h"
 #include "compression.h"
 
 #ifndef HAVE_ZLIB
@@ -25,6 +26,10 @@
 #  define i_stream_create_lz4 NULL
 #  define o_stream_create_lz4 NULL
 #endif
+#ifndef HAVE_ZSTD
+#  define i_stream_create_zstd NULL
+#  define o_stream_create_zstd NULL
+#endif
 
 static bool is_compressed_zlib(struct istream *input)
 {
@@ -79,6 +84,16 @@ static bool is_compressed_lz4(struct istream *input)
 	return memcmp(data, IOSTREAM_LZ4_MAGIC, IOSTREAM_LZ4_MAGIC_LEN) == 0;
 }
 
+static bool is_compressed_zstd(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_bytes(input, &data, &size, IOSTREAM_ZSTD_MAGIC_LEN) <= 0)
+		return FALSE;
+	return memcmp(data, IOSTREAM_ZSTD_MAGIC, IOSTREAM_ZSTD_MAGIC_LEN) == 0;
+}
+
 const struct compression_handler *compression_lookup_handler(const char *name)
 {
 	unsigned int i;
@@ -132,5 +147,7 @@ const struct compression_handler compression_handlers[] = {
 	  i_stream_create_lzma, o_stream_create_lzma },
 	{ "lz4", ".lz4", is_compressed_lz4,
 	  i_stream_create_lz4, o_stream_create_lz4 },
+	{ "zstd", ".zst", is_compressed_zstd,
+	  i_stream_create_zstd, o_stream_create_zstd },
 	{ NULL, NULL, NULL, NULL, NULL }
 };
@@ -0,0 +1,25 @@
+#ifndef IOSTREAM_ZSTD_PRIVATE_H
+#define IOSTREAM_ZSTD_PRIVATE_H
+
+#include "iostream-zstd.h"
+
+#include <zstd.h>
+
+struct zstd_dict {
+	int refcount;
+	unsigned int id;
+
+	void *data;
+	size_t size;
+
+	ZSTD_DDict *ddict;
+	/* compression dictionaries are created lazily, because they depend
+	   on the compression level. indexed by level-1. they're kept until
+	   the dict is freed, since ostreams (possibly in a worker thread)
+	   keep using them. */
+	ARRAY(ZSTD_CDict *) cdicts;
+};
+
+const ZSTD_CDict *zstd_dict_get_cdict(struct zstd_dict *dict, int level);
+
+#endif
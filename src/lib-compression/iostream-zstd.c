@@ -0,0 +1,205 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "read-full.h"
+#include "iostream-zstd.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Dictionaries trained by zstd are typically around 100 kB. Don't allow
+   accidentally reading a huge file into memory. */
+#define ZSTD_DICT_MAX_SIZE (1024*1024*16)
+
+#ifdef HAVE_ZSTD
+
+#include "iostream-zstd-private.h"
+
+int zstd_dict_create(const void *data, size_t size,
+		     struct zstd_dict **dict_r, const char **error_r)
+{
+	struct zstd_dict *dict;
+	unsigned int id;
+
+	/* raw content dictionaries have no ID, so they couldn't be found
+	   when decompressing. require a properly trained dictionary. */
+	id = ZSTD_getDictID_fromDict(data, size);
+	if (id == 0) {
+		*error_r = "Not a zstd dictionary";
+		return -1;
+	}
+
+	dict = i_new(struct zstd_dict, 1);
+	dict->refcount = 1;
+	dict->id = id;
+	dict->data = i_malloc(size);
+	memcpy(dict->data, data, size);
+	dict->size = size;
+	dict->ddict = ZSTD_createDDict(dict->data, dict->size);
+	if (dict->ddict == NULL) {
+		i_free(dict->data);
+		i_free(dict);
+		*error_r = "ZSTD_createDDict() failed";
+		return -1;
+	}
+	*dict_r = dict;
+	return 0;
+}
+
+int zstd_dict_create_file(const char *path, struct zstd_dict **dict_r,
+			  const char **error_r)
+{
+	struct stat st;
+	void *data;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (st.st_size > ZSTD_DICT_MAX_SIZE) {
+		*error_r = t_strdup_printf("%s: Dictionary too large "
+			"(%"PRIuUOFF_T" > %u bytes)", path,
+			(uoff_t)st.st_size, ZSTD_DICT_MAX_SIZE);
+		i_close_fd(&fd);
+		return -1;
+	}
+
+	data = i_malloc(st.st_size + 1);
+	ret = read_full(fd, data, st.st_size);
+	if (ret <= 0) {
+		if (ret < 0)
+			*error_r = t_strdup_printf("read(%s) failed: %m", path);
+		else {
+			*error_r = t_strdup_printf(
+				"read(%s) failed: Unexpected EOF", path);
+		}
+		ret = -1;
+	} else if (zstd_dict_create(data, st.st_size, dict_r, error_r) < 0) {
+		*error_r = t_strdup_printf("%s: %s", path, *error_r);
+		ret = -1;
+	} else {
+		ret = 0;
+	}
+	i_free(data);
+	i_close_fd(&fd);
+	return ret;
+}
+
+void zstd_dict_ref(struct zstd_dict *dict)
+{
+	i_assert(dict->refcount > 0);
+	dict->refcount++;
+}
+
+void zstd_dict_unref(struct zstd_dict **_dict)
+{
+	struct zstd_dict *dict = *_dict;
+	ZSTD_CDict **cdictp;
+
+	*_dict = NULL;
+	if (dict == NULL)
+		return;
+	i_assert(dict->refcount > 0);
+	if (--dict->refcount > 0)
+		return;
+
+	if (array_is_created(&dict->cdicts)) {
+		array_foreach_modifiable(&dict->cdicts, cdictp)
+			ZSTD_freeCDict(*cdictp);
+		array_free(&dict->cdicts);
+	}
+	ZSTD_freeDDict(dict->ddict);
+	i_free(dict->data);
+	i_free(dict);
+}
+
+unsigned int zstd_dict_get_id(const struct zstd_dict *dict)
+{
+	return dict->id;
+}
+
+const ZSTD_CDict *zstd_dict_get_cdict(struct zstd_dict *dict, int level)
+{
+	ZSTD_CDict **cdictp;
+
+	i_assert(level >= 1);
+
+	if (!array_is_created(&dict->cdicts))
+		i_array_init(&dict->cdicts, level);
+	cdictp = array_idx_get_space(&dict->cdicts, level - 1);
+	if (*cdictp == NULL) {
+		*cdictp = ZSTD_createCDict(dict->data, dict->size, level);
+		if (*cdictp == NULL) {
+			i_fatal_status(FATAL_OUTOFMEM,
+				       "zstd: ZSTD_createCDict() failed");
+		}
+	}
+	return *cdictp;
+}
+
+#else
+
+int zstd_dict_create(const void *data ATTR_UNUSED, size_t size ATTR_UNUSED,
+		     struct zstd_dict **dict_r ATTR_UNUSED,
+		     const char **error_r)
+{
+	*error_r = "zstd support not compiled in";
+	return -1;
+}
+
+int zstd_dict_create_file(const char *path ATTR_UNUSED,
+			  struct zstd_dict **dict_r ATTR_UNUSED,
+			  const char **error_r)
+{
+	*error_r = "zstd support not compiled in";
+	return -1;
+}
+
+void zstd_dict_ref(struct zstd_dict *dict ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void zstd_dict_unref(struct zstd_dict **dict)
+{
+	i_assert(*dict == NULL);
+}
+
+unsigned int zstd_dict_get_id(const struct zstd_dict *dict ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+struct istream *
+i_stream_create_zstd_dicts(struct istream *input ATTR_UNUSED,
+			   bool log_errors ATTR_UNUSED,
+			   struct zstd_dict *const *dicts ATTR_UNUSED,
+			   unsigned int count ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool i_stream_zstd_has_seek_table(struct istream *input ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+struct ostream *
+o_stream_create_zstd_dict(struct ostream *output ATTR_UNUSED,
+			  int level ATTR_UNUSED,
+			  struct zstd_dict *dict ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef IOSTREAM_ZSTD_H
+#define IOSTREAM_ZSTD_H
+
+/*
+   Dovecot's zstd compressed files are a sequence of standard zstd frames,
+   so they can be decompressed with the zstd command line tool (using the
+   same dictionary, if any). A new frame is started after every
+   OSTREAM_ZSTD_FRAME_SIZE bytes of uncompressed data and whenever the
+   stream is flushed. Each frame header contains the frame's uncompressed
+   size and each frame ends with a checksum.
+
+   When there is more than one frame, the stream ends with a seek table in
+   zstd's seekable format: a skippable frame containing the compressed and
+   uncompressed size of each frame, followed by a footer with the number
+   of frames and IOSTREAM_ZSTD_SEEKABLE_MAGIC. Decompressors that don't know
+   about it simply skip it. The istream uses it to seek to the frame
+   containing the wanted offset without decompressing the earlier frames.
+*/
+
+/* zstd frame magic number 0xFD2FB528 in little-endian */
+#define IOSTREAM_ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define IOSTREAM_ZSTD_MAGIC_LEN (sizeof(IOSTREAM_ZSTD_MAGIC)-1)
+
+/* skippable frame magic number used by the seek table, and the magic number
+   at the end of its footer */
+#define IOSTREAM_ZSTD_SEEK_TABLE_MAGIC 0x184D2A5E
+#define IOSTREAM_ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+/* skippable frame magic + frame size */
+#define IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN 8
+/* number of frames + descriptor + seekable magic */
+#define IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN 9
+
+/* How large frames we're buffering into memory before compressing them */
+#define OSTREAM_ZSTD_FRAME_SIZE (1024*128)
+
+/* A dictionary trained from sample data (e.g. "zstd --train"). Small mails
+   compress much better when a dictionary trained from similar mails is
+   used. The dictionary ID is written to each frame's header, so the same
+   dictionary must be available when decompressing. */
+struct zstd_dict;
+
+/* Create a dictionary from the given data. Returns 0 on success, -1 if the
+   data isn't a valid zstd dictionary or zstd support isn't compiled in. */
+int zstd_dict_create(const void *data, size_t size,
+		     struct zstd_dict **dict_r, const char **error_r);
+/* Create a dictionary from the given file. */
+int zstd_dict_create_file(const char *path, struct zstd_dict **dict_r,
+			  const char **error_r);
+void zstd_dict_ref(struct zstd_dict *dict);
+void zstd_dict_unref(struct zstd_dict **dict);
+/* Returns the dictionary's ID. */
+unsigned int zstd_dict_get_id(const struct zstd_dict *dict);
+
+/* Same as i_stream_create_zstd(), but frames compressed with any of the given
+   dictionaries can be decompressed as well. */
+struct istream *
+i_stream_create_zstd_dicts(struct istream *input, bool log_errors,
+			   struct zstd_dict *const *dicts, unsigned int count);
+/* Returns TRUE if the zstd input stream has a seek table, so seeking
+   decompresses only the frame containing the wanted offset. This requires
+   the parent stream to be seekable and have a known size. */
+bool i_stream_zstd_has_seek_table(struct istream *input);
+/* Same as o_stream_create_zstd(), but compress using the given dictionary. */
+struct ostream *
+o_stream_create_zstd_dict(struct ostream *output, int level,
+			  struct zstd_dict *dict);
+
+#endif
@@ -0,0 +1,589 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "array.h"
+#include "byteorder.h"
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include "iostream-zstd-private.h"
+
+#define CHUNK_SIZE (1024*64)
+/* magic + frame header descriptor + window descriptor + dictionary ID +
+   frame content size */
+#define ZSTD_FRAME_HEADER_MAX_SIZE (4 + 1 + 1 + 4 + 8)
+
+/* seek table entry: where a frame starts in the compressed and in the
+   uncompressed stream */
+struct zstd_seek_frame {
+	uoff_t compressed_offset;
+	uoff_t uncompressed_offset;
+};
+
+struct zstd_istream {
+	struct istream_private istream;
+
+	ZSTD_DCtx *dctx;
+	ARRAY(struct zstd_dict *) dicts;
+	/* frames in the seek table, followed by the end offsets */
+	ARRAY(struct zstd_seek_frame) seek_frames;
+
+	uoff_t eof_offset, stream_size;
+	size_t high_pos;
+	struct stat last_parent_statbuf;
+
+	bool log_errors:1;
+	bool marked:1;
+	bool frame_started:1;
+	bool seek_table_checked:1;
+};
+
+static void i_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+	struct zstd_dict **dictp;
+
+	if (zstream->dctx != NULL) {
+		ZSTD_freeDCtx(zstream->dctx);
+		zstream->dctx = NULL;
+	}
+	if (array_is_created(&zstream->dicts)) {
+		array_foreach_modifiable(&zstream->dicts, dictp)
+			zstd_dict_unref(dictp);
+		array_free(&zstream->dicts);
+	}
+	if (array_is_created(&zstream->seek_frames))
+		array_free(&zstream->seek_frames);
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void zstd_read_error(struct zstd_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "zstd.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    i_stream_get_absolute_offset(&zstream->istream.istream));
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static void zstd_stream_end(struct zstd_istream *zstream)
+{
+	zstream->eof_offset = zstream->istream.istream.v_offset +
+		(zstream->istream.pos - zstream->istream.skip);
+	zstream->stream_size = zstream->eof_offset;
+}
+
+static int i_stream_zstd_frame_begin(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	struct zstd_dict *const *dictp, *dict = NULL;
+	const unsigned char *data;
+	unsigned int dict_id;
+	size_t size, ret;
+	int ret2;
+
+	if (!array_is_created(&zstream->dicts))
+		return 1;
+
+	/* find the dictionary used by this frame */
+	ret2 = i_stream_read_bytes(stream->parent, &data, &size,
+				   ZSTD_FRAME_HEADER_MAX_SIZE);
+	if (ret2 == 0 && !stream->parent->eof)
+		return 0;
+	if (ret2 < 0 && stream->parent->stream_errno != 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	dict_id = ZSTD_getDictID_fromFrame(data, size);
+	if (dict_id != 0) {
+		array_foreach(&zstream->dicts, dictp) {
+			if ((*dictp)->id == dict_id) {
+				dict = *dictp;
+				break;
+			}
+		}
+		if (dict == NULL) {
+			zstd_read_error(zstream, t_strdup_printf(
+				"Unknown dictionary ID %u", dict_id));
+			stream->istream.stream_errno = EINVAL;
+			return -1;
+		}
+	}
+	ret = ZSTD_DCtx_reset(zstream->dctx, ZSTD_reset_session_only);
+	if (!ZSTD_isError(ret))
+		ret = ZSTD_DCtx_refDDict(zstream->dctx,
+					 dict == NULL ? NULL : dict->ddict);
+	if (ZSTD_isError(ret)) {
+		zstd_read_error(zstream, t_strdup_printf(
+			"Failed to set dictionary: %s", ZSTD_getErrorName(ret)));
+		stream->istream.stream_errno = EIO;
+		return -1;
+	}
+	return 1;
+}
+
+static ssize_t i_stream_zstd_read(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	const unsigned char *data;
+	uoff_t high_offset;
+	size_t size, out_size, ret;
+	int ret2;
+
+	high_offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (zstream->eof_offset == high_offset) {
+		i_assert(zstream->high_pos == 0 ||
+			 zstream->high_pos == stream->pos);
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	if (stream->pos < zstream->high_pos) {
+		/* we're here because we seeked back within the read buffer. */
+		ret2 = zstream->high_pos - stream->pos;
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+
+		if (zstream->eof_offset != (uoff_t)-1) {
+			high_offset = stream->istream.v_offset +
+				(stream->pos - stream->skip);
+			i_assert(zstream->eof_offset == high_offset);
+			stream->istream.eof = TRUE;
+		}
+		return ret2;
+	}
+	zstream->high_pos = 0;
+
+	if (!zstream->marked) {
+		if (!i_stream_try_alloc(stream, CHUNK_SIZE, &out_size))
+			return -2; /* buffer full */
+	} else {
+		/* try to avoid compressing, so we can quickly seek backwards */
+		if (!i_stream_try_alloc_avoid_compress(stream, CHUNK_SIZE, &out_size))
+			return -2; /* buffer full */
+	}
+
+	if (!zstream->frame_started) {
+		if ((ret2 = i_stream_zstd_frame_begin(zstream)) <= 0)
+			return ret2;
+	}
+
+	if (i_stream_read_more(stream->parent, &data, &size) < 0) {
+		if (stream->parent->stream_errno != 0) {
+			stream->istream.stream_errno =
+				stream->parent->stream_errno;
+		} else if (zstream->frame_started) {
+			zstd_read_error(zstream, "truncated zstd frame");
+			stream->istream.stream_errno = EPIPE;
+		} else {
+			i_assert(stream->parent->eof);
+			zstd_stream_end(zstream);
+			stream->istream.eof = TRUE;
+		}
+		return -1;
+	}
+	if (size == 0) {
+		/* no more input */
+		i_assert(!stream->istream.blocking);
+		return 0;
+	}
+
+	in.src = data;
+	in.size = size;
+	in.pos = 0;
+	out.dst = stream->w_buffer + stream->pos;
+	out.size = out_size;
+	out.pos = 0;
+	/* this stops at the end of each frame, so the next frame's dictionary
+	   can be selected before decompressing it */
+	ret = ZSTD_decompressStream(zstream->dctx, &out, &in);
+
+	out_size = out.pos;
+	stream->pos += out_size;
+	i_stream_skip(stream->parent, in.pos);
+
+	if (ZSTD_isError(ret)) {
+		zstd_read_error(zstream, t_strdup_printf(
+			"corrupted data: %s", ZSTD_getErrorName(ret)));
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	/* 0 = frame was fully decoded and flushed */
+	zstream->frame_started = ret != 0;
+
+	if (out_size == 0) {
+		/* read more input */
+		return i_stream_zstd_read(stream);
+	}
+	return out_size;
+}
+
+static int
+i_stream_zstd_read_seek_frames(struct zstd_istream *zstream,
+			       uoff_t table_offset, unsigned int frame_count,
+			       size_t entry_size)
+{
+	struct istream_private *stream = &zstream->istream;
+	struct zstd_seek_frame *frame;
+	const unsigned char *data;
+	size_t size;
+	uoff_t compressed_offset = 0, uncompressed_offset = 0;
+	unsigned int i;
+
+	i_stream_seek(stream->parent, table_offset +
+		      IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN);
+	i_array_init(&zstream->seek_frames, frame_count + 1);
+	for (i = 0; i < frame_count; i++) {
+		if (i_stream_read_bytes(stream->parent, &data, &size,
+					entry_size) <= 0)
+			return -1;
+		frame = array_append_space(&zstream->seek_frames);
+		frame->compressed_offset = compressed_offset;
+		frame->uncompressed_offset = uncompressed_offset;
+		compressed_offset += le32_to_cpu_unaligned(data);
+		uncompressed_offset += le32_to_cpu_unaligned(data + 4);
+		i_stream_skip(stream->parent, entry_size);
+	}
+	/* the frames must end where the seek table begins */
+	if (stream->parent_start_offset + compressed_offset != table_offset)
+		return -1;
+	frame = array_append_space(&zstream->seek_frames);
+	frame->compressed_offset = compressed_offset;
+	frame->uncompressed_offset = uncompressed_offset;
+	return 0;
+}
+
+static void i_stream_zstd_read_seek_table_real(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct zstd_seek_frame *end_frame;
+	const unsigned char *data;
+	size_t size, entry_size;
+	uoff_t parent_size, table_size, table_offset;
+	unsigned int frame_count;
+
+	/* the seek table is at the end of the stream. if it can't be read,
+	   fall back to decompressing from the beginning. */
+	if (!stream->parent->seekable || !stream->parent->blocking)
+		return;
+	if (i_stream_get_size(stream->parent, TRUE, &parent_size) <= 0 ||
+	    parent_size < stream->parent_start_offset +
+	    IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN +
+	    IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN)
+		return;
+
+	i_stream_seek(stream->parent,
+		      parent_size - IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN);
+	if (i_stream_read_bytes(stream->parent, &data, &size,
+				IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN) <= 0 ||
+	    le32_to_cpu_unaligned(data + 5) != IOSTREAM_ZSTD_SEEKABLE_MAGIC)
+		return;
+	frame_count = le32_to_cpu_unaligned(data);
+	/* the highest bit in the descriptor means that each entry has
+	   a checksum. we don't need it, since the frames have their own. */
+	entry_size = (data[4] & 0x80) != 0 ? 12 : 8;
+	table_size = (uoff_t)frame_count * entry_size +
+		IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN;
+	if (frame_count == 0 ||
+	    table_size + IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN >
+	    parent_size - stream->parent_start_offset)
+		return;
+
+	table_offset = parent_size - table_size -
+		IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN;
+	i_stream_seek(stream->parent, table_offset);
+	if (i_stream_read_bytes(stream->parent, &data, &size,
+				IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN) <= 0 ||
+	    le32_to_cpu_unaligned(data) != IOSTREAM_ZSTD_SEEK_TABLE_MAGIC ||
+	    le32_to_cpu_unaligned(data + 4) != table_size)
+		return;
+
+	if (i_stream_zstd_read_seek_frames(zstream, table_offset,
+					   frame_count, entry_size) < 0) {
+		if (stream->parent->stream_errno == 0 && zstream->log_errors) {
+			i_error("zstd.read(%s): Ignoring invalid seek table",
+				i_stream_get_name(&stream->istream));
+		}
+		array_free(&zstream->seek_frames);
+		return;
+	}
+	end_frame = array_idx(&zstream->seek_frames, frame_count);
+	zstream->stream_size = end_frame->uncompressed_offset;
+}
+
+static void i_stream_zstd_read_seek_table(struct zstd_istream *zstream)
+{
+	struct istream *parent = zstream->istream.parent;
+	uoff_t old_offset = parent->v_offset;
+
+	i_assert(!zstream->seek_table_checked);
+	zstream->seek_table_checked = TRUE;
+
+	i_stream_zstd_read_seek_table_real(zstream);
+	/* parent_expected_offset may be updated from the parent's offset */
+	i_stream_seek(parent, old_offset);
+}
+
+static const struct zstd_seek_frame *
+i_stream_zstd_seek_frame_find(struct zstd_istream *zstream, uoff_t v_offset)
+{
+	const struct zstd_seek_frame *frames;
+	unsigned int idx, left_idx, right_idx, count;
+
+	/* the last entry contains only the end offsets */
+	frames = array_get(&zstream->seek_frames, &count);
+	count--;
+	if (v_offset >= frames[count].uncompressed_offset)
+		return &frames[count-1];
+
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (frames[idx].uncompressed_offset > v_offset)
+			right_idx = idx;
+		else if (frames[idx+1].uncompressed_offset <= v_offset)
+			left_idx = idx + 1;
+		else
+			return &frames[idx];
+	}
+	i_unreached();
+}
+
+static void i_stream_zstd_init(struct zstd_istream *zstream)
+{
+	zstream->dctx = ZSTD_createDCtx();
+	if (zstream->dctx == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: ZSTD_createDCtx() failed");
+}
+
+static void i_stream_zstd_reset(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->frame_started = FALSE;
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+	zstream->high_pos = 0;
+
+	(void)ZSTD_DCtx_reset(zstream->dctx, ZSTD_reset_session_only);
+}
+
+static bool
+i_stream_zstd_seek_frame(struct zstd_istream *zstream, uoff_t v_offset,
+			 uoff_t start_offset)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct zstd_seek_frame *frame;
+	uoff_t high_offset;
+
+	if (!zstream->seek_table_checked)
+		i_stream_zstd_read_seek_table(zstream);
+	if (!array_is_created(&zstream->seek_frames))
+		return FALSE;
+
+	frame = i_stream_zstd_seek_frame_find(zstream, v_offset);
+	high_offset = start_offset + I_MAX(stream->pos, zstream->high_pos);
+	if (frame->uncompressed_offset >= start_offset &&
+	    frame->uncompressed_offset <= high_offset) {
+		/* the frame is already (partially) in the read buffer, so
+		   it's faster to just continue reading from it */
+		return FALSE;
+	}
+
+	i_stream_seek(stream->parent, stream->parent_start_offset +
+		      frame->compressed_offset);
+	stream->parent_expected_offset = stream->parent->v_offset;
+	zstream->frame_started = FALSE;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = frame->uncompressed_offset;
+	zstream->high_pos = 0;
+
+	(void)ZSTD_DCtx_reset(zstream->dctx, ZSTD_reset_session_only);
+	return TRUE;
+}
+
+static void
+i_stream_zstd_seek(struct istream_private *stream, uoff_t v_offset, bool mark)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+
+	if ((v_offset < start_offset ||
+	     v_offset > start_offset + I_MAX(stream->pos, zstream->high_pos)) &&
+	    i_stream_zstd_seek_frame(zstream, v_offset, start_offset)) {
+		/* seeked to the beginning of the frame containing v_offset */
+		start_offset = stream->istream.v_offset;
+	} else if (v_offset < start_offset) {
+		/* have to seek backwards */
+		i_stream_zstd_reset(zstream);
+		start_offset = 0;
+	} else if (zstream->high_pos != 0) {
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+	}
+
+	if (v_offset <= start_offset + stream->pos) {
+		/* seeking backwards within what's already cached */
+		stream->skip = v_offset - start_offset;
+		stream->istream.v_offset = v_offset;
+		zstream->high_pos = stream->pos;
+		stream->pos = stream->skip;
+	} else {
+		/* read and cache forward */
+		ssize_t ret;
+
+		do {
+			size_t avail = stream->pos - stream->skip;
+
+			if (stream->istream.v_offset + avail >= v_offset) {
+				i_stream_skip(&stream->istream,
+					      v_offset -
+					      stream->istream.v_offset);
+				ret = -1;
+				break;
+			}
+
+			i_stream_skip(&stream->istream, avail);
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+
+		if (stream->istream.v_offset != v_offset) {
+			/* some failure, we've broken it */
+			if (stream->istream.stream_errno != 0) {
+				i_error("zstd_istream.seek(%s) failed: %s",
+					i_stream_get_name(&stream->istream),
+					strerror(stream->istream.stream_errno));
+				i_stream_close(&stream->istream);
+			} else {
+				/* unexpected EOF. allow it since we may just
+				   want to check if there's anything.. */
+				i_assert(stream->istream.eof);
+			}
+		}
+	}
+
+	if (mark)
+		zstream->marked = TRUE;
+}
+
+static int
+i_stream_zstd_stat(struct istream_private *stream, bool exact)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+	size_t size;
+
+	if (i_stream_stat(stream->parent, exact, &st) < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	stream->statbuf = *st;
+
+	/* when exact=FALSE always return the parent stat's size, even if we
+	   know the exact value. this is necessary because otherwise e.g. mbox
+	   code can see two different values and think that a compressed mbox
+	   file keeps changing. */
+	if (!exact)
+		return 0;
+
+	if (zstream->stream_size == (uoff_t)-1 && !zstream->seek_table_checked)
+		i_stream_zstd_read_seek_table(zstream);
+	if (zstream->stream_size == (uoff_t)-1) {
+		uoff_t old_offset = stream->istream.v_offset;
+		ssize_t ret;
+
+		do {
+			size = i_stream_get_data_size(&stream->istream);
+			i_stream_skip(&stream->istream, size);
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+
+		i_stream_seek(&stream->istream, old_offset);
+		if (zstream->stream_size == (uoff_t)-1)
+			return -1;
+	}
+	stream->statbuf.st_size = zstream->stream_size;
+	return 0;
+}
+
+static void i_stream_zstd_sync(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		if (memcmp(&zstream->last_parent_statbuf,
+			   st, sizeof(*st)) == 0) {
+			/* a compressed file doesn't change unexpectedly,
+			   don't clear our caches unnecessarily */
+			return;
+		}
+		zstream->last_parent_statbuf = *st;
+	}
+	i_stream_zstd_reset(zstream);
+}
+
+bool i_stream_zstd_has_seek_table(struct istream *input)
+{
+	struct zstd_istream *zstream =
+		(struct zstd_istream *)input->real_stream;
+
+	i_assert(zstream->istream.read == i_stream_zstd_read);
+
+	if (!zstream->seek_table_checked)
+		i_stream_zstd_read_seek_table(zstream);
+	return array_is_created(&zstream->seek_frames);
+}
+
+struct istream *
+i_stream_create_zstd_dicts(struct istream *input, bool log_errors,
+			   struct zstd_dict *const *dicts, unsigned int count)
+{
+	struct zstd_istream *zstream;
+	unsigned int i;
+
+	zstream = i_new(struct zstd_istream, 1);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->stream_size = (uoff_t)-1;
+	zstream->log_errors = log_errors;
+
+	i_stream_zstd_init(zstream);
+	if (count > 0) {
+		i_array_init(&zstream->dicts, count);
+		for (i = 0; i < count; i++) {
+			zstd_dict_ref(dicts[i]);
+			array_append(&zstream->dicts, &dicts[i], 1);
+		}
+	}
+
+	zstream->istream.iostream.close = i_stream_zstd_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_zstd_read;
+	zstream->istream.seek = i_stream_zstd_seek;
+	zstream->istream.stat = i_stream_zstd_stat;
+	zstream->istream.sync = i_stream_zstd_sync;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input), 0);
+}
+
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors)
+{
+	return i_stream_create_zstd_dicts(input, log_errors, NULL, 0);
+}
+#endif
@@ -6,25 +6,38 @@
 
 #include "crc32.h"
 #include "ostream-private.h"
+#include "ostream-worker.h"
 #include "ostream-zlib.h"
 #include <zlib.h>
 
 #define CHUNK_SIZE (1024*32)
+#define GZ_BLOCK_SIZE (1024*128)
+#define GZ_HEADER_SIZE 10
+#define GZ_TRAILER_SIZE 8
 #define ZLIB_OS_CODE 0x03  /* Unix */
 
+/* Raw deflate stream. This is used by IMAP COMPRESS, which flushes after
+   each uncorked write, so it's always compressed in the calling thread. */
 struct zlib_ostream {
 	struct ostream_private ostream;
 	z_stream zs;
 
-	unsigned char gz_header[10];
 	unsigned char outbuf[CHUNK_SIZE];
 	unsigned int outbuf_offset, outbuf_used;
 
+	bool flushed:1;
+};
+
+/* .gz file. The blocks may be compressed in a separate thread, so
+   o_stream_gz_process() must not use lib functions. */
+struct gz_ostream {
+	z_stream zs;
+
+	unsigned char header[GZ_HEADER_SIZE];
 	uint32_t crc, bytes32;
 
-	bool gz:1;
-	bool header_sent:1;
-	bool flushed:1;
+	bool header_written:1;
+	bool stream_ended:1;
 };
 
 static void o_stream_zlib_close(struct iostream_private *stream,
@@ -40,49 +53,6 @@ static void o_stream_zlib_close(struct iostream_private *stream,
 		o_stream_close(zstream->ostream.parent);
 }
 
-static int o_stream_zlib_send_gz_header(struct zlib_ostream *zstream)
-{
-	ssize_t ret;
-
-	ret = o_stream_send(zstream->ostream.parent, zstream->gz_header,
-			    sizeof(zstream->gz_header));
-	if ((size_t)ret != sizeof(zstream->gz_header)) {
-		o_stream_copy_error_from_parent(&zstream->ostream);
-		return -1;
-	}
-	zstream->header_sent = TRUE;
-	return 0;
-}
-
-static int o_stream_zlib_lsb_uint32(struct ostream *output, uint32_t num)
-{
-	unsigned char buf[sizeof(uint32_t)];
-	unsigned int i;
-
-	for (i = 0; i < sizeof(buf); i++) {
-		buf[i] = num & 0xff;
-		num >>= 8;
-	}
-	if (o_stream_send(output, buf, sizeof(buf)) != sizeof(buf))
-		return -1;
-	return 0;
-}
-
-static int o_stream_zlib_send_gz_trailer(struct zlib_ostream *zstream)
-{
-	struct ostream *output = zstream->ostream.parent;
-
-	if (!zstream->gz)
-		return 0;
-
-	if (o_stream_zlib_lsb_uint32(output, zstream->crc) < 0 ||
-	    o_stream_zlib_lsb_uint32(output, zstream->bytes32) < 0) {
-		o_stream_copy_error_from_parent(&zstream->ostream);
-		return -1;
-	}
-	return 0;
-}
-
 static int o_stream_zlib_send_outbuf(struct zlib_ostream *zstream)
 {
 	ssize_t ret;
@@ -117,13 +87,7 @@ o_stream_zlib_send_chunk(struct zlib_ostream *zstream,
 
 	i_assert(zstream->outbuf_used == 0);
 
-	flush = zstream->ostream.corked || zstream->gz ?
-		Z_NO_FLUSH : Z_SYNC_FLUSH;
-
-	if (!zstream->header_sent) {
-		if (o_stream_zlib_send_gz_header(zstream) < 0)
-			return -1;
-	}
+	flush = zstream->ostream.corked ? Z_NO_FLUSH : Z_SYNC_FLUSH;
 
 	zs->next_in = (void *)data;
 	zs->avail_in = size;
@@ -148,10 +112,6 @@ o_stream_zlib_send_chunk(struct zlib_ostream *zstream,
 		case Z_OK:
 		case Z_BUF_ERROR:
 			break;
-		case Z_STREAM_ERROR:
-			i_assert(zstream->gz);
-			i_panic("zlib.write(%s) failed: Can't write more data to .gz after flushing",
-				o_stream_get_name(&zstream->ostream.ostream));
 		default:
 			i_panic("zlib.write(%s) failed with unexpected code %d",
 				o_stream_get_name(&zstream->ostream.ostream), ret);
@@ -159,20 +119,17 @@ o_stream_zlib_send_chunk(struct zlib_ostream *zstream,
 	}
 	size -= zs->avail_in;
 
-	zstream->crc = crc32_data_more(zstream->crc, data, size);
-	zstream->bytes32 += size;
 	zstream->flushed = flush == Z_SYNC_FLUSH && zs->avail_in == 0 &&
 		zs->avail_out == sizeof(zstream->outbuf);
 	return size;
 }
 
-static int
-o_stream_zlib_send_flush(struct zlib_ostream *zstream, bool final)
+static int o_stream_zlib_send_flush(struct zlib_ostream *zstream)
 {
 	z_stream *zs = &zstream->zs;
 	size_t len;
 	bool done = FALSE;
-	int ret, flush;
+	int ret;
 
 	i_assert(zs->avail_in == 0);
 
@@ -181,17 +138,9 @@ o_stream_zlib_send_flush(struct zlib_ostream *zstream, bool final)
 
 	if ((ret = o_stream_flush_parent_if_needed(&zstream->ostream)) <= 0)
 		return ret;
-	if (!zstream->header_sent) {
-		if (o_stream_zlib_send_gz_header(zstream) < 0)
-			return -1;
-	}
-
 	if ((ret = o_stream_zlib_send_outbuf(zstream)) <= 0)
 		return ret;
 
-	flush = !zstream->gz ? Z_SYNC_FLUSH :
-		(final ? Z_FINISH : Z_NO_FLUSH);
-
 	i_assert(zstream->outbuf_used == 0);
 	do {
 		len = sizeof(zstream->outbuf) - zs->avail_out;
@@ -206,7 +155,7 @@ o_stream_zlib_send_flush(struct zlib_ostream *zstream, bool final)
 				break;
 		}
 
-		switch (deflate(zs, flush)) {
+		switch (deflate(zs, Z_SYNC_FLUSH)) {
 		case Z_OK:
 		case Z_BUF_ERROR:
 			break;
@@ -218,12 +167,7 @@ o_stream_zlib_send_flush(struct zlib_ostream *zstream, bool final)
 		}
 	} while (zs->avail_out != sizeof(zstream->outbuf));
 
-	if (final) {
-		if (o_stream_zlib_send_gz_trailer(zstream) < 0)
-			return -1;
-	}
-	if (final || flush != Z_NO_FLUSH)
-		zstream->flushed = TRUE;
+	zstream->flushed = TRUE;
 	return 0;
 }
 
@@ -231,7 +175,7 @@ static int o_stream_zlib_flush(struct ostream_private *stream)
 {
 	struct zlib_ostream *zstream = (struct zlib_ostream *)stream;
 
-	if (o_stream_zlib_send_flush(zstream, stream->finished) < 0)
+	if (o_stream_zlib_send_flush(zstream) < 0)
 		return -1;
 
 	return o_stream_flush_parent(stream);
@@ -285,7 +229,7 @@ o_stream_zlib_sendv(struct ostream_private *stream,
 	stream->ostream.offset += bytes;
 
 	if (!zstream->ostream.corked && i == iov_count) {
-		if (o_stream_zlib_send_flush(zstream, FALSE) < 0)
+		if (o_stream_zlib_send_flush(zstream) < 0)
 			return -1;
 	}
 	/* avail_in!=0 check is used to detect errors. if it's non-zero here
@@ -294,10 +238,111 @@ o_stream_zlib_sendv(struct ostream_private *stream,
 	return bytes;
 }
 
-static void o_stream_zlib_init_gz_header(struct zlib_ostream *zstream,
-					 int level, int strategy)
+static void o_stream_zlib_deflate_init(z_stream *zs, int level, int strategy)
+{
+	int ret;
+
+	ret = deflateInit2(zs, level, Z_DEFLATED, -15, 8, strategy);
+	switch (ret) {
+	case Z_OK:
+		break;
+	case Z_MEM_ERROR:
+		i_fatal_status(FATAL_OUTOFMEM, "deflateInit(): Out of memory");
+	case Z_VERSION_ERROR:
+		i_fatal("Wrong zlib library version (broken compilation)");
+	case Z_STREAM_ERROR:
+		i_fatal("Invalid compression level %d", level);
+	default:
+		i_fatal("deflateInit() failed with %d", ret);
+	}
+}
+
+static void o_stream_gz_destroy(void *context)
+{
+	struct gz_ostream *gstream = context;
+
+	(void)deflateEnd(&gstream->zs);
+	i_free(gstream);
+}
+
+static void o_stream_gz_lsb_uint32(unsigned char *output, uint32_t num)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(uint32_t); i++) {
+		output[i] = num & 0xff;
+		num >>= 8;
+	}
+}
+
+static int
+o_stream_gz_process(void *context, struct ostream_worker_block *block,
+		    const char **error_r)
+{
+	struct gz_ostream *gstream = context;
+	z_stream *zs = &gstream->zs;
+	size_t size;
+	int ret;
+
+	if (!gstream->header_written) {
+		if (block->output_size < sizeof(gstream->header))
+			return 0;
+		memcpy(block->output, gstream->header, sizeof(gstream->header));
+		block->output += sizeof(gstream->header);
+		block->output_size -= sizeof(gstream->header);
+		gstream->header_written = TRUE;
+	}
+
+	while (!gstream->stream_ended) {
+		if (block->input_size == 0 && !block->final)
+			return 1;
+		if (block->output_size == 0)
+			return 0;
+
+		zs->next_in = (void *)block->input;
+		zs->avail_in = block->input_size;
+		zs->next_out = block->output;
+		zs->avail_out = block->output_size;
+		ret = deflate(zs, block->final ? Z_FINISH : Z_NO_FLUSH);
+		switch (ret) {
+		case Z_OK:
+		case Z_BUF_ERROR:
+			break;
+		case Z_STREAM_END:
+			gstream->stream_ended = TRUE;
+			break;
+		default:
+			*error_r = "deflate() failed";
+			return -1;
+		}
+		size = block->input_size - zs->avail_in;
+		gstream->crc = crc32_data_more(gstream->crc, block->input, size);
+		gstream->bytes32 += size;
+		block->input += size;
+		block->input_size -= size;
+		block->output = zs->next_out;
+		block->output_size = zs->avail_out;
+	}
+
+	if (block->output_size < GZ_TRAILER_SIZE)
+		return 0;
+	o_stream_gz_lsb_uint32(block->output, gstream->crc);
+	o_stream_gz_lsb_uint32(block->output + sizeof(uint32_t),
+			       gstream->bytes32);
+	block->output += GZ_TRAILER_SIZE;
+	block->output_size -= GZ_TRAILER_SIZE;
+	return 1;
+}
+
+static const struct ostream_worker_vfuncs o_stream_gz_vfuncs = {
+	.process = o_stream_gz_process,
+	.destroy = o_stream_gz_destroy,
+};
+
+static void o_stream_gz_init_header(struct gz_ostream *gstream,
+				    int level, int strategy)
 {
-	unsigned char *hdr = zstream->gz_header;
+	unsigned char *hdr = gstream->header;
 
 	hdr[0] = 0x1f;
 	hdr[1] = 0x8b;
@@ -306,15 +351,31 @@ static void o_stream_zlib_init_gz_header(struct zlib_ostream *zstream,
 		(strategy >= Z_HUFFMAN_ONLY ||
 		 (level != Z_DEFAULT_COMPRESSION && level < 2) ? 4 : 0);
 	hdr[9] = ZLIB_OS_CODE;
-	i_assert(sizeof(zstream->gz_header) == 10);
 }
 
-static struct ostream *
-o_stream_create_zlib(struct ostream *output, int level, bool gz)
+struct ostream *o_stream_create_gz(struct ostream *output, int level)
 {
 	const int strategy = Z_DEFAULT_STRATEGY;
+	struct ostream_worker_settings set = {
+		.name = "gz",
+		.block_size = GZ_BLOCK_SIZE,
+	};
+	struct gz_ostream *gstream;
+
+	i_assert(level >= 1 && level <= 9);
+
+	gstream = i_new(struct gz_ostream, 1);
+	o_stream_gz_init_header(gstream, level, strategy);
+	o_stream_zlib_deflate_init(&gstream->zs, level, strategy);
+	set.output_size = GZ_HEADER_SIZE +
+		deflateBound(&gstream->zs, GZ_BLOCK_SIZE) + GZ_TRAILER_SIZE;
+	return o_stream_create_worker(output, &set, &o_stream_gz_vfuncs,
+				      gstream);
+}
+
+struct ostream *o_stream_create_deflate(struct ostream *output, int level)
+{
 	struct zlib_ostream *zstream;
-	int ret;
 
 	i_assert(level >= 1 && level <= 9);
 
@@ -326,39 +387,11 @@ o_stream_create_zlib(struct ostream *output, int level, bool gz)
 	zstream->ostream.get_buffer_avail_size =
 		o_stream_zlib_get_buffer_avail_size;
 	zstream->ostream.iostream.close = o_stream_zlib_close;
-	zstream->crc = 0;
-	zstream->gz = gz;
-	if (!gz)
-		zstream->header_sent = TRUE;
-
-	o_stream_zlib_init_gz_header(zstream, level, strategy);
-	ret = deflateInit2(&zstream->zs, level, Z_DEFLATED, -15, 8, strategy);
-	switch (ret) {
-	case Z_OK:
-		break;
-	case Z_MEM_ERROR:
-		i_fatal_status(FATAL_OUTOFMEM, "deflateInit(): Out of memory");
-	case Z_VERSION_ERROR:
-		i_fatal("Wrong zlib library version (broken compilation)");
-	case Z_STREAM_ERROR:
-		i_fatal("Invalid compression level %d", level);
-	default:
-		i_fatal("deflateInit() failed with %d", ret);
-	}
 
+	o_stream_zlib_deflate_init(&zstream->zs, level, Z_DEFAULT_STRATEGY);
 	zstream->zs.next_out = zstream->outbuf;
 	zstream->zs.avail_out = sizeof(zstream->outbuf);
 	return o_stream_create(&zstream->ostream, output,
 			       o_stream_get_fd(output));
 }
-
-struct ostream *o_stream_create_gz(struct ostream *output, int level)
-{
-	return o_stream_create_zlib(output, level, TRUE);
-}
-
-struct ostream *o_stream_create_deflate(struct ostream *output, int level)
-{
-	return o_stream_create_zlib(output, level, FALSE);
-}
 #endif
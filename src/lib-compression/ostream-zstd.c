@@ -0,0 +1,192 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "byteorder.h"
+#include "ostream-worker.h"
+#include "ostream-zlib.h"
+#include "iostream-zstd-private.h"
+
+#define FRAME_SIZE OSTREAM_ZSTD_FRAME_SIZE
+#define SEEK_TABLE_ENTRY_SIZE (sizeof(uint32_t) * 2)
+
+/* The frames may be compressed in a separate thread, so only
+   o_stream_create_zstd_dict() and o_stream_zstd_destroy() may use lib
+   functions. */
+struct zstd_ostream {
+	ZSTD_CCtx *cctx;
+	struct zstd_dict *dict;
+
+	/* seek table entries, which are added while the frames are
+	   compressed. malloc()ed, since they're grown by the worker
+	   thread. */
+	unsigned char *seek_table;
+	unsigned int frame_count, frame_alloc_count;
+};
+
+static void o_stream_zstd_destroy(void *context)
+{
+	struct zstd_ostream *zstream = context;
+
+	ZSTD_freeCCtx(zstream->cctx);
+	zstd_dict_unref(&zstream->dict);
+	free(zstream->seek_table);
+	i_free(zstream);
+}
+
+static int
+o_stream_zstd_seek_table_add(struct zstd_ostream *zstream,
+			     size_t compressed_size, size_t uncompressed_size)
+{
+	unsigned char *entry;
+	unsigned int count;
+
+	if (zstream->frame_count == zstream->frame_alloc_count) {
+		count = zstream->frame_alloc_count == 0 ? 16 :
+			zstream->frame_alloc_count * 2;
+		entry = realloc(zstream->seek_table,
+				count * SEEK_TABLE_ENTRY_SIZE);
+		if (entry == NULL)
+			return -1;
+		zstream->seek_table = entry;
+		zstream->frame_alloc_count = count;
+	}
+	entry = zstream->seek_table +
+		zstream->frame_count * SEEK_TABLE_ENTRY_SIZE;
+	cpu32_to_le_unaligned(compressed_size, entry);
+	cpu32_to_le_unaligned(uncompressed_size, entry + sizeof(uint32_t));
+	zstream->frame_count++;
+	return 0;
+}
+
+static size_t o_stream_zstd_seek_table_size(struct zstd_ostream *zstream)
+{
+	if (zstream->frame_count < 2) {
+		/* a single frame's header already contains its size, so
+		   there's nothing to gain from a seek table */
+		return 0;
+	}
+	return IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN +
+		zstream->frame_count * SEEK_TABLE_ENTRY_SIZE +
+		IOSTREAM_ZSTD_SEEK_TABLE_FOOTER_LEN;
+}
+
+static void
+o_stream_zstd_seek_table_write(struct zstd_ostream *zstream,
+			       unsigned char *output, size_t size)
+{
+	size_t entries_size = zstream->frame_count * SEEK_TABLE_ENTRY_SIZE;
+
+	/* skippable frame header */
+	cpu32_to_le_unaligned(IOSTREAM_ZSTD_SEEK_TABLE_MAGIC, output);
+	cpu32_to_le_unaligned(size - IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN,
+			      output + sizeof(uint32_t));
+	output += IOSTREAM_ZSTD_SKIPPABLE_HEADER_LEN;
+
+	memcpy(output, zstream->seek_table, entries_size);
+	output += entries_size;
+
+	cpu32_to_le_unaligned(zstream->frame_count, output);
+	/* descriptor: no checksums */
+	output[sizeof(uint32_t)] = 0;
+	cpu32_to_le_unaligned(IOSTREAM_ZSTD_SEEKABLE_MAGIC,
+			      output + sizeof(uint32_t) + 1);
+}
+
+static int
+o_stream_zstd_process(void *context, struct ostream_worker_block *block,
+		      const char **error_r)
+{
+	struct zstd_ostream *zstream = context;
+	size_t ret, size;
+
+	/* compress each block into a separate frame. the frame header then
+	   contains the uncompressed size and the frames can be decompressed
+	   independently from each others. an empty stream still gets a
+	   single empty frame so it's recognized as zstd data. */
+	if (block->input_size > 0 ||
+	    (block->final && zstream->frame_count == 0)) {
+		if (block->output_size < ZSTD_compressBound(block->input_size))
+			return 0;
+		ret = ZSTD_compress2(zstream->cctx,
+				     block->output, block->output_size,
+				     block->input, block->input_size);
+		if (ZSTD_isError(ret)) {
+			*error_r = ZSTD_getErrorName(ret);
+			return -1;
+		}
+		i_assert(ret > 0 && ret <= block->output_size);
+		if (o_stream_zstd_seek_table_add(zstream, ret,
+						 block->input_size) < 0) {
+			*error_r = "Out of memory";
+			return -1;
+		}
+		block->input += block->input_size;
+		block->input_size = 0;
+		block->output += ret;
+		block->output_size -= ret;
+	}
+	if (block->final) {
+		size = o_stream_zstd_seek_table_size(zstream);
+		if (block->output_size < size)
+			return 0;
+		if (size > 0) {
+			o_stream_zstd_seek_table_write(zstream, block->output,
+						       size);
+			block->output += size;
+			block->output_size -= size;
+		}
+	}
+	return 1;
+}
+
+static const struct ostream_worker_vfuncs o_stream_zstd_vfuncs = {
+	.process = o_stream_zstd_process,
+	.destroy = o_stream_zstd_destroy,
+};
+
+struct ostream *
+o_stream_create_zstd_dict(struct ostream *output, int level,
+			  struct zstd_dict *dict)
+{
+	const struct ostream_worker_settings set = {
+		.name = "zstd",
+		.block_size = FRAME_SIZE,
+		.output_size = ZSTD_compressBound(FRAME_SIZE),
+	};
+	struct zstd_ostream *zstream;
+	size_t ret;
+
+	i_assert(level >= 1 && level <= ZSTD_maxCLevel());
+
+	zstream = i_new(struct zstd_ostream, 1);
+	zstream->cctx = ZSTD_createCCtx();
+	if (zstream->cctx == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: ZSTD_createCCtx() failed");
+	ret = ZSTD_CCtx_setParameter(zstream->cctx, ZSTD_c_compressionLevel,
+				     level);
+	if (!ZSTD_isError(ret)) {
+		ret = ZSTD_CCtx_setParameter(zstream->cctx,
+					     ZSTD_c_checksumFlag, 1);
+	}
+	if (!ZSTD_isError(ret) && dict != NULL) {
+		zstd_dict_ref(dict);
+		zstream->dict = dict;
+		ret = ZSTD_CCtx_refCDict(zstream->cctx,
+					 zstd_dict_get_cdict(dict, level));
+	}
+	if (ZSTD_isError(ret)) {
+		i_panic("zstd: Failed to set compression parameters: %s",
+			ZSTD_getErrorName(ret));
+	}
+	return o_stream_create_worker(output, &set, &o_stream_zstd_vfuncs,
+				      zstream);
+}
+
+struct ostream *o_stream_create_zstd(struct ostream *output, int level)
+{
+	return o_stream_create_zstd_dict(output, level, NULL);
+}
+#endif
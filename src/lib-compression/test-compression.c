@@ -1,16 +1,30 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "buffer.h"
+#include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
 #include "sha1.h"
 #include "randgen.h"
+#include "str.h"
+#include "time-util.h"
 #include "test-common.h"
 #include "compression.h"
+#include "iostream-zstd.h"
 
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#  include <zdict.h>
+#endif
+
+ARRAY_DEFINE_TYPE(test_mail, string_t *);
 
 static void test_compression_handler(const struct compression_handler *handler)
 {
@@ -204,6 +218,350 @@ static void test_gz_large_header(void)
 	test_end();
 }
 
+#ifdef HAVE_ZSTD
+static void test_zstd_mail_generate(string_t *str, unsigned int n)
+{
+	static const char *const words[] = {
+		"meeting", "report", "invoice", "tomorrow", "project",
+		"please", "attached", "regards", "schedule", "update"
+	};
+	unsigned int i;
+
+	str_truncate(str, 0);
+	str_printfa(str, "Return-Path: <user%u@example.com>\r\n"
+		    "Received: from mx%u.example.com (mx%u.example.com "
+		    "[192.168.%u.%u])\r\n\tby imap.example.org with LMTP id %x\r\n"
+		    "Message-ID: <%x.%u@example.com>\r\n"
+		    "Date: Mon, %u Jan 2018 12:%02u:%02u +0200\r\n"
+		    "From: User %u <user%u@example.com>\r\n"
+		    "To: Recipient <rcpt%u@example.org>\r\n"
+		    "Subject: %s %s\r\n"
+		    "MIME-Version: 1.0\r\n"
+		    "Content-Type: text/plain; charset=utf-8\r\n"
+		    "Content-Transfer-Encoding: 7bit\r\n\r\n",
+		    n % 97, n % 7, n % 7, n % 256, (n * 7) % 256, n * 2654435761U,
+		    n * 2654435761U, n, n % 28 + 1, n % 60, (n * 13) % 60, n % 97, n % 97, n % 31,
+		    words[n % N_ELEMENTS(words)],
+		    words[(n / 3) % N_ELEMENTS(words)]);
+	for (i = 0; i < 3 + n % 5; i++) {
+		str_printfa(str, "Hello, the %s %s is %s.\r\n",
+			    words[(n + i) % N_ELEMENTS(words)],
+			    words[(n * i) % N_ELEMENTS(words)],
+			    words[(n + 3 * i) % N_ELEMENTS(words)]);
+	}
+}
+
+static struct zstd_dict *test_zstd_dict_train(unsigned int seed)
+{
+	string_t *samples = t_str_new(1024*512), *str = t_str_new(1024);
+	size_t sample_sizes[1000];
+	unsigned char dict_buf[1024*8];
+	struct zstd_dict *dict;
+	const char *error;
+	size_t ret;
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(sample_sizes); i++) {
+		test_zstd_mail_generate(str, seed + i);
+		str_append_str(samples, str);
+		sample_sizes[i] = str_len(str);
+	}
+	ret = ZDICT_trainFromBuffer(dict_buf, sizeof(dict_buf),
+				    str_data(samples), sample_sizes,
+				    N_ELEMENTS(sample_sizes));
+	if (ZDICT_isError(ret))
+		i_fatal("ZDICT_trainFromBuffer() failed: %s",
+			ZDICT_getErrorName(ret));
+	if (zstd_dict_create(dict_buf, ret, &dict, &error) < 0)
+		i_fatal("zstd_dict_create() failed: %s", error);
+	return dict;
+}
+
+static void
+test_zstd_compress(buffer_t *dest, const string_t *src, struct zstd_dict *dict)
+{
+	struct ostream *buf_output, *output;
+
+	buf_output = o_stream_create_buffer(dest);
+	output = o_stream_create_zstd_dict(buf_output, 3, dict);
+	o_stream_nsend(output, str_data(src), str_len(src));
+	test_assert(o_stream_finish(output) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+}
+
+static int
+test_zstd_uncompress(const buffer_t *src, struct zstd_dict *const *dicts,
+		     unsigned int dict_count, string_t *dest)
+{
+	struct istream *input, *zinput;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	str_truncate(dest, 0);
+	input = test_istream_create_data(src->data, src->used);
+	zinput = i_stream_create_zstd_dicts(input, FALSE, dicts, dict_count);
+	while (i_stream_read_more(zinput, &data, &size) > 0) {
+		str_append_data(dest, data, size);
+		i_stream_skip(zinput, size);
+	}
+	ret = zinput->stream_errno;
+	i_stream_unref(&zinput);
+	i_stream_unref(&input);
+	return ret;
+}
+
+static void test_zstd_dict(void)
+{
+	struct zstd_dict *dict1, *dict2, *dicts[2];
+	buffer_t *plain_output = t_buffer_create(1024);
+	buffer_t *dict_output = t_buffer_create(1024);
+	buffer_t *concat_output = t_buffer_create(1024);
+	string_t *mail = t_str_new(1024), *mail2 = t_str_new(1024);
+	string_t *result = t_str_new(1024);
+	const char *error;
+
+	test_begin("zstd dictionary");
+	dict1 = test_zstd_dict_train(0);
+	dict2 = test_zstd_dict_train(100000);
+	test_assert(zstd_dict_get_id(dict1) != 0);
+	test_assert(zstd_dict_get_id(dict1) != zstd_dict_get_id(dict2));
+	test_assert(zstd_dict_create("foo", 3, &dicts[0], &error) < 0);
+
+	/* a small mail compresses better with a dictionary */
+	test_zstd_mail_generate(mail, 5000);
+	test_zstd_compress(plain_output, mail, NULL);
+	test_zstd_compress(dict_output, mail, dict1);
+	test_assert(dict_output->used < plain_output->used);
+
+	test_assert(test_zstd_uncompress(dict_output, &dict1, 1, result) == 0);
+	test_assert(str_equals(result, mail));
+	/* dictionary is required */
+	test_assert(test_zstd_uncompress(dict_output, NULL, 0, result) == EINVAL);
+	test_assert(test_zstd_uncompress(dict_output, &dict2, 1, result) == EINVAL);
+
+	/* each frame's dictionary is looked up separately */
+	test_zstd_mail_generate(mail2, 5001);
+	test_zstd_compress(concat_output, mail, dict1);
+	test_zstd_compress(concat_output, mail2, dict2);
+	test_zstd_compress(concat_output, mail, NULL);
+	dicts[0] = dict2; dicts[1] = dict1;
+	test_assert(test_zstd_uncompress(concat_output, dicts, 2, result) == 0);
+	test_assert(str_len(result) == str_len(mail)*2 + str_len(mail2) &&
+		    memcmp(str_data(result), str_data(mail), str_len(mail)) == 0 &&
+		    memcmp(str_data(result) + str_len(mail), str_data(mail2),
+			   str_len(mail2)) == 0 &&
+		    memcmp(str_data(result) + str_len(mail) + str_len(mail2),
+			   str_data(mail), str_len(mail)) == 0);
+
+	zstd_dict_unref(&dict1);
+	zstd_dict_unref(&dict2);
+	test_end();
+}
+
+static void test_zstd_dict_levels(void)
+{
+	static const int levels[] = { 3, 1, 3, 9 };
+	struct ostream *buf_outputs[N_ELEMENTS(levels)];
+	struct ostream *outputs[N_ELEMENTS(levels)];
+	buffer_t *bufs[N_ELEMENTS(levels)];
+	string_t *mail = t_str_new(1024), *result = t_str_new(1024);
+	struct zstd_dict *dict;
+	unsigned int i;
+
+	test_begin("zstd dictionary with multiple levels");
+	dict = test_zstd_dict_train(0);
+	test_zstd_mail_generate(mail, 5000);
+
+	/* the ostreams are alive at the same time with different levels, so
+	   each level's compression dictionary must stay valid */
+	for (i = 0; i < N_ELEMENTS(levels); i++) {
+		bufs[i] = t_buffer_create(1024);
+		buf_outputs[i] = o_stream_create_buffer(bufs[i]);
+		outputs[i] = o_stream_create_zstd_dict(buf_outputs[i],
+						       levels[i], dict);
+	}
+	for (i = 0; i < N_ELEMENTS(levels); i++) {
+		o_stream_nsend(outputs[i], str_data(mail), str_len(mail));
+		test_assert_idx(o_stream_finish(outputs[i]) > 0, i);
+	}
+	/* the dictionary is freed only after the last ostream */
+	zstd_dict_unref(&dict);
+	for (i = 0; i < N_ELEMENTS(levels); i++) {
+		o_stream_destroy(&outputs[i]);
+		o_stream_destroy(&buf_outputs[i]);
+	}
+
+	dict = test_zstd_dict_train(0);
+	for (i = 0; i < N_ELEMENTS(levels); i++) {
+		test_assert_idx(test_zstd_uncompress(bufs[i], &dict, 1,
+						     result) == 0, i);
+		test_assert_idx(str_equals(result, mail), i);
+	}
+	zstd_dict_unref(&dict);
+	test_end();
+}
+
+static void test_zstd_truncated(void)
+{
+	buffer_t *output = t_buffer_create(1024);
+	string_t *mail = t_str_new(1024), *result = t_str_new(1024);
+	size_t full_size;
+
+	test_begin("zstd truncated");
+	test_zstd_mail_generate(mail, 1);
+	test_zstd_compress(output, mail, NULL);
+	full_size = output->used;
+	buffer_set_used_size(output, full_size - 1);
+	test_assert(test_zstd_uncompress(output, NULL, 0, result) == EPIPE);
+
+	/* empty input still produces a valid (empty) frame */
+	buffer_set_used_size(output, 0);
+	str_truncate(mail, 0);
+	test_zstd_compress(output, mail, NULL);
+	test_assert(output->used > 0);
+	test_assert(test_zstd_uncompress(output, NULL, 0, result) == 0);
+	test_assert(str_len(result) == 0);
+	test_end();
+}
+
+static void
+test_zstd_seek_verify(struct istream *zinput, const string_t *plain,
+		      uoff_t offset)
+{
+	const unsigned char *data;
+	size_t size;
+
+	i_stream_seek(zinput, offset);
+	if (i_stream_read_bytes(zinput, &data, &size, 1) <= 0) {
+		test_assert_idx(offset == str_len(plain), offset);
+		return;
+	}
+	size = I_MIN(size, str_len(plain) - offset);
+	test_assert_idx(memcmp(data, str_data(plain) + offset, size) == 0,
+			offset);
+}
+
+static void test_zstd_seek_table(void)
+{
+	buffer_t *output = t_buffer_create(1024*128);
+	string_t *plain = t_str_new(1024*640), *mail = t_str_new(1024);
+	struct istream *input, *zinput;
+	unsigned char *data;
+	uoff_t size, offset;
+	unsigned int i;
+
+	test_begin("zstd seek table");
+	for (i = 0; str_len(plain) < OSTREAM_ZSTD_FRAME_SIZE * 4 + 1234; i++) {
+		test_zstd_mail_generate(mail, i);
+		str_append_str(plain, mail);
+	}
+	test_zstd_compress(output, plain, NULL);
+	test_assert(memcmp(CONST_PTR_OFFSET(output->data, output->used - 4),
+			   "\xb1\xea\x92\x8f", 4) == 0);
+
+	/* seek around in the stream */
+	input = i_stream_create_from_data(output->data, output->used);
+	zinput = i_stream_create_zstd_dicts(input, FALSE, NULL, 0);
+	test_assert(i_stream_zstd_has_seek_table(zinput));
+	test_assert(i_stream_get_size(zinput, TRUE, &size) == 1 &&
+		    size == str_len(plain));
+	for (i = 0; i < 100; i++) {
+		offset = ((uoff_t)i * 2654435761U) % str_len(plain);
+		test_zstd_seek_verify(zinput, plain, offset);
+	}
+	test_zstd_seek_verify(zinput, plain, str_len(plain) - 1);
+	test_zstd_seek_verify(zinput, plain, 0);
+	test_zstd_seek_verify(zinput, plain, str_len(plain));
+	i_stream_unref(&zinput);
+	i_stream_unref(&input);
+
+	/* the first frame isn't needed when seeking to the last one */
+	data = buffer_get_modifiable_data(output, NULL);
+	data[100] ^= 0xff;
+	input = i_stream_create_from_data(output->data, output->used);
+	zinput = i_stream_create_zstd_dicts(input, FALSE, NULL, 0);
+	test_zstd_seek_verify(zinput, plain, str_len(plain) - 100);
+	test_assert(zinput->stream_errno == 0);
+	i_stream_seek(zinput, 0);
+	while (i_stream_read(zinput) > 0)
+		i_stream_skip(zinput, i_stream_get_data_size(zinput));
+	test_assert(zinput->stream_errno != 0);
+	i_stream_unref(&zinput);
+	i_stream_unref(&input);
+	data[100] ^= 0xff;
+
+	/* invalid seek table is ignored */
+	data[output->used - 1] ^= 0xff;
+	input = i_stream_create_from_data(output->data, output->used);
+	zinput = i_stream_create_zstd_dicts(input, FALSE, NULL, 0);
+	test_assert(!i_stream_zstd_has_seek_table(zinput));
+	test_zstd_seek_verify(zinput, plain, str_len(plain) - 100);
+	test_zstd_seek_verify(zinput, plain, 1000);
+	i_stream_unref(&zinput);
+	i_stream_unref(&input);
+
+	/* a single frame doesn't get a seek table */
+	buffer_set_used_size(output, 0);
+	test_zstd_compress(output, mail, NULL);
+	input = i_stream_create_from_data(output->data, output->used);
+	zinput = i_stream_create_zstd_dicts(input, FALSE, NULL, 0);
+	test_assert(!i_stream_zstd_has_seek_table(zinput));
+	i_stream_unref(&zinput);
+	i_stream_unref(&input);
+	test_end();
+}
+
+static void test_zstd_partial_output(void)
+{
+	buffer_t *output = t_buffer_create(1024*128);
+	string_t *plain = t_str_new(1024*640), *mail = t_str_new(1024);
+	string_t *result = t_str_new(1024*640);
+	struct ostream *test_output, *zoutput;
+	struct ioloop *ioloop;
+	size_t pos = 0, max_output = 0;
+	ssize_t ret;
+	unsigned int i;
+
+	/* large streams are compressed in a separate thread. make sure the
+	   frames are still written in the right order when the parent stream
+	   accepts only a little bit of output at a time. */
+	test_begin("zstd partial output");
+	for (i = 0; str_len(plain) < OSTREAM_ZSTD_FRAME_SIZE * 4 + 1234; i++) {
+		test_zstd_mail_generate(mail, i);
+		str_append_str(plain, mail);
+	}
+	ioloop = io_loop_create();
+	test_output = test_ostream_create_nonblocking(output, 1024);
+	test_ostream_set_max_output_size(test_output, max_output);
+	zoutput = o_stream_create_zstd_dict(test_output, 3, NULL);
+	while (pos < str_len(plain)) {
+		ret = o_stream_send(zoutput, str_data(plain) + pos,
+				    I_MIN(str_len(plain) - pos, 10000));
+		test_assert(ret >= 0);
+		pos += ret;
+		if (ret == 0) {
+			max_output += 4096;
+			test_ostream_set_max_output_size(test_output,
+							 max_output);
+		}
+	}
+	while ((ret = o_stream_finish(zoutput)) == 0) {
+		max_output += 4096;
+		test_ostream_set_max_output_size(test_output, max_output);
+	}
+	test_assert(ret > 0);
+	o_stream_destroy(&zoutput);
+	o_stream_destroy(&test_output);
+	io_loop_destroy(&ioloop);
+
+	test_assert(test_zstd_uncompress(output, NULL, 0, result) == 0);
+	test_assert(str_equals(plain, result));
+	test_end();
+}
+#endif
+
 static void test_uncompress_file(const char *path)
 {
 	const struct compression_handler *handler;
@@ -288,6 +646,155 @@ static void test_compress_file(const char *in_path, const char *out_path)
 	i_close_fd(&fd_out);
 }
 
+static void
+test_benchmark_add_file(ARRAY_TYPE(test_mail) *mails, const char *path)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *str = t_str_new(1024);
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_fatal("read(%s) failed: %s", path,
+			i_stream_get_error(input));
+	}
+	i_stream_destroy(&input);
+	array_append(mails, &str, 1);
+}
+
+static void
+test_benchmark_handler(const struct compression_handler *handler, int level,
+		       struct zstd_dict *dict,
+		       const ARRAY_TYPE(test_mail) *mails)
+{
+	string_t *const *mailp;
+	struct ostream *buf_output, *output;
+	struct istream *input, *zinput;
+	struct timeval start, end;
+	buffer_t *compressed = buffer_create_dynamic(default_pool, 1024*64);
+	buffer_t *mail_buf = buffer_create_dynamic(default_pool, 1024*16);
+	ARRAY(size_t) offsets;
+	const unsigned char *data;
+	size_t size, prev_offset, *offsetp;
+	uoff_t plain_size = 0;
+	long long compress_usecs, decompress_usecs;
+
+	/* compress each mail separately like the zlib plugin does. a separate
+	   buffer is used for each mail, because the buffer ostream counts all
+	   of the buffer's data as unsent. */
+	i_array_init(&offsets, array_count(mails));
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	array_foreach(mails, mailp) {
+		buffer_set_used_size(mail_buf, 0);
+		buf_output = o_stream_create_buffer(mail_buf);
+		if (dict != NULL)
+			output = o_stream_create_zstd_dict(buf_output, level, dict);
+		else
+			output = handler->create_ostream(buf_output, level);
+		o_stream_nsend(output, str_data(*mailp), str_len(*mailp));
+		if (o_stream_finish(output) < 0)
+			i_fatal("compression failed: %s", o_stream_get_error(output));
+		o_stream_destroy(&output);
+		o_stream_destroy(&buf_output);
+		buffer_append_buf(compressed, mail_buf, 0, (size_t)-1);
+		array_append(&offsets, &compressed->used, 1);
+		plain_size += str_len(*mailp);
+	}
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	compress_usecs = timeval_diff_usecs(&end, &start);
+
+	prev_offset = 0;
+	if (gettimeofday(&start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	array_foreach_modifiable(&offsets, offsetp) {
+		input = i_stream_create_from_data(CONST_PTR_OFFSET(compressed->data,
+								   prev_offset),
+						  *offsetp - prev_offset);
+		if (dict != NULL)
+			zinput = i_stream_create_zstd_dicts(input, TRUE, &dict, 1);
+		else
+			zinput = handler->create_istream(input, TRUE);
+		while (i_stream_read_more(zinput, &data, &size) > 0)
+			i_stream_skip(zinput, size);
+		if (zinput->stream_errno != 0)
+			i_fatal("decompression failed: %s", i_stream_get_error(zinput));
+		i_stream_unref(&zinput);
+		i_stream_unref(&input);
+		prev_offset = *offsetp;
+	}
+	if (gettimeofday(&end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	decompress_usecs = timeval_diff_usecs(&end, &start);
+
+	printf("%-8s level %d%s: %5.1f%% of original size, "
+	       "compress %7.1f MB/s, decompress %7.1f MB/s\n",
+	       handler->name, level, dict == NULL ? "      " : " +dict",
+	       compressed->used * 100.0 / I_MAX(plain_size, 1),
+	       plain_size / (double)I_MAX(compress_usecs, 1),
+	       plain_size / (double)I_MAX(decompress_usecs, 1));
+	array_free(&offsets);
+	buffer_free(&compressed);
+	buffer_free(&mail_buf);
+}
+
+static void test_compression_benchmark(const char *path, const char *dict_path)
+{
+	static const int levels[] = { 1, 6 };
+	ARRAY_TYPE(test_mail) mails;
+	struct zstd_dict *dict = NULL;
+	const char *error;
+	struct dirent *d;
+	struct stat st;
+	DIR *dirp;
+	unsigned int i, j;
+
+	/* a directory (e.g. maildir/cur) is benchmarked one file at a time,
+	   other files as a single large mail */
+	t_array_init(&mails, 1024);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	if (!S_ISDIR(st.st_mode))
+		test_benchmark_add_file(&mails, path);
+	else {
+		if ((dirp = opendir(path)) == NULL)
+			i_fatal("opendir(%s) failed: %m", path);
+		while ((d = readdir(dirp)) != NULL) {
+			if (d->d_name[0] != '.') {
+				test_benchmark_add_file(&mails,
+					t_strconcat(path, "/", d->d_name, NULL));
+			}
+		}
+		(void)closedir(dirp);
+	}
+	if (dict_path != NULL &&
+	    zstd_dict_create_file(dict_path, &dict, &error) < 0)
+		i_fatal("%s", error);
+
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		const struct compression_handler *handler =
+			&compression_handlers[i];
+
+		/* skip the streaming-only deflate, which has no end marker */
+		if (handler->create_ostream == NULL || handler->ext == NULL)
+			continue;
+		for (j = 0; j < N_ELEMENTS(levels); j++) T_BEGIN {
+			test_benchmark_handler(handler, levels[j], NULL, &mails);
+			if (dict != NULL && strcmp(handler->name, "zstd") == 0) {
+				test_benchmark_handler(handler, levels[j],
+						       dict, &mails);
+			}
+		} T_END;
+	}
+	zstd_dict_unref(&dict);
+}
+
 int main(int argc, char *argv[])
 {
 	static void (*const test_functions[])(void) = {
@@ -295,8 +802,20 @@ int main(int argc, char *argv[])
 		test_gz_concat,
 		test_gz_no_concat,
 		test_gz_large_header,
+#ifdef HAVE_ZSTD
+		test_zstd_dict,
+		test_zstd_dict_levels,
+		test_zstd_truncated,
+		test_zstd_seek_table,
+		test_zstd_partial_output,
+#endif
 		NULL
 	};
+	if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+		/* -b <file or directory> [<zstd dictionary>] */
+		test_compression_benchmark(argv[2], argc > 3 ? argv[3] : NULL);
+		return 0;
+	}
 	if (argc == 2) {
 		test_uncompress_file(argv[1]);
 		return 0;
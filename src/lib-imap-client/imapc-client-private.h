@@ -43,6 +43,7 @@ struct imapc_client_mailbox {
 	void (*reopen_callback)(void *context);
 	void *reopen_context;
 
+	imapc_untagged_callback_t *untagged_callback;
 	void *untagged_box_context;
 
 	bool reconnect_ok;
@@ -399,6 +399,12 @@ void imapc_client_mailbox_set_reopen_cb(struct imapc_client_mailbox *box,
 	box->reopen_context = context;
 }
 
+void imapc_client_mailbox_set_untagged_callback(struct imapc_client_mailbox *box,
+						imapc_untagged_callback_t *callback)
+{
+	box->untagged_callback = callback;
+}
+
 bool imapc_client_mailbox_can_reconnect(struct imapc_client_mailbox *box)
 {
 	/* the reconnect_ok flag attempts to avoid infinite reconnection loops
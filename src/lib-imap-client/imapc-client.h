@@ -223,6 +223,12 @@ imapc_client_mailbox_open(struct imapc_client *client,
 void imapc_client_mailbox_set_reopen_cb(struct imapc_client_mailbox *box,
 					void (*callback)(void *context),
 					void *context);
+/* Send untagged replies received while this mailbox is selected to the given
+   callback instead of the client's untagged callback. This is useful for
+   connections that have a mailbox selected only for helping another
+   connection, and whose replies mustn't update the mailbox state. */
+void imapc_client_mailbox_set_untagged_callback(struct imapc_client_mailbox *box,
+						imapc_untagged_callback_t *callback);
 void imapc_client_mailbox_close(struct imapc_client_mailbox **box);
 bool imapc_client_mailbox_can_reconnect(struct imapc_client_mailbox *box);
 void imapc_client_mailbox_reconnect(struct imapc_client_mailbox *box,
@@ -101,6 +101,8 @@ struct imapc_connection {
 	uint32_t cur_num;
 	struct timeval last_connect;
 	unsigned int reconnect_count;
+	/* number of tagged replies received since the last connect */
+	unsigned int reply_count;
 
 	struct imapc_client_mailbox *selecting_box, *selected_box;
 	enum imapc_connection_state state;
@@ -438,6 +440,23 @@ imapc_connection_literal_reset(struct imapc_connection_literal *literal)
 	literal->fd = -1;
 }
 
+static const char *imapc_connection_get_stats(struct imapc_connection *conn)
+{
+	uoff_t in_bytes = 0, out_bytes = 0;
+	int msecs;
+
+	if (conn->fd != -1) {
+		in_bytes = i_stream_get_absolute_offset(conn->raw_input);
+		out_bytes = conn->raw_output->offset;
+	}
+	msecs = timeval_diff_msecs(&ioloop_timeval, &conn->last_connect);
+	return t_strdup_printf("%u commands, in=%"PRIuUOFF_T" out=%"PRIuUOFF_T
+		" bytes in %d.%03d secs, %"PRIuUOFF_T" kB/s",
+		conn->reply_count, in_bytes, out_bytes,
+		msecs / 1000, msecs % 1000, msecs <= 0 ? 0 :
+		(in_bytes + out_bytes) * 1000 / 1024 / msecs);
+}
+
 void imapc_connection_disconnect_full(struct imapc_connection *conn,
 				      bool reconnecting)
 {
@@ -448,8 +467,10 @@ void imapc_connection_disconnect_full(struct imapc_connection *conn,
 	if (conn->state == IMAPC_CONNECTION_STATE_DISCONNECTED)
 		return;
 
-	if (conn->client->set.debug)
-		i_debug("imapc(%s): Disconnected", conn->name);
+	if (conn->client->set.debug) {
+		i_debug("imapc(%s): Disconnected (%s)", conn->name,
+			imapc_connection_get_stats(conn));
+	}
 
 	if (conn->dns_lookup != NULL)
 		dns_lookup_abort(&conn->dns_lookup);
@@ -1272,7 +1293,14 @@ static int imapc_connection_input_untagged(struct imapc_connection *conn)
 	/* the callback may disconnect and destroy the parser */
 	parser = conn->parser;
 	imap_parser_ref(parser);
-	conn->client->untagged_callback(&reply, conn->client->untagged_context);
+	if (conn->selected_box != NULL &&
+	    conn->selected_box->untagged_callback != NULL) {
+		conn->selected_box->untagged_callback(&reply,
+			conn->selected_box->untagged_box_context);
+	} else {
+		conn->client->untagged_callback(&reply,
+						conn->client->untagged_context);
+	}
 	imap_parser_unref(&parser);
 	imapc_connection_input_reset(conn);
 	return 1;
@@ -1483,6 +1511,7 @@ static int imapc_connection_input_tagged(struct imapc_connection *conn)
 			conn->cur_tag, line, reply.text_full);
 		return -1;
 	}
+	conn->reply_count++;
 	if ((cmd->flags & IMAPC_COMMAND_FLAG_SELECT) != 0)
 		conn->select_waiting_reply = FALSE;
 
@@ -1879,6 +1908,7 @@ void imapc_connection_connect(struct imapc_connection *conn)
 
 	imapc_connection_input_reset(conn);
 	conn->last_connect = ioloop_timeval;
+	conn->reply_count = 0;
 
 	if (conn->client->set.debug) {
 		i_debug("imapc(%s): Looking up IP address "
@@ -12,6 +12,7 @@
 #include "ostream.h"
 #include "message-parser.h"
 #include "message-decoder.h"
+#include "mail-cache.h"
 #include "mail-storage-private.h"
 #include "mail-namespace.h"
 #include "imap-bodystructure.h"
@@ -462,6 +463,47 @@ imap_msgpart_crlf_seek(struct mail *mail, struct istream *input,
 	return crlf_input;
 }
 
+static bool imap_msgpart_want_cached_parts(struct mail *mail)
+{
+	struct mail_cache *cache = mail->box->cache;
+	enum mail_cache_decision_type decision;
+	unsigned int field_idx;
+
+	if (cache == NULL)
+		return FALSE;
+	field_idx = mail_cache_register_lookup(cache, "mime.parts");
+	if (field_idx == UINT_MAX)
+		return FALSE;
+	decision = mail_cache_field_get_decision(cache, field_idx);
+	return (decision & ~MAIL_CACHE_DECISION_FORCED) !=
+		MAIL_CACHE_DECISION_NO;
+}
+
+static void
+imap_msgpart_lookup_nul_state(struct mail *mail,
+			      const struct imap_msgpart *msgpart,
+			      struct istream *input)
+{
+	struct message_part *parts;
+	uoff_t old_offset = input->v_offset;
+
+	/* The NUL state isn't cached, so the input would have to be run
+	   through istream-nonuls, which prevents sending it with sendfile().
+	   The input is otherwise usable as-is, so parse the mail once to
+	   find out the NUL state. This is worth it only if the parsed message
+	   parts are cached, so the following FETCHes can skip this. Partial
+	   FETCHes usually send only a small part of a large mail, so don't
+	   parse the whole mail for them. */
+	if (msgpart->partial_offset != 0 ||
+	    msgpart->partial_size != (uoff_t)-1)
+		return;
+	if (!imap_msgpart_want_cached_parts(mail))
+		return;
+
+	(void)mail_get_parts(mail, &parts);
+	i_stream_seek(input, old_offset);
+}
+
 static void
 imap_msgpart_get_partial(struct mail *mail, const struct imap_msgpart *msgpart,
 			 bool convert_nuls, bool use_partial_cache,
@@ -502,6 +544,9 @@ imap_msgpart_get_partial(struct mail *mail, const struct imap_msgpart *msgpart,
 		result->size = bytes_left;
 	}
 
+	if (!mail->has_no_nuls && !mail->has_nuls && convert_nuls &&
+	    result->input->readable_fd)
+		imap_msgpart_lookup_nul_state(mail, msgpart, result->input);
 	if (!mail->has_no_nuls && convert_nuls) {
 		/* IMAP literals must not contain NULs. change them to
 		   0x80 characters. */
@@ -2,9 +2,12 @@
 
 #include "lib.h"
 #include "buffer.h"
-#include "hex-binary.h"
 #include "qp-decoder.h"
 
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
 /* quoted-printable lines can be max 76 characters. if we've seen more than
    that much whitespace, it means there really shouldn't be anything else left
    in the line except trailing whitespace. */
@@ -48,37 +51,113 @@ void qp_decoder_deinit(struct qp_decoder **_qp)
 	i_free(qp);
 }
 
+static inline int qp_hex_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	/* lowercase hex isn't strictly valid, but allow */
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* Returns the position of the next character in src that may need
+   handling (i.e. '=', CR, LF, space or tab), or src_size if none. */
+static inline size_t
+qp_decoder_find_special(const unsigned char *src, size_t i, size_t src_size)
+{
+#ifdef __SSE2__
+	const __m128i equals = _mm_set1_epi8('='), cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n'), space = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+
+	for (; src_size - i >= 16; i += 16) {
+		__m128i data = _mm_loadu_si128((const void *)(src + i));
+		__m128i match;
+		unsigned int mask;
+
+		match = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(data, equals),
+				     _mm_cmpeq_epi8(data, cr)),
+			_mm_or_si128(_mm_cmpeq_epi8(data, lf),
+				     _mm_or_si128(_mm_cmpeq_epi8(data, space),
+						  _mm_cmpeq_epi8(data, tab))));
+		mask = _mm_movemask_epi8(match);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < src_size; i++) {
+		if (src[i] <= '=')
+			break;
+	}
+	return i;
+}
+
 static size_t
 qp_decoder_more_text(struct qp_decoder *qp, const unsigned char *src,
 		     size_t src_size)
 {
-	size_t i, start = 0, ret = src_size;
+	unsigned char out[64];
+	size_t i = 0, start = 0, ret = src_size, out_pos;
+	int hi, lo;
 
-	for (i = 0; i < src_size; i++) {
-		if (src[i] > '=') {
-			/* fast path */
-			continue;
-		}
+	/* The common cases are handled here directly when the following
+	   characters are already available. The rest goes through the state
+	   machine in qp_decoder_more(). */
+	while ((i = qp_decoder_find_special(src, i, src_size)) < src_size) {
 		switch (src[i]) {
 		case '=':
+			if (i + 2 < src_size &&
+			    (hi = qp_hex_value(src[i+1])) >= 0 &&
+			    (lo = qp_hex_value(src[i+2])) >= 0) {
+				/* decode all the following =<hex><hex> at
+				   once, e.g. UTF-8 sequences */
+				buffer_append(qp->dest, src+start, i-start);
+				out_pos = 0;
+				do {
+					out[out_pos++] = (hi << 4) | lo;
+					i += 3;
+				} while (out_pos < sizeof(out) &&
+					 i + 2 < src_size && src[i] == '=' &&
+					 (hi = qp_hex_value(src[i+1])) >= 0 &&
+					 (lo = qp_hex_value(src[i+2])) >= 0);
+				buffer_append(qp->dest, out, out_pos);
+				start = i;
+				continue;
+			}
 			qp->state = STATE_EQUALS;
 			break;
 		case '\r':
+			if (i + 1 < src_size && src[i+1] == '\n') {
+				/* CRLF is kept as-is */
+				i += 2;
+				continue;
+			}
 			qp->state = STATE_CR;
 			break;
 		case '\n':
 			/* LF without preceding CR */
 			buffer_append(qp->dest, src+start, i-start);
 			buffer_append(qp->dest, "\r\n", 2);
-			start = i+1;
+			start = ++i;
 			continue;
 		case ' ':
 		case '\t':
+			if (i + 1 < src_size &&
+			    !QP_IS_TRAILING_WHITESPACE(src[i+1]) &&
+			    src[i+1] != '\r' && src[i+1] != '\n') {
+				/* whitespace between words */
+				i++;
+				continue;
+			}
 			i_assert(qp->whitespace->used == 0);
 			qp->state = STATE_WHITESPACE;
 			buffer_append_c(qp->whitespace, src[i]);
 			break;
 		default:
+			i++;
 			continue;
 		}
 		ret = i+1;
@@ -133,6 +212,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 {
 	const char *error;
 	size_t i;
+	int lo;
 
 	*invalid_src_pos_r = (size_t)-1;
 	*error_r = NULL;
@@ -175,10 +255,7 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_EQUALS:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    /* lowercase hex isn't strictly valid, but allow */
-			    (src[i] >= 'a' && src[i] <= 'f')) {
+			if (qp_hex_value(src[i]) >= 0) {
 				qp->hexchar = src[i];
 				qp->state = STATE_HEX2;
 			} else if (QP_IS_TRAILING_WHITESPACE(src[i])) {
@@ -200,16 +277,9 @@ int qp_decoder_more(struct qp_decoder *qp, const unsigned char *src,
 			}
 			break;
 		case STATE_HEX2:
-			if ((src[i] >= '0' && src[i] <= '9') ||
-			    (src[i] >= 'A' && src[i] <= 'F') ||
-			    (src[i] >= 'a' && src[i] <= 'f')) {
-				char data[3];
-
-				data[0] = qp->hexchar;
-				data[1] = src[i];
-				data[2] = '\0';
-				if (hex_to_binary(data, qp->dest) < 0)
-					i_unreached();
+			if ((lo = qp_hex_value(src[i])) >= 0) {
+				buffer_append_c(qp->dest,
+					(qp_hex_value(qp->hexchar) << 4) | lo);
 				qp->state = STATE_TEXT;
 			} else {
 				/* invalid input */
@@ -2,9 +2,13 @@
 
 #include "lib.h"
 #include "str.h"
+#include "time-util.h"
 #include "qp-decoder.h"
 #include "test-common.h"
 
+#include <stdio.h>
+#include <sys/time.h>
+
 struct test_quoted_printable_decode_data {
 	const char *input;
 	const char *output;
@@ -27,6 +31,11 @@ static void test_qp_decoder(void)
 		{ "foo_bar", "foo_bar", 0, 0 },
 		{ "\n\n", "\r\n\r\n", 0, 0 },
 		{ "\r\n\n\n\r\n", "\r\n\r\n\r\n\r\n", 0, 0 },
+		{ "foo bar\tbaz \t=3D=3d=e4\r\nx", "foo bar\tbaz \t==\xe4\r\nx", 0, 0 },
+		{ "a \tb\t \r\nc \n", "a \tb\r\nc\r\n", 0, 0 },
+		{ "foo =\nbar =", "foo bar =", 11, -1 },
+		{ "=C3=A4=c3=a4=\n=C3=A4=C", "\xc3\xa4\xc3\xa4\xc3\xa4=C", 22, -1 },
+		{ "0123456789abcdef=\r\n0123456789 abcdef=41", "0123456789abcdef0123456789 abcdefA", 0, 0 },
 
 		{ "foo=", "foo=", 4, -1 },
 		{ "foo= \t", "foo= \t", 6, -1 },
@@ -35,6 +44,8 @@ static void test_qp_decoder(void)
 		{ "foo=A", "foo=A", 5, -1 },
 		{ "foo=Ax", "foo=Ax", 5, -1 },
 		{ "foo=Ax=xy", "foo=Ax=xy", 5, -1 },
+		{ "foo=4\r\n", "foo=4\r\n", 5, -1 },
+		{ "foo\rbar", "foo\rbar", 4, -1 },
 
 		/* above 76 whitespaces is invalid and gets truncated
 		   (at 77th whitespace because of the current implementation) */
@@ -85,10 +96,153 @@ static void test_qp_decoder(void)
 	test_end();
 }
 
+static int
+test_qp_decoder_buf(const unsigned char *input, size_t size,
+		    size_t max_chunk, buffer_t *dest)
+{
+	struct qp_decoder *qp = qp_decoder_init(dest);
+	const char *error;
+	size_t pos, chunk, error_pos;
+	int ret = 0;
+
+	for (pos = 0; pos < size; pos += chunk) {
+		chunk = i_rand_minmax(1, max_chunk);
+		chunk = I_MIN(chunk, size - pos);
+		if (qp_decoder_more(qp, input + pos, chunk,
+				    &error_pos, &error) < 0)
+			ret = -1;
+	}
+	if (qp_decoder_finish(qp, &error) < 0)
+		ret = -1;
+	qp_decoder_deinit(&qp);
+	return ret;
+}
+
+static void test_qp_decoder_random(void)
+{
+	static const char chars[] = "ab\xe4 \t=\r\n0fF";
+	unsigned char input[200];
+	buffer_t *dest1, *dest2;
+	unsigned int i, j, len;
+	int ret1, ret2;
+
+	/* Decoding in one call uses the fast paths, while decoding a byte
+	   at a time goes through the state machine. The results must be
+	   the same. */
+	test_begin("qp-decoder random");
+	dest1 = t_buffer_create(256);
+	dest2 = t_buffer_create(256);
+	for (i = 0; i < 10000; i++) {
+		len = i_rand_limit(sizeof(input));
+		for (j = 0; j < len; j++)
+			input[j] = chars[i_rand_limit(sizeof(chars) - 1)];
+		buffer_set_used_size(dest1, 0);
+		buffer_set_used_size(dest2, 0);
+		ret1 = test_qp_decoder_buf(input, len, len + 1, dest1);
+		ret2 = test_qp_decoder_buf(input, len, 1 + i % 8, dest2);
+		test_assert_idx(ret1 == ret2, i);
+		test_assert_idx(buffer_cmp(dest1, dest2), i);
+	}
+	test_end();
+}
+
+static void test_qp_decoder_benchmark_start(struct timeval *start_r)
+{
+	if (gettimeofday(start_r, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void
+test_qp_decoder_benchmark_print(const char *name, size_t size,
+				const struct timeval *start)
+{
+	struct timeval now;
+	long long usecs;
+
+	test_qp_decoder_benchmark_start(&now);
+	usecs = timeval_diff_usecs(&now, start);
+	printf("%-24s %8.1f MB/s\n", name,
+	       usecs == 0 ? 0 : size / (double)usecs);
+}
+
+static void
+test_qp_decoder_benchmark_one(const char *name, const buffer_t *input,
+			      unsigned int mb)
+{
+	const unsigned int count = mb * 1024*1024 / input->used;
+	buffer_t *dest = buffer_create_dynamic(default_pool, input->used);
+	struct timeval start;
+	unsigned int i;
+
+	test_qp_decoder_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		buffer_set_used_size(dest, 0);
+		if (test_qp_decoder_buf(input->data, input->used,
+					input->used, dest) < 0)
+			i_unreached();
+	}
+	test_qp_decoder_benchmark_print(name, (size_t)count * input->used,
+					&start);
+	buffer_free(&dest);
+}
+
+static void test_qp_decoder_benchmark(void)
+{
+	static const char *words[] = {
+		"Lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+		"adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+		"=C3=A4iti", "k=C3=A4=C3=A4nn=C3=B6s", "=E2=82=AC"
+	};
+	const char *value = getenv("QP_BENCHMARK");
+	buffer_t *text, *encoded;
+	unsigned int mb, line_len = 0;
+	const char *word;
+
+	/* QP_BENCHMARK=<MB> measures the decoding throughput */
+	if (value == NULL || str_to_uint(value, &mb) < 0 || mb == 0)
+		return;
+
+	test_begin("qp-decoder benchmark");
+	text = buffer_create_dynamic(default_pool, 65536);
+	encoded = buffer_create_dynamic(default_pool, 65536);
+	while (text->used < 65536) {
+		/* mostly ASCII text with soft line breaks */
+		word = words[i_rand_limit(N_ELEMENTS(words) - 3)];
+		if (line_len + strlen(word) > 72) {
+			buffer_append(text, "=\r\n", 3);
+			line_len = 0;
+		} else if (line_len > 0) {
+			buffer_append_c(text, ' ');
+			line_len++;
+		}
+		buffer_append(text, word, strlen(word));
+		line_len += strlen(word);
+	}
+	line_len = 0;
+	while (encoded->used < 65536) {
+		/* mostly encoded UTF-8 */
+		word = words[N_ELEMENTS(words) - 3 + i_rand_limit(3)];
+		if (line_len + strlen(word) > 72) {
+			buffer_append(encoded, "=\r\n", 3);
+			line_len = 0;
+		}
+		buffer_append(encoded, word, strlen(word));
+		buffer_append(encoded, "=20", 3);
+		line_len += strlen(word) + 3;
+	}
+	test_qp_decoder_benchmark_one("text", text, mb);
+	test_qp_decoder_benchmark_one("encoded", encoded, mb);
+	buffer_free(&text);
+	buffer_free(&encoded);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_qp_decoder,
+		test_qp_decoder_random,
+		test_qp_decoder_benchmark,
 		NULL
 	};
 	return test_run(test_functions);
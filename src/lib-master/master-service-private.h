@@ -59,6 +59,8 @@ struct master_service {
 	void (*avail_overflow_callback)(void);
 	struct timeout *to_overflow_state;
 
+	struct timeout *to_mem_accounting;
+
 	struct master_login *login;
 
 	master_service_connection_callback_t *callback;
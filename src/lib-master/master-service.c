@@ -9,6 +9,7 @@
 #include "strescape.h"
 #include "env-util.h"
 #include "home-expand.h"
+#include "mem-accounting.h"
 #include "process-title.h"
 #include "restrict-access.h"
 #include "settings-parser.h"
@@ -44,6 +45,10 @@
 
 struct master_service *master_service;
 
+static struct event_category event_category_mem_accounting = {
+	.name = "memory",
+};
+
 static void master_service_io_listeners_close(struct master_service *service);
 static void master_service_refresh_login_state(struct master_service *service);
 static void
@@ -572,6 +577,60 @@ static void master_status_error(struct master_service *service)
 	master_service_error(service);
 }
 
+static void
+master_service_mem_accounting_report_one(enum mem_accounting_type type,
+					 const struct mem_accounting *acc,
+					 void *context)
+{
+	struct event *event = context;
+	bool pool = type == MEM_ACCOUNTING_TYPE_POOL;
+
+	if (acc->peak_bytes == 0)
+		return;
+
+	e_debug(event_create_passthrough(event)->
+		set_name(pool ? "memory_pool_usage" : "data_stack_usage")->
+		add_str("name", acc->name)->
+		add_int("bytes", acc->bytes)->
+		add_int("peak_bytes", acc->peak_bytes)->
+		add_int("alloc_count", acc->alloc_count)->event(),
+		"Memory usage of %s %s: %"PRIuSIZE_T" bytes "
+		"(peak %"PRIuSIZE_T" bytes), %llu allocations",
+		pool ? "pool" : "data stack frame", acc->name,
+		acc->bytes, acc->peak_bytes, acc->alloc_count);
+}
+
+static void master_service_mem_accounting_report(struct master_service *service)
+{
+	struct event *event = event_create(NULL);
+
+	event_add_category(event, &event_category_mem_accounting);
+	event_add_str(event, "service", service->name);
+	mem_accounting_foreach(master_service_mem_accounting_report_one,
+			       event);
+	event_unref(&event);
+}
+
+static void master_service_mem_accounting_init(struct master_service *service)
+{
+	const char *value;
+	unsigned int secs;
+
+	if (!mem_accounting_enabled)
+		return;
+
+	/* MEMORY_ACCOUNTING=<secs> reports the usage periodically. It's
+	   always reported when the process exits. */
+	value = getenv("MEMORY_ACCOUNTING");
+	if (value != NULL && str_to_uint(value, &secs) == 0 && secs > 0 &&
+	    secs < UINT_MAX / 1000) {
+		service->to_mem_accounting =
+			timeout_add(secs * 1000,
+				    master_service_mem_accounting_report,
+				    service);
+	}
+}
+
 void master_service_init_finish(struct master_service *service)
 {
 	enum libsig_flags sigint_flags = LIBSIG_FLAG_DELAYED;
@@ -606,6 +665,7 @@ void master_service_init_finish(struct master_service *service)
 		service->master_status.available_count--;
 	}
 	master_status_update(service);
+	master_service_mem_accounting_init(service);
 
 	/* close data stack frame opened by master_service_init() */
 	if ((service->flags & MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME) == 0) {
@@ -995,6 +1055,9 @@ void master_service_deinit(struct master_service **_service)
 	master_service_io_listeners_remove(service);
 	master_service_ssl_ctx_deinit(service);
 
+	if (mem_accounting_enabled)
+		master_service_mem_accounting_report(service);
+	timeout_remove(&service->to_mem_accounting);
 	if (service->stats_client != NULL)
 		stats_client_deinit(&service->stats_client);
 	master_service_close_config_fd(service);
@@ -0,0 +1,283 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "base64.h"
+#include "hex-binary.h"
+#include "ioloop.h"
+#include "net.h"
+#include "istream.h"
+#include "str.h"
+#include "strescape.h"
+#include "write-full.h"
+#include "iostream-ssl.h"
+#include "ssl-session-cache-client.h"
+
+#include <unistd.h>
+
+#define SSL_SESSION_CACHE_HANDSHAKE "VERSION\tssl-session-cache-client\t1\t0\n"
+/* The session lookups are done synchronously during the SSL handshake, so
+   don't wait long if the service is stuck. */
+#define SSL_SESSION_CACHE_TIMEOUT_SECS 2
+/* Don't bother sharing larger sessions. This must fit to the server's
+   input buffer after base64-encoding. */
+#define SSL_SESSION_CACHE_MAX_SESSION_SIZE (16*1024)
+#define SSL_SESSION_CACHE_INBUF_SIZE (64*1024)
+
+struct ssl_session_cache_client {
+	char *path;
+	int fd;
+	struct istream *input;
+	void (*disconnect_callback)(void);
+
+	ARRAY(struct ssl_iostream_ticket_key) ticket_keys;
+	time_t ticket_keys_refresh_time;
+};
+
+struct ssl_session_cache_client *
+ssl_session_cache_client_init(const char *path,
+			      void (*disconnect_callback)(void))
+{
+	struct ssl_session_cache_client *client;
+
+	client = i_new(struct ssl_session_cache_client, 1);
+	client->path = i_strdup(path);
+	client->fd = -1;
+	client->disconnect_callback = disconnect_callback;
+	i_array_init(&client->ticket_keys, 4);
+	return client;
+}
+
+static void
+ssl_session_cache_client_disconnect(struct ssl_session_cache_client *client)
+{
+	if (client->fd == -1)
+		return;
+	i_stream_destroy(&client->input);
+	net_disconnect(client->fd);
+	client->fd = -1;
+}
+
+void ssl_session_cache_client_deinit(struct ssl_session_cache_client **_client)
+{
+	struct ssl_session_cache_client *client = *_client;
+
+	*_client = NULL;
+	ssl_session_cache_client_disconnect(client);
+	array_free(&client->ticket_keys);
+	i_free(client->path);
+	i_free(client);
+}
+
+static void
+ssl_session_cache_client_fail(struct ssl_session_cache_client *client)
+{
+	ssl_session_cache_client_disconnect(client);
+	if (client->disconnect_callback != NULL)
+		client->disconnect_callback();
+}
+
+static int
+ssl_session_cache_client_send(struct ssl_session_cache_client *client,
+			      const char *cmd)
+{
+	int ret;
+
+	if (client->fd == -1)
+		return -1;
+
+	alarm(SSL_SESSION_CACHE_TIMEOUT_SECS);
+	ret = write_full(client->fd, cmd, strlen(cmd));
+	alarm(0);
+	if (ret < 0) {
+		if (errno == EINTR) {
+			i_error("write(%s) failed: Timed out after %u secs",
+				client->path, SSL_SESSION_CACHE_TIMEOUT_SECS);
+		} else {
+			i_error("write(%s) failed: %m", client->path);
+		}
+		ssl_session_cache_client_fail(client);
+		return -1;
+	}
+	return 0;
+}
+
+static const char *
+ssl_session_cache_client_query(struct ssl_session_cache_client *client,
+			       const char *cmd)
+{
+	const char *line;
+
+	if (ssl_session_cache_client_send(client, cmd) < 0)
+		return NULL;
+
+	alarm(SSL_SESSION_CACHE_TIMEOUT_SECS);
+	line = i_stream_read_next_line(client->input);
+	alarm(0);
+	if (line == NULL) {
+		if (client->input->stream_errno == EINTR) {
+			i_error("read(%s) failed: Timed out after %u secs",
+				client->path, SSL_SESSION_CACHE_TIMEOUT_SECS);
+		} else if (client->input->stream_errno != 0) {
+			i_error("read(%s) failed: %s", client->path,
+				i_stream_get_error(client->input));
+		} else {
+			i_error("read(%s) failed: EOF", client->path);
+		}
+		ssl_session_cache_client_fail(client);
+		return NULL;
+	}
+	return line;
+}
+
+int ssl_session_cache_client_connect(struct ssl_session_cache_client *client)
+{
+	int fd;
+
+	i_assert(client->fd == -1);
+
+	fd = net_connect_unix(client->path);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			i_error("net_connect_unix(%s) failed: %m",
+				client->path);
+		}
+		return -1;
+	}
+	/* all the queries are synchronous */
+	net_set_nonblock(fd, FALSE);
+
+	client->fd = fd;
+	client->input = i_stream_create_fd(fd, SSL_SESSION_CACHE_INBUF_SIZE);
+	return ssl_session_cache_client_send(client,
+					     SSL_SESSION_CACHE_HANDSHAKE);
+}
+
+static void
+ssl_session_cache_client_add(void *context, const unsigned char *id,
+			     unsigned int id_size, time_t expire_time,
+			     const unsigned char *data, size_t size)
+{
+	struct ssl_session_cache_client *client = context;
+	string_t *cmd;
+
+	if (size > SSL_SESSION_CACHE_MAX_SESSION_SIZE)
+		return;
+
+	cmd = t_str_new(128 + MAX_BASE64_ENCODED_SIZE(size));
+	str_append(cmd, "ADD\t");
+	binary_to_hex_append(cmd, id, id_size);
+	str_printfa(cmd, "\t%ld\t", (long)expire_time);
+	base64_encode(data, size, cmd);
+	str_append_c(cmd, '\n');
+	(void)ssl_session_cache_client_send(client, str_c(cmd));
+}
+
+static bool
+ssl_session_cache_client_lookup(void *context, const unsigned char *id,
+				unsigned int id_size, buffer_t *data)
+{
+	struct ssl_session_cache_client *client = context;
+	const char *reply;
+
+	reply = ssl_session_cache_client_query(client, t_strdup_printf(
+		"LOOKUP\t%s\n", binary_to_hex(id, id_size)));
+	if (reply == NULL || reply[0] == '\0')
+		return FALSE;
+	if (base64_decode(reply, strlen(reply), NULL, data) < 0) {
+		i_error("%s: Received invalid session data", client->path);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+ssl_session_cache_client_remove(void *context, const unsigned char *id,
+				unsigned int id_size)
+{
+	struct ssl_session_cache_client *client = context;
+
+	(void)ssl_session_cache_client_send(client, t_strdup_printf(
+		"REMOVE\t%s\n", binary_to_hex(id, id_size)));
+}
+
+static int
+ssl_session_cache_client_parse_ticket_keys(struct ssl_session_cache_client *client,
+					   const char *reply)
+{
+	const char *const *args = t_strsplit_tabescaped(reply);
+	struct ssl_iostream_ticket_key *key;
+	unsigned int i, refresh_secs;
+	buffer_t *buf;
+
+	/* <refresh secs> <key1> [<key2> ...] */
+	if (args[0] == NULL || str_to_uint(args[0], &refresh_secs) < 0)
+		return -1;
+
+	array_clear(&client->ticket_keys);
+	buf = t_buffer_create(sizeof(*key) + 1);
+	for (i = 1; args[i] != NULL; i++) {
+		buffer_set_used_size(buf, 0);
+		if (base64_decode(args[i], strlen(args[i]), NULL, buf) < 0 ||
+		    buf->used != sizeof(*key)) {
+			array_clear(&client->ticket_keys);
+			return -1;
+		}
+		key = array_append_space(&client->ticket_keys);
+		memcpy(key, buf->data, sizeof(*key));
+	}
+	client->ticket_keys_refresh_time = ioloop_time + refresh_secs;
+	return 0;
+}
+
+static const struct ssl_iostream_ticket_key *
+ssl_session_cache_client_get_ticket_keys(void *context, unsigned int *count_r)
+{
+	struct ssl_session_cache_client *client = context;
+	const char *reply;
+
+	if (client->ticket_keys_refresh_time <= ioloop_time &&
+	    client->fd != -1) T_BEGIN {
+		reply = ssl_session_cache_client_query(client, "TICKET-KEYS\n");
+		if (reply != NULL &&
+		    ssl_session_cache_client_parse_ticket_keys(client, reply) < 0) {
+			/* don't log the reply, it contains the keys */
+			i_error("%s: Received invalid ticket keys",
+				client->path);
+		}
+	} T_END;
+	/* If the connection was lost, keep using the old keys. They're
+	   still valid for a while. */
+	return array_get(&client->ticket_keys, count_r);
+}
+
+static void
+ssl_session_cache_client_ticket_decrypted(void *context,
+					  enum ssl_iostream_ticket_result result)
+{
+	struct ssl_session_cache_client *client = context;
+	const char *cmd;
+
+	switch (result) {
+	case SSL_IOSTREAM_TICKET_RESULT_HIT:
+		cmd = "TICKET\thit\n";
+		break;
+	case SSL_IOSTREAM_TICKET_RESULT_RENEW:
+		cmd = "TICKET\trenew\n";
+		break;
+	case SSL_IOSTREAM_TICKET_RESULT_MISS:
+		cmd = "TICKET\tmiss\n";
+		break;
+	default:
+		i_unreached();
+	}
+	(void)ssl_session_cache_client_send(client, cmd);
+}
+
+const struct ssl_iostream_session_cache ssl_session_cache_client_vfuncs = {
+	.add = ssl_session_cache_client_add,
+	.lookup = ssl_session_cache_client_lookup,
+	.remove = ssl_session_cache_client_remove,
+	.get_ticket_keys = ssl_session_cache_client_get_ticket_keys,
+	.ticket_decrypted = ssl_session_cache_client_ticket_decrypted,
+};
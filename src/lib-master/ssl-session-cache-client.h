@@ -0,0 +1,21 @@
+#ifndef SSL_SESSION_CACHE_CLIENT_H
+#define SSL_SESSION_CACHE_CLIENT_H
+
+struct ssl_iostream_session_cache;
+
+/* Session cache that can be given to ssl_iostream_set_session_cache() with
+   the ssl_session_cache_client as context. */
+extern const struct ssl_iostream_session_cache ssl_session_cache_client_vfuncs;
+
+/* The disconnect_callback is called if the connection to the
+   ssl-session-cache service is lost. There's no automatic reconnection. */
+struct ssl_session_cache_client *
+ssl_session_cache_client_init(const char *path,
+			      void (*disconnect_callback)(void));
+void ssl_session_cache_client_deinit(struct ssl_session_cache_client **client);
+
+/* Connect to the ssl-session-cache service. Returns 0 on success, -1 if it
+   failed. A missing socket isn't logged as an error. */
+int ssl_session_cache_client_connect(struct ssl_session_cache_client *client);
+
+#endif
@@ -1,20 +1,39 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "buffer.h"
 #include "safe-memset.h"
+#include "sha2.h"
 #include "iostream-openssl.h"
 #include "dovecot-openssl-common.h"
 
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
 #include <openssl/pem.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#else
+#  include <openssl/hmac.h>
+#endif
 
 #if !defined(OPENSSL_NO_ECDH) && OPENSSL_VERSION_NUMBER >= 0x10000000L
 #  define HAVE_ECDH
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#  define SSL_SESSION_GET_CB_ID_CONST const
+#else
+#  define SSL_SESSION_GET_CB_ID_CONST
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  define SSL_TICKET_MAC_CTX EVP_MAC_CTX
+#else
+#  define SSL_TICKET_MAC_CTX HMAC_CTX
+#endif
+
 struct ssl_iostream_password_context {
 	const char *password;
 	const char *error;
@@ -592,6 +611,207 @@ ssl_iostream_context_init_common(struct ssl_iostream_context *ctx,
 	return ssl_iostream_context_set(ctx, set, error_r);
 }
 
+static int ssl_iostream_session_new_cb(SSL *ssl ATTR_UNUSED,
+				       SSL_SESSION *session)
+{
+	const unsigned char *id;
+	unsigned int id_size;
+	unsigned char *p;
+	time_t expire_time;
+	int size;
+
+	id = SSL_SESSION_get_id(session, &id_size);
+	size = i2d_SSL_SESSION(session, NULL);
+	if (id_size == 0 || size <= 0)
+		return 0;
+	expire_time = SSL_SESSION_get_time(session) +
+		SSL_SESSION_get_timeout(session);
+
+	T_BEGIN {
+		unsigned char *data = t_malloc_no0(size);
+
+		p = data;
+		if (i2d_SSL_SESSION(session, &p) == size) {
+			ssl_iostream_session_cache->add(
+				ssl_iostream_session_cache_context,
+				id, id_size, expire_time, data, size);
+		}
+	} T_END;
+	/* we didn't keep a reference to the session */
+	return 0;
+}
+
+static SSL_SESSION *
+ssl_iostream_session_get_cb(SSL *ssl ATTR_UNUSED,
+			    SSL_SESSION_GET_CB_ID_CONST unsigned char *id,
+			    int id_size, int *copy_r)
+{
+	SSL_SESSION *session = NULL;
+
+	*copy_r = 0;
+	if (id_size <= 0)
+		return NULL;
+	T_BEGIN {
+		buffer_t *data = t_buffer_create(1024);
+		const unsigned char *p;
+
+		if (ssl_iostream_session_cache->lookup(
+				ssl_iostream_session_cache_context,
+				id, id_size, data)) {
+			p = data->data;
+			session = d2i_SSL_SESSION(NULL, &p, data->used);
+		}
+	} T_END;
+	return session;
+}
+
+static void ssl_iostream_session_remove_cb(SSL_CTX *ssl_ctx ATTR_UNUSED,
+					   SSL_SESSION *session)
+{
+	const unsigned char *id;
+	unsigned int id_size;
+
+	id = SSL_SESSION_get_id(session, &id_size);
+	if (id_size > 0) {
+		ssl_iostream_session_cache->remove(
+			ssl_iostream_session_cache_context, id, id_size);
+	}
+}
+
+static int
+ssl_ticket_mac_init(SSL_TICKET_MAC_CTX *mac_ctx, const unsigned char *key)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+		(void *)key, SSL_IOSTREAM_TICKET_KEY_SECRET_SIZE);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+		(char *)"sha256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	return EVP_MAC_CTX_set_params(mac_ctx, params);
+#else
+	return HMAC_Init_ex(mac_ctx, key, SSL_IOSTREAM_TICKET_KEY_SECRET_SIZE,
+			    EVP_sha256(), NULL);
+#endif
+}
+
+static int
+ssl_iostream_ticket_key_cb(SSL *ssl ATTR_UNUSED,
+			   unsigned char key_name[SSL_IOSTREAM_TICKET_KEY_NAME_SIZE],
+			   unsigned char *iv, EVP_CIPHER_CTX *cipher_ctx,
+			   SSL_TICKET_MAC_CTX *mac_ctx, int enc)
+{
+	const struct ssl_iostream_ticket_key *keys;
+	enum ssl_iostream_ticket_result result;
+	unsigned int i, count;
+
+	keys = ssl_iostream_session_cache->get_ticket_keys(
+		ssl_iostream_session_cache_context, &count);
+	if (enc != 0) {
+		/* new ticket - encrypt it with the current key */
+		if (count == 0 ||
+		    RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return 0;
+		memcpy(key_name, keys[0].name, SSL_IOSTREAM_TICKET_KEY_NAME_SIZE);
+		if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+				       keys[0].aes_key, iv) <= 0 ||
+		    ssl_ticket_mac_init(mac_ctx, keys[0].hmac_key) <= 0)
+			return -1;
+		return 1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (memcmp(key_name, keys[i].name,
+			   SSL_IOSTREAM_TICKET_KEY_NAME_SIZE) == 0)
+			break;
+	}
+	if (i == count) {
+		ssl_iostream_session_cache->ticket_decrypted(
+			ssl_iostream_session_cache_context,
+			SSL_IOSTREAM_TICKET_RESULT_MISS);
+		return 0;
+	}
+	if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+			       keys[i].aes_key, iv) <= 0 ||
+	    ssl_ticket_mac_init(mac_ctx, keys[i].hmac_key) <= 0)
+		return -1;
+
+	/* tickets encrypted with older keys are accepted, but the client
+	   gets a new ticket encrypted with the current key. */
+	result = i == 0 ? SSL_IOSTREAM_TICKET_RESULT_HIT :
+		SSL_IOSTREAM_TICKET_RESULT_RENEW;
+	ssl_iostream_session_cache->ticket_decrypted(
+		ssl_iostream_session_cache_context, result);
+	return i == 0 ? 1 : 2;
+}
+
+static void
+ssl_iostream_sid_ctx_add_str(struct sha256_ctx *hash, const char *str)
+{
+	/* include the NUL, so that the fields can't get mixed up */
+	if (str == NULL)
+		str = "";
+	sha256_loop(hash, str, strlen(str) + 1);
+}
+
+static int
+ssl_iostream_context_init_session_cache(struct ssl_iostream_context *ctx,
+					const struct ssl_iostream_settings *set,
+					const char **error_r)
+{
+	unsigned char sid_ctx[SHA256_RESULTLEN];
+	struct sha256_ctx hash;
+	const unsigned char flags[] = {
+		set->verify_remote_cert ? 1 : 0,
+		set->skip_crl_check ? 1 : 0,
+	};
+
+	/* Sessions are shared with other processes, so they must be resumed
+	   only by contexts that use the same certificates and verify the
+	   client certificates the same way. Otherwise a session created
+	   without requiring a client certificate could be resumed by a
+	   context that requires one. */
+	i_assert(sizeof(sid_ctx) <= SSL_MAX_SID_CTX_LENGTH);
+	sha256_init(&hash);
+	ssl_iostream_sid_ctx_add_str(&hash, set->cert.cert);
+	ssl_iostream_sid_ctx_add_str(&hash, set->alt_cert.cert);
+	ssl_iostream_sid_ctx_add_str(&hash, set->ca);
+	ssl_iostream_sid_ctx_add_str(&hash, set->ca_file);
+	ssl_iostream_sid_ctx_add_str(&hash, set->ca_dir);
+	ssl_iostream_sid_ctx_add_str(&hash, set->cert_username_field);
+	sha256_loop(&hash, flags, sizeof(flags));
+	sha256_result(&hash, sid_ctx);
+	if (SSL_CTX_set_session_id_context(ctx->ssl_ctx, sid_ctx,
+					   sizeof(sid_ctx)) != 1) {
+		*error_r = t_strdup_printf(
+			"SSL_CTX_set_session_id_context() failed: %s",
+			openssl_iostream_error());
+		return -1;
+	}
+
+	/* use only the external cache, so that sessions don't get removed
+	   from it when this process's internal cache fills up. */
+	SSL_CTX_set_session_cache_mode(ctx->ssl_ctx, SSL_SESS_CACHE_SERVER |
+				       SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx->ssl_ctx, ssl_iostream_session_new_cb);
+	SSL_CTX_sess_set_get_cb(ctx->ssl_ctx, ssl_iostream_session_get_cb);
+	SSL_CTX_sess_set_remove_cb(ctx->ssl_ctx,
+				   ssl_iostream_session_remove_cb);
+
+	if (set->tickets &&
+	    ssl_iostream_session_cache->get_ticket_keys != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx->ssl_ctx,
+			ssl_iostream_ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx->ssl_ctx,
+			ssl_iostream_ticket_key_cb);
+#endif
+	}
+	return 0;
+}
+
 int openssl_iostream_context_init_client(const struct ssl_iostream_settings *set,
 					 struct ssl_iostream_context **ctx_r,
 					 const char **error_r)
@@ -634,7 +854,9 @@ int openssl_iostream_context_init_server(const struct ssl_iostream_settings *set
 	ctx = i_new(struct ssl_iostream_context, 1);
 	ctx->refcount = 1;
 	ctx->ssl_ctx = ssl_ctx;
-	if (ssl_iostream_context_init_common(ctx, set, error_r) < 0) {
+	if (ssl_iostream_context_init_common(ctx, set, error_r) < 0 ||
+	    (ssl_iostream_session_cache != NULL &&
+	     ssl_iostream_context_init_session_cache(ctx, set, error_r) < 0)) {
 		ssl_iostream_context_unref(&ctx);
 		return -1;
 	}
@@ -243,6 +243,63 @@ openssl_iostream_set(struct ssl_iostream *ssl_io,
 	return 0;
 }
 
+#ifdef SSL_OP_ENABLE_KTLS
+static int
+openssl_iostream_set_socket_bio(SSL *ssl, struct istream *input,
+				struct ostream *output, const char **error_r)
+{
+	BIO *bio;
+	int fd = i_stream_get_fd(input);
+
+	/* OpenSSL can enable kTLS only when it's using a socket BIO. It
+	   reads and writes the fd directly, bypassing the plain streams, so
+	   they must not be wrapped or have anything buffered. */
+	if (fd == -1 || fd != o_stream_get_fd(output))
+		return 0;
+	if (input->real_stream->parent != NULL ||
+	    output->real_stream->parent != NULL)
+		return 0;
+	if (i_stream_get_data_size(input) > 0 ||
+	    o_stream_get_buffer_used_size(output) > 0)
+		return 0;
+
+	bio = BIO_new_socket(fd, BIO_NOCLOSE);
+	if (bio == NULL) {
+		*error_r = t_strdup_printf("BIO_new_socket() failed: %s",
+					   openssl_iostream_error());
+		return -1;
+	}
+	/* If the kernel doesn't support kTLS, OpenSSL keeps doing the
+	   encryption itself with the socket BIO. */
+	SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	/* o_stream_ssl_flush_buffer() may retry SSL_write() after the
+	   buffer has been reallocated */
+	SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_set_bio(ssl, bio, bio);
+	return 1;
+}
+#endif
+
+static int
+openssl_iostream_set_bio_pair(SSL *ssl, BIO **bio_ext_r, const char **error_r)
+{
+	BIO *bio_int;
+
+	/* BIO pairs use default buffer sizes (17 kB in OpenSSL 0.9.8e).
+	   Each of the BIOs have one "write buffer". BIO_write() copies data
+	   to them, while BIO_read() reads from the other BIO's write buffer
+	   into the given buffer. The bio_int is used by OpenSSL and bio_ext
+	   is used by this library. */
+	if (BIO_new_bio_pair(&bio_int, 0, bio_ext_r, 0) != 1) {
+		*error_r = t_strdup_printf("BIO_new_bio_pair() failed: %s",
+					   openssl_iostream_error());
+		return -1;
+	}
+	/* bio_int will be freed by SSL_free() */
+	SSL_set_bio(ssl, bio_int, bio_int);
+	return 1;
+}
+
 static int
 openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 			const struct ssl_iostream_settings *set,
@@ -252,7 +309,8 @@ openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 {
 	struct ssl_iostream *ssl_io;
 	SSL *ssl;
-	BIO *bio_int, *bio_ext;
+	BIO *bio_ext = NULL;
+	int ret = 0;
 
 	/* Don't allow an existing io_add_istream() to be use on the input.
 	   It would seem to work, but it would also cause hangs. */
@@ -265,14 +323,15 @@ openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 		return -1;
 	}
 
-	/* BIO pairs use default buffer sizes (17 kB in OpenSSL 0.9.8e).
-	   Each of the BIOs have one "write buffer". BIO_write() copies data
-	   to them, while BIO_read() reads from the other BIO's write buffer
-	   into the given buffer. The bio_int is used by OpenSSL and bio_ext
-	   is used by this library. */
-	if (BIO_new_bio_pair(&bio_int, 0, &bio_ext, 0) != 1) {
-		*error_r = t_strdup_printf("BIO_new_bio_pair() failed: %s",
-					   openssl_iostream_error());
+#ifdef SSL_OP_ENABLE_KTLS
+	if (set->ktls) {
+		ret = openssl_iostream_set_socket_bio(ssl, *input, *output,
+						      error_r);
+	}
+#endif
+	if (ret == 0)
+		ret = openssl_iostream_set_bio_pair(ssl, &bio_ext, error_r);
+	if (ret < 0) {
 		SSL_free(ssl);
 		return -1;
 	}
@@ -288,8 +347,6 @@ openssl_iostream_create(struct ssl_iostream_context *ctx, const char *host,
 	ssl_io->connected_host = i_strdup(host);
 	ssl_io->log_prefix = host == NULL ? i_strdup("") :
 		i_strdup_printf("%s: ", host);
-	/* bio_int will be freed by SSL_free() */
-	SSL_set_bio(ssl_io->ssl, bio_int, bio_int);
         SSL_set_ex_data(ssl_io->ssl, dovecot_ssl_extdata_index, ssl_io);
 #ifdef HAVE_SSL_GET_SERVERNAME
 	SSL_set_tlsext_host_name(ssl_io->ssl, host);
@@ -507,6 +564,11 @@ bool openssl_iostream_bio_sync(struct ssl_iostream *ssl_io,
 {
 	bool ret;
 
+	if (ssl_io->bio_ext == NULL) {
+		/* OpenSSL is reading and writing the socket directly */
+		return FALSE;
+	}
+
 	ret = openssl_iostream_bio_output(ssl_io);
 	if (openssl_iostream_bio_input(ssl_io, type))
 		ret = TRUE;
@@ -548,6 +610,14 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 	err = SSL_get_error(ssl_io->ssl, ret);
 	switch (err) {
 	case SSL_ERROR_WANT_WRITE:
+		if (ssl_io->bio_ext == NULL) {
+			/* wait until the socket is writable */
+			ssl_io->want_read = FALSE;
+			if (type != OPENSSL_IOSTREAM_SYNC_TYPE_WRITE)
+				ssl_io->istream_waiting_output = TRUE;
+			o_stream_set_flush_pending(ssl_io->plain_output, TRUE);
+			return 0;
+		}
 		if (!openssl_iostream_bio_sync(ssl_io, type)) {
 			if (type != OPENSSL_IOSTREAM_SYNC_TYPE_WRITE)
 				i_panic("SSL ostream buffer size not unlimited");
@@ -560,6 +630,10 @@ int openssl_iostream_handle_error(struct ssl_iostream *ssl_io, int ret,
 		return 1;
 	case SSL_ERROR_WANT_READ:
 		ssl_io->want_read = TRUE;
+		if (ssl_io->bio_ext == NULL) {
+			/* wait until the socket is readable */
+			return 0;
+		}
 		(void)openssl_iostream_bio_sync(ssl_io, type);
 		if (ssl_io->closed) {
 			openssl_iostream_closed(ssl_io);
@@ -862,7 +936,6 @@ openssl_iostream_get_protocol_name(struct ssl_iostream *ssl_io)
 	return SSL_get_version(ssl_io->ssl);
 }
 
-
 static const struct iostream_ssl_vfuncs ssl_vfuncs = {
 	.global_init = openssl_iostream_global_init,
 	.context_init_client = openssl_iostream_context_init_client,
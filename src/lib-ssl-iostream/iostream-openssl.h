@@ -33,6 +33,7 @@ struct ssl_iostream {
 	struct ssl_iostream_context *ctx;
 
 	SSL *ssl;
+	/* NULL if OpenSSL is using a socket BIO on plain_input's fd */
 	BIO *bio_ext;
 
 	struct istream *plain_input;
@@ -65,6 +66,7 @@ struct ssl_iostream {
 	bool cert_broken:1;
 	bool want_read:1;
 	bool ostream_flush_waiting_input:1;
+	bool istream_waiting_output:1;
 	bool closed:1;
 };
 
@@ -49,6 +49,9 @@ struct iostream_ssl_vfuncs {
 	const char *(*get_protocol_name)(struct ssl_iostream *ssl_io);
 };
 
+extern const struct ssl_iostream_session_cache *ssl_iostream_session_cache;
+extern void *ssl_iostream_session_cache_context;
+
 void iostream_ssl_module_init(const struct iostream_ssl_vfuncs *vfuncs);
 
 /* Returns TRUE if both settings are equal. Note that NULL and "" aren't
@@ -29,6 +29,9 @@ static struct module *ssl_module = NULL;
 #endif
 static const struct iostream_ssl_vfuncs *ssl_vfuncs = NULL;
 
+const struct ssl_iostream_session_cache *ssl_iostream_session_cache = NULL;
+void *ssl_iostream_session_cache_context = NULL;
+
 #ifdef HAVE_SSL
 static void ssl_module_unload(void)
 {
@@ -329,6 +332,7 @@ void ssl_iostream_settings_drop_stream_only(struct ssl_iostream_settings *set)
 	set->verbose = FALSE;
 	set->verbose_invalid_cert = FALSE;
 	set->allow_invalid_cert = FALSE;
+	set->ktls = FALSE;
 }
 
 const char *ssl_iostream_get_cipher(struct ssl_iostream *ssl_io,
@@ -346,3 +350,10 @@ const char *ssl_iostream_get_protocol_name(struct ssl_iostream *ssl_io)
 {
 	return ssl_vfuncs->get_protocol_name(ssl_io);
 }
+
+void ssl_iostream_set_session_cache(const struct ssl_iostream_session_cache *cache,
+				    void *context)
+{
+	ssl_iostream_session_cache = cache;
+	ssl_iostream_session_cache_context = context;
+}
@@ -33,6 +33,7 @@ struct ssl_iostream_settings {
 	bool prefer_server_ciphers; /* both */
 	bool compression; /* context-only */
 	bool tickets; /* context-only */
+	bool ktls; /* stream-only */
 };
 
 /* Load SSL module */
@@ -157,4 +158,53 @@ int ssl_iostream_server_context_cache_get(const struct ssl_iostream_settings *se
 					  const char **error_r);
 void ssl_iostream_context_cache_free(void);
 
+#define SSL_IOSTREAM_TICKET_KEY_NAME_SIZE 16
+#define SSL_IOSTREAM_TICKET_KEY_SECRET_SIZE 32
+
+struct ssl_iostream_ticket_key {
+	unsigned char name[SSL_IOSTREAM_TICKET_KEY_NAME_SIZE];
+	unsigned char aes_key[SSL_IOSTREAM_TICKET_KEY_SECRET_SIZE];
+	unsigned char hmac_key[SSL_IOSTREAM_TICKET_KEY_SECRET_SIZE];
+};
+
+enum ssl_iostream_ticket_result {
+	/* Ticket was decrypted with the current key */
+	SSL_IOSTREAM_TICKET_RESULT_HIT,
+	/* Ticket was decrypted with an older key and will be renewed */
+	SSL_IOSTREAM_TICKET_RESULT_RENEW,
+	/* Ticket key wasn't found - doing a full handshake */
+	SSL_IOSTREAM_TICKET_RESULT_MISS,
+};
+
+/* External session cache for server contexts. This allows resuming sessions
+   that were created by other processes. */
+struct ssl_iostream_session_cache {
+	/* A new session was created. The data is the serialized session. */
+	void (*add)(void *context, const unsigned char *id,
+		    unsigned int id_size, time_t expire_time,
+		    const unsigned char *data, size_t size);
+	/* Look up a session. Returns TRUE and appends the serialized session
+	   to data if it was found. */
+	bool (*lookup)(void *context, const unsigned char *id,
+		       unsigned int id_size, buffer_t *data);
+	/* Session is no longer valid. */
+	void (*remove)(void *context, const unsigned char *id,
+		       unsigned int id_size);
+
+	/* Returns the keys for encrypting and decrypting session tickets.
+	   New tickets are encrypted with the first key. Returns 0 keys if
+	   they're currently unavailable, in which case no tickets are
+	   issued or accepted. If NULL, each process uses its own keys. */
+	const struct ssl_iostream_ticket_key *
+		(*get_ticket_keys)(void *context, unsigned int *count_r);
+	/* A session ticket was received from the client. */
+	void (*ticket_decrypted)(void *context,
+				 enum ssl_iostream_ticket_result result);
+};
+
+/* Use the given external session cache for all the server contexts that are
+   created afterwards. */
+void ssl_iostream_set_session_cache(const struct ssl_iostream_session_cache *cache,
+				    void *context);
+
 #endif
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "istream-private.h"
+#include "ostream.h"
 #include "iostream-openssl.h"
 
 struct ssl_istream {
@@ -80,11 +81,22 @@ static ssize_t i_stream_ssl_read_real(struct istream_private *stream)
 	stream->pos += ret;
 	total_ret = ret;
 
+	if (ssl_io->bio_ext == NULL) {
+		/* OpenSSL read the socket directly, so bio_sync didn't notice
+		   the new input. Continue a write that was waiting for it. */
+		ssl_io->want_read = FALSE;
+		if (ssl_io->ostream_flush_waiting_input) {
+			ssl_io->ostream_flush_waiting_input = FALSE;
+			o_stream_set_flush_pending(ssl_io->plain_output, TRUE);
+		}
+	}
+
 	/* now make sure that we read everything already buffered in OpenSSL
 	   into the stream (without reading anything more). this makes I/O loop
 	   behave similarly for ssl-istream as file-istream. */
 	stream->max_buffer_size = (size_t)-1;
-	while ((ret = SSL_read(ssl_io->ssl, buffer, sizeof(buffer))) > 0) {
+	while ((ssl_io->bio_ext != NULL || SSL_pending(ssl_io->ssl) > 0) &&
+	       (ret = SSL_read(ssl_io->ssl, buffer, sizeof(buffer))) > 0) {
 		memcpy(i_stream_alloc(stream, ret), buffer, ret);
 		stream->pos += ret;
 		total_ret += ret;
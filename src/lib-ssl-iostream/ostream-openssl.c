@@ -114,6 +114,8 @@ static int o_stream_ssl_flush_buffer(struct ssl_ostream *sstream)
 				break;
 		} else {
 			pos += ret;
+			if (sstream->ssl_io->bio_ext == NULL)
+				sstream->ssl_io->want_read = FALSE;
 			(void)openssl_iostream_bio_sync(sstream->ssl_io,
 				OPENSSL_IOSTREAM_SYNC_TYPE_WRITE);
 		}
@@ -190,6 +192,15 @@ static int plain_flush_callback(struct ssl_ostream *sstream)
 	if ((ret = o_stream_flush(sstream->ssl_io->plain_output)) < 0)
 		return -1;
 
+	if (sstream->ssl_io->istream_waiting_output) {
+		/* SSL_read() was waiting for the socket to become writable */
+		sstream->ssl_io->istream_waiting_output = FALSE;
+		if (sstream->ssl_io->ssl_input != NULL) {
+			i_stream_set_input_pending(sstream->ssl_io->ssl_input,
+						   TRUE);
+		}
+	}
+
 	/* we may be able to copy more data, try it */
 	o_stream_ref(ostream);
 	if (sstream->ostream.callback != NULL)
@@ -3,6 +3,11 @@
 
 #include "mdbox-map.h"
 
+/* Map UIDs and file_ids are split into ranges of this size between map
+   shards. The last shard uses all the remaining IDs, so with a single shard
+   the whole ID space belongs to it. */
+#define MDBOX_MAP_SHARD_ID_RANGE 0x10000000U
+
 struct dbox_mail_lookup_rec {
 	uint32_t map_uid;
 	uint16_t refcount;
@@ -21,6 +26,13 @@ struct mdbox_map {
 
 	struct mailbox_list *root_list;
 
+	/* The first shard is the map that owns all the other shards.
+	   root->shards[0] == root. */
+	struct mdbox_map *root;
+	ARRAY(struct mdbox_map *) shards;
+	unsigned int shard_idx;
+	struct event *event;
+
 	bool verify_existing_file_ids:1;
 };
 
@@ -45,18 +57,40 @@ struct mdbox_map_append_context {
 	bool failed:1;
 };
 
-struct mdbox_map_atomic_context {
-	struct mdbox_map *map;
+struct mdbox_map_atomic_shard {
 	struct mail_index_transaction *sync_trans;
 	struct mail_index_sync_ctx *sync_ctx;
 	struct mail_index_view *sync_view;
 
+	/* Changes were already written to this shard while it was locked */
+	bool changed:1;
+};
+
+struct mdbox_map_atomic_context {
+	struct mdbox_map *map;
+	/* If non-NULL, only this shard can be locked by the atomic context */
+	struct mdbox_map *shard;
+	/* Locked map shards, indexed by shard_idx */
+	ARRAY(struct mdbox_map_atomic_shard) shards;
+
 	bool map_refreshed:1;
+	/* All the shards of the atomic context are locked */
 	bool locked:1;
 	bool success:1;
 	bool failed:1;
 };
 
+/* Return the map shard containing the map UID or file_id. */
+struct mdbox_map *mdbox_map_get_shard(struct mdbox_map *map, uint32_t id);
+/* Return the next map UID that can be appended to the shard. */
+uint32_t mdbox_map_shard_get_next_uid(struct mdbox_map *map,
+				      struct mail_index_view *view);
+/* Return the atomic context's sync state for the shard. The shard is locked
+   if sync_ctx != NULL. */
+struct mdbox_map_atomic_shard *
+mdbox_map_atomic_get_shard(struct mdbox_map_atomic_context *atomic,
+			   struct mdbox_map *map);
+
 int mdbox_map_view_lookup_rec(struct mdbox_map *map,
 			      struct mail_index_view *view, uint32_t seq,
 			      struct dbox_mail_lookup_rec *rec_r);
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "hash.h"
 #include "ostream.h"
+#include "time-util.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
 #include "mailbox-list-private.h"
@@ -12,22 +13,36 @@
 #include "mdbox-map-private.h"
 
 #include <dirent.h>
+#include <unistd.h>
 
 #define MAX_BACKWARDS_LOOKUPS 10
 
 #define DBOX_FORCE_PURGE_MIN_BYTES (1024*1024*10)
 #define DBOX_FORCE_PURGE_MIN_RATIO 0.5
 
+/* Log a warning if waiting for a map shard's lock takes longer than this */
+#define MDBOX_MAP_LOCK_WARN_MSECS 5000
+
 #define MAP_STORAGE(map) (&(map)->storage->storage.storage)
 
 struct mdbox_map_transaction_context {
 	struct mdbox_map_atomic_context *atomic;
-	struct mail_index_transaction *trans;
-
-	bool changed:1;
+	enum mail_index_transaction_flags flags;
+	/* map index transactions, indexed by shard_idx. created when the
+	   shard is first changed. */
+	ARRAY(struct mail_index_transaction *) shard_trans;
+	/* bitmask of changed shards */
+	uint32_t changed_shards;
+
+	bool failed:1;
 	bool committed:1;
 };
 
+static struct event_category event_category_mdbox_map = {
+	.parent = &event_category_storage,
+	.name = "mdbox-map",
+};
+
 static int mdbox_map_generate_uid_validity(struct mdbox_map *map);
 
 void mdbox_map_set_corrupted(struct mdbox_map *map, const char *format, ...)
@@ -44,24 +59,31 @@ void mdbox_map_set_corrupted(struct mdbox_map *map, const char *format, ...)
 	mdbox_storage_set_corrupted(map->storage);
 }
 
-struct mdbox_map *
-mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
+static struct mdbox_map *
+mdbox_map_shard_init(struct mdbox_storage *storage,
+		     struct mailbox_list *root_list, struct mdbox_map *root,
+		     unsigned int shard_idx)
 {
 	struct mdbox_map *map;
-	const char *root, *index_root;
+	const char *root_dir, *index_root, *prefix;
 
-	root = mailbox_list_get_root_forced(root_list, MAILBOX_LIST_PATH_TYPE_DIR);
-	index_root = mailbox_list_get_root_forced(root_list, MAILBOX_LIST_PATH_TYPE_INDEX);
+	root_dir = mailbox_list_get_root_forced(root_list,
+						MAILBOX_LIST_PATH_TYPE_DIR);
+	index_root = mailbox_list_get_root_forced(root_list,
+						  MAILBOX_LIST_PATH_TYPE_INDEX);
+	prefix = shard_idx == 0 ? MDBOX_GLOBAL_INDEX_PREFIX :
+		t_strdup_printf(MDBOX_GLOBAL_INDEX_SHARD_FORMAT, shard_idx);
 
 	map = i_new(struct mdbox_map, 1);
 	map->storage = storage;
 	map->set = storage->set;
-	map->path = i_strconcat(root, "/"MDBOX_GLOBAL_DIR_NAME, NULL);
+	map->root = root != NULL ? root : map;
+	map->shard_idx = shard_idx;
+	map->path = i_strconcat(root_dir, "/"MDBOX_GLOBAL_DIR_NAME, NULL);
 	map->index_path =
 		i_strconcat(index_root, "/"MDBOX_GLOBAL_DIR_NAME, NULL);
 	map->index = mail_index_alloc(storage->storage.storage.user->event,
-				      map->index_path,
-				      MDBOX_GLOBAL_INDEX_PREFIX);
+				      map->index_path, prefix);
 	mail_index_set_fsync_mode(map->index,
 		MAP_STORAGE(map)->set->parsed_fsync_mode, 0);
 	mail_index_set_lock_method(map->index,
@@ -77,7 +99,30 @@ mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
 	return map;
 }
 
-void mdbox_map_deinit(struct mdbox_map **_map)
+struct mdbox_map *
+mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list)
+{
+	struct mdbox_map *map, *shard;
+	unsigned int i;
+
+	i_assert(storage->set->mdbox_map_shards > 0 &&
+		 storage->set->mdbox_map_shards <= MDBOX_MAP_MAX_SHARDS);
+
+	map = mdbox_map_shard_init(storage, root_list, NULL, 0);
+	map->event = event_create(storage->storage.storage.user->event);
+	event_add_category(map->event, &event_category_mdbox_map);
+	event_set_forced_debug(map->event,
+			       storage->storage.storage.user->mail_debug);
+	i_array_init(&map->shards, storage->set->mdbox_map_shards);
+	array_append(&map->shards, &map, 1);
+	for (i = 1; i < storage->set->mdbox_map_shards; i++) T_BEGIN {
+		shard = mdbox_map_shard_init(storage, root_list, map, i);
+		array_append(&map->shards, &shard, 1);
+	} T_END;
+	return map;
+}
+
+static void mdbox_map_shard_deinit(struct mdbox_map **_map)
 {
 	struct mdbox_map *map = *_map;
 
@@ -93,6 +138,54 @@ void mdbox_map_deinit(struct mdbox_map **_map)
 	i_free(map);
 }
 
+void mdbox_map_deinit(struct mdbox_map **_map)
+{
+	struct mdbox_map *map = *_map;
+	struct mdbox_map **shards;
+	unsigned int i, count;
+
+	*_map = NULL;
+
+	i_assert(map->root == map);
+
+	shards = array_get_modifiable(&map->shards, &count);
+	for (i = count; i > 1; i--)
+		mdbox_map_shard_deinit(&shards[i-1]);
+	array_free(&map->shards);
+	event_unref(&map->event);
+	mdbox_map_shard_deinit(&map);
+}
+
+struct mdbox_map *mdbox_map_get_shard(struct mdbox_map *map, uint32_t id)
+{
+	struct mdbox_map *const *shards;
+	unsigned int idx, count;
+
+	shards = array_get(&map->root->shards, &count);
+	idx = id == 0 ? 0 : (id - 1) / MDBOX_MAP_SHARD_ID_RANGE;
+	return shards[I_MIN(idx, count - 1)];
+}
+
+static uint32_t mdbox_map_shard_first_id(struct mdbox_map *map)
+{
+	return map->shard_idx * MDBOX_MAP_SHARD_ID_RANGE + 1;
+}
+
+static uint32_t mdbox_map_shard_last_id(struct mdbox_map *map)
+{
+	if (map->shard_idx + 1 == array_count(&map->root->shards))
+		return (uint32_t)-1;
+	return (map->shard_idx + 1) * MDBOX_MAP_SHARD_ID_RANGE;
+}
+
+uint32_t mdbox_map_shard_get_next_uid(struct mdbox_map *map,
+				      struct mail_index_view *view)
+{
+	const struct mail_index_header *hdr = mail_index_get_header(view);
+
+	return I_MAX(hdr->next_uid, mdbox_map_shard_first_id(map));
+}
+
 static int mdbox_map_mkdir_storage(struct mdbox_map *map)
 {
 	if (mailbox_list_mkdir_root(map->root_list, map->path,
@@ -132,7 +225,8 @@ static void mdbox_map_cleanup(struct mdbox_map *map)
 	}
 }
 
-static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
+static int
+mdbox_map_shard_open(struct mdbox_map *map, bool create_missing)
 {
 	enum mail_index_open_flags open_flags;
 	struct mailbox_permissions perm;
@@ -180,7 +274,8 @@ static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
 	}
 
 	map->view = mail_index_view_open(map->index);
-	mdbox_map_cleanup(map);
+	if (map->shard_idx == 0)
+		mdbox_map_cleanup(map);
 
 	if (mail_index_get_header(map->view)->uid_validity == 0) {
 		if (mdbox_map_generate_uid_validity(map) < 0) {
@@ -196,6 +291,26 @@ static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
 	return 1;
 }
 
+static int mdbox_map_open_internal(struct mdbox_map *map, bool create_missing)
+{
+	struct mdbox_map *const *shardp;
+	int ret;
+
+	map = map->root;
+	if ((ret = mdbox_map_shard_open(map, create_missing)) <= 0)
+		return ret;
+
+	/* the map exists, so create the rest of the shards if they're
+	   missing. this happens also when the number of shards is increased
+	   for an existing map: the old map simply becomes the first shard. */
+	array_foreach(&map->shards, shardp) {
+		if ((*shardp)->view == NULL &&
+		    mdbox_map_shard_open(*shardp, TRUE) < 0)
+			return -1;
+	}
+	return 1;
+}
+
 int mdbox_map_open(struct mdbox_map *map)
 {
 	return mdbox_map_open_internal(map, FALSE);
@@ -206,16 +321,16 @@ int mdbox_map_open_or_create(struct mdbox_map *map)
 	return mdbox_map_open_internal(map, TRUE) <= 0 ? -1 : 0;
 }
 
-int mdbox_map_refresh(struct mdbox_map *map)
+static int mdbox_map_shard_refresh(struct mdbox_map *map)
 {
 	struct mail_index_view_sync_ctx *ctx;
 	bool delayed_expunges, fscked;
 	int ret = 0;
 
-	/* some open files may have read partially written mails. now that
-	   map syncing makes the new mails visible, we need to make sure the
-	   partial data is flushed out of memory */
-	mdbox_files_sync_input(map->storage);
+	if (map->view == NULL) {
+		/* not opened yet */
+		return 0;
+	}
 
 	if (mail_index_refresh(map->view->index) < 0) {
 		mail_storage_set_index_error(MAP_STORAGE(map), map->index);
@@ -238,17 +353,38 @@ int mdbox_map_refresh(struct mdbox_map *map)
 	return ret;
 }
 
+int mdbox_map_refresh(struct mdbox_map *map)
+{
+	struct mdbox_map *const *shardp;
+	int ret = 0;
+
+	/* some open files may have read partially written mails. now that
+	   map syncing makes the new mails visible, we need to make sure the
+	   partial data is flushed out of memory */
+	mdbox_files_sync_input(map->storage);
+
+	array_foreach(&map->root->shards, shardp) {
+		if (mdbox_map_shard_refresh(*shardp) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
 bool mdbox_map_is_fscked(struct mdbox_map *map)
 {
+	struct mdbox_map *const *shardp;
 	const struct mail_index_header *hdr;
 
-	if (map->view == NULL) {
-		/* map isn't opened yet. don't bother. */
-		return FALSE;
+	array_foreach(&map->root->shards, shardp) {
+		if ((*shardp)->view == NULL) {
+			/* map isn't opened yet. don't bother. */
+			continue;
+		}
+		hdr = mail_index_get_header((*shardp)->view);
+		if ((hdr->flags & MAIL_INDEX_HDR_FLAG_FSCKD) != 0)
+			return TRUE;
 	}
-
-	hdr = mail_index_get_header(map->view);
-	return (hdr->flags & MAIL_INDEX_HDR_FLAG_FSCKD) != 0;
+	return FALSE;
 }
 
 static void
@@ -267,6 +403,7 @@ uint32_t mdbox_map_get_rebuild_count(struct mdbox_map *map)
 {
 	struct mdbox_map_mail_index_header hdr;
 
+	map = map->root;
 	mdbox_map_get_ext_hdr(map, map->view, &hdr);
 	return hdr.rebuild_count;
 }
@@ -314,6 +451,7 @@ int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
+	map = mdbox_map_get_shard(map, map_uid);
 	if ((ret = mdbox_map_get_seq(map, map_uid, &seq)) <= 0)
 		return ret;
 
@@ -324,6 +462,29 @@ int mdbox_map_lookup(struct mdbox_map *map, uint32_t map_uid,
 	return 1;
 }
 
+static int
+mdbox_map_shard_lookup_seq_full(struct mdbox_map *map, uint32_t seq,
+				struct mdbox_map_mail_index_record *rec_r,
+				uint16_t *refcount_r)
+{
+	const struct mdbox_map_mail_index_record *rec;
+	const uint16_t *ref16_p;
+	const void *data;
+
+	if (mdbox_map_lookup_seq(map, seq, &rec) < 0)
+		return -1;
+	*rec_r = *rec;
+
+	mail_index_lookup_ext(map->view, seq, map->ref_ext_id, &data, NULL);
+	if (data == NULL) {
+		mdbox_map_set_corrupted(map, "missing ref extension");
+		return -1;
+	}
+	ref16_p = data;
+	*refcount_r = *ref16_p;
+	return 1;
+}
+
 int mdbox_map_lookup_full(struct mdbox_map *map, uint32_t map_uid,
 			  struct mdbox_map_mail_index_record *rec_r,
 			  uint16_t *refcount_r)
@@ -334,45 +495,55 @@ int mdbox_map_lookup_full(struct mdbox_map *map, uint32_t map_uid,
 	if (mdbox_map_open_or_create(map) < 0)
 		return -1;
 
+	map = mdbox_map_get_shard(map, map_uid);
 	if ((ret = mdbox_map_get_seq(map, map_uid, &seq)) <= 0)
 		return ret;
 
-	return mdbox_map_lookup_seq_full(map, seq, rec_r, refcount_r);
+	return mdbox_map_shard_lookup_seq_full(map, seq, rec_r, refcount_r);
+}
+
+static struct mdbox_map *
+mdbox_map_get_seq_shard(struct mdbox_map *map, uint32_t *seq)
+{
+	struct mdbox_map *const *shards;
+	unsigned int i, count, messages_count;
+
+	/* the sequences continue from one shard to the next */
+	shards = array_get(&map->root->shards, &count);
+	for (i = 0; i < count - 1; i++) {
+		messages_count = mail_index_view_get_messages_count(shards[i]->view);
+		if (*seq <= messages_count)
+			break;
+		*seq -= messages_count;
+	}
+	return shards[i];
 }
 
 int mdbox_map_lookup_seq_full(struct mdbox_map *map, uint32_t seq,
 			      struct mdbox_map_mail_index_record *rec_r,
 			      uint16_t *refcount_r)
 {
-	const struct mdbox_map_mail_index_record *rec;
-	const uint16_t *ref16_p;
-	const void *data;
-
-	if (mdbox_map_lookup_seq(map, seq, &rec) < 0)
-		return -1;
-	*rec_r = *rec;
-
-	mail_index_lookup_ext(map->view, seq, map->ref_ext_id, &data, NULL);
-	if (data == NULL) {
-		mdbox_map_set_corrupted(map, "missing ref extension");
-		return -1;
-	}
-	ref16_p = data;
-	*refcount_r = *ref16_p;
-	return 1;
+	map = mdbox_map_get_seq_shard(map, &seq);
+	return mdbox_map_shard_lookup_seq_full(map, seq, rec_r, refcount_r);
 }
 
 uint32_t mdbox_map_lookup_uid(struct mdbox_map *map, uint32_t seq)
 {
 	uint32_t uid;
 
+	map = mdbox_map_get_seq_shard(map, &seq);
 	mail_index_lookup_uid(map->view, seq, &uid);
 	return uid;
 }
 
 unsigned int mdbox_map_get_messages_count(struct mdbox_map *map)
 {
-	return mail_index_view_get_messages_count(map->view);
+	struct mdbox_map *const *shardp;
+	unsigned int count = 0;
+
+	array_foreach(&map->root->shards, shardp)
+		count += mail_index_view_get_messages_count((*shardp)->view);
+	return count;
 }
 
 int mdbox_map_view_lookup_rec(struct mdbox_map *map,
@@ -412,6 +583,7 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 
 	if (mdbox_map_refresh(map) < 0)
 		return -1;
+	map = mdbox_map_get_shard(map, file_id);
 	hdr = mail_index_get_header(map->view);
 
 	i_zero(&msg);
@@ -429,8 +601,9 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 	return 0;
 }
 
-int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r)
+static void
+mdbox_map_shard_get_zero_ref_files(struct mdbox_map *map,
+				   ARRAY_TYPE(seq_range) *file_ids_r)
 {
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
@@ -438,14 +611,6 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 	const void *data;
 	uint32_t seq;
 	bool expunged;
-	int ret;
-
-	if ((ret = mdbox_map_open(map)) <= 0) {
-		/* no map / internal error */
-		return ret;
-	}
-	if (mdbox_map_refresh(map) < 0)
-		return -1;
 
 	hdr = mail_index_get_header(map->view);
 	for (seq = 1; seq <= hdr->messages_count; seq++) {
@@ -464,6 +629,23 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 			seq_range_array_add(file_ids_r, rec->file_id);
 		}
 	}
+}
+
+int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
+				 ARRAY_TYPE(seq_range) *file_ids_r)
+{
+	struct mdbox_map *const *shardp;
+	int ret;
+
+	if ((ret = mdbox_map_open(map)) <= 0) {
+		/* no map / internal error */
+		return ret;
+	}
+	if (mdbox_map_refresh(map) < 0)
+		return -1;
+
+	array_foreach(&map->root->shards, shardp)
+		mdbox_map_shard_get_zero_ref_files(*shardp, file_ids_r);
 	return 0;
 }
 
@@ -472,10 +654,54 @@ struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map)
 	struct mdbox_map_atomic_context *atomic;
 
 	atomic = i_new(struct mdbox_map_atomic_context, 1);
-	atomic->map = map;
+	atomic->map = map->root;
+	i_array_init(&atomic->shards, array_count(&map->root->shards));
+	return atomic;
+}
+
+struct mdbox_map_atomic_context *
+mdbox_map_atomic_begin_file(struct mdbox_map *map, uint32_t file_id)
+{
+	struct mdbox_map_atomic_context *atomic;
+
+	atomic = mdbox_map_atomic_begin(map);
+	atomic->shard = mdbox_map_get_shard(map, file_id);
 	return atomic;
 }
 
+struct mdbox_map_atomic_shard *
+mdbox_map_atomic_get_shard(struct mdbox_map_atomic_context *atomic,
+			   struct mdbox_map *map)
+{
+	i_assert(map->root == atomic->map);
+	i_assert(atomic->shard == NULL || atomic->shard == map);
+
+	return array_idx_get_space(&atomic->shards, map->shard_idx);
+}
+
+static uint32_t
+mdbox_map_atomic_get_shard_mask(struct mdbox_map_atomic_context *atomic)
+{
+	if (atomic->shard != NULL)
+		return 1U << atomic->shard->shard_idx;
+	return (1U << (array_count(&atomic->map->shards) - 1) << 1) - 1;
+}
+
+static uint32_t
+mdbox_map_atomic_get_locked_mask(struct mdbox_map_atomic_context *atomic)
+{
+	const struct mdbox_map_atomic_shard *ashards;
+	unsigned int i, count;
+	uint32_t mask = 0;
+
+	ashards = array_get(&atomic->shards, &count);
+	for (i = 0; i < count; i++) {
+		if (ashards[i].sync_ctx != NULL)
+			mask |= 1U << i;
+	}
+	return mask;
+}
+
 static void
 mdbox_map_sync_handle(struct mdbox_map *map,
 		      struct mail_index_sync_ctx *sync_ctx)
@@ -489,45 +715,134 @@ mdbox_map_sync_handle(struct mdbox_map *map,
 		/* something had crashed. need a full resync. */
 		i_warning("mdbox %s: Inconsistency in map index "
 			  "(%u,%"PRIuUOFF_T" != %u,%"PRIuUOFF_T")",
-			  map->path, seq1, offset1, seq2, offset2);
+			  map->index->filepath, seq1, offset1, seq2, offset2);
 		mdbox_storage_set_corrupted(map->storage);
 	}
 	while (mail_index_sync_next(sync_ctx, &sync_rec)) ;
 }
 
-int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
-			  const char *reason)
+static int
+mdbox_map_atomic_lock_shard(struct mdbox_map_atomic_context *atomic,
+			    struct mdbox_map *map, const char *reason)
 {
+	struct mdbox_map_atomic_shard *ashard =
+		mdbox_map_atomic_get_shard(atomic, map);
+	struct timeval start_time, end_time;
+	struct event *event;
+	const char *error;
+	long long wait_usecs;
 	int ret;
 
-	if (atomic->locked)
-		return 0;
+	i_assert(ashard->sync_ctx == NULL);
 
-	if (mdbox_map_open_or_create(atomic->map) < 0)
-		return -1;
+	/* the event is created before waiting for the lock, so its duration
+	   is the lock wait time */
+	event = event_create(map->root->event);
+	event_set_name(event, "mdbox_map_lock_finished");
+	event_add_int(event, "shard", map->shard_idx);
+	event_add_str(event, "reason", reason);
 
 	/* use syncing to lock the transaction log, so that we always see
 	   log's head_offset = tail_offset */
-	ret = mail_index_sync_begin(atomic->map->index, &atomic->sync_ctx,
-				    &atomic->sync_view, &atomic->sync_trans,
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	ret = mail_index_sync_begin(map->index, &ashard->sync_ctx,
+				    &ashard->sync_view, &ashard->sync_trans,
 				    MAIL_INDEX_SYNC_FLAG_UPDATE_TAIL_OFFSET);
-	if (mail_index_reset_fscked(atomic->map->index))
-		mdbox_storage_set_corrupted(atomic->map->storage);
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	wait_usecs = timeval_diff_usecs(&end_time, &start_time);
+	event_add_int(event, "lock_wait_usecs", wait_usecs);
+
+	if (mail_index_reset_fscked(map->index))
+		mdbox_storage_set_corrupted(map->storage);
 	if (ret <= 0) {
 		i_assert(ret != 0);
-		mail_storage_set_index_error(MAP_STORAGE(atomic->map),
-					     atomic->map->index);
+		mail_storage_set_index_error(MAP_STORAGE(map), map->index);
+		error = mail_storage_get_last_internal_error(MAP_STORAGE(map),
+							     NULL);
+		e_debug(event_create_passthrough(event)->
+			add_str("error", error)->event(),
+			"Failed to lock map %s for %s: %s "
+			"(waited %lld.%03lld ms)", map->index->filepath, reason,
+			error, wait_usecs / 1000, wait_usecs % 1000);
+		event_unref(&event);
 		return -1;
 	}
-	mail_index_sync_set_reason(atomic->sync_ctx, reason);
-	atomic->locked = TRUE;
+	if (wait_usecs / 1000 >= MDBOX_MAP_LOCK_WARN_MSECS) {
+		e_warning(event, "Locking map %s for %s took %lld.%03lld secs",
+			  map->index->filepath, reason,
+			  wait_usecs / 1000000, (wait_usecs / 1000) % 1000);
+	} else {
+		e_debug(event, "Locked map %s for %s (waited %lld.%03lld ms)",
+			map->index->filepath, reason,
+			wait_usecs / 1000, wait_usecs % 1000);
+	}
+	event_unref(&event);
+
+	mail_index_sync_set_reason(ashard->sync_ctx, reason);
+	mdbox_map_sync_handle(map, ashard->sync_ctx);
+	return 0;
+}
+
+static int
+mdbox_map_atomic_lock_shards(struct mdbox_map_atomic_context *atomic,
+			     uint32_t mask, const char *reason)
+{
+	struct mdbox_map *const *shards;
+	struct mdbox_map_atomic_shard *ashards;
+	unsigned int i, count;
+	uint32_t locked_mask;
+
+	locked_mask = mdbox_map_atomic_get_locked_mask(atomic);
+	mask &= ~locked_mask;
+	if (mask == 0)
+		return 0;
+
+	if (mdbox_map_open_or_create(atomic->map) < 0)
+		return -1;
+
+	/* shards must be locked in ascending order to avoid deadlocks */
+	if (locked_mask > (mask & -mask)) {
+		/* we already have a higher shard locked. nothing has been
+		   written to it yet, so unlock it and start again. */
+		ashards = array_get_modifiable(&atomic->shards, &count);
+		for (i = 0; i < count; i++) {
+			if (ashards[i].sync_ctx == NULL)
+				continue;
+			i_assert(!ashards[i].changed);
+			mail_index_sync_rollback(&ashards[i].sync_ctx);
+			i_zero(&ashards[i]);
+		}
+		mask |= locked_mask;
+	}
+
+	shards = array_get(&atomic->map->shards, &count);
+	for (i = 0; i < count; i++) {
+		if ((mask & (1U << i)) != 0) {
+			if (mdbox_map_atomic_lock_shard(atomic, shards[i],
+							reason) < 0)
+				return -1;
+		}
+	}
+	atomic->locked = mdbox_map_atomic_get_locked_mask(atomic) ==
+		mdbox_map_atomic_get_shard_mask(atomic);
 	/* reset refresh state so that if it's wanted to be done locked,
 	   it gets the latest changes */
 	atomic->map_refreshed = FALSE;
-	mdbox_map_sync_handle(atomic->map, atomic->sync_ctx);
 	return 0;
 }
 
+int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
+			  const char *reason)
+{
+	if (atomic->locked)
+		return 0;
+
+	return mdbox_map_atomic_lock_shards(atomic,
+		mdbox_map_atomic_get_shard_mask(atomic), reason);
+}
+
 bool mdbox_map_atomic_is_locked(struct mdbox_map_atomic_context *atomic)
 {
 	return atomic->locked;
@@ -547,28 +862,41 @@ void mdbox_map_atomic_set_success(struct mdbox_map_atomic_context *atomic)
 
 void mdbox_map_atomic_unset_fscked(struct mdbox_map_atomic_context *atomic)
 {
-	mail_index_unset_fscked(atomic->sync_trans);
+	struct mdbox_map_atomic_shard *ashard;
+
+	array_foreach_modifiable(&atomic->shards, ashard) {
+		if (ashard->sync_ctx != NULL)
+			mail_index_unset_fscked(ashard->sync_trans);
+	}
 }
 
 int mdbox_map_atomic_finish(struct mdbox_map_atomic_context **_atomic)
 {
 	struct mdbox_map_atomic_context *atomic = *_atomic;
+	struct mdbox_map *const *shards;
+	struct mdbox_map_atomic_shard *ashards;
+	unsigned int i, count;
 	int ret = 0;
 
 	*_atomic = NULL;
 
-	if (atomic->sync_ctx == NULL) {
-		/* not locked */
-		i_assert(!atomic->locked);
-	} else if (atomic->success) {
-		if (mail_index_sync_commit(&atomic->sync_ctx) < 0) {
-			mail_storage_set_index_error(MAP_STORAGE(atomic->map),
-						     atomic->map->index);
-			ret = -1;
+	shards = array_idx(&atomic->map->shards, 0);
+	ashards = array_get_modifiable(&atomic->shards, &count);
+	for (i = 0; i < count; i++) {
+		if (ashards[i].sync_ctx == NULL) {
+			/* not locked */
+		} else if (atomic->success) {
+			if (mail_index_sync_commit(&ashards[i].sync_ctx) < 0) {
+				mail_storage_set_index_error(
+					MAP_STORAGE(atomic->map),
+					shards[i]->index);
+				ret = -1;
+			}
+		} else {
+			mail_index_sync_rollback(&ashards[i].sync_ctx);
 		}
-	} else {
-		mail_index_sync_rollback(&atomic->sync_ctx);
 	}
+	array_free(&atomic->shards);
 	i_free(atomic);
 	return ret;
 }
@@ -587,6 +915,8 @@ mdbox_map_transaction_begin(struct mdbox_map_atomic_context *atomic,
 
 	ctx = i_new(struct mdbox_map_transaction_context, 1);
 	ctx->atomic = atomic;
+	ctx->flags = flags;
+	i_array_init(&ctx->shard_trans, array_count(&atomic->map->shards));
 	if (atomic->locked && atomic->map_refreshed) {
 		/* already refreshed within a lock, don't do it again */
 		success = TRUE;
@@ -595,30 +925,59 @@ mdbox_map_transaction_begin(struct mdbox_map_atomic_context *atomic,
 			mdbox_map_refresh(atomic->map) == 0;
 	}
 
-	if (success) {
+	if (success)
 		atomic->map_refreshed = TRUE;
-		ctx->trans = mail_index_transaction_begin(atomic->map->view,
-							  flags);
-	}
+	else
+		ctx->failed = TRUE;
 	return ctx;
 }
 
+static struct mail_index_transaction *
+mdbox_map_transaction_get_shard(struct mdbox_map_transaction_context *ctx,
+				struct mdbox_map *map)
+{
+	struct mail_index_transaction **transp;
+
+	i_assert(ctx->atomic->shard == NULL || ctx->atomic->shard == map);
+
+	transp = array_idx_get_space(&ctx->shard_trans, map->shard_idx);
+	if (*transp == NULL)
+		*transp = mail_index_transaction_begin(map->view, ctx->flags);
+	return *transp;
+}
+
 int mdbox_map_transaction_commit(struct mdbox_map_transaction_context *ctx,
 				 const char *reason)
 {
+	struct mdbox_map *const *shards;
+	struct mail_index_transaction **shard_trans;
+	struct mdbox_map_atomic_shard *ashard;
+	unsigned int i, count;
+
 	i_assert(!ctx->committed);
 
 	ctx->committed = TRUE;
-	if (!ctx->changed)
+	if (ctx->changed_shards == 0)
 		return 0;
 
-	if (mdbox_map_atomic_lock(ctx->atomic, reason) < 0)
+	/* lock only the shards that have changes */
+	if (mdbox_map_atomic_lock_shards(ctx->atomic, ctx->changed_shards,
+					 reason) < 0)
 		return -1;
 
-	if (mail_index_transaction_commit(&ctx->trans) < 0) {
-		mail_storage_set_index_error(MAP_STORAGE(ctx->atomic->map),
-					     ctx->atomic->map->index);
-		return -1;
+	shards = array_idx(&ctx->atomic->map->shards, 0);
+	shard_trans = array_get_modifiable(&ctx->shard_trans, &count);
+	for (i = 0; i < count; i++) {
+		if ((ctx->changed_shards & (1U << i)) == 0)
+			continue;
+
+		ashard = mdbox_map_atomic_get_shard(ctx->atomic, shards[i]);
+		ashard->changed = TRUE;
+		if (mail_index_transaction_commit(&shard_trans[i]) < 0) {
+			mail_storage_set_index_error(MAP_STORAGE(shards[i]),
+						     shards[i]->index);
+			return -1;
+		}
 	}
 	mdbox_map_atomic_set_success(ctx->atomic);
 	return 0;
@@ -627,25 +986,31 @@ int mdbox_map_transaction_commit(struct mdbox_map_transaction_context *ctx,
 void mdbox_map_transaction_free(struct mdbox_map_transaction_context **_ctx)
 {
 	struct mdbox_map_transaction_context *ctx = *_ctx;
+	struct mail_index_transaction **transp;
 
 	*_ctx = NULL;
 
-	if (ctx->trans != NULL)
-		mail_index_transaction_rollback(&ctx->trans);
+	array_foreach_modifiable(&ctx->shard_trans, transp) {
+		if (*transp != NULL)
+			mail_index_transaction_rollback(transp);
+	}
+	array_free(&ctx->shard_trans);
 	i_free(ctx);
 }
 
 int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 			      uint32_t map_uid, int diff)
 {
-	struct mdbox_map *map = ctx->atomic->map;
+	struct mdbox_map *map;
+	struct mail_index_transaction *trans;
 	const void *data;
 	uint32_t seq;
 	int old_diff, new_diff;
 
-	if (unlikely(ctx->trans == NULL))
+	if (unlikely(ctx->failed))
 		return -1;
 
+	map = mdbox_map_get_shard(ctx->atomic->map, map_uid);
 	if (!mail_index_lookup_seq(map->view, map_uid, &seq)) {
 		/* we can't refresh map here since view has a
 		   transaction open. */
@@ -661,8 +1026,9 @@ int mdbox_map_update_refcount(struct mdbox_map_transaction_context *ctx,
 	}
 	mail_index_lookup_ext(map->view, seq, map->ref_ext_id, &data, NULL);
 	old_diff = data == NULL ? 0 : *((const uint16_t *)data);
-	ctx->changed = TRUE;
-	new_diff = mail_index_atomic_inc_ext(ctx->trans, seq,
+	trans = mdbox_map_transaction_get_shard(ctx, map);
+	ctx->changed_shards |= 1U << map->shard_idx;
+	new_diff = mail_index_atomic_inc_ext(trans, seq,
 					     map->ref_ext_id, diff);
 	if (old_diff + new_diff < 0) {
 		mdbox_map_set_corrupted(map, "map_uid=%u refcount too low",
@@ -687,7 +1053,7 @@ int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 	const uint32_t *uidp;
 	unsigned int i, count;
 
-	if (unlikely(ctx->trans == NULL))
+	if (unlikely(ctx->failed))
 		return -1;
 
 	count = array_count(map_uids);
@@ -713,11 +1079,12 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 	   messages that have already been moved to other files. */
 
 	/* we need a per-file transaction, otherwise we can't refresh the map */
-	atomic = mdbox_map_atomic_begin(map);
+	atomic = mdbox_map_atomic_begin_file(map, file_id);
 	map_trans = mdbox_map_transaction_begin(atomic, TRUE);
+	map = atomic->shard;
 
-	hdr = mail_index_get_header(map->view);
-	for (seq = 1; seq <= hdr->messages_count; seq++) {
+	hdr = map_trans->failed ? NULL : mail_index_get_header(map->view);
+	for (seq = 1; hdr != NULL && seq <= hdr->messages_count; seq++) {
 		mail_index_lookup_ext(map->view, seq, map->map_ext_id,
 				      &data, NULL);
 		if (data == NULL) {
@@ -728,10 +1095,14 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 
 		rec = data;
 		if (rec->file_id == file_id) {
-			map_trans->changed = TRUE;
-			mail_index_expunge(map_trans->trans, seq);
+			map_trans->changed_shards |= 1U << map->shard_idx;
+			mail_index_expunge(
+				mdbox_map_transaction_get_shard(map_trans, map),
+				seq);
 		}
 	}
+	if (map_trans->failed)
+		ret = -1;
 	if (ret == 0)
 		ret = mdbox_map_transaction_commit(map_trans, "removing file");
 	mdbox_map_transaction_free(&map_trans);
@@ -740,6 +1111,18 @@ int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id)
 	return ret;
 }
 
+static struct mdbox_map *mdbox_map_get_append_shard(struct mdbox_map *map)
+{
+	struct mdbox_map *const *shards;
+	unsigned int count;
+
+	/* concurrent saves are done by different processes. spread them
+	   to different shards so they don't have to wait for each others'
+	   locks. */
+	shards = array_get(&map->shards, &count);
+	return shards[count == 1 ? 0 : (unsigned int)getpid() % count];
+}
+
 struct mdbox_map_append_context *
 mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic)
 {
@@ -747,7 +1130,8 @@ mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic)
 
 	ctx = i_new(struct mdbox_map_append_context, 1);
 	ctx->atomic = atomic;
-	ctx->map = atomic->map;
+	ctx->map = atomic->shard != NULL ? atomic->shard :
+		mdbox_map_get_append_shard(atomic->map);
 	ctx->first_new_file_id = (uint32_t)-1;
 	i_array_init(&ctx->file_appends, 64);
 	i_array_init(&ctx->files, 64);
@@ -766,6 +1150,29 @@ mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic)
 	return ctx;
 }
 
+int mdbox_map_append_lock(struct mdbox_map_append_context *ctx,
+			  const ARRAY_TYPE(uint32_t) *map_uids,
+			  const char *reason)
+{
+	const uint32_t *uidp;
+	uint32_t mask = 0;
+
+	if (array_count(&ctx->appends) > 0)
+		mask |= 1U << ctx->map->shard_idx;
+	if (map_uids != NULL) {
+		array_foreach(map_uids, uidp) {
+			mask |= 1U << mdbox_map_get_shard(ctx->map,
+							  *uidp)->shard_idx;
+		}
+	}
+	if (mask == 0) {
+		/* nothing to write, but keep the old behavior of having
+		   the map locked while syncing the mailbox */
+		mask = 1U << ctx->map->shard_idx;
+	}
+	return mdbox_map_atomic_lock_shards(ctx->atomic, mask, reason);
+}
+
 static time_t day_begin_stamp(unsigned int interval)
 {
 	struct tm tm;
@@ -1202,7 +1609,8 @@ mdbox_find_highest_file_id(struct mdbox_map *map, uint32_t *file_id_r)
 	}
 	while ((d = readdir(dir)) != NULL) {
 		if (strncmp(d->d_name, MDBOX_MAIL_FILE_PREFIX, prefix_len) == 0 &&
-		    str_to_uint(d->d_name + prefix_len, &id) == 0) {
+		    str_to_uint(d->d_name + prefix_len, &id) == 0 &&
+		    mdbox_map_get_shard(map, id) == map) {
 			if (highest_id < id)
 				highest_id = id;
 		}
@@ -1220,15 +1628,20 @@ mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 	struct dbox_file_append_context *const *file_appends;
 	unsigned int i, count;
 	struct mdbox_map_mail_index_header hdr;
-	uint32_t first_file_id, file_id, existing_id;
+	struct mdbox_map_atomic_shard *ashard;
+	uint32_t first_file_id, file_id, existing_id, new_files_count = 0;
 
 	/* start the syncing. we'll need it even if there are no file ids to
 	   be assigned. */
-	if (mdbox_map_atomic_lock(ctx->atomic, reason) < 0)
+	if (mdbox_map_atomic_lock_shards(ctx->atomic,
+					 1U << ctx->map->shard_idx, reason) < 0)
 		return -1;
+	ashard = mdbox_map_atomic_get_shard(ctx->atomic, ctx->map);
+	ashard->changed = TRUE;
 
-	mdbox_map_get_ext_hdr(ctx->map, ctx->atomic->sync_view, &hdr);
-	file_id = hdr.highest_file_id + 1;
+	mdbox_map_get_ext_hdr(ctx->map, ashard->sync_view, &hdr);
+	file_id = I_MAX(hdr.highest_file_id + 1,
+			mdbox_map_shard_first_id(ctx->map));
 
 	if (ctx->map->verify_existing_file_ids) {
 		/* storage/ directory had been already created but
@@ -1244,6 +1657,21 @@ mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 	/* assign file_ids for newly created files */
 	first_file_id = file_id;
 	file_appends = array_get(&ctx->file_appends, &count);
+	for (i = 0; i < count; i++) {
+		struct mdbox_file *mfile =
+			(struct mdbox_file *)file_appends[i]->file;
+
+		if (mfile->file_id == 0)
+			new_files_count++;
+	}
+	if (new_files_count > 0 &&
+	    (file_id > mdbox_map_shard_last_id(ctx->map) ||
+	     new_files_count - 1 > mdbox_map_shard_last_id(ctx->map) - file_id)) {
+		mail_storage_set_critical(MAP_STORAGE(ctx->map),
+			"mdbox map %s: No more file IDs available",
+			ctx->map->index->filepath);
+		return -1;
+	}
 	for (i = 0; i < count; i++) {
 		struct mdbox_file *mfile =
 			(struct mdbox_file *)file_appends[i]->file;
@@ -1265,7 +1693,7 @@ mdbox_map_assign_file_ids(struct mdbox_map_append_context *ctx,
 	if (first_file_id != file_id) {
 		file_id--;
 		mail_index_update_header_ext(ctx->trans != NULL ? ctx->trans :
-					     ctx->atomic->sync_trans,
+					     ashard->sync_trans,
 					     ctx->map->map_ext_id,
 					     0, &file_id, sizeof(file_id));
 	}
@@ -1277,12 +1705,13 @@ int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
 				     uint32_t *last_map_uid_r)
 {
 	const struct mdbox_map_append *appends;
+	struct mail_index_view *sync_view;
 	const struct mail_index_header *hdr;
 	struct mdbox_map_mail_index_record rec;
 	unsigned int i, count;
 	ARRAY_TYPE(seq_range) uids;
 	const struct seq_range *range;
-	uint32_t seq;
+	uint32_t seq, next_uid;
 	uint16_t ref16;
 	int ret = 0;
 
@@ -1317,10 +1746,20 @@ int mdbox_map_append_assign_map_uids(struct mdbox_map_append_context *ctx,
 				      &ref16, NULL);
 	}
 
-	/* assign map UIDs for appended records */
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
+	/* assign map UIDs for appended records. each shard has its own
+	   range of map UIDs. */
+	sync_view = mdbox_map_atomic_get_shard(ctx->atomic, ctx->map)->sync_view;
+	hdr = mail_index_get_header(sync_view);
+	next_uid = mdbox_map_shard_get_next_uid(ctx->map, sync_view);
+	if (next_uid > mdbox_map_shard_last_id(ctx->map) ||
+	    count - 1 > mdbox_map_shard_last_id(ctx->map) - next_uid) {
+		mail_storage_set_critical(MAP_STORAGE(ctx->map),
+			"mdbox map %s: No more map UIDs available",
+			ctx->map->index->filepath);
+		return -1;
+	}
 	t_array_init(&uids, 1);
-	mail_index_append_finish_uids(ctx->trans, hdr->next_uid, &uids);
+	mail_index_append_finish_uids(ctx->trans, next_uid, &uids);
 	range = array_idx(&uids, 0);
 	i_assert(range[0].seq2 - range[0].seq1 + 1 == count);
 
@@ -1352,16 +1791,19 @@ int mdbox_map_append_move(struct mdbox_map_append_context *ctx,
 	struct seq_range_iter iter;
 	const uint32_t *uids;
 	unsigned int i, j, map_uids_count, appends_count;
+	struct mdbox_map_atomic_shard *ashard;
 	uint32_t uid, seq, next_uid;
 
-	/* map is locked by this call */
+	/* map is locked by this call. the moved messages are all in the
+	   same shard as the file being purged. */
 	if (mdbox_map_assign_file_ids(ctx, FALSE, "purging - update uids") < 0)
 		return -1;
+	ashard = mdbox_map_atomic_get_shard(ctx->atomic, ctx->map);
 
 	i_zero(&rec);
 	appends = array_get(&ctx->appends, &appends_count);
 
-	next_uid = mail_index_get_header(ctx->atomic->sync_view)->next_uid;
+	next_uid = mdbox_map_shard_get_next_uid(ctx->map, ashard->sync_view);
 	uids = array_get(map_uids, &map_uids_count);
 	for (i = j = 0; i < map_uids_count; i++) {
 		struct mdbox_file *mfile =
@@ -1373,25 +1815,25 @@ int mdbox_map_append_move(struct mdbox_map_append_context *ctx,
 		rec.size = appends[j].size;
 		j++;
 
-		if (!mail_index_lookup_seq(ctx->atomic->sync_view,
+		if (!mail_index_lookup_seq(ashard->sync_view,
 					   uids[i], &seq)) {
 			/* We wrote the email to the new m.* file, but another
 			   process already expunged it and purged it. Deleting
 			   the email from the new m.* file would be problematic
 			   at this point, so just add the mail back to the map
 			   with refcount=0 and the next purge will remove it. */
-			mail_index_append(ctx->atomic->sync_trans,
+			mail_index_append(ashard->sync_trans,
 					  next_uid++, &seq);
 		}
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
+		mail_index_update_ext(ashard->sync_trans, seq,
 				      ctx->map->map_ext_id, &rec, NULL);
 	}
 
 	seq_range_array_iter_init(&iter, expunge_map_uids); i = 0;
 	while (seq_range_array_iter_nth(&iter, i++, &uid)) {
-		if (!mail_index_lookup_seq(ctx->atomic->sync_view, uid, &seq))
+		if (!mail_index_lookup_seq(ashard->sync_view, uid, &seq))
 			i_unreached();
-		mail_index_expunge(ctx->atomic->sync_trans, seq);
+		mail_index_expunge(ashard->sync_trans, seq);
 	}
 	return 0;
 }
@@ -1492,6 +1934,7 @@ uint32_t mdbox_map_get_uid_validity(struct mdbox_map *map)
 {
 	uint32_t uid_validity;
 
+	map = map->root;
 	i_assert(map->view != NULL);
 
 	uid_validity = mail_index_get_header(map->view)->uid_validity;
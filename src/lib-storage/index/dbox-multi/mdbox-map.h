@@ -3,6 +3,8 @@
 
 #include "seq-range-array.h"
 
+#define MDBOX_MAP_MAX_SHARDS 16
+
 struct dbox_file_append_context;
 struct mdbox_map_append_context;
 struct mdbox_storage;
@@ -71,10 +73,15 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 /* Begin atomic context. There can be multiple transactions/appends within the
    same atomic context. */
 struct mdbox_map_atomic_context *mdbox_map_atomic_begin(struct mdbox_map *map);
-/* Lock the map immediately. */
+/* Begin atomic context that only locks the map shard containing the file.
+   Appends within the context are done to the same shard. */
+struct mdbox_map_atomic_context *
+mdbox_map_atomic_begin_file(struct mdbox_map *map, uint32_t file_id);
+/* Lock the map immediately. With multiple map shards all of them are
+   locked. */
 int mdbox_map_atomic_lock(struct mdbox_map_atomic_context *atomic,
 			  const char *reason);
-/* Returns TRUE if map is locked */
+/* Returns TRUE if the whole map is locked */
 bool mdbox_map_atomic_is_locked(struct mdbox_map_atomic_context *atomic);
 /* When finish() is called, rollback the changes. If data was already written
    to map's transaction log, this desyncs the map and causes a rebuild */
@@ -109,6 +116,12 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 
 struct mdbox_map_append_context *
 mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic);
+/* Lock the map shards needed for committing the appends and for updating
+   the refcounts of the given map UIDs (may be NULL). Other shards are left
+   unlocked, so saves to different shards don't block each others. */
+int mdbox_map_append_lock(struct mdbox_map_append_context *ctx,
+			  const ARRAY_TYPE(uint32_t) *map_uids,
+			  const char *reason);
 /* Request file for saving a new message with given size (if available). If an
    existing file can be used, the record is locked and updated in index.
    Returns 0 if ok, -1 if error. */
@@ -6,6 +6,8 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "time-util.h"
+#include "lib-signals.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -15,6 +17,9 @@
 
 #include <dirent.h>
 
+/* How many bytes mdbox_purge_max_iops counts as a single read or write */
+#define MDBOX_PURGE_IO_BLOCK_SIZE (64*1024)
+
 /*
    Altmoving works like:
 
@@ -48,6 +53,13 @@ struct mdbox_purge_context {
 
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	/* mdbox_purge_max_bandwidth and mdbox_purge_max_iops accounting */
+	struct timeval throttle_start;
+	uoff_t throttle_bytes;
+	uint64_t throttle_ops;
+	/* signal_term_counter when purging started */
+	unsigned int start_signal_term_counter;
 };
 
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
@@ -182,6 +194,47 @@ mdbox_purge_want_altpath(struct mdbox_purge_context *ctx,
 	return action == MDBOX_MSG_ACTION_MOVE_TO_ALT;
 }
 
+static void
+mdbox_purge_throttle(struct mdbox_purge_context *ctx, uoff_t size)
+{
+	uoff_t max_bandwidth = ctx->storage->set->mdbox_purge_max_bandwidth;
+	unsigned int max_iops = ctx->storage->set->mdbox_purge_max_iops;
+	struct timeval now;
+	long long wanted_usecs, iops_usecs, elapsed_usecs;
+
+	if (max_bandwidth == 0 && max_iops == 0)
+		return;
+
+	if (ctx->throttle_ops == 0) {
+		if (gettimeofday(&ctx->throttle_start, NULL) < 0)
+			i_fatal("gettimeofday() failed: %m");
+	}
+	ctx->throttle_bytes += size;
+	/* each message is read and written once per started I/O block */
+	ctx->throttle_ops += 2 * I_MAX(1, (size + MDBOX_PURGE_IO_BLOCK_SIZE - 1) /
+				       MDBOX_PURGE_IO_BLOCK_SIZE);
+
+	/* sleep until the average copying rate since the beginning of the
+	   purge drops below both of the limits */
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	wanted_usecs = max_bandwidth == 0 ? 0 :
+		(long long)(ctx->throttle_bytes * 1000000 / max_bandwidth);
+	if (max_iops != 0) {
+		iops_usecs = (long long)(ctx->throttle_ops * 1000000 / max_iops);
+		wanted_usecs = I_MAX(wanted_usecs, iops_usecs);
+	}
+	elapsed_usecs = timeval_diff_usecs(&now, &ctx->throttle_start);
+	while (wanted_usecs > elapsed_usecs &&
+	       ctx->start_signal_term_counter == signal_term_counter) {
+		/* usleep() isn't guaranteed to work with >=1 second */
+		usleep(I_MIN(wanted_usecs - elapsed_usecs, 500000));
+		if (gettimeofday(&now, NULL) < 0)
+			i_fatal("gettimeofday() failed: %m");
+		elapsed_usecs = timeval_diff_usecs(&now, &ctx->throttle_start);
+	}
+}
+
 static int
 mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		     const struct mdbox_map_file_msg *msg)
@@ -205,6 +258,8 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 
 	i_assert(file != out_file_append->file);
 
+	/* the message is copied as-is between files */
+	o_stream_file_set_copy_file_range(output, TRUE);
 	input = i_stream_create_limit(file->input, msg_size);
 	o_stream_nsend_istream(output, input);
 	if (o_stream_flush(output) < 0) {
@@ -230,6 +285,7 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			return ret;
 
 		mdbox_map_append_finish(ctx->append_ctx);
+		mdbox_purge_throttle(ctx, msg_size);
 	}
 	return ret;
 }
@@ -333,7 +389,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	array_sort(&msgs_arr, mdbox_map_file_msg_offset_cmp);
 
 	ext_refs_pool = pool_alloconly_create("mdbox purge ext refs", 1024);
-	ctx->atomic = mdbox_map_atomic_begin(ctx->storage->map);
+	ctx->atomic = mdbox_map_atomic_begin_file(ctx->storage->map, file_id);
 	msgs = array_get(&msgs_arr, &count);
 	i_array_init(&ext_refs, 32);
 	i_array_init(&copied_map_uids, I_MIN(count, 1));
@@ -473,6 +529,7 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	ctx->pool = pool;
 	ctx->storage = storage;
 	ctx->lowest_primary_file_id = (uint32_t)-1;
+	ctx->start_signal_term_counter = signal_term_counter;
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
@@ -679,6 +736,15 @@ int mdbox_purge(struct mail_storage *_storage)
 				ret = -1;
 		}
 		dbox_file_unref(&file);
+
+		if (ret == 0 &&
+		    ctx->start_signal_term_counter != signal_term_counter) {
+			/* each file's purge is committed separately, so the
+			   remaining files are simply purged by the next run */
+			mail_storage_set_error(_storage, MAIL_ERROR_TEMP,
+				"Purging was interrupted");
+			ret = -1;
+		}
 	} T_END;
 	mdbox_purge_free(&ctx);
 
@@ -289,8 +289,11 @@ int mdbox_transaction_save_commit_pre(struct mail_save_context *_ctx)
 		return -1;
 	}
 
-	/* make sure the map gets locked */
-	if (mdbox_map_atomic_lock(ctx->atomic, "saving") < 0) {
+	/* make sure the map gets locked. only the shards we're going to
+	   write to are locked. */
+	if (mdbox_map_append_lock(ctx->append_ctx,
+				  array_is_created(&ctx->copy_map_uids) ?
+				  &ctx->copy_map_uids : NULL, "saving") < 0) {
 		mdbox_transaction_save_rollback(_ctx);
 		return -1;
 	}
@@ -48,7 +48,8 @@ struct mdbox_storage_rebuild_context {
 	struct mdbox_map_atomic_context *atomic;
 	pool_t pool;
 
-	struct mdbox_map_mail_index_header orig_map_hdr;
+	struct mdbox_map_mail_index_header orig_map_hdrs[MDBOX_MAP_MAX_SHARDS];
+	uint32_t shard_highest_file_ids[MDBOX_MAP_MAX_SHARDS];
 	HASH_TABLE(uint8_t *, struct mdbox_rebuild_msg *) guid_hash;
 	ARRAY(struct mdbox_rebuild_msg *) msgs;
 	ARRAY_TYPE(seq_range) seen_file_ids;
@@ -235,6 +236,19 @@ static int rebuild_file_mails(struct mdbox_storage_rebuild_context *ctx,
 		return 1;
 }
 
+static void
+rebuild_update_highest_file_id(struct mdbox_storage_rebuild_context *ctx,
+			       uint32_t file_id)
+{
+	struct mdbox_map *shard =
+		mdbox_map_get_shard(ctx->storage->map, file_id);
+
+	if (ctx->highest_file_id < file_id)
+		ctx->highest_file_id = file_id;
+	if (ctx->shard_highest_file_ids[shard->shard_idx] < file_id)
+		ctx->shard_highest_file_ids[shard->shard_idx] = file_id;
+}
+
 static int
 rebuild_rename_file(struct mdbox_storage_rebuild_context *ctx,
 		    const char *dir, const char **fname_p, uint32_t *file_id_r)
@@ -249,6 +263,8 @@ rebuild_rename_file(struct mdbox_storage_rebuild_context *ctx,
 		   don't overwrite any files. */
 		if (link(old_path, new_path) == 0) {
 			i_unlink(old_path);
+			rebuild_update_highest_file_id(ctx,
+						       ctx->highest_file_id);
 			*fname_p = strrchr(new_path, '/') + 1;
 			*file_id_r = ctx->highest_file_id;
 			return 0;
@@ -281,10 +297,9 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 		}
 		return 0;
 	}
-	if (!seq_range_exists(&ctx->seen_file_ids, file_id)) {
-		if (ctx->highest_file_id < file_id)
-			ctx->highest_file_id = file_id;
-	} else {
+	if (!seq_range_exists(&ctx->seen_file_ids, file_id))
+		rebuild_update_highest_file_id(ctx, file_id);
+	else {
 		/* duplicate file. either readdir() returned it twice
 		   (unlikely) or it exists in both alt and primary storage.
 		   to make sure we don't lose any mails from either of the
@@ -304,49 +319,59 @@ static int rebuild_add_file(struct mdbox_storage_rebuild_context *ctx,
 }
 
 static void
-rebuild_add_missing_map_uids(struct mdbox_storage_rebuild_context *ctx,
-			     uint32_t next_uid)
+rebuild_add_missing_map_uids(struct mdbox_storage_rebuild_context *ctx)
 {
+	struct mdbox_map *map = ctx->storage->map, *shard;
+	struct mdbox_map_atomic_shard *ashard;
 	struct mdbox_rebuild_msg **msgs;
 	struct mdbox_map_mail_index_record rec;
+	uint32_t next_uids[MDBOX_MAP_MAX_SHARDS];
 	unsigned int i, count;
 	uint32_t seq;
 
+	i_zero(&next_uids);
 	i_zero(&rec);
 	msgs = array_get_modifiable(&ctx->msgs, &count);
 	for (i = 0; i < count; i++) {
 		if (msgs[i]->map_uid != 0)
 			continue;
 
+		/* the map record is added to the shard owning the file */
+		shard = mdbox_map_get_shard(map, msgs[i]->file_id);
+		ashard = mdbox_map_atomic_get_shard(ctx->atomic, shard);
+		if (next_uids[shard->shard_idx] == 0) {
+			next_uids[shard->shard_idx] =
+				mdbox_map_shard_get_next_uid(shard,
+							     ashard->sync_view);
+		}
+
 		rec.file_id = msgs[i]->file_id;
 		rec.offset = msgs[i]->offset;
 		rec.size = msgs[i]->rec_size;
 
-		msgs[i]->map_uid = next_uid++;
-		mail_index_append(ctx->atomic->sync_trans,
+		msgs[i]->map_uid = next_uids[shard->shard_idx]++;
+		mail_index_append(ashard->sync_trans,
 				  msgs[i]->map_uid, &seq);
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
-				      ctx->storage->map->map_ext_id,
-				      &rec, NULL);
+		mail_index_update_ext(ashard->sync_trans, seq,
+				      shard->map_ext_id, &rec, NULL);
 	}
 }
 
-static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
+static void
+rebuild_apply_map_shard(struct mdbox_storage_rebuild_context *ctx,
+			struct mdbox_map *shard)
 {
-	struct mdbox_map *map = ctx->storage->map;
+	struct mdbox_map_atomic_shard *ashard =
+		mdbox_map_atomic_get_shard(ctx->atomic, shard);
 	const struct mail_index_header *hdr;
 	struct mdbox_rebuild_msg **pos;
 	struct mdbox_rebuild_msg search_msg, *search_msgp = &search_msg;
 	struct dbox_mail_lookup_rec rec;
 	uint32_t seq;
 
-	array_sort(&ctx->msgs, mdbox_rebuild_msg_offset_cmp);
-	/* msgs now contains a list of all messages that exists in m.* files,
-	   sorted by file_id,offset */
-
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
+	hdr = mail_index_get_header(ashard->sync_view);
 	for (seq = 1; seq <= hdr->messages_count; seq++) {
-		if (mdbox_map_view_lookup_rec(map, ctx->atomic->sync_view,
+		if (mdbox_map_view_lookup_rec(shard, ashard->sync_view,
 					      seq, &rec) < 0) {
 			/* map or ref extension is missing from the index.
 			   Just ignore the file entirely. (Don't try to
@@ -356,6 +381,14 @@ static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
 			break;
 		}
 
+		if (mdbox_map_get_shard(shard, rec.map_uid) != shard ||
+		    mdbox_map_get_shard(shard, rec.rec.file_id) != shard) {
+			/* the shard count has been changed. move the record
+			   to the shard that owns the file. */
+			mail_index_expunge(ashard->sync_trans, seq);
+			continue;
+		}
+
 		/* look up the rebuild msg record for this message based on
 		   the (file_id, offset, size) triplet */
 		search_msg.file_id = rec.rec.file_id;
@@ -366,7 +399,7 @@ static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
 		if (pos == NULL || (*pos)->map_uid != 0) {
 			/* map record points to nonexistent or
 			   a duplicate message. */
-			mail_index_expunge(ctx->atomic->sync_trans, seq);
+			mail_index_expunge(ashard->sync_trans, seq);
 		} else {
 			/* remember this message's map_uid */
 			(*pos)->map_uid = rec.map_uid;
@@ -374,7 +407,19 @@ static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
 				(*pos)->seen_zero_ref_in_map = TRUE;
 		}
 	}
-	rebuild_add_missing_map_uids(ctx, hdr->next_uid);
+}
+
+static void rebuild_apply_map(struct mdbox_storage_rebuild_context *ctx)
+{
+	struct mdbox_map *const *shardp;
+
+	array_sort(&ctx->msgs, mdbox_rebuild_msg_offset_cmp);
+	/* msgs now contains a list of all messages that exists in m.* files,
+	   sorted by file_id,offset */
+
+	array_foreach(&ctx->storage->map->shards, shardp)
+		rebuild_apply_map_shard(ctx, *shardp);
+	rebuild_add_missing_map_uids(ctx);
 
 	/* afterwards we're interested in looking up map_uids.
 	   re-sort the messages to make it easier. */
@@ -804,33 +849,36 @@ static int rebuild_handle_zero_refs(struct mdbox_storage_rebuild_context *ctx)
 	return 0;
 }
 
-static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
+static void
+rebuild_update_shard_refcounts(struct mdbox_storage_rebuild_context *ctx,
+			       struct mdbox_map *shard,
+			       struct mdbox_rebuild_msg **msgs,
+			       unsigned int count)
 {
+	struct mdbox_map_atomic_shard *ashard =
+		mdbox_map_atomic_get_shard(ctx->atomic, shard);
 	const struct mail_index_header *hdr;
 	const void *data;
-	struct mdbox_rebuild_msg **msgs;
 	const uint16_t *ref16_p;
 	uint32_t seq, map_uid;
-	unsigned int i, count;
+	unsigned int i;
 
 	/* update refcounts for existing map records */
-	msgs = array_get_modifiable(&ctx->msgs, &count);
-	hdr = mail_index_get_header(ctx->atomic->sync_view);
+	hdr = mail_index_get_header(ashard->sync_view);
 	for (seq = 1, i = 0; seq <= hdr->messages_count && i < count; seq++) {
-		mail_index_lookup_uid(ctx->atomic->sync_view, seq, &map_uid);
+		mail_index_lookup_uid(ashard->sync_view, seq, &map_uid);
 		if (map_uid != msgs[i]->map_uid) {
 			/* we've already expunged this map record */
 			i_assert(map_uid < msgs[i]->map_uid);
 			continue;
 		}
 
-		mail_index_lookup_ext(ctx->atomic->sync_view, seq,
-				      ctx->storage->map->ref_ext_id,
-				      &data, NULL);
+		mail_index_lookup_ext(ashard->sync_view, seq,
+				      shard->ref_ext_id, &data, NULL);
 		ref16_p = data;
 		if (ref16_p == NULL || *ref16_p != msgs[i]->refcount) {
-			mail_index_update_ext(ctx->atomic->sync_trans, seq,
-					      ctx->storage->map->ref_ext_id,
+			mail_index_update_ext(ashard->sync_trans, seq,
+					      shard->ref_ext_id,
 					      &msgs[i]->refcount, NULL);
 		}
 		i++;
@@ -838,15 +886,37 @@ static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
 
 	/* update refcounts for newly created map records */
 	for (; i < count; i++, seq++) {
-		mail_index_update_ext(ctx->atomic->sync_trans, seq,
-				      ctx->storage->map->ref_ext_id,
+		mail_index_update_ext(ashard->sync_trans, seq,
+				      shard->ref_ext_id,
 				      &msgs[i]->refcount, NULL);
 	}
 }
 
+static void rebuild_update_refcounts(struct mdbox_storage_rebuild_context *ctx)
+{
+	struct mdbox_map *shard;
+	struct mdbox_rebuild_msg **msgs;
+	unsigned int i, j, count;
+
+	/* msgs are sorted by map_uid, and each shard owns a contiguous
+	   range of map_uids */
+	msgs = array_get_modifiable(&ctx->msgs, &count);
+	for (i = 0; i < count; i = j) {
+		shard = mdbox_map_get_shard(ctx->storage->map,
+					    msgs[i]->map_uid);
+		for (j = i + 1; j < count; j++) {
+			if (mdbox_map_get_shard(shard, msgs[j]->map_uid) != shard)
+				break;
+		}
+		rebuild_update_shard_refcounts(ctx, shard, msgs + i, j - i);
+	}
+}
+
 static int rebuild_finish(struct mdbox_storage_rebuild_context *ctx)
 {
+	struct mdbox_map *const *shards;
 	struct mdbox_map_mail_index_header map_hdr;
+	unsigned int i, count;
 
 	i_assert(ctx->default_list != NULL);
 
@@ -854,14 +924,21 @@ static int rebuild_finish(struct mdbox_storage_rebuild_context *ctx)
 		return -1;
 	rebuild_update_refcounts(ctx);
 
-	/* update map header */
-	map_hdr = ctx->orig_map_hdr;
-	map_hdr.highest_file_id = ctx->highest_file_id;
-	map_hdr.rebuild_count = ++ctx->rebuild_count;
-
-	mail_index_update_header_ext(ctx->atomic->sync_trans,
-				     ctx->storage->map->map_ext_id,
-				     0, &map_hdr, sizeof(map_hdr));
+	/* update map headers. the rebuild count is kept only in the first
+	   shard. */
+	shards = array_get(&ctx->storage->map->shards, &count);
+	for (i = 0; i < count; i++) {
+		map_hdr = ctx->orig_map_hdrs[i];
+		map_hdr.highest_file_id = I_MAX(map_hdr.highest_file_id,
+						ctx->shard_highest_file_ids[i]);
+		if (i == 0)
+			map_hdr.rebuild_count = ++ctx->rebuild_count;
+
+		mail_index_update_header_ext(
+			mdbox_map_atomic_get_shard(ctx->atomic,
+						   shards[i])->sync_trans,
+			shards[i]->map_ext_id, 0, &map_hdr, sizeof(map_hdr));
+	}
 	return 0;
 }
 
@@ -903,32 +980,40 @@ mdbox_storage_rebuild_scan_dir(struct mdbox_storage_rebuild_context *ctx,
 
 static int mdbox_storage_rebuild_scan(struct mdbox_storage_rebuild_context *ctx)
 {
+	struct mdbox_map *const *shardp;
+	struct mdbox_map_mail_index_header *hdr;
 	const void *data;
 	size_t data_size;
 
 	if (mdbox_map_open_or_create(ctx->storage->map) < 0)
 		return -1;
 
-	/* begin by locking the map, so that other processes can't try to
-	   rebuild at the same time. */
+	/* begin by locking all the map shards, so that other processes
+	   can't try to rebuild at the same time. */
 	if (mdbox_map_atomic_lock(ctx->atomic, "mdbox storage rebuild") < 0)
 		return -1;
 
-	/* fsck the map just in case its UIDs are broken */
-	if (mail_index_fsck(ctx->storage->map->index) < 0) {
-		mail_storage_set_index_error(&ctx->storage->storage.storage,
-					     ctx->storage->map->index);
-		return -1;
-	}
+	array_foreach(&ctx->storage->map->shards, shardp) {
+		struct mdbox_map *shard = *shardp;
+
+		/* fsck the map just in case its UIDs are broken */
+		if (mail_index_fsck(shard->index) < 0) {
+			mail_storage_set_index_error(&ctx->storage->storage.storage,
+						     shard->index);
+			return -1;
+		}
 
-	/* get old map header */
-	mail_index_get_header_ext(ctx->atomic->sync_view,
-				  ctx->storage->map->map_ext_id,
-				  &data, &data_size);
-	i_zero(&ctx->orig_map_hdr);
-	memcpy(&ctx->orig_map_hdr, data,
-	       I_MIN(data_size, sizeof(ctx->orig_map_hdr)));
-	ctx->highest_file_id = ctx->orig_map_hdr.highest_file_id;
+		/* get old map header */
+		mail_index_get_header_ext(
+			mdbox_map_atomic_get_shard(ctx->atomic,
+						   shard)->sync_view,
+			shard->map_ext_id, &data, &data_size);
+		hdr = &ctx->orig_map_hdrs[shard->shard_idx];
+		i_zero(hdr);
+		memcpy(hdr, data, I_MIN(data_size, sizeof(*hdr)));
+		if (ctx->highest_file_id < hdr->highest_file_id)
+			ctx->highest_file_id = hdr->highest_file_id;
+	}
 
 	/* get storage rebuild counter after locking */
 	ctx->rebuild_count = mdbox_map_get_rebuild_count(ctx->storage->map);
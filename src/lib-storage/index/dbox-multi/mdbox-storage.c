@@ -47,6 +47,13 @@ int mdbox_storage_create(struct mail_storage *_storage,
 		*error_r = "mdbox: MAILBOXDIR must not be empty";
 		return -1;
 	}
+	if (storage->set->mdbox_map_shards == 0 ||
+	    storage->set->mdbox_map_shards > MDBOX_MAP_MAX_SHARDS) {
+		*error_r = t_strdup_printf(
+			"mdbox_map_shards must be 1..%u",
+			MDBOX_MAP_MAX_SHARDS);
+		return -1;
+	}
 
 	_storage->unique_root_dir =
 		p_strdup(_storage->pool, ns->list->set.root_dir);
@@ -8,6 +8,7 @@
 #define MDBOX_STORAGE_NAME "mdbox"
 #define MDBOX_DELETED_STORAGE_NAME "mdbox_deleted"
 #define MDBOX_GLOBAL_INDEX_PREFIX "dovecot.map.index"
+#define MDBOX_GLOBAL_INDEX_SHARD_FORMAT "dovecot.map.%u.index"
 #define MDBOX_GLOBAL_DIR_NAME "storage"
 #define MDBOX_MAIL_FILE_PREFIX "m."
 #define MDBOX_MAIL_FILE_FORMAT MDBOX_MAIL_FILE_PREFIX"%u"
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "nfs-workarounds.h"
+#include "file-copy.h"
 #include "fs-api.h"
 #include "dbox-save.h"
 #include "dbox-attachment.h"
@@ -9,6 +10,8 @@
 #include "sdbox-file.h"
 #include "mail-copy.h"
 
+#include <unistd.h>
+
 static int
 sdbox_file_copy_attachments(struct sdbox_file *src_file,
 			    struct sdbox_file *dest_file)
@@ -89,6 +92,32 @@ sdbox_file_copy_attachments(struct sdbox_file *src_file,
 	return ret;
 }
 
+static int
+sdbox_copy_finish(struct mail_save_context *_ctx, struct mail *mail,
+		  struct dbox_file *src_file, struct dbox_file *dest_file)
+{
+	struct dbox_save_context *ctx = DBOX_SAVECTX(_ctx);
+	int ret;
+
+	ret = sdbox_file_copy_attachments((struct sdbox_file *)src_file,
+					  (struct sdbox_file *)dest_file);
+	if (ret <= 0) {
+		(void)sdbox_file_unlink_aborted_save((struct sdbox_file *)dest_file);
+		dbox_file_unref(&src_file);
+		dbox_file_unref(&dest_file);
+		return ret;
+	}
+	((struct sdbox_file *)dest_file)->written_to_disk = TRUE;
+
+	dbox_save_add_to_index(ctx);
+	index_copy_cache_fields(_ctx, mail, ctx->seq);
+
+	sdbox_save_add_file(_ctx, dest_file);
+	mail_set_seq_saving(_ctx->dest_mail, ctx->seq);
+	dbox_file_unref(&src_file);
+	return 1;
+}
+
 static int
 sdbox_copy_hardlink(struct mail_save_context *_ctx, struct mail *mail)
 {
@@ -139,23 +168,89 @@ sdbox_copy_hardlink(struct mail_save_context *_ctx, struct mail *mail)
 		return ret;
 	}
 
-	ret = sdbox_file_copy_attachments((struct sdbox_file *)src_file,
-					  (struct sdbox_file *)dest_file);
+	return sdbox_copy_finish(_ctx, mail, src_file, dest_file);
+}
+
+static int
+sdbox_copy_clone_fd(struct mail *mail, struct dbox_file *src_file,
+		    struct dbox_file *dest_file)
+{
+	struct dbox_storage *storage = dest_file->storage;
+	int dest_fd, ret;
+
+	dest_fd = storage->v.file_create_fd(dest_file, dest_file->cur_path,
+					    TRUE);
+	if (dest_fd == -1)
+		return -1;
+
+	ret = file_clone_fd(src_file->fd, dest_fd);
+	if (ret < 0) {
+		if (ENOQUOTA(errno)) {
+			mail_storage_set_error(&storage->storage,
+				MAIL_ERROR_NOQUOTA, MAIL_ERRSTR_NO_QUOTA);
+		} else {
+			mail_set_critical(mail, "file_clone_fd(%s, %s) failed: %m",
+					  src_file->cur_path,
+					  dest_file->cur_path);
+		}
+	} else if (ret > 0 &&
+		   storage->storage.set->parsed_fsync_mode != FSYNC_MODE_NEVER &&
+		   fdatasync(dest_fd) < 0) {
+		mail_set_critical(mail, "fdatasync(%s) failed: %m",
+				  dest_file->cur_path);
+		ret = -1;
+	}
+	if (close(dest_fd) < 0) {
+		mail_set_critical(mail, "close(%s) failed: %m",
+				  dest_file->cur_path);
+		ret = -1;
+	}
+	if (ret <= 0)
+		i_unlink(dest_file->cur_path);
+	return ret;
+}
+
+static int
+sdbox_copy_clone(struct mail_save_context *_ctx, struct mail *mail)
+{
+	struct dbox_save_context *ctx = DBOX_SAVECTX(_ctx);
+	struct sdbox_mailbox *dest_mbox = SDBOX_MAILBOX(_ctx->transaction->box);
+	struct sdbox_mailbox *src_mbox;
+	struct dbox_file *src_file, *dest_file;
+	bool deleted;
+	int ret;
+
+	if (strcmp(mail->box->storage->name, SDBOX_STORAGE_NAME) == 0)
+		src_mbox = SDBOX_MAILBOX(mail->box);
+	else {
+		/* Source storage isn't sdbox, can't clone */
+		return 0;
+	}
+
+	src_file = sdbox_file_init(src_mbox, mail->uid);
+	dest_file = sdbox_file_init(dest_mbox, 0);
+
+	ctx->ctx.data.flags &= ~DBOX_INDEX_FLAG_ALT;
+
+	ret = dbox_file_open(src_file, &deleted);
+	if (ret > 0 && !deleted) {
+		/* keep the copy in alt storage, like with hard links */
+		if (dbox_file_is_in_alt(src_file) &&
+		    dest_file->alt_path != NULL) {
+			dest_file->cur_path = dest_file->alt_path;
+			ctx->ctx.data.flags |= DBOX_INDEX_FLAG_ALT;
+		}
+		ret = sdbox_copy_clone_fd(mail, src_file, dest_file);
+	} else if (ret > 0) {
+		/* let the fallback copying code handle the error */
+		ret = 0;
+	}
 	if (ret <= 0) {
-		(void)sdbox_file_unlink_aborted_save((struct sdbox_file *)dest_file);
 		dbox_file_unref(&src_file);
 		dbox_file_unref(&dest_file);
 		return ret;
 	}
-	((struct sdbox_file *)dest_file)->written_to_disk = TRUE;
-
-	dbox_save_add_to_index(ctx);
-	index_copy_cache_fields(_ctx, mail, ctx->seq);
-
-	sdbox_save_add_file(_ctx, dest_file);
-	mail_set_seq_saving(_ctx->dest_mail, ctx->seq);
-	dbox_file_unref(&src_file);
-	return 1;
+	return sdbox_copy_finish(_ctx, mail, src_file, dest_file);
 }
 
 int sdbox_copy(struct mail_save_context *_ctx, struct mail *mail)
@@ -168,8 +263,17 @@ int sdbox_copy(struct mail_save_context *_ctx, struct mail *mail)
 	i_assert((_t->flags & MAILBOX_TRANSACTION_FLAG_EXTERNAL) != 0);
 
 	ctx->finished = TRUE;
-	if (mail_storage_copy_can_use_hardlink(mail->box, &mbox->box) &&
-	    _ctx->data.guid == NULL) {
+	if (_ctx->data.guid != NULL) {
+		/* the GUID is stored in the file, so it can't be copied
+		   as-is */
+		return mail_storage_copy(_ctx, mail);
+	}
+	if (mbox->box.disable_reflink_copy_to) {
+		/* the mail must be written through mailbox_save_*(), which
+		   may modify it (e.g. compress or encrypt) */
+		return mail_storage_copy(_ctx, mail);
+	}
+	if (mail_storage_copy_can_use_hardlink(mail->box, &mbox->box)) {
 		T_BEGIN {
 			ret = sdbox_copy_hardlink(_ctx, mail);
 		} T_END;
@@ -179,7 +283,20 @@ int sdbox_copy(struct mail_save_context *_ctx, struct mail *mail)
 			return ret > 0 ? 0 : -1;
 		}
 
-		/* non-fatal hardlinking failure, try the slow way */
+		/* non-fatal hardlinking failure, try cloning */
 	}
+	/* clone into a new file created with the destination mailbox's
+	   permissions. this also works when hard links can't be used due to
+	   different permissions or link count limits. */
+	T_BEGIN {
+		ret = sdbox_copy_clone(_ctx, mail);
+	} T_END;
+
+	if (ret != 0) {
+		index_save_context_free(_ctx);
+		return ret > 0 ? 0 : -1;
+	}
+
+	/* cloning isn't supported, try the slow way */
 	return mail_storage_copy(_ctx, mail);
 }
@@ -326,6 +326,7 @@ int sdbox_file_move(struct dbox_file *file, bool alt_path)
 		return -1;
 
 	output = o_stream_create_fd_file(out_fd, 0, FALSE);
+	o_stream_file_set_copy_file_range(output, TRUE);
 	i_stream_seek(file->input, 0);
 	o_stream_nsend_istream(output, file->input);
 	if (o_stream_finish(output) < 0) {
@@ -0,0 +1,270 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "hex-binary.h"
+#include "md5.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "safe-mkstemp.h"
+#include "imapc-storage.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <utime.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* The directory is under the index root directory. The bodies of all the
+   user's mailboxes are in the same directory, so the imapc_body_cache_size
+   applies to the whole user. */
+#define IMAPC_BODY_CACHE_DIR_NAME "imapc-body-cache"
+/* When the cache becomes full, drop the least recently used bodies until
+   the cache is this percentage full. This way the directory doesn't need to
+   be scanned again on every following addition. */
+#define IMAPC_BODY_CACHE_CLEAN_PERCENTAGE 75
+
+struct imapc_body_cache_file {
+	const char *name;
+	time_t mtime;
+	uoff_t size;
+};
+
+static const char *imapc_body_cache_get_dir(struct imapc_mailbox *mbox)
+{
+	struct imapc_storage *storage = mbox->storage;
+	const char *index_dir;
+
+	if (storage->body_cache_dir != NULL)
+		return storage->body_cache_dir[0] == '\0' ? NULL :
+			storage->body_cache_dir;
+
+	if (storage->set->imapc_body_cache_size == 0 ||
+	    IMAPC_HAS_FEATURE(storage, IMAPC_FEATURE_ZIMBRA_WORKAROUNDS) ||
+	    !mailbox_list_get_root_path(mbox->box.list,
+					MAILBOX_LIST_PATH_TYPE_INDEX,
+					&index_dir)) {
+		/* disabled, or there are no index files (e.g. INDEX=MEMORY) */
+		storage->body_cache_dir = "";
+		return NULL;
+	}
+	storage->body_cache_dir = p_strconcat(storage->storage.pool, index_dir,
+					      "/"IMAPC_BODY_CACHE_DIR_NAME,
+					      NULL);
+	return storage->body_cache_dir;
+}
+
+static const char *
+imapc_body_cache_get_fname(struct imapc_mailbox *mbox, uint32_t uid)
+{
+	unsigned char name_hash[MD5_RESULTLEN];
+
+	/* <hash of mailbox name>.<uidvalidity>.<uid> */
+	md5_get_digest(mbox->box.vname, strlen(mbox->box.vname), name_hash);
+	return t_strdup_printf("%s.%u.%u",
+			       binary_to_hex(name_hash, sizeof(name_hash)),
+			       mbox->sync_uid_validity, uid);
+}
+
+static int
+imapc_body_cache_file_cmp(const struct imapc_body_cache_file *f1,
+			  const struct imapc_body_cache_file *f2)
+{
+	if (f1->mtime < f2->mtime)
+		return -1;
+	if (f1->mtime > f2->mtime)
+		return 1;
+	return strcmp(f1->name, f2->name);
+}
+
+static int
+imapc_body_cache_scan(struct imapc_storage *storage, const char *dir)
+{
+	ARRAY(struct imapc_body_cache_file) files;
+	struct imapc_body_cache_file *file;
+	struct dirent *d;
+	struct stat st;
+	DIR *dirp;
+	string_t *path;
+	size_t dir_len;
+	uoff_t used = 0, max_used;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			i_error("imapc: opendir(%s) failed: %m", dir);
+			return -1;
+		}
+		storage->body_cache_used = 0;
+		storage->body_cache_used_set = TRUE;
+		return 0;
+	}
+
+	t_array_init(&files, 128);
+	path = t_str_new(256);
+	str_printfa(path, "%s/", dir);
+	dir_len = str_len(path);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		str_truncate(path, dir_len);
+		str_append(path, d->d_name);
+		if (stat(str_c(path), &st) < 0) {
+			if (errno != ENOENT)
+				i_error("imapc: stat(%s) failed: %m", str_c(path));
+			continue;
+		}
+		file = array_append_space(&files);
+		file->name = t_strdup(d->d_name);
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		used += st.st_size;
+	}
+	if (closedir(dirp) < 0)
+		i_error("imapc: closedir(%s) failed: %m", dir);
+
+	if (used > storage->set->imapc_body_cache_size) {
+		/* drop the least recently used bodies */
+		max_used = storage->set->imapc_body_cache_size / 100 *
+			IMAPC_BODY_CACHE_CLEAN_PERCENTAGE;
+		array_sort(&files, imapc_body_cache_file_cmp);
+		array_foreach_modifiable(&files, file) {
+			if (used <= max_used)
+				break;
+			str_truncate(path, dir_len);
+			str_append(path, file->name);
+			if (i_unlink_if_exists(str_c(path)) < 0)
+				continue;
+			used -= file->size;
+		}
+	}
+	storage->body_cache_used = used;
+	storage->body_cache_used_set = TRUE;
+	return 0;
+}
+
+int imapc_body_cache_lookup(struct imapc_mailbox *mbox, uint32_t uid)
+{
+	const char *dir, *path;
+	int fd;
+
+	if (mbox->sync_uid_validity == 0 ||
+	    (dir = imapc_body_cache_get_dir(mbox)) == NULL)
+		return -1;
+
+	path = t_strdup_printf("%s/%s", dir,
+			       imapc_body_cache_get_fname(mbox, uid));
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_error("imapc: open(%s) failed: %m", path);
+		return -1;
+	}
+	/* update mtime so the least recently used bodies get dropped first */
+	if (utime(path, NULL) < 0 && errno != ENOENT)
+		i_error("imapc: utime(%s) failed: %m", path);
+	return fd;
+}
+
+static int
+imapc_body_cache_write(int fd, const char *path, int src_fd,
+		       const buffer_t *src_buf, uoff_t *size_r)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	uoff_t offset = 0;
+	ssize_t ret;
+
+	if (src_buf != NULL) {
+		if (write_full(fd, src_buf->data, src_buf->used) < 0) {
+			if (!ENOSPACE(errno))
+				i_error("imapc: write(%s) failed: %m", path);
+			return -1;
+		}
+		*size_r = src_buf->used;
+		return 0;
+	}
+
+	while ((ret = pread(src_fd, buf, sizeof(buf), offset)) > 0) {
+		if (write_full(fd, buf, ret) < 0) {
+			if (!ENOSPACE(errno))
+				i_error("imapc: write(%s) failed: %m", path);
+			return -1;
+		}
+		offset += ret;
+	}
+	if (ret < 0) {
+		i_error("imapc: pread(%s) failed: %m", path);
+		return -1;
+	}
+	*size_r = offset;
+	return 0;
+}
+
+void imapc_body_cache_add(struct imapc_mailbox *mbox, uint32_t uid,
+			  int src_fd, const buffer_t *src_buf)
+{
+	struct imapc_storage *storage = mbox->storage;
+	struct mailbox_permissions perm;
+	const char *dir, *path;
+	string_t *temp_path;
+	uoff_t size;
+	int fd;
+
+	i_assert(src_fd != -1 || src_buf != NULL);
+
+	if (mbox->sync_uid_validity == 0 ||
+	    (dir = imapc_body_cache_get_dir(mbox)) == NULL)
+		return;
+	if (!storage->body_cache_used_set) {
+		if (imapc_body_cache_scan(storage, dir) < 0)
+			return;
+	}
+
+	mailbox_list_get_root_permissions(mbox->box.list, &perm);
+	temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s/.temp.", dir);
+	fd = safe_mkstemp_hostpid(temp_path, perm.file_create_mode,
+				  (uid_t)-1, perm.file_create_gid);
+	if (fd == -1 && errno == ENOENT) {
+		if (mailbox_list_mkdir_root(mbox->box.list, dir,
+					    MAILBOX_LIST_PATH_TYPE_INDEX) < 0)
+			return;
+		str_truncate(temp_path, 0);
+		str_printfa(temp_path, "%s/.temp.", dir);
+		fd = safe_mkstemp_hostpid(temp_path, perm.file_create_mode,
+					  (uid_t)-1, perm.file_create_gid);
+	}
+	if (fd == -1) {
+		if (!ENOSPACE(errno)) {
+			i_error("imapc: safe_mkstemp(%s) failed: %m",
+				str_c(temp_path));
+		}
+		return;
+	}
+
+	path = t_strdup_printf("%s/%s", dir,
+			       imapc_body_cache_get_fname(mbox, uid));
+	if (imapc_body_cache_write(fd, str_c(temp_path), src_fd, src_buf,
+				   &size) < 0) {
+		i_close_fd(&fd);
+		i_unlink(str_c(temp_path));
+		return;
+	}
+	i_close_fd(&fd);
+	if (rename(str_c(temp_path), path) < 0) {
+		i_error("imapc: rename(%s, %s) failed: %m",
+			str_c(temp_path), path);
+		i_unlink(str_c(temp_path));
+		return;
+	}
+
+	storage->body_cache_used += size;
+	if (storage->body_cache_used > storage->set->imapc_body_cache_size) {
+		/* other processes may have added or removed bodies as well,
+		   so recalculate the size while dropping the old bodies */
+		(void)imapc_body_cache_scan(storage, dir);
+	}
+}
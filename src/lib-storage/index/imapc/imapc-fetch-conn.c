@@ -0,0 +1,176 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "strnum.h"
+#include "imap-arg.h"
+#include "imapc-mail.h"
+#include "imapc-storage.h"
+
+/* Extra connections that have the same mailbox EXAMINEd as the mailbox's own
+   connection. They are used only for sending UID FETCH commands, so that large
+   prefetches can be split across multiple connections and the remote server
+   can process them in parallel. Any untagged replies other than FETCH are
+   ignored, because the mailbox's own connection is responsible for keeping
+   the mailbox state in sync. */
+
+static void
+imapc_fetch_conn_untagged_fetch(struct imapc_fetch_connection *fetch_conn,
+				const struct imapc_untagged_reply *reply)
+{
+	struct imapc_mailbox *mbox = fetch_conn->mbox;
+	struct imapc_fetch_request *const *fetch_requestp;
+	struct imapc_mail *const *mailp;
+	const struct imap_arg *list;
+	const char *atom;
+	uint32_t uid = 0;
+	unsigned int i;
+
+	if (!imap_arg_get_list(reply->args, &list))
+		return;
+	for (i = 0; list[i].type != IMAP_ARG_EOL; i += 2) {
+		if (!imap_arg_get_atom(&list[i], &atom) ||
+		    list[i+1].type == IMAP_ARG_EOL)
+			return;
+		if (strcasecmp(atom, "UID") == 0) {
+			if (!imap_arg_get_atom(&list[i+1], &atom) ||
+			    str_to_uint32(atom, &uid) < 0)
+				return;
+			break;
+		}
+	}
+	if (uid == 0) {
+		/* unsolicited FETCH (e.g. flag change) without UID. the
+		   mailbox's own connection will see the change as well. */
+		return;
+	}
+
+	array_foreach(&mbox->fetch_requests, fetch_requestp) {
+		if ((*fetch_requestp)->fetch_conn != fetch_conn)
+			continue;
+		array_foreach(&(*fetch_requestp)->mails, mailp) {
+			struct imapc_mail *mail = *mailp;
+
+			if (mail->imail.mail.mail.uid == uid)
+				imapc_mail_fetch_update(mail, reply, list);
+		}
+	}
+}
+
+static void
+imapc_fetch_conn_untagged_cb(const struct imapc_untagged_reply *reply,
+			     void *context)
+{
+	struct imapc_fetch_connection *fetch_conn = context;
+	uint32_t uid_validity;
+
+	if (fetch_conn->failed)
+		return;
+
+	if (reply->resp_text_key != NULL &&
+	    strcasecmp(reply->resp_text_key, "UIDVALIDITY") == 0) {
+		if (reply->resp_text_value == NULL ||
+		    str_to_uint32(reply->resp_text_value, &uid_validity) < 0 ||
+		    uid_validity != fetch_conn->mbox->sync_uid_validity) {
+			/* the mailbox was recreated after we selected it.
+			   the mailbox's own connection will notice this. */
+			fetch_conn->failed = TRUE;
+		}
+	} else if (strcasecmp(reply->name, "FETCH") == 0 &&
+		   fetch_conn->selected) {
+		imapc_fetch_conn_untagged_fetch(fetch_conn, reply);
+	}
+}
+
+static void
+imapc_fetch_conn_examine_callback(const struct imapc_command_reply *reply,
+				  void *context)
+{
+	struct imapc_fetch_connection *fetch_conn = context;
+
+	if (reply->state == IMAPC_COMMAND_STATE_OK)
+		fetch_conn->selected = TRUE;
+	else {
+		if (!fetch_conn->closing) {
+			i_error("imapc: EXAMINE for an extra FETCH connection "
+				"failed: %s", reply->text_full);
+		}
+		fetch_conn->failed = TRUE;
+	}
+}
+
+static struct imapc_fetch_connection *
+imapc_fetch_conn_open(struct imapc_mailbox *mbox)
+{
+	struct imapc_fetch_connection *fetch_conn;
+	struct imapc_command *cmd;
+
+	fetch_conn = i_new(struct imapc_fetch_connection, 1);
+	fetch_conn->mbox = mbox;
+	fetch_conn->client_box =
+		imapc_client_mailbox_open(mbox->storage->client->client,
+					  fetch_conn);
+	imapc_client_mailbox_set_untagged_callback(fetch_conn->client_box,
+						   imapc_fetch_conn_untagged_cb);
+	array_append(&mbox->fetch_conns, &fetch_conn, 1);
+
+	/* FETCH commands are sent only after EXAMINE has finished */
+	cmd = imapc_client_mailbox_cmd(fetch_conn->client_box,
+				       imapc_fetch_conn_examine_callback,
+				       fetch_conn);
+	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_SELECT);
+	imapc_command_sendf(cmd, "EXAMINE %s",
+			    imapc_mailbox_get_remote_name(mbox));
+	return fetch_conn;
+}
+
+struct imapc_fetch_connection *
+imapc_fetch_conn_get(struct imapc_mailbox *mbox)
+{
+	struct imapc_fetch_connection *const *fetch_connp, *best = NULL;
+
+	if (mbox->storage->set->imapc_fetch_connections <= 1 ||
+	    mbox->sync_uid_validity == 0 || !mbox->selected)
+		return NULL;
+
+	if (!array_is_created(&mbox->fetch_conns))
+		i_array_init(&mbox->fetch_conns, 4);
+	array_foreach(&mbox->fetch_conns, fetch_connp) {
+		if ((*fetch_connp)->failed)
+			continue;
+		if (best == NULL ||
+		    (*fetch_connp)->pending_count < best->pending_count)
+			best = *fetch_connp;
+	}
+	if ((best == NULL || best->pending_count > 0) &&
+	    array_count(&mbox->fetch_conns) <
+	    mbox->storage->set->imapc_fetch_connections - 1) {
+		/* all the existing connections are busy - open a new one.
+		   failed connections are counted as well, so a broken server
+		   doesn't cause an ever-growing number of connections. */
+		return imapc_fetch_conn_open(mbox);
+	}
+	return best;
+}
+
+void imapc_fetch_conns_close(struct imapc_mailbox *mbox)
+{
+	struct imapc_fetch_connection *const *fetch_connp;
+
+	if (!array_is_created(&mbox->fetch_conns))
+		return;
+
+	/* closing aborts any pending commands, which calls their callbacks.
+	   keep the structs allocated until all of them are closed. */
+	array_foreach(&mbox->fetch_conns, fetch_connp) {
+		(*fetch_connp)->closing = TRUE;
+		imapc_client_mailbox_close(&(*fetch_connp)->client_box);
+	}
+	array_foreach(&mbox->fetch_conns, fetch_connp) {
+		struct imapc_fetch_connection *fetch_conn = *fetch_connp;
+
+		i_assert(fetch_conn->pending_count == 0);
+		i_free(fetch_conn);
+	}
+	array_free(&mbox->fetch_conns);
+}
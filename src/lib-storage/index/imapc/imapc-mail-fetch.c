@@ -12,9 +12,18 @@
 #include "imap-quote.h"
 #include "imap-bodystructure.h"
 #include "imap-resp-code.h"
+#include "imap-util.h"
 #include "imapc-mail.h"
 #include "imapc-storage.h"
 
+/* Don't split a FETCH across extra connections into parts with fewer mails
+   than this. Small FETCHes aren't worth the extra round-trips. */
+#define IMAPC_FETCH_SPLIT_MIN_MAILS 8
+
+static void
+imapc_mail_fetch_request_send(struct imapc_mailbox *mbox,
+			      struct imapc_fetch_request *request);
+
 static void imapc_mail_set_failure(struct imapc_mail *mail,
 				   const struct imapc_command_reply *reply)
 {
@@ -55,11 +64,31 @@ imapc_mail_fetch_callback(const struct imapc_command_reply *reply,
 			  void *context)
 {
 	struct imapc_fetch_request *request = context;
+	struct imapc_fetch_connection *fetch_conn = request->fetch_conn;
 	struct imapc_fetch_request *const *requests;
 	struct imapc_mail *const *mailp;
 	struct imapc_mailbox *mbox = NULL;
 	unsigned int i, count;
 
+	if (fetch_conn != NULL) {
+		i_assert(fetch_conn->pending_count > 0);
+		fetch_conn->pending_count--;
+
+		mailp = array_idx(&request->mails, 0);
+		mbox = IMAPC_MAILBOX((*mailp)->imail.mail.mail.box);
+		if ((reply->state != IMAPC_COMMAND_STATE_OK ||
+		     fetch_conn->failed) && !fetch_conn->closing &&
+		    mbox->client_box != NULL) {
+			/* the extra connection failed - retry using the
+			   mailbox's own connection, which also handles
+			   any errors properly. */
+			fetch_conn->failed = TRUE;
+			request->fetch_conn = NULL;
+			imapc_mail_fetch_request_send(mbox, request);
+			return;
+		}
+	}
+
 	array_foreach(&request->mails, mailp) {
 		struct imapc_mail *mail = *mailp;
 
@@ -81,6 +110,8 @@ imapc_mail_fetch_callback(const struct imapc_command_reply *reply,
 	i_assert(i < count);
 
 	array_free(&request->mails);
+	array_free(&request->uids);
+	i_free(request->fields);
 	i_free(request);
 
 	if (reply->state == IMAPC_COMMAND_STATE_OK)
@@ -140,36 +171,15 @@ headers_merge(pool_t pool, const char *const *h1, const char *const *h2)
 	return array_idx(&headers, 0);
 }
 
-static bool
-imapc_mail_try_merge_fetch(struct imapc_mailbox *mbox, string_t *str)
-{
-	const char *s1 = str_c(str);
-	const char *s2 = str_c(mbox->pending_fetch_cmd);
-	const char *p1, *p2;
-
-	i_assert(strncmp(s1, "UID FETCH ", 10) == 0);
-	i_assert(strncmp(s2, "UID FETCH ", 10) == 0);
-
-	/* skip over UID range */
-	p1 = strchr(s1+10, ' ');
-	p2 = strchr(s2+10, ' ');
-
-	if (null_strcmp(p1, p2) != 0)
-		return FALSE;
-	/* append the new UID to the pending FETCH UID range */
-	str_truncate(str, p1-s1);
-	str_insert(mbox->pending_fetch_cmd, p2-s2, ",");
-	str_insert(mbox->pending_fetch_cmd, p2-s2+1, str_c(str) + 10);
-	return TRUE;
-}
-
 static void
 imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 {
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
 
+	/* the pending FETCH can be merged with this one if they're fetching
+	   the same fields. */
 	if (mbox->pending_fetch_request != NULL &&
-	    !imapc_mail_try_merge_fetch(mbox, str)) {
+	    strcmp(str_c(mbox->pending_fetch_cmd), str_c(str)) != 0) {
 		/* send the previous FETCH and create a new one */
 		imapc_mail_fetch_flush(mbox);
 	}
@@ -177,10 +187,13 @@ imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 		mbox->pending_fetch_request =
 			i_new(struct imapc_fetch_request, 1);
 		i_array_init(&mbox->pending_fetch_request->mails, 4);
+		i_array_init(&mbox->pending_fetch_request->uids, 4);
 		i_assert(mbox->pending_fetch_cmd->used == 0);
 		str_append_str(mbox->pending_fetch_cmd, str);
 	}
 	array_append(&mbox->pending_fetch_request->mails, &mail, 1);
+	seq_range_array_add(&mbox->pending_fetch_request->uids,
+			    mail->imail.mail.mail.uid);
 
 	if (mbox->to_pending_fetch_send == NULL &&
 	    array_count(&mbox->pending_fetch_request->mails) >
@@ -250,7 +263,7 @@ imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 		fields |= MAIL_FETCH_STREAM_HEADER;
 
 	str = t_str_new(64);
-	str_printfa(str, "UID FETCH %u (", _mail->uid);
+	str_append_c(str, '(');
 	if ((fields & MAIL_FETCH_RECEIVED_DATE) != 0)
 		str_append(str, "INTERNALDATE ");
 	if ((fields & (MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE)) != 0)
@@ -369,9 +382,27 @@ void imapc_mail_try_init_stream_from_cache(struct imapc_mail *mail)
 {
 	struct mail *_mail = &mail->imail.mail.mail;
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(_mail->box);
+	struct imapc_mail_cache disk_cache;
 
-	if (mbox->prev_mail_cache.uid == _mail->uid)
+	if (mbox->prev_mail_cache.uid == _mail->uid) {
 		imapc_mail_cache_get(mail, &mbox->prev_mail_cache);
+		/* it was already added to the on-disk cache when the
+		   previous mail was closed */
+		mail->body_cached = mail->body_fetched;
+	}
+	if (mail->imail.data.stream != NULL || mail->body_fetched ||
+	    _mail->saving)
+		return;
+
+	i_zero(&disk_cache);
+	disk_cache.uid = _mail->uid;
+	disk_cache.fd = imapc_body_cache_lookup(mbox, _mail->uid);
+	if (disk_cache.fd != -1) {
+		imapc_mail_cache_get(mail, &disk_cache);
+		mail->body_cached = mail->body_fetched;
+		/* closes the fd if it wasn't used */
+		imapc_mail_cache_free(&disk_cache);
+	}
 }
 
 bool imapc_mail_prefetch(struct mail *_mail)
@@ -490,26 +521,96 @@ int imapc_mail_fetch(struct mail *_mail, enum mail_fetch_field fields,
 	return 0;
 }
 
-void imapc_mail_fetch_flush(struct imapc_mailbox *mbox)
+static void
+imapc_mail_fetch_request_send(struct imapc_mailbox *mbox,
+			      struct imapc_fetch_request *request)
 {
+	struct imapc_client_mailbox *client_box = mbox->client_box;
 	struct imapc_command *cmd;
+	string_t *str;
+
+	if (request->fetch_conn != NULL) {
+		client_box = request->fetch_conn->client_box;
+		request->fetch_conn->pending_count++;
+	}
+	cmd = imapc_client_mailbox_cmd(client_box, imapc_mail_fetch_callback,
+				       request);
+	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_RETRIABLE);
+
+	/* the UIDs are usually mostly sequential, so the UID set compresses
+	   well into ranges */
+	str = t_str_new(128);
+	str_append(str, "UID FETCH ");
+	imap_write_seq_range(str, &request->uids);
+	str_append_c(str, ' ');
+	str_append(str, request->fields);
+	imapc_command_send(cmd, str_c(str));
+}
+
+static void
+imapc_mail_fetch_split(struct imapc_mailbox *mbox,
+		       struct imapc_fetch_request *request)
+{
+	struct imapc_fetch_request *part;
+	struct imapc_fetch_connection *fetch_conn;
+	struct imapc_mail *const *mails;
+	unsigned int i, p, parts, count, start;
+	bool split = FALSE;
+
+	mails = array_get(&request->mails, &count);
+	parts = I_MIN(mbox->storage->set->imapc_fetch_connections,
+		      count / IMAPC_FETCH_SPLIT_MIN_MAILS);
+
+	/* the first part stays in the original request and is sent to the
+	   mailbox's own connection. it's usually the one needed first. */
+	for (p = parts - 1; p > 0; p--) {
+		if ((fetch_conn = imapc_fetch_conn_get(mbox)) == NULL)
+			break;
+		start = count * p / parts;
+
+		part = i_new(struct imapc_fetch_request, 1);
+		part->fields = i_strdup(request->fields);
+		part->fetch_conn = fetch_conn;
+		i_array_init(&part->mails, count - start);
+		i_array_init(&part->uids, 4);
+		for (i = start; i < count; i++) {
+			array_append(&part->mails, &mails[i], 1);
+			seq_range_array_add(&part->uids,
+					    mails[i]->imail.mail.mail.uid);
+		}
+		array_delete(&request->mails, start, count - start);
+		count = start;
+		array_append(&mbox->fetch_requests, &part, 1);
+		imapc_mail_fetch_request_send(mbox, part);
+		split = TRUE;
+	}
+	if (!split)
+		return;
+
+	array_clear(&request->uids);
+	for (i = 0; i < count; i++)
+		seq_range_array_add(&request->uids, mails[i]->imail.mail.mail.uid);
+}
+
+void imapc_mail_fetch_flush(struct imapc_mailbox *mbox)
+{
+	struct imapc_fetch_request *request = mbox->pending_fetch_request;
 	struct imapc_mail *const *mailp;
 
-	if (mbox->pending_fetch_request == NULL) {
+	if (request == NULL) {
 		i_assert(mbox->to_pending_fetch_send == NULL);
 		return;
 	}
 
-	array_foreach(&mbox->pending_fetch_request->mails, mailp)
+	array_foreach(&request->mails, mailp)
 		(*mailp)->fetch_sent = TRUE;
+	request->fields = i_strdup(str_c(mbox->pending_fetch_cmd));
 
-	cmd = imapc_client_mailbox_cmd(mbox->client_box,
-				       imapc_mail_fetch_callback,
-				       mbox->pending_fetch_request);
-	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_RETRIABLE);
-	array_append(&mbox->fetch_requests, &mbox->pending_fetch_request, 1);
-
-	imapc_command_send(cmd, str_c(mbox->pending_fetch_cmd));
+	if (mbox->storage->set->imapc_fetch_connections > 1 &&
+	    array_count(&request->mails) >= IMAPC_FETCH_SPLIT_MIN_MAILS*2)
+		imapc_mail_fetch_split(mbox, request);
+	array_append(&mbox->fetch_requests, &request, 1);
+	imapc_mail_fetch_request_send(mbox, request);
 
 	mbox->pending_fetch_request = NULL;
 	timeout_remove(&mbox->to_pending_fetch_send);
@@ -432,6 +432,8 @@ static void imapc_mail_close(struct mail *_mail)
 	struct imapc_mail *mail = IMAPC_MAIL(_mail);
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(_mail->box);
 	struct imapc_mail_cache *cache = &mbox->prev_mail_cache;
+	/* index_mail_close() resets the uid */
+	uint32_t uid = _mail->uid;
 
 	if (mail->fetch_count > 0) {
 		imapc_mail_fetch_flush(mbox);
@@ -442,9 +444,12 @@ static void imapc_mail_close(struct mail *_mail)
 	index_mail_close(_mail);
 
 	mail->fetching_headers = NULL;
+	if (mail->body_fetched && !mail->body_cached) T_BEGIN {
+		imapc_body_cache_add(mbox, uid, mail->fd, mail->body);
+	} T_END;
 	if (mail->body_fetched) {
 		imapc_mail_cache_free(cache);
-		cache->uid = _mail->uid;
+		cache->uid = uid;
 		if (mail->fd != -1) {
 			cache->fd = mail->fd;
 			mail->fd = -1;
@@ -457,6 +462,7 @@ static void imapc_mail_close(struct mail *_mail)
 	buffer_free(&mail->body);
 	mail->header_fetched = FALSE;
 	mail->body_fetched = FALSE;
+	mail->body_cached = FALSE;
 
 	i_assert(mail->fetch_count == 0);
 }
@@ -20,6 +20,8 @@ struct imapc_mail {
 	buffer_t *body;
 	bool header_fetched;
 	bool body_fetched;
+	/* body is already in the on-disk body cache */
+	bool body_cached;
 	bool header_list_fetched;
 	bool fetch_ignore_if_missing;
 	bool fetch_failed;
@@ -33,6 +33,8 @@ static const struct setting_define imapc_setting_defines[] = {
 	DEF(SET_UINT, imapc_connection_retry_count),
 	DEF(SET_TIME_MSECS, imapc_connection_retry_interval),
 	DEF(SET_SIZE, imapc_max_line_length),
+	DEF(SET_SIZE, imapc_body_cache_size),
+	DEF(SET_UINT, imapc_fetch_connections),
 
 	DEF(SET_STR, pop3_deleted_flag),
 
@@ -59,6 +61,8 @@ static const struct imapc_settings imapc_default_settings = {
 	.imapc_connection_retry_count = 1,
 	.imapc_connection_retry_interval = 1000,
 	.imapc_max_line_length = 0,
+	.imapc_body_cache_size = 0,
+	.imapc_fetch_connections = 1,
 
 	.pop3_deleted_flag = ""
 };
@@ -166,6 +170,10 @@ static bool imapc_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 		*error_r = "imapc_max_idle_time must not be 0";
 		return FALSE;
 	}
+	if (set->imapc_fetch_connections == 0) {
+		*error_r = "imapc_fetch_connections must not be 0";
+		return FALSE;
+	}
 	if (imapc_settings_parse_features(set, error_r) < 0)
 		return FALSE;
 	return TRUE;
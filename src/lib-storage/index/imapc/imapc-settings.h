@@ -48,6 +48,8 @@ struct imapc_settings {
 	unsigned int imapc_connection_retry_count;
 	unsigned int imapc_connection_retry_interval;
 	uoff_t imapc_max_line_length;
+	uoff_t imapc_body_cache_size;
+	unsigned int imapc_fetch_connections;
 
 	const char *pop3_deleted_flag;
 
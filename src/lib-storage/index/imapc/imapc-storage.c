@@ -397,7 +397,7 @@ imapc_storage_create(struct mail_storage *_storage,
 	_storage->unique_root_dir = p_strdup_printf(_storage->pool,
 						    "%s%s://(%s|%s):%s@%s:%u/%s mechs:%s features:%s "
 						    "rawlog:%s cmd_timeout:%u maxidle:%u maxline:%"PRIuSIZE_T"u "
-						    "pop3delflg:%s root_dir:%s",
+						    "bodycache:%"PRIuUOFF_T" fetchconns:%u pop3delflg:%s root_dir:%s",
 						    storage->set->imapc_ssl,
 						    storage->set->imapc_ssl_verify ? "(verify)" : "",
 						    storage->set->imapc_user,
@@ -412,6 +412,8 @@ imapc_storage_create(struct mail_storage *_storage,
 						    storage->set->imapc_cmd_timeout,
 						    storage->set->imapc_max_idle_time,
 						    (size_t) storage->set->imapc_max_line_length,
+						    storage->set->imapc_body_cache_size,
+						    storage->set->imapc_fetch_connections,
 						    storage->set->pop3_deleted_flag,
 						    ns->list->set.root_dir);
 
@@ -776,6 +778,7 @@ static void imapc_mailbox_close(struct mailbox *box)
 
 	(void)imapc_mailbox_commit_delayed_trans(mbox, &changes);
 	imapc_mail_fetch_flush(mbox);
+	imapc_fetch_conns_close(mbox);
 	if (mbox->client_box != NULL)
 		imapc_client_mailbox_close(&mbox->client_box);
 	if (array_is_created(&mbox->rseq_modseqs))
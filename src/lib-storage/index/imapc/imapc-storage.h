@@ -75,7 +75,14 @@ struct imapc_storage {
 
 	ARRAY(struct imapc_namespace) remote_namespaces;
 
+	/* directory for bodies cached across sessions, "" if disabled. It's
+	   shared by all the mailboxes, so imapc_body_cache_size limits the
+	   user's total cache size. */
+	const char *body_cache_dir;
+	uoff_t body_cache_used;
+
 	bool namespaces_requested:1;
+	bool body_cache_used_set:1;
 };
 
 struct imapc_mail_cache {
@@ -86,8 +93,25 @@ struct imapc_mail_cache {
 	buffer_t *buf;
 };
 
+struct imapc_fetch_connection {
+	struct imapc_mailbox *mbox;
+	struct imapc_client_mailbox *client_box;
+	/* number of FETCH commands waiting for a reply */
+	unsigned int pending_count;
+
+	bool selected:1;
+	bool failed:1;
+	bool closing:1;
+};
+
 struct imapc_fetch_request {
 	ARRAY(struct imapc_mail *) mails;
+	ARRAY_TYPE(seq_range) uids;
+	/* the "(fields)" part of the FETCH command */
+	char *fields;
+	/* extra connection where the FETCH was sent to, or NULL if it was
+	   sent to the mailbox's own connection */
+	struct imapc_fetch_connection *fetch_conn;
 };
 
 struct imapc_mailbox {
@@ -103,12 +127,15 @@ struct imapc_mailbox {
 	struct timeout *to_idle_check, *to_idle_delay;
 
 	ARRAY(struct imapc_fetch_request *) fetch_requests;
-	/* if non-empty, contains the latest FETCH command we're going to be
-	   sending soon (but still waiting to see if we can increase its
-	   UID range) */
+	/* if non-empty, contains the fetched fields of the latest FETCH
+	   command we're going to be sending soon (but still waiting to see if
+	   we can increase its UID range) */
 	string_t *pending_fetch_cmd;
 	struct imapc_fetch_request *pending_fetch_request;
 	struct timeout *to_pending_fetch_send;
+	/* extra connections for splitting large FETCHes, up to
+	   imapc_fetch_connections-1 of them */
+	ARRAY(struct imapc_fetch_connection *) fetch_conns;
 
 	ARRAY(struct imapc_mailbox_event_callback) untagged_callbacks;
 	ARRAY(struct imapc_mailbox_event_callback) resp_text_callbacks;
@@ -179,6 +206,18 @@ void imapc_transaction_save_rollback(struct mail_save_context *ctx);
 void imapc_mailbox_run(struct imapc_mailbox *mbox);
 void imapc_mailbox_run_nofetch(struct imapc_mailbox *mbox);
 void imapc_mail_cache_free(struct imapc_mail_cache *cache);
+/* Returns fd to the mail's body in the user's imapc_body_cache_size limited
+   on-disk cache, or -1 if it isn't cached. */
+int imapc_body_cache_lookup(struct imapc_mailbox *mbox, uint32_t uid);
+/* Add the fetched mail body from either src_fd or src_buf to the on-disk
+   cache, dropping the least recently used bodies if the cache is full. */
+void imapc_body_cache_add(struct imapc_mailbox *mbox, uint32_t uid,
+			  int src_fd, const buffer_t *src_buf);
+/* Returns the least busy extra connection for sending a FETCH, opening a new
+   one if needed, or NULL if no extra connections can be used. */
+struct imapc_fetch_connection *
+imapc_fetch_conn_get(struct imapc_mailbox *mbox);
+void imapc_fetch_conns_close(struct imapc_mailbox *mbox);
 int imapc_mailbox_select(struct imapc_mailbox *mbox);
 
 bool imapc_mailbox_has_modseqs(struct imapc_mailbox *mbox);
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "ioloop.h"
 #include "nfs-workarounds.h"
+#include "file-copy.h"
 #include "maildir-storage.h"
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
@@ -12,16 +13,18 @@
 #include "index-mail.h"
 #include "mail-copy.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
-struct hardlink_ctx {
-	const char *dest_path;
+struct copy_file_ctx {
+	struct maildir_mailbox *dest_mbox;
+	const char *dest_fname, *dest_path;
 	bool success:1;
 };
 
 static int do_hardlink(struct maildir_mailbox *mbox, const char *path,
-		       struct hardlink_ctx *ctx)
+		       struct copy_file_ctx *ctx)
 {
 	int ret;
 
@@ -55,15 +58,86 @@ static int do_hardlink(struct maildir_mailbox *mbox, const char *path,
 }
 
 static int
-maildir_copy_hardlink(struct mail_save_context *ctx, struct mail *mail)
+do_clone_fd(struct maildir_mailbox *mbox, const char *path, int src_fd,
+	    struct copy_file_ctx *ctx)
+{
+	struct maildir_mailbox *dest_mbox = ctx->dest_mbox;
+	struct mail_storage *storage = &dest_mbox->storage->storage;
+	const char *tmp_dir, *dest_path;
+	int dest_fd, ret;
+
+	tmp_dir = t_strconcat(mailbox_get_path(&dest_mbox->box), "/tmp", NULL);
+	dest_fd = maildir_create_tmp(dest_mbox, tmp_dir, &ctx->dest_fname);
+	if (dest_fd == -1)
+		return -1;
+	dest_path = t_strdup_printf("%s/%s", tmp_dir, ctx->dest_fname);
+
+	ret = file_clone_fd(src_fd, dest_fd);
+	if (ret < 0) {
+		if (ENOQUOTA(errno)) {
+			mail_storage_set_error(storage, MAIL_ERROR_NOQUOTA,
+					       MAIL_ERRSTR_NO_QUOTA);
+		} else {
+			mailbox_set_critical(&mbox->box,
+				"file_clone_fd(%s, %s) failed: %m",
+				path, dest_path);
+		}
+	} else if (ret > 0 &&
+		   storage->set->parsed_fsync_mode != FSYNC_MODE_NEVER &&
+		   fsync(dest_fd) < 0) {
+		mailbox_set_critical(&dest_mbox->box,
+				     "fsync(%s) failed: %m", dest_path);
+		ret = -1;
+	}
+	if (close(dest_fd) < 0) {
+		mailbox_set_critical(&dest_mbox->box,
+				     "close(%s) failed: %m", dest_path);
+		ret = -1;
+	}
+	if (ret <= 0)
+		i_unlink(dest_path);
+	return ret;
+}
+
+static int do_clone(struct maildir_mailbox *mbox, const char *path,
+		    struct copy_file_ctx *ctx)
+{
+	int src_fd, ret;
+
+	src_fd = open(path, O_RDONLY);
+	if (src_fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		if (errno == EACCES || errno == EPERM) {
+			/* we can't read the source file directly, but
+			   mail_storage_copy() may still be able to */
+			return 1;
+		}
+		mailbox_set_critical(&mbox->box, "open(%s) failed: %m", path);
+		return -1;
+	}
+	ret = do_clone_fd(mbox, path, src_fd, ctx);
+	i_close_fd(&src_fd);
+	if (ret < 0)
+		return -1;
+
+	/* if cloning isn't supported, fallback to standard copying */
+	ctx->success = ret > 0;
+	return 1;
+}
+
+static int
+maildir_copy_file(struct mail_save_context *ctx, struct mail *mail,
+		  bool clone)
 {
 	struct maildir_mailbox *dest_mbox = MAILDIR_MAILBOX(ctx->transaction->box);
 	struct maildir_mailbox *src_mbox;
 	struct maildir_filename *mf;
-	struct hardlink_ctx do_ctx;
+	struct copy_file_ctx do_ctx;
 	const char *path, *guid, *dest_fname;
 	uoff_t vsize, size;
 	enum mail_lookup_abort old_abort;
+	int ret;
 
 	if (strcmp(mail->box->storage->name, MAILDIR_STORAGE_NAME) == 0)
 		src_mbox = MAILDIR_MAILBOX(mail->box);
@@ -75,33 +149,43 @@ maildir_copy_hardlink(struct mail_save_context *ctx, struct mail *mail)
 		return 0;
 	}
 
-	/* hard link to tmp/ with a newly generated filename and later when we
-	   have uidlist locked, move it to new/cur. */
-	dest_fname = maildir_filename_generate();
+	/* hard link or clone to tmp/ with a newly generated filename and later
+	   when we have uidlist locked, move it to new/cur. */
 	i_zero(&do_ctx);
-	do_ctx.dest_path =
-		t_strdup_printf("%s/tmp/%s", mailbox_get_path(&dest_mbox->box),
-				dest_fname);
+	do_ctx.dest_mbox = dest_mbox;
+	if (!clone) {
+		do_ctx.dest_fname = maildir_filename_generate();
+		do_ctx.dest_path = t_strdup_printf("%s/tmp/%s",
+			mailbox_get_path(&dest_mbox->box), do_ctx.dest_fname);
+	}
 	if (src_mbox != NULL) {
 		/* maildir */
-		if (maildir_file_do(src_mbox, mail->uid,
-				    do_hardlink, &do_ctx) < 0)
-			return -1;
+		if (clone)
+			ret = maildir_file_do(src_mbox, mail->uid,
+					      do_clone, &do_ctx);
+		else
+			ret = maildir_file_do(src_mbox, mail->uid,
+					      do_hardlink, &do_ctx);
 	} else {
 		/* raw / lda */
 		if (mail_get_special(mail, MAIL_FETCH_STORAGE_ID,
 				     &path) < 0 || *path == '\0')
 			return 0;
-		if (do_hardlink(dest_mbox, path, &do_ctx) < 0)
-			return -1;
+		if (clone)
+			ret = do_clone(dest_mbox, path, &do_ctx);
+		else
+			ret = do_hardlink(dest_mbox, path, &do_ctx);
 	}
+	if (ret < 0)
+		return -1;
 
 	if (!do_ctx.success) {
-		/* couldn't copy with hardlinking, fallback to copying */
+		/* couldn't copy the file, fallback to copying */
 		return 0;
 	}
+	dest_fname = do_ctx.dest_fname;
 
-	/* hardlinked to tmp/, treat as normal copied mail */
+	/* hardlinked or cloned to tmp/, treat as normal copied mail */
 	mf = maildir_save_add(ctx, dest_fname, mail);
 	if (mail_get_special(mail, MAIL_FETCH_GUID, &guid) == 0) {
 		if (*guid != '\0')
@@ -128,10 +212,16 @@ int maildir_copy(struct mail_save_context *ctx, struct mail *mail)
 
 	i_assert((_t->flags & MAILBOX_TRANSACTION_FLAG_EXTERNAL) != 0);
 
-	if (mbox->storage->set->maildir_copy_with_hardlinks &&
-	    mail_storage_copy_can_use_hardlink(mail->box, &mbox->box)) {
+	if (!mbox->storage->set->maildir_copy_with_hardlinks ||
+	    mbox->box.disable_reflink_copy_to) {
+		/* the mail must be written through mailbox_save_*(), which
+		   may modify it (e.g. compress or encrypt) */
+		return mail_storage_copy(ctx, mail);
+	}
+
+	if (mail_storage_copy_can_use_hardlink(mail->box, &mbox->box)) {
 		T_BEGIN {
-			ret = maildir_copy_hardlink(ctx, mail);
+			ret = maildir_copy_file(ctx, mail, FALSE);
 		} T_END;
 
 		if (ret != 0) {
@@ -139,8 +229,21 @@ int maildir_copy(struct mail_save_context *ctx, struct mail *mail)
 			return ret > 0 ? 0 : -1;
 		}
 
-		/* non-fatal hardlinking failure, try the slow way */
+		/* non-fatal hardlinking failure, try cloning */
+	}
+
+	/* clone into a new file created with the destination mailbox's
+	   permissions. this also works when hard links can't be used due to
+	   different permissions or link count limits. */
+	T_BEGIN {
+		ret = maildir_copy_file(ctx, mail, TRUE);
+	} T_END;
+
+	if (ret != 0) {
+		index_save_context_free(ctx);
+		return ret > 0 ? 0 : -1;
 	}
 
+	/* cloning isn't supported, try the slow way */
 	return mail_storage_copy(ctx, mail);
 }
@@ -339,8 +339,8 @@ const char *maildir_save_file_get_path(struct mailbox_transaction_context *t,
 	return maildir_mf_get_path(save_ctx, mf);
 }
 
-static int maildir_create_tmp(struct maildir_mailbox *mbox, const char *dir,
-			      const char **fname_r)
+int maildir_create_tmp(struct maildir_mailbox *mbox, const char *dir,
+		       const char **fname_r)
 {
 	struct mailbox *box = &mbox->box;
 	const struct mailbox_permissions *perm = mailbox_get_permissions(box);
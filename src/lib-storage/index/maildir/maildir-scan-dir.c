@@ -0,0 +1,86 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#define _GNU_SOURCE /* for getdents64() */
+#include "lib.h"
+#include "maildir-scan-dir.h"
+
+#if defined(HAVE_GETDENTS64) && defined(HAVE_DIRFD)
+#  define MAILDIR_USE_GETDENTS64
+#endif
+
+void maildir_scan_dir_reader_init(struct maildir_scan_dir_reader *reader_r,
+				  DIR *dirp, size_t buf_size)
+{
+	i_zero(reader_r);
+	reader_r->dirp = dirp;
+#ifdef MAILDIR_USE_GETDENTS64
+	if (buf_size > 0) {
+		reader_r->buf_size = buf_size;
+		reader_r->buf = i_malloc(buf_size);
+	}
+#endif
+}
+
+void maildir_scan_dir_reader_deinit(struct maildir_scan_dir_reader *reader)
+{
+	i_free(reader->buf);
+}
+
+#ifdef MAILDIR_USE_GETDENTS64
+static const char *
+maildir_scan_dir_next_getdents(struct maildir_scan_dir_reader *reader)
+{
+	const struct dirent64 *dp;
+	ssize_t ret;
+
+	if (reader->buf_pos == reader->buf_used) {
+		ret = getdents64(dirfd(reader->dirp), reader->buf,
+				 reader->buf_size);
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = 0;
+			return NULL;
+		}
+		reader->buf_pos = 0;
+		reader->buf_used = ret;
+	}
+	dp = (const void *)(reader->buf + reader->buf_pos);
+	reader->buf_pos += dp->d_reclen;
+	return dp->d_name;
+}
+#endif
+
+static const char *
+maildir_scan_dir_next_entry(struct maildir_scan_dir_reader *reader)
+{
+	struct dirent *dp;
+
+#ifdef MAILDIR_USE_GETDENTS64
+	if (reader->buf != NULL) {
+		const char *fname;
+
+		fname = maildir_scan_dir_next_getdents(reader);
+		if (fname != NULL || errno != ENOSYS || reader->buf_used > 0)
+			return fname;
+		/* getdents64() isn't allowed, e.g. by a seccomp filter.
+		   nothing was read yet, so readdir() can take over. */
+		i_free(reader->buf);
+		errno = 0;
+	}
+#endif
+	dp = readdir(reader->dirp);
+	return dp == NULL ? NULL : dp->d_name;
+}
+
+const char *maildir_scan_dir_next(struct maildir_scan_dir_reader *reader)
+{
+	const char *fname;
+
+	while ((fname = maildir_scan_dir_next_entry(reader)) != NULL) {
+		if (fname[0] != '.' ||
+		    (fname[1] != '\0' &&
+		     (fname[1] != '.' || fname[2] != '\0')))
+			break;
+	}
+	return fname;
+}
@@ -0,0 +1,30 @@
+#ifndef MAILDIR_SCAN_DIR_H
+#define MAILDIR_SCAN_DIR_H
+
+#include <dirent.h>
+
+/* Read this many bytes of directory entries with one getdents64() call.
+   This is enough for a few thousand maildir filenames. */
+#define MAILDIR_SCAN_DIR_BUF_SIZE (1024*256)
+
+struct maildir_scan_dir_reader {
+	DIR *dirp;
+	unsigned char *buf;
+	size_t buf_size, buf_pos, buf_used;
+};
+
+/* Start reading filenames from dirp, which must not have been read yet. If
+   buf_size is non-zero and getdents64() is available, the entries are read
+   directly into a buffer of that size instead of going through readdir()'s
+   small one. This avoids many syscalls with large cur/ directories. */
+void maildir_scan_dir_reader_init(struct maildir_scan_dir_reader *reader_r,
+				  DIR *dirp, size_t buf_size);
+/* Free the buffer. The DIR isn't closed. */
+void maildir_scan_dir_reader_deinit(struct maildir_scan_dir_reader *reader);
+
+/* Returns the next filename in the directory, skipping "." and "..".
+   Returns NULL with errno=0 at the end of directory, or with errno set on
+   failure. The returned name is valid only until the next call. */
+const char *maildir_scan_dir_next(struct maildir_scan_dir_reader *reader);
+
+#endif
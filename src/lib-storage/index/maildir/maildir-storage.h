@@ -121,6 +121,10 @@ int maildir_save_continue(struct mail_save_context *ctx);
 int maildir_save_finish(struct mail_save_context *ctx);
 void maildir_save_cancel(struct mail_save_context *ctx);
 
+/* Create a new file with a unique filename into dir (tmp/) using the
+   mailbox's permissions. Returns fd, or -1 on error. */
+int maildir_create_tmp(struct maildir_mailbox *mbox, const char *dir,
+		       const char **fname_r);
 struct maildir_filename *
 maildir_save_add(struct mail_save_context *_ctx, const char *tmp_fname,
 		 struct mail *src_mail) ATTR_NULL(3);
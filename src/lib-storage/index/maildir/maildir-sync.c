@@ -181,6 +181,7 @@
 #include "maildir-storage.h"
 #include "maildir-uidlist.h"
 #include "maildir-filename.h"
+#include "maildir-scan-dir.h"
 #include "maildir-sync.h"
 
 #include <stdio.h>
@@ -401,10 +402,10 @@ static int
 maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		 enum maildir_scan_why why)
 {
-	const char *path;
+	const char *path, *fname;
 	DIR *dirp;
+	struct maildir_scan_dir_reader reader;
 	string_t *src, *dest;
-	struct dirent *dp;
 	struct stat st;
 	enum maildir_uidlist_rec_flag flags;
 	unsigned int time_diff, i, readdir_count = 0, move_count = 0;
@@ -466,28 +467,28 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		((ctx->mbox->box.flags & MAILBOX_FLAG_DROP_RECENT) != 0 ||
 		 ctx->mbox->storage->set->maildir_empty_new);
 
+	maildir_scan_dir_reader_init(&reader, dirp, MAILDIR_SCAN_DIR_BUF_SIZE);
 	errno = 0;
-	for (; (dp = readdir(dirp)) != NULL; errno = 0) {
-		if (dp->d_name[0] == '.')
+	for (; (fname = maildir_scan_dir_next(&reader)) != NULL; errno = 0) {
+		if (fname[0] == '.')
 			continue;
 
-		if (dp->d_name[0] == MAILDIR_INFO_SEP) {
+		if (fname[0] == MAILDIR_INFO_SEP) {
 			/* don't even try to use file with empty base name */
-			if (maildir_rename_empty_basename(ctx, path,
-							  dp->d_name) < 0)
+			if (maildir_rename_empty_basename(ctx, path, fname) < 0)
 				break;
 			continue;
 		}
 
 		flags = 0;
 		if (move_new) {
-			i_assert(dp->d_name[0] != '\0');
+			i_assert(fname[0] != '\0');
 
 			str_truncate(src, 0);
 			str_truncate(dest, 0);
-			str_printfa(src, "%s/%s", ctx->new_dir, dp->d_name);
-			str_printfa(dest, "%s/%s", ctx->cur_dir, dp->d_name);
-			if (strchr(dp->d_name, MAILDIR_INFO_SEP) == NULL) {
+			str_printfa(src, "%s/%s", ctx->new_dir, fname);
+			str_printfa(dest, "%s/%s", ctx->cur_dir, fname);
+			if (strchr(fname, MAILDIR_INFO_SEP) == NULL) {
 				str_append(dest, MAILDIR_FLAGS_FULL_SEP);
 			}
 			if (rename(str_c(src), str_c(dest)) == 0) {
@@ -525,7 +526,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 			maildir_sync_notify(ctx);
 
 		ret = maildir_uidlist_sync_next(ctx->uidlist_sync_ctx,
-						dp->d_name, flags);
+						fname, flags);
 		if (ret <= 0) {
 			if (ret < 0)
 				break;
@@ -533,7 +534,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 			/* possibly duplicate - try fixing it */
 			T_BEGIN {
 				ret = maildir_fix_duplicate(ctx, path,
-							    dp->d_name);
+							    fname);
 			} T_END;
 			if (ret < 0)
 				break;
@@ -554,6 +555,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		ret = -1;
 	}
 
+	maildir_scan_dir_reader_deinit(&reader);
 	if (closedir(dirp) < 0) {
 		mailbox_set_critical(&ctx->mbox->box,
 				     "closedir(%s) failed: %m", path);
@@ -22,10 +22,32 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is an optional binary format, which is written instead
+   of version 3 when maildir_binary_uidlist=yes. Existing files are
+   converted between the two formats when they're recreated. All integers
+   are 32bit little endian. The format is:
+
+   header: 4 <3 unused bytes> <header size> <uid validity> <next uid>
+           <16 byte mailbox GUID> [<key><value> ...]\0 <padding>
+   block: <record count> <string table size>
+          [<uid> <filename offset> <extensions offset> ...]
+          <string table>
+
+   New records are appended as new blocks. The offsets point to the block's
+   string table. Filenames are \0-terminated and extensions use the same
+   <key><value>\0[<key><value>\0 ...]\0 format as in memory, so they
+   can be used without parsing. Extensions offset is 0xffffffff if the
+   record has no extensions. An incomplete block at the end of the file is
+   ignored until it has been fully written.
 */
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
+#include "byteorder.h"
 #include "hash.h"
 #include "istream.h"
 #include "ostream.h"
@@ -45,8 +67,21 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_VERSION_BINARY 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
+#define UIDLIST_BINARY_HDR_BASE_SIZE 32
+#define UIDLIST_BINARY_HDR_MAX_SIZE (64*1024)
+#define UIDLIST_BINARY_BLOCK_HDR_SIZE 8
+#define UIDLIST_BINARY_REC_SIZE 12
+#define UIDLIST_BINARY_NO_EXTENSIONS 0xffffffffU
+/* Start a new block after this many records or this many bytes of strings
+   when writing. Blocks larger than UIDLIST_BINARY_BLOCK_MAX_SIZE are
+   treated as corruption when reading. */
+#define UIDLIST_BINARY_BLOCK_WRITE_RECORDS 1024
+#define UIDLIST_BINARY_BLOCK_WRITE_STRINGS_SIZE (256*1024)
+#define UIDLIST_BINARY_BLOCK_MAX_SIZE (16*1024*1024)
+
 #define UIDLIST_IS_LOCKED(uidlist) \
 	((uidlist)->lock_count > 0)
 
@@ -81,7 +116,7 @@ struct maildir_uidlist {
 	HASH_TABLE_TYPE(path_to_maildir_uidlist_rec) files;
 	unsigned int change_counter;
 
-	unsigned int version;
+	unsigned int version, write_version;
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
 	unsigned int hdr_next_uid;
 	unsigned int read_records_count, read_line_count;
@@ -275,6 +310,8 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
+	uidlist->write_version = mbox->storage->set->maildir_binary_uidlist ?
+		UIDLIST_VERSION_BINARY : UIDLIST_VERSION;
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
 	uidlist->dotlock_settings.use_excl_lock =
@@ -369,11 +406,15 @@ static void maildir_uidlist_update_hdr(struct maildir_uidlist *uidlist,
 {
 	struct maildir_index_header *mhdr = uidlist->mhdr;
 
-	if (mhdr->uidlist_mtime == 0 && uidlist->version != UIDLIST_VERSION) {
-		/* upgrading from older version. don't update the
-		   uidlist times until it uses the new format */
+	if (uidlist->version != uidlist->write_version) {
+		/* upgrading from older version or converting between the
+		   text and binary formats */
 		uidlist->recreate = TRUE;
-		return;
+		if (mhdr->uidlist_mtime == 0) {
+			/* don't update the uidlist times until it uses
+			   the new format */
+			return;
+		}
 	}
 	mhdr->uidlist_mtime = st->st_mtime;
 	mhdr->uidlist_mtime_nsecs = ST_MTIME_NSEC(*st);
@@ -444,41 +485,25 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+static int maildir_uidlist_next_uid(struct maildir_uidlist *uidlist,
+				    uint32_t uid)
 {
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
-
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
-
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist, 
 					      "UIDs not ordered (%u >= %u)",
 					      uid, uidlist->prev_read_uid);
-		return FALSE;
+		return -1;
 	}
 	if (uid >= (uint32_t)-1) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UID too high (%u)", uid);
-		return FALSE;
+		return -1;
 	}
 	uidlist->prev_read_uid = uid;
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
-		return TRUE;
+		return 0;
 	}
         uidlist->last_seen_uid = uid;
 
@@ -486,41 +511,29 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		maildir_uidlist_set_corrupted(uidlist, 
 			"UID larger than next_uid (%u >= %u)",
 			uid, uidlist->next_uid);
-		return FALSE;
+		return -1;
 	}
+	return 1;
+}
 
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist, 
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
-	}
+static bool maildir_uidlist_add_rec(struct maildir_uidlist *uidlist,
+				    struct maildir_uidlist_rec *rec,
+				    const char *filename)
+{
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
 
-	if (strchr(line, '/') != NULL) {
+	if (strchr(filename, '/') != NULL) {
 		maildir_uidlist_set_corrupted(uidlist, 
 			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
+			uidlist->path, uidlist->read_line_count, filename);
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	old_rec = hash_table_lookup(uidlist->files, filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
-	} else if (old_rec->uid == uid) {
+	} else if (old_rec->uid == rec->uid) {
 		/* most likely this is a record we saved ourself, but couldn't
 		   update last_seen_uid because uidlist wasn't refreshed while
 		   it was locked.
@@ -541,8 +554,8 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		   was appended to uidlist. */
 		i_warning("%s: Duplicate file entry at line %u: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
-			  old_rec->uid, uid, uidlist->retry_rewind ?
+			  uidlist->path, uidlist->read_line_count, filename,
+			  old_rec->uid, rec->uid, uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
 			return FALSE;
@@ -555,18 +568,196 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	}
 
 	recs = array_get(&uidlist->records, &count);
-	if (count > 0 && recs[count-1]->uid > uid) {
+	if (count > 0 && recs[count-1]->uid > rec->uid) {
 		/* we most likely have some records in the array that we saved
 		   ourself without refreshing uidlist */
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
+	/* records read from a binary uidlist already point to the string
+	   table copied to record_pool */
+	if (rec->filename == NULL)
+		rec->filename = p_strdup(uidlist->record_pool, filename);
 	hash_table_update(uidlist->files, rec->filename, rec);
 	array_append(&uidlist->records, &rec, 1);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	int ret;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if ((ret = maildir_uidlist_next_uid(uidlist, uid)) <= 0)
+		return ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version == UIDLIST_VERSION) {
+		/* read extended fields */
+		bool ret;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_extended(uidlist, &line,
+							    rec);
+		} T_END;
+		if (!ret) {
+			maildir_uidlist_set_corrupted(uidlist, 
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+	return maildir_uidlist_add_rec(uidlist, rec, line);
+}
+
+static bool
+maildir_uidlist_binary_rec_is_valid(const unsigned char *strings,
+				    uint32_t strings_size,
+				    uint32_t name_offset, uint32_t ext_offset)
+{
+	const unsigned char *p, *end = strings + strings_size;
+
+	if (name_offset >= strings_size || strings[name_offset] == '\0' ||
+	    memchr(strings + name_offset, '\0',
+		   strings_size - name_offset) == NULL)
+		return FALSE;
+	if (ext_offset == UIDLIST_BINARY_NO_EXTENSIONS)
+		return TRUE;
+	if (ext_offset >= strings_size)
+		return FALSE;
+
+	/* <key><value>\0[<key><value>\0 ...]\0 */
+	for (p = strings + ext_offset; p < end && *p != '\0'; p++) {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			return FALSE;
+		p = memchr(p, '\0', end - p);
+		if (p == NULL)
+			return FALSE;
+	}
+	return p < end;
+}
+
+static bool
+maildir_uidlist_read_binary_block(struct maildir_uidlist *uidlist,
+				  const unsigned char *data,
+				  uint32_t count, uint32_t strings_size)
+{
+	const unsigned char *recp = data;
+	const unsigned char *strings = data + count * UIDLIST_BINARY_REC_SIZE;
+	unsigned char *strings_copy = NULL;
+	struct maildir_uidlist_rec *rec;
+	uint32_t i, uid, name_offset, ext_offset;
+	int ret;
+
+	for (i = 0; i < count; i++, recp += UIDLIST_BINARY_REC_SIZE) {
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+
+		uid = le32_to_cpu_unaligned(recp);
+		name_offset = le32_to_cpu_unaligned(recp + 4);
+		ext_offset = le32_to_cpu_unaligned(recp + 8);
+		if (uid == 0 ||
+		    !maildir_uidlist_binary_rec_is_valid(strings, strings_size,
+							 name_offset,
+							 ext_offset)) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid record (uid=%u, filename offset=%u, "
+				"extensions offset=%u)",
+				uid, name_offset, ext_offset);
+			return FALSE;
+		}
+		if ((ret = maildir_uidlist_next_uid(uidlist, uid)) < 0)
+			return FALSE;
+		if (ret == 0)
+			continue;
+
+		/* copy the string table only when the block has new records.
+		   the filenames and extensions can then be used directly. */
+		if (strings_copy == NULL) {
+			strings_copy = p_malloc(uidlist->record_pool,
+						strings_size);
+			memcpy(strings_copy, strings, strings_size);
+		}
+		rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+		rec->uid = uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+		rec->filename = (char *)strings_copy + name_offset;
+		if (ext_offset != UIDLIST_BINARY_NO_EXTENSIONS)
+			rec->extensions = strings_copy + ext_offset;
+		if (!maildir_uidlist_add_rec(uidlist, rec, rec->filename))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool maildir_uidlist_read_binary(struct maildir_uidlist *uidlist,
+					struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+	uint32_t count, strings_size;
+	uoff_t block_size;
+
+	/* stop at EOF or at an incomplete block. the caller checks for
+	   read errors. */
+	while (i_stream_read_bytes(input, &data, &size,
+				   UIDLIST_BINARY_BLOCK_HDR_SIZE) > 0) {
+		count = le32_to_cpu_unaligned(data);
+		strings_size = le32_to_cpu_unaligned(data + 4);
+		block_size = UIDLIST_BINARY_BLOCK_HDR_SIZE +
+			(uoff_t)count * UIDLIST_BINARY_REC_SIZE + strings_size;
+		if (count == 0 || block_size > UIDLIST_BINARY_BLOCK_MAX_SIZE) {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid block (%u records, %u bytes of strings)",
+				count, strings_size);
+			return FALSE;
+		}
+		if (i_stream_read_bytes(input, &data, &size, block_size) <= 0)
+			break;
+		if (!maildir_uidlist_read_binary_block(uidlist,
+				data + UIDLIST_BINARY_BLOCK_HDR_SIZE,
+				count, strings_size))
+			return FALSE;
+		i_stream_skip(input, block_size);
+	}
+	return TRUE;
+}
+
+static bool maildir_uidlist_read_records(struct maildir_uidlist *uidlist,
+					 struct istream *input)
+{
+	const char *line;
+
+	if (uidlist->version == UIDLIST_VERSION_BINARY)
+		return maildir_uidlist_read_binary(uidlist, input);
+
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		uidlist->read_records_count++;
+		uidlist->read_line_count++;
+		if (!maildir_uidlist_next(uidlist, line))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -621,13 +812,102 @@ maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 	return 0;
 }
 
+static int maildir_uidlist_set_header(struct maildir_uidlist *uidlist,
+				      unsigned int uid_validity,
+				      unsigned int next_uid)
+{
+	if (uid_validity == 0 || next_uid == 0) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken header (uidvalidity = %u, next_uid=%u)",
+			uid_validity, next_uid);
+		return 0;
+	}
+
+	if (uid_validity == uidlist->uid_validity &&
+	    next_uid < uidlist->hdr_next_uid) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"next_uid header was lowered (%u -> %u)",
+			uidlist->hdr_next_uid, next_uid);
+		return 0;
+	}
+
+	uidlist->uid_validity = uid_validity;
+	uidlist->next_uid = next_uid;
+	uidlist->hdr_next_uid = next_uid;
+	return 1;
+}
+
+static int
+maildir_uidlist_read_binary_header(struct maildir_uidlist *uidlist,
+				   struct istream *input,
+				   unsigned int *uid_validity_r,
+				   unsigned int *next_uid_r)
+{
+	const unsigned char *data;
+	size_t size;
+	uint32_t hdr_size;
+
+	uidlist->read_line_count = 1;
+	if (i_stream_read_bytes(input, &data, &size,
+				UIDLIST_BINARY_HDR_BASE_SIZE) <= 0) {
+		if (input->stream_errno != 0)
+			return -1;
+		maildir_uidlist_set_corrupted(uidlist, "Truncated header");
+		return 0;
+	}
+	hdr_size = le32_to_cpu_unaligned(data + 4);
+	if (hdr_size <= UIDLIST_BINARY_HDR_BASE_SIZE ||
+	    hdr_size > UIDLIST_BINARY_HDR_MAX_SIZE) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (invalid header size %u)", hdr_size);
+		return 0;
+	}
+	if (i_stream_read_bytes(input, &data, &size, hdr_size) <= 0) {
+		if (input->stream_errno != 0)
+			return -1;
+		maildir_uidlist_set_corrupted(uidlist, "Truncated header");
+		return 0;
+	}
+	if (memchr(data + UIDLIST_BINARY_HDR_BASE_SIZE, '\0',
+		   hdr_size - UIDLIST_BINARY_HDR_BASE_SIZE) == NULL) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Corrupted header (unterminated extensions)");
+		return 0;
+	}
+
+	uidlist->version = data[0];
+	*uid_validity_r = le32_to_cpu_unaligned(data + 8);
+	*next_uid_r = le32_to_cpu_unaligned(data + 12);
+	memcpy(uidlist->mailbox_guid, data + 16, sizeof(uidlist->mailbox_guid));
+	uidlist->have_mailbox_guid =
+		!guid_128_is_empty(uidlist->mailbox_guid);
+	str_truncate(uidlist->hdr_extensions, 0);
+	str_append(uidlist->hdr_extensions,
+		   (const char *)data + UIDLIST_BINARY_HDR_BASE_SIZE);
+	i_stream_skip(input, hdr_size);
+	return 1;
+}
+
 static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 				       struct istream *input)
 {
 	unsigned int uid_validity = 0, next_uid = 0;
+	const unsigned char *data;
 	const char *line;
+	size_t size;
 	int ret;
 
+	if (i_stream_read_bytes(input, &data, &size, 1) > 0 &&
+	    data[0] == UIDLIST_VERSION_BINARY) {
+		ret = maildir_uidlist_read_binary_header(uidlist, input,
+							 &uid_validity,
+							 &next_uid);
+		if (ret <= 0)
+			return ret;
+		return maildir_uidlist_set_header(uidlist, uid_validity,
+						  next_uid);
+	}
+
 	line = i_stream_read_next_line(input);
         if (line == NULL) {
                 /* I/O error / empty file */
@@ -666,26 +946,7 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 					      uidlist->version);
 		return 0;
 	}
-
-	if (uid_validity == 0 || next_uid == 0) {
-		maildir_uidlist_set_corrupted(uidlist,
-			"Broken header (uidvalidity = %u, next_uid=%u)",
-			uid_validity, next_uid);
-		return 0;
-	}
-
-	if (uid_validity == uidlist->uid_validity &&
-	    next_uid < uidlist->hdr_next_uid) {
-		maildir_uidlist_set_corrupted(uidlist,
-			"next_uid header was lowered (%u -> %u)",
-			uidlist->hdr_next_uid, next_uid);
-		return 0;
-	}
-
-	uidlist->uid_validity = uid_validity;
-	uidlist->next_uid = next_uid;
-	uidlist->hdr_next_uid = next_uid;
-	return 1;
+	return maildir_uidlist_set_header(uidlist, uid_validity, next_uid);
 }
 
 static void maildir_uidlist_records_sort_by_uid(struct maildir_uidlist *uidlist)
@@ -698,7 +959,6 @@ static int
 maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 			    bool *retry_r, bool try_retry)
 {
-	const char *line;
 	uint32_t orig_next_uid, orig_uid_validity;
 	struct istream *input;
 	struct stat st;
@@ -773,19 +1033,14 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
 
 		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
-			uidlist->read_records_count++;
-			uidlist->read_line_count++;
-			if (!maildir_uidlist_next(uidlist, line)) {
-				if (!uidlist->retry_rewind)
-					ret = 0;
-				else {
-					ret = -1;
-					*retry_r = TRUE;
-				}
-				break;
+		if (!maildir_uidlist_read_records(uidlist, input)) {
+			if (!uidlist->retry_rewind)
+				ret = 0;
+			else {
+				ret = -1;
+				*retry_r = TRUE;
 			}
-                }
+		}
 		uidlist->retry_rewind = FALSE;
 		if (input->stream_errno != 0)
                         ret = -1;
@@ -1234,53 +1489,137 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
-static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
-				    const char *path, unsigned int first_idx,
-				    uoff_t *file_size_r)
+static void
+maildir_uidlist_write_binary_header(struct maildir_uidlist *uidlist,
+				    struct ostream *output)
 {
-	struct mail_storage *storage = uidlist->box->storage;
-	struct maildir_uidlist_iter_ctx *iter;
-	struct ostream *output;
+	unsigned char hdr[UIDLIST_BINARY_HDR_BASE_SIZE];
+	static const unsigned char padding[3] = { 0, 0, 0 };
+	size_t ext_size, hdr_size;
+
+	ext_size = str_len(uidlist->hdr_extensions) + 1;
+	hdr_size = UIDLIST_BINARY_HDR_BASE_SIZE + ext_size;
+	hdr_size = (hdr_size + 3) & ~3;
+	i_assert(hdr_size <= UIDLIST_BINARY_HDR_MAX_SIZE);
+
+	memset(hdr, 0, sizeof(hdr));
+	hdr[0] = UIDLIST_VERSION_BINARY;
+	cpu32_to_le_unaligned(hdr_size, hdr + 4);
+	cpu32_to_le_unaligned(uidlist->uid_validity, hdr + 8);
+	cpu32_to_le_unaligned(uidlist->next_uid, hdr + 12);
+	memcpy(hdr + 16, uidlist->mailbox_guid, sizeof(uidlist->mailbox_guid));
+
+	o_stream_nsend(output, hdr, sizeof(hdr));
+	/* write the extensions with the trailing \0 */
+	o_stream_nsend(output, str_c(uidlist->hdr_extensions), ext_size);
+	o_stream_nsend(output, padding,
+		       hdr_size - UIDLIST_BINARY_HDR_BASE_SIZE - ext_size);
+}
+
+static void
+maildir_uidlist_write_binary_block(struct ostream *output, buffer_t *recs,
+				   buffer_t *strings)
+{
+	unsigned char hdr[UIDLIST_BINARY_BLOCK_HDR_SIZE];
+
+	if (recs->used == 0)
+		return;
+
+	while (strings->used % 4 != 0)
+		buffer_append_c(strings, '\0');
+	cpu32_to_le_unaligned(recs->used / UIDLIST_BINARY_REC_SIZE, hdr);
+	cpu32_to_le_unaligned(strings->used, hdr + 4);
+	o_stream_nsend(output, hdr, sizeof(hdr));
+	o_stream_nsend(output, recs->data, recs->used);
+	o_stream_nsend(output, strings->data, strings->used);
+
+	buffer_set_used_size(recs, 0);
+	buffer_set_used_size(strings, 0);
+}
+
+static void
+maildir_uidlist_write_binary_records(struct maildir_uidlist_iter_ctx *iter,
+				     struct ostream *output)
+{
+	struct maildir_uidlist *uidlist = iter->uidlist;
 	struct maildir_uidlist_rec *rec;
-	string_t *str;
+	unsigned char recbuf[UIDLIST_BINARY_REC_SIZE];
+	buffer_t *recs, *strings;
 	const unsigned char *p;
 	const char *strp;
 	size_t len;
 
-	i_assert(fd != -1);
+	recs = t_buffer_create(UIDLIST_BINARY_BLOCK_WRITE_RECORDS *
+			       UIDLIST_BINARY_REC_SIZE);
+	strings = t_buffer_create(UIDLIST_BINARY_BLOCK_WRITE_RECORDS * 64);
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
 
-	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
-	o_stream_cork(output);
-	str = t_str_new(512);
+		cpu32_to_le_unaligned(rec->uid, recbuf);
+		cpu32_to_le_unaligned(strings->used, recbuf + 4);
+		strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
+		if (strp == NULL)
+			buffer_append(strings, rec->filename,
+				      strlen(rec->filename));
+		else {
+			buffer_append(strings, rec->filename,
+				      strp - rec->filename);
+		}
+		buffer_append_c(strings, '\0');
 
-	if (output->offset == 0) {
-		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
+		if (rec->extensions == NULL) {
+			cpu32_to_le_unaligned(UIDLIST_BINARY_NO_EXTENSIONS,
+					      recbuf + 8);
+		} else {
+			cpu32_to_le_unaligned(strings->used, recbuf + 8);
+			for (p = rec->extensions; *p != '\0'; p += len + 1) {
+				i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+				len = strlen((const char *)p);
+			}
+			buffer_append(strings, rec->extensions,
+				      p - rec->extensions + 1);
+		}
+		buffer_append(recs, recbuf, sizeof(recbuf));
 
-		if (uidlist->uid_validity == 0)
-			maildir_uidlist_generate_uid_validity(uidlist);
-		if (!uidlist->have_mailbox_guid)
-			guid_128_generate(uidlist->mailbox_guid);
+		if (recs->used >= UIDLIST_BINARY_BLOCK_WRITE_RECORDS *
+		    		  UIDLIST_BINARY_REC_SIZE ||
+		    strings->used >= UIDLIST_BINARY_BLOCK_WRITE_STRINGS_SIZE)
+			maildir_uidlist_write_binary_block(output, recs, strings);
+	}
+	maildir_uidlist_write_binary_block(output, recs, strings);
+}
 
-		i_assert(uidlist->next_uid > 0);
-		str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
-			    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
-			    uidlist->uid_validity,
-			    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
-			    uidlist->next_uid,
-			    MAILDIR_UIDLIST_HDR_EXT_GUID,
-			    guid_128_to_string(uidlist->mailbox_guid));
-		if (str_len(uidlist->hdr_extensions) > 0) {
-			str_append_c(str, ' ');
-			str_append_str(str, uidlist->hdr_extensions);
-		}
-		str_append_c(str, '\n');
-		o_stream_nsend(output, str_data(str), str_len(str));
+static void
+maildir_uidlist_write_text_header(struct maildir_uidlist *uidlist,
+				  struct ostream *output)
+{
+	string_t *str = t_str_new(256);
+
+	str_printfa(str, "%u %c%u %c%u %c%s", uidlist->version,
+		    MAILDIR_UIDLIST_HDR_EXT_UID_VALIDITY,
+		    uidlist->uid_validity,
+		    MAILDIR_UIDLIST_HDR_EXT_NEXT_UID,
+		    uidlist->next_uid,
+		    MAILDIR_UIDLIST_HDR_EXT_GUID,
+		    guid_128_to_string(uidlist->mailbox_guid));
+	if (str_len(uidlist->hdr_extensions) > 0) {
+		str_append_c(str, ' ');
+		str_append_str(str, uidlist->hdr_extensions);
 	}
+	str_append_c(str, '\n');
+	o_stream_nsend(output, str_data(str), str_len(str));
+}
 
-	iter = maildir_uidlist_iter_init(uidlist);
-	i_assert(first_idx <= array_count(&uidlist->records));
-	iter->next += first_idx;
+static void
+maildir_uidlist_write_text_records(struct maildir_uidlist_iter_ctx *iter,
+				   struct ostream *output)
+{
+	struct maildir_uidlist *uidlist = iter->uidlist;
+	struct maildir_uidlist_rec *rec;
+	string_t *str = t_str_new(512);
+	const unsigned char *p;
+	const char *strp;
+	size_t len;
 
 	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
 		uidlist->read_records_count++;
@@ -1304,6 +1643,45 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 		str_append_c(str, '\n');
 		o_stream_nsend(output, str_data(str), str_len(str));
 	}
+}
+
+static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
+				    const char *path, unsigned int first_idx,
+				    uoff_t *file_size_r)
+{
+	struct mail_storage *storage = uidlist->box->storage;
+	struct maildir_uidlist_iter_ctx *iter;
+	struct ostream *output;
+
+	i_assert(fd != -1);
+
+	output = o_stream_create_fd_file(fd, (uoff_t)-1, FALSE);
+	o_stream_cork(output);
+
+	if (output->offset == 0) {
+		i_assert(first_idx == 0);
+		uidlist->version = uidlist->write_version;
+
+		if (uidlist->uid_validity == 0)
+			maildir_uidlist_generate_uid_validity(uidlist);
+		if (!uidlist->have_mailbox_guid)
+			guid_128_generate(uidlist->mailbox_guid);
+
+		i_assert(uidlist->next_uid > 0);
+		if (uidlist->version == UIDLIST_VERSION_BINARY)
+			maildir_uidlist_write_binary_header(uidlist, output);
+		else
+			maildir_uidlist_write_text_header(uidlist, output);
+	}
+
+	iter = maildir_uidlist_iter_init(uidlist);
+	i_assert(first_idx <= array_count(&uidlist->records));
+	iter->next += first_idx;
+
+	if (uidlist->version == UIDLIST_VERSION_BINARY)
+		maildir_uidlist_write_binary_records(iter, output);
+	else
+		maildir_uidlist_write_text_records(iter, output);
 	maildir_uidlist_iter_deinit(&iter);
 
 	if (o_stream_finish(output) < 0) {
@@ -1515,7 +1893,7 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
+	if (uidlist->fd == -1 || uidlist->version != uidlist->write_version ||
 	    !uidlist->have_mailbox_guid)
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
@@ -244,11 +244,10 @@ static void
 mbox_save_append_keyword_headers(struct mbox_save_context *ctx,
 				 struct mail_keywords *keywords)
 {
-	unsigned char space[MBOX_HEADER_PADDING+1 +
-			    sizeof("Content-Length: \n")-1 + MAX_INT_STRLEN];
 	const ARRAY_TYPE(keywords) *keyword_names_list;
 	const char *const *keyword_names;
 	unsigned int i, count, keyword_names_count;
+	size_t space_size;
 
 	keyword_names_list = mail_index_get_keywords(ctx->mbox->box.index);
 	keyword_names = array_get(keyword_names_list, &keyword_names_count);
@@ -262,8 +261,10 @@ mbox_save_append_keyword_headers(struct mbox_save_context *ctx,
 		str_append(ctx->headers, keyword_names[keywords->idx[i]]);
 	}
 
-	memset(space, ' ', sizeof(space));
-	str_append_n(ctx->headers, space, sizeof(space));
+	space_size = mbox_get_header_padding(ctx->mbox) + 1 +
+		sizeof("Content-Length: \n")-1 + MAX_INT_STRLEN;
+	memset(buffer_append_space_unsafe(ctx->headers, space_size),
+	       ' ', space_size);
 	ctx->space_end_idx = str_len(ctx->headers);
 	str_append_c(ctx->headers, '\n');
 }
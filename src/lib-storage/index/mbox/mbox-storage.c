@@ -811,6 +811,25 @@ bool mbox_is_backend_readonly(struct mbox_mailbox *mbox)
 	return mbox->backend_readonly;
 }
 
+unsigned int mbox_get_header_padding(struct mbox_mailbox *mbox)
+{
+	const ARRAY_TYPE(keywords) *keywords;
+	const char *const *namep;
+	unsigned int padding = MBOX_HEADER_PADDING;
+
+	/* each time a keyword is added to a message whose X-Keywords header
+	   doesn't have enough padding, the following mails in the mbox file
+	   need to be moved. leave enough space for the mailbox's existing
+	   keywords to be added. */
+	keywords = mail_index_get_keywords(mbox->box.index);
+	array_foreach(keywords, namep) {
+		padding += strlen(*namep) + 1;
+		if (padding >= MBOX_HEADER_MAX_PADDING)
+			return MBOX_HEADER_MAX_PADDING;
+	}
+	return padding;
+}
+
 struct mail_storage mbox_storage = {
 	.name = MBOX_STORAGE_NAME,
 	.class_flags = MAIL_STORAGE_CLASS_FLAG_MAILBOX_IS_FILE |
@@ -7,6 +7,8 @@
 
 /* Padding to leave in X-Keywords header when rewriting mbox */
 #define MBOX_HEADER_PADDING 50
+/* Maximum padding when it's grown by mbox_get_header_padding() */
+#define MBOX_HEADER_MAX_PADDING 256
 /* Don't write Content-Length header unless it's value is larger than this. */
 #define MBOX_MIN_CONTENT_LENGTH_SIZE 1024
 
@@ -105,5 +107,7 @@ void mbox_transaction_save_commit_post(struct mail_save_context *ctx,
 void mbox_transaction_save_rollback(struct mail_save_context *ctx);
 
 bool mbox_is_backend_readonly(struct mbox_mailbox *mbox);
+/* Returns how much padding to leave in X-Keywords header. */
+unsigned int mbox_get_header_padding(struct mbox_mailbox *mbox);
 
 #endif
@@ -117,6 +117,8 @@ struct mbox_sync_context {
 	const struct mail_index_header *hdr;
 
 	string_t *header, *from_line;
+	/* buffer used by mbox_move() */
+	buffer_t *move_buf;
 
 	/* header state: */
 	uint32_t base_uid_validity, base_uid_last;
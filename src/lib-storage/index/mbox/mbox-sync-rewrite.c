@@ -4,21 +4,40 @@
 #include "array.h"
 #include "buffer.h"
 #include "istream.h"
-#include "ostream.h"
 #include "str.h"
+#include "read-full.h"
 #include "write-full.h"
 #include "message-parser.h"
 #include "mbox-storage.h"
 #include "mbox-sync-private.h"
 #include "istream-raw-mbox.h"
 
+/* Maximum number of bytes to read/write at once when moving data within
+   the mbox file */
+#define MBOX_MOVE_BUFFER_SIZE (1024*1024)
+
+static void
+mbox_move_set_error(struct mbox_sync_context *sync_ctx,
+		    uoff_t dest, uoff_t source, uoff_t size, uoff_t moved,
+		    int ret, const char *function)
+{
+	if (ret < 0)
+		mbox_set_syscall_error(sync_ctx->mbox, function);
+	else {
+		mbox_sync_set_critical(sync_ctx,
+			"mbox_move(%"PRIuUOFF_T", %"PRIuUOFF_T", %"PRIuUOFF_T
+			") moved only %"PRIuUOFF_T" bytes",
+			dest, source, size, moved);
+	}
+}
+
 int mbox_move(struct mbox_sync_context *sync_ctx,
 	      uoff_t dest, uoff_t source, uoff_t size)
 {
-	struct mbox_mailbox *mbox = sync_ctx->mbox;
-	struct istream *input;
-	struct ostream *output;
-	int ret;
+	unsigned char *buf;
+	uoff_t offset;
+	size_t block_size;
+	int ret = 0;
 
 	i_assert(source > 0 || (dest != 1 && dest != 2));
 	i_assert(size < OFF_T_MAX);
@@ -28,43 +47,61 @@ int mbox_move(struct mbox_sync_context *sync_ctx,
 
 	i_stream_sync(sync_ctx->input);
 
-	output = o_stream_create_fd_file(sync_ctx->write_fd, (uoff_t)-1, FALSE);
-	i_stream_seek(sync_ctx->file_input, source);
-	if (o_stream_seek(output, dest) < 0) {
-		mbox_set_syscall_error(sync_ctx->mbox,
-				       "o_stream_seek()");
-		o_stream_unref(&output);
-		return -1;
+	/* the same data is moved around with large reads and writes directly
+	   to the file, bypassing the streams. this way moving even a large
+	   mbox runs at the disk's speed. */
+	block_size = I_MIN(size, MBOX_MOVE_BUFFER_SIZE);
+	if (sync_ctx->move_buf == NULL) {
+		sync_ctx->move_buf =
+			buffer_create_dynamic(default_pool, block_size);
 	}
-
-	/* we're moving data within a file. it really shouldn't be failing at
-	   this point or we're corrupted. */
-	input = i_stream_create_limit(sync_ctx->file_input, size);
-	(void)o_stream_send_istream(output, input);
-	if (input->stream_errno != 0) {
-		mailbox_set_critical(&mbox->box,
-			"read() failed with mbox: %s",
-			i_stream_get_error(input));
-		ret = -1;
-	} else if (output->stream_errno != 0) {
-		mailbox_set_critical(&mbox->box,
-			"write() failed with mbox: %s",
-			o_stream_get_error(output));
-		ret = -1;
-	} else if (input->v_offset != size) {
-		mbox_sync_set_critical(sync_ctx,
-			"mbox_move(%"PRIuUOFF_T", %"PRIuUOFF_T", %"PRIuUOFF_T
-			") moved only %"PRIuUOFF_T" bytes",
-			dest, source, size, input->v_offset);
-		ret = -1;
+	buf = buffer_get_space_unsafe(sync_ctx->move_buf, 0, block_size);
+
+	if (dest < source) {
+		/* moving backwards. copy from the beginning, so we won't
+		   overwrite data that hasn't been read yet. */
+		for (offset = 0; offset < size; offset += block_size) {
+			block_size = I_MIN(block_size, size - offset);
+			ret = pread_full(sync_ctx->write_fd, buf, block_size,
+					 source + offset);
+			if (ret <= 0) {
+				mbox_move_set_error(sync_ctx, dest, source,
+						    size, offset, ret,
+						    "pread_full()");
+				break;
+			}
+			if (pwrite_full(sync_ctx->write_fd, buf, block_size,
+					dest + offset) < 0) {
+				mbox_set_syscall_error(sync_ctx->mbox,
+						       "pwrite_full()");
+				ret = -1;
+				break;
+			}
+		}
 	} else {
-		ret = 0;
+		/* moving forward. copy from the end for the same reason. */
+		for (offset = size; offset > 0; offset -= block_size) {
+			block_size = I_MIN(block_size, offset);
+			ret = pread_full(sync_ctx->write_fd, buf, block_size,
+					 source + offset - block_size);
+			if (ret <= 0) {
+				mbox_move_set_error(sync_ctx, dest, source,
+						    size, size - offset, ret,
+						    "pread_full()");
+				break;
+			}
+			if (pwrite_full(sync_ctx->write_fd, buf, block_size,
+					dest + offset - block_size) < 0) {
+				mbox_set_syscall_error(sync_ctx->mbox,
+						       "pwrite_full()");
+				ret = -1;
+				break;
+			}
+		}
 	}
-	i_stream_unref(&input);
 
 	mbox_sync_file_updated(sync_ctx, FALSE);
-	o_stream_destroy(&output);
-	return ret;
+	return ret > 0 ? 0 : -1;
 }
 
 static int mbox_fill_space(struct mbox_sync_context *sync_ctx,
@@ -774,7 +774,7 @@ mbox_sync_handle_missing_space(struct mbox_sync_mail_context *mail_ctx)
 		   plus the expunged space of this message. so it contains how
 		   many bytes of _extra_ space we have. */
 		i_assert(mail_ctx->mail.space >= sync_ctx->space_diff);
-		extra_space = MBOX_HEADER_PADDING *
+		extra_space = mbox_get_header_padding(sync_ctx->mbox) *
 			(sync_ctx->seq - sync_ctx->need_space_seq + 1);
 		needed_space = mail_ctx->mail.space - sync_ctx->space_diff;
 		if ((uoff_t)sync_ctx->space_diff > needed_space + extra_space) {
@@ -1284,22 +1284,18 @@ static int mbox_write_pseudo(struct mbox_sync_context *sync_ctx, bool force)
 static int mbox_append_zero(struct mbox_sync_context *sync_ctx,
 			    uoff_t orig_file_size, uoff_t count)
 {
-	char block[IO_BLOCK_SIZE];
-	uoff_t offset = orig_file_size;
-	ssize_t ret = 0;
-
-	memset(block, 0, I_MIN(sizeof(block), count));
-	while (count > 0) {
-		ret = pwrite(sync_ctx->write_fd, block,
-			     I_MIN(sizeof(block), count), offset);
-		if (ret < 0)
-			break;
-		offset += ret;
-		count -= ret;
-	}
-
-	if (ret < 0) {
-		mbox_set_syscall_error(sync_ctx->mbox, "pwrite()");
+	/* allocate the space before starting to move the data, so running
+	   out of disk space won't leave the mbox half-moved. */
+	if (file_set_size(sync_ctx->write_fd,
+			  (off_t)(orig_file_size + count)) < 0) {
+		/* file_set_size() already logged other errors */
+		if (ENOSPACE(errno)) {
+			mbox_set_syscall_error(sync_ctx->mbox,
+					       "file_set_size()");
+		} else {
+			mail_storage_set_internal_error(
+				&sync_ctx->mbox->storage->storage);
+		}
 		if (ftruncate(sync_ctx->write_fd, orig_file_size) < 0)
 			mbox_set_syscall_error(sync_ctx->mbox, "ftruncate()");
 		return -1;
@@ -1343,7 +1339,7 @@ static int mbox_sync_handle_eof_updates(struct mbox_sync_context *sync_ctx,
 		i_assert(sync_ctx->write_fd != -1);
 
 		i_assert(sync_ctx->space_diff < 0);
-		padding = MBOX_HEADER_PADDING *
+		padding = mbox_get_header_padding(sync_ctx->mbox) *
 			(sync_ctx->seq - sync_ctx->need_space_seq + 1);
 		sync_ctx->space_diff -= padding;
 
@@ -1789,6 +1785,8 @@ static void mbox_sync_context_free(struct mbox_sync_context *sync_ctx)
 	pool_unref(&sync_ctx->saved_keywords_pool);
 	str_free(&sync_ctx->header);
 	str_free(&sync_ctx->from_line);
+	if (sync_ctx->move_buf != NULL)
+		buffer_free(&sync_ctx->move_buf);
 	array_free(&sync_ctx->mails);
 }
 
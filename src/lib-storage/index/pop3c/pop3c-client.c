@@ -23,6 +23,8 @@
 #define POP3C_DNS_LOOKUP_TIMEOUT_MSECS (1000*30)
 #define POP3C_CONNECT_TIMEOUT_MSECS (1000*30)
 #define POP3C_COMMAND_TIMEOUT_MSECS (1000*60*5)
+/* Maximum number of commands to pipeline before waiting for replies */
+#define POP3C_MAX_PIPELINED_COMMANDS 32
 
 enum pop3c_client_state {
 	/* No connection */
@@ -823,6 +825,13 @@ pop3c_client_cmd_line_async(struct pop3c_client *client, const char *cmdline,
 	if ((client->capabilities & POP3C_CAPABILITY_PIPELINING) == 0) {
 		while (array_count(&client->commands) > 0)
 			pop3c_client_wait_one(client);
+	} else {
+		/* don't let the replies pile up in the server's output
+		   buffer (and the prefetched mails in our temp files) while
+		   we're still sending more commands */
+		while (array_count(&client->commands) >= POP3C_MAX_PIPELINED_COMMANDS &&
+		       client->state == POP3C_CLIENT_STATE_DONE)
+			pop3c_client_wait_one(client);
 	}
 	i_assert(client->state == POP3C_CLIENT_STATE_DISCONNECTED ||
 		 client->state == POP3C_CLIENT_STATE_DONE);
@@ -171,6 +171,9 @@ static int pop3c_mailbox_open(struct mailbox *box)
 
 	if (index_storage_mailbox_open(box, FALSE) < 0)
 		return -1;
+	mbox->pop3c_ext_id =
+		mail_index_ext_register(box->index, POP3C_INDEX_HEADER_NAME,
+					sizeof(struct pop3c_index_header), 0, 0);
 
 	mbox->client = pop3c_client_create_from_set(box->storage,
 						    mbox->storage->set);
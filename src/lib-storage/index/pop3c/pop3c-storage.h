@@ -1,9 +1,19 @@
 #ifndef POP3C_STORAGE_H
 #define POP3C_STORAGE_H
 
+#include "sha1.h"
 #include "index-storage.h"
 
 #define POP3C_STORAGE_NAME "pop3c"
+#define POP3C_INDEX_HEADER_NAME "pop3c"
+
+struct pop3c_index_header {
+	/* The first uidl_count remote messages are the same as the local
+	   messages in the same order, i.e. remote seq N = local seq N. */
+	uint32_t uidl_count;
+	/* SHA1 of the first uidl_count remote UIDLs, each followed by LF */
+	unsigned char uidls_sha1[SHA1_RESULTLEN];
+};
 
 struct pop3c_storage {
 	struct mail_storage storage;
@@ -26,6 +36,7 @@ struct pop3c_mailbox {
 	   the UID may not exist for the entire session */
 	uint32_t *msg_uids;
 
+	uint32_t pop3c_ext_id;
 	bool logged_in:1;
 };
 
@@ -176,33 +176,66 @@ static int pop3c_sync_msg_uidl_cmp(const struct pop3c_sync_msg *msg1,
 }
 
 static void
-pop3c_sync_messages(struct pop3c_mailbox *mbox,
-		    struct mail_index_view *sync_view,
-		    struct mail_index_transaction *sync_trans,
-		    struct mail_cache_view *cache_view)
+pop3c_sync_get_uidls_sha1(struct pop3c_mailbox *mbox, unsigned int count,
+			  unsigned char result[STATIC_ARRAY SHA1_RESULTLEN])
+{
+	struct sha1_ctxt ctx;
+	unsigned int i;
+
+	sha1_init(&ctx);
+	for (i = 0; i < count; i++) {
+		sha1_loop(&ctx, mbox->msg_uidls[i], strlen(mbox->msg_uidls[i]));
+		sha1_loop(&ctx, "\n", 1);
+	}
+	sha1_result(&ctx, result);
+}
+
+static bool
+pop3c_sync_messages_appended(struct pop3c_mailbox *mbox,
+			     struct mail_index_view *sync_view,
+			     const struct mail_index_header *hdr)
+{
+	struct pop3c_index_header ext_hdr;
+	unsigned char uidls_sha1[SHA1_RESULTLEN];
+	const void *data;
+	size_t data_size;
+	uint32_t seq;
+
+	/* If the local messages are still the first messages in remote in
+	   the same order, the server has only appended new messages since
+	   the last sync. Check this using the UIDLs hash saved during the
+	   last sync, so we don't need to look up all the UIDLs from cache. */
+	mail_index_get_header_ext(sync_view, mbox->pop3c_ext_id,
+				  &data, &data_size);
+	if (data_size != sizeof(ext_hdr))
+		return FALSE;
+	memcpy(&ext_hdr, data, sizeof(ext_hdr));
+	if (ext_hdr.uidl_count != hdr->messages_count ||
+	    ext_hdr.uidl_count > mbox->msg_count)
+		return FALSE;
+
+	pop3c_sync_get_uidls_sha1(mbox, ext_hdr.uidl_count, uidls_sha1);
+	if (memcmp(uidls_sha1, ext_hdr.uidls_sha1, sizeof(uidls_sha1)) != 0)
+		return FALSE;
+
+	for (seq = 1; seq <= ext_hdr.uidl_count; seq++)
+		mail_index_lookup_uid(sync_view, seq, &mbox->msg_uids[seq-1]);
+	return TRUE;
+}
+
+static void
+pop3c_sync_messages_diff(struct pop3c_mailbox *mbox,
+			 struct mail_index_view *sync_view,
+			 struct mail_index_transaction *sync_trans,
+			 struct mail_cache_view *cache_view,
+			 const struct mail_index_header *hdr,
+			 unsigned int cache_idx)
 {
-	struct index_mailbox_context *ibox =
-		INDEX_STORAGE_CONTEXT(&mbox->box);
-	const struct mail_index_header *hdr;
-	struct mail_cache_transaction_ctx *cache_trans;
 	ARRAY_TYPE(pop3c_sync_msg) local_msgs, remote_msgs;
 	const struct pop3c_sync_msg *lmsg, *rmsg;
-	uint32_t seq1, seq2, next_uid;
 	unsigned int lidx, ridx, lcount, rcount;
-	unsigned int cache_idx = ibox->cache_fields[MAIL_CACHE_POP3_UIDL].idx;
 	pool_t pool;
 
-	i_assert(mbox->msg_uids == NULL);
-
-	/* set our uidvalidity */
-	hdr = mail_index_get_header(sync_view);
-	if (hdr->uid_validity == 0) {
-		uint32_t uid_validity = ioloop_time;
-		mail_index_update_header(sync_trans,
-			offsetof(struct mail_index_header, uid_validity),
-			&uid_validity, sizeof(uid_validity), TRUE);
-	}
-
 	pool = pool_alloconly_create(MEMPOOL_GROWING"pop3c sync", 10240);
 	p_array_init(&local_msgs, pool, hdr->messages_count);
 	pop3c_get_local_msgs(pool, &local_msgs, hdr->messages_count,
@@ -215,15 +248,10 @@ pop3c_sync_messages(struct pop3c_mailbox *mbox,
 	array_sort(&remote_msgs, pop3c_sync_msg_uidl_cmp);
 
 	/* skip over existing messages with matching UIDLs and expunge the ones
-	   that no longer exist in remote. */
-	mbox->msg_uids = mbox->msg_count == 0 ?
-		i_new(uint32_t, 1) : /* avoid malloc(0) assert */
-		i_new(uint32_t, mbox->msg_count);
-	cache_trans = mail_cache_get_transaction(cache_view, sync_trans);
-
+	   that no longer exist in remote. the new messages are left with
+	   msg_uids[]=0 and appended by the caller. */
 	lmsg = array_get(&local_msgs, &lcount);
 	rmsg = array_get(&remote_msgs, &rcount);
-	next_uid = hdr->next_uid;
 	lidx = ridx = 0;
 	while (lidx < lcount || ridx < rcount) {
 		uint32_t lseq = lidx < lcount ? lmsg[lidx].seq : 0;
@@ -243,12 +271,6 @@ pop3c_sync_messages(struct pop3c_mailbox *mbox,
 			lidx++;
 		} else if (ret > 0) {
 			/* new message in remote */
-			i_assert(mbox->msg_uids[rseq-1] == 0);
-			mbox->msg_uids[rseq-1] = next_uid;
-			mail_index_append(sync_trans, next_uid++, &lseq);
-			mail_cache_add(cache_trans, lseq, cache_idx,
-				       rmsg[ridx].uidl,
-				       strlen(rmsg[ridx].uidl)+1);
 			ridx++;
 		} else {
 			/* UIDL matched */
@@ -259,12 +281,93 @@ pop3c_sync_messages(struct pop3c_mailbox *mbox,
 			ridx++;
 		}
 	}
+	pool_unref(&pool);
+}
+
+static void
+pop3c_sync_update_header(struct pop3c_mailbox *mbox,
+			 struct mail_index_view *sync_view,
+			 struct mail_index_transaction *sync_trans)
+{
+	struct pop3c_index_header ext_hdr;
+	const void *data;
+	size_t data_size;
+	unsigned int i;
+
+	/* the local messages are now the same as remote messages. if their
+	   order is the same as well, the next sync can skip comparing them. */
+	i_zero(&ext_hdr);
+	for (i = 1; i < mbox->msg_count; i++) {
+		if (mbox->msg_uids[i-1] >= mbox->msg_uids[i])
+			break;
+	}
+	if (i >= mbox->msg_count) {
+		ext_hdr.uidl_count = mbox->msg_count;
+		pop3c_sync_get_uidls_sha1(mbox, mbox->msg_count,
+					  ext_hdr.uidls_sha1);
+	}
+
+	mail_index_get_header_ext(sync_view, mbox->pop3c_ext_id,
+				  &data, &data_size);
+	if (data_size != sizeof(ext_hdr) ||
+	    memcmp(data, &ext_hdr, sizeof(ext_hdr)) != 0) {
+		mail_index_update_header_ext(sync_trans, mbox->pop3c_ext_id,
+					     0, &ext_hdr, sizeof(ext_hdr));
+	}
+}
+
+static void
+pop3c_sync_messages(struct pop3c_mailbox *mbox,
+		    struct mail_index_view *sync_view,
+		    struct mail_index_transaction *sync_trans,
+		    struct mail_cache_view *cache_view)
+{
+	struct index_mailbox_context *ibox =
+		INDEX_STORAGE_CONTEXT(&mbox->box);
+	const struct mail_index_header *hdr;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const char *uidl;
+	uint32_t seq, seq1, seq2, next_uid, rseq;
+	unsigned int cache_idx = ibox->cache_fields[MAIL_CACHE_POP3_UIDL].idx;
+
+	i_assert(mbox->msg_uids == NULL);
+
+	/* set our uidvalidity */
+	hdr = mail_index_get_header(sync_view);
+	if (hdr->uid_validity == 0) {
+		uint32_t uid_validity = ioloop_time;
+		mail_index_update_header(sync_trans,
+			offsetof(struct mail_index_header, uid_validity),
+			&uid_validity, sizeof(uid_validity), TRUE);
+	}
+
+	mbox->msg_uids = mbox->msg_count == 0 ?
+		i_new(uint32_t, 1) : /* avoid malloc(0) assert */
+		i_new(uint32_t, mbox->msg_count);
+	if (!pop3c_sync_messages_appended(mbox, sync_view, hdr)) {
+		pop3c_sync_messages_diff(mbox, sync_view, sync_trans,
+					 cache_view, hdr, cache_idx);
+	}
+
+	/* append the new messages in remote order, so the UIDs stay in the
+	   same order as the remote sequences whenever possible */
+	cache_trans = mail_cache_get_transaction(cache_view, sync_trans);
+	next_uid = hdr->next_uid;
+	for (rseq = 1; rseq <= mbox->msg_count; rseq++) {
+		if (mbox->msg_uids[rseq-1] != 0)
+			continue;
+		uidl = mbox->msg_uidls[rseq-1];
+		mbox->msg_uids[rseq-1] = next_uid;
+		mail_index_append(sync_trans, next_uid++, &seq);
+		mail_cache_add(cache_trans, seq, cache_idx,
+			       uidl, strlen(uidl)+1);
+	}
+	pop3c_sync_update_header(mbox, sync_view, sync_trans);
 
 	/* mark the newly seen messages as recent */
 	if (mail_index_lookup_seq_range(sync_view, hdr->first_recent_uid,
 					hdr->next_uid, &seq1, &seq2))
 		mailbox_recent_flags_set_seqs(&mbox->box, sync_view, seq1, seq2);
-	pool_unref(&pool);
 }
 
 int pop3c_sync(struct pop3c_mailbox *mbox)
@@ -2,7 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
-#include "hash.h"
+#include "hash-flat.h"
 #include "mail-storage.h"
 #include "mailbox-list-private.h"
 #include "mailbox-guid-cache.h"
@@ -18,15 +18,15 @@ int mailbox_guid_cache_find(struct mailbox_list *list,
 	const struct mailbox_guid_cache_rec *rec;
 	const uint8_t *guid_p = guid;
 
-	if (!hash_table_is_created(list->guid_cache) ||
+	if (!hash_flat_is_created(list->guid_cache) ||
 	    list->guid_cache_invalidated) {
 		mailbox_guid_cache_refresh(list);
-		rec = hash_table_lookup(list->guid_cache, guid_p);
+		rec = hash_flat_lookup(list->guid_cache, guid_p);
 	} else {
-		rec = hash_table_lookup(list->guid_cache, guid_p);
+		rec = hash_flat_lookup(list->guid_cache, guid_p);
 		if (rec == NULL && list->guid_cache_updated) {
 			mailbox_guid_cache_refresh(list);
-			rec = hash_table_lookup(list->guid_cache, guid_p);
+			rec = hash_flat_lookup(list->guid_cache, guid_p);
 		}
 	}
 	if (rec == NULL) {
@@ -46,13 +46,13 @@ void mailbox_guid_cache_refresh(struct mailbox_list *list)
 	struct mailbox_guid_cache_rec *rec;
 	uint8_t *guid_p;
 
-	if (!hash_table_is_created(list->guid_cache)) {
+	if (!hash_flat_is_created(list->guid_cache)) {
 		list->guid_cache_pool =
 			pool_alloconly_create("guid cache", 1024*16);
-		hash_table_create(&list->guid_cache, list->guid_cache_pool, 0,
-				  guid_128_hash, guid_128_cmp);
+		hash_flat_create(&list->guid_cache, 0,
+				 guid_128_hash, guid_128_cmp);
 	} else {
-		hash_table_clear(list->guid_cache, TRUE);
+		hash_flat_clear(list->guid_cache);
 		p_clear(list->guid_cache_pool);
 	}
 	list->guid_cache_invalidated = FALSE;
@@ -73,7 +73,7 @@ void mailbox_guid_cache_refresh(struct mailbox_list *list)
 			i_error("Couldn't get mailbox %s GUID: %s",
 				info->vname, mailbox_get_last_internal_error(box, NULL));
 			list->guid_cache_errors = TRUE;
-		} else if ((rec = hash_table_lookup(list->guid_cache,
+		} else if ((rec = hash_flat_lookup(list->guid_cache,
 				(const uint8_t *)metadata.guid)) != NULL) {
 			i_warning("Mailbox %s has duplicate GUID with %s: %s",
 				  info->vname, rec->vname,
@@ -84,7 +84,7 @@ void mailbox_guid_cache_refresh(struct mailbox_list *list)
 			memcpy(rec->guid, metadata.guid, sizeof(rec->guid));
 			rec->vname = p_strdup(list->guid_cache_pool, info->vname);
 			guid_p = rec->guid;
-			hash_table_insert(list->guid_cache, guid_p, rec);
+			hash_flat_insert(list->guid_cache, guid_p, rec);
 		}
 		mailbox_free(&box);
 	}
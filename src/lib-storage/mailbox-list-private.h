@@ -128,7 +128,7 @@ struct mailbox_list {
 	int lock_refcount;
 
 	pool_t guid_cache_pool;
-	HASH_TABLE(uint8_t *, struct mailbox_guid_cache_rec *) guid_cache;
+	HASH_FLAT(uint8_t *, struct mailbox_guid_cache_rec *) guid_cache;
 	bool guid_cache_errors;
 
 	/* Last error set in mailbox_list_set_critical(). */
@@ -9,7 +9,7 @@
 #include "hex-binary.h"
 #include "str.h"
 #include "sha1.h"
-#include "hash.h"
+#include "hash-flat.h"
 #include "home-expand.h"
 #include "time-util.h"
 #include "unichar.h"
@@ -814,8 +814,8 @@ void mailbox_list_destroy(struct mailbox_list **_list)
 	i_free_and_null(list->error_string);
 	i_free(list->last_internal_error);
 
-	if (hash_table_is_created(list->guid_cache)) {
-		hash_table_destroy(&list->guid_cache);
+	if (hash_flat_is_created(list->guid_cache)) {
+		hash_flat_destroy(&list->guid_cache);
 		pool_unref(&list->guid_cache_pool);
 	}
 
@@ -0,0 +1,419 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "hostpid.h"
+#include "net.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "mail-search-build.h"
+#include "mail-storage-private.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_HOME_NAME ".test-imapc-storage"
+#define TEST_UIDVALIDITY 1234
+
+struct test_server {
+	in_port_t port;
+	pid_t pid;
+
+	int fd_listen, fd;
+	struct istream *input;
+	struct ostream *output;
+};
+
+static struct ip_addr bind_ip;
+static struct test_server server;
+static uint32_t test_mail_count;
+/* absolute paths, since mail_storage_service changes the directory */
+static const char *test_cwd, *test_home, *test_fetch_log;
+static struct ioloop *test_ioloop;
+
+static const char *test_mail_body(uint32_t uid)
+{
+	return t_strdup_printf("Subject: mail %u\r\n\r\nbody %u\r\n", uid, uid);
+}
+
+static void test_server_log_fetch(const char *uidset)
+{
+	int fd;
+
+	fd = open(test_fetch_log, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_fetch_log);
+	if (write(fd, t_strconcat(uidset, "\n", NULL), strlen(uidset)+1) < 0)
+		i_fatal("write(%s) failed: %m", test_fetch_log);
+	i_close_fd(&fd);
+}
+
+static void test_server_fetch_bodies(const char *tag, const char *uidset)
+{
+	const char *const *ranges = t_strsplit(uidset, ",");
+	uint32_t uid, uid1, uid2;
+	const char *p, *body;
+
+	test_server_log_fetch(uidset);
+	for (; *ranges != NULL; ranges++) {
+		p = strchr(*ranges, ':');
+		if (p == NULL) {
+			if (str_to_uint32(*ranges, &uid1) < 0)
+				i_unreached();
+			uid2 = uid1;
+		} else if (str_to_uint32(t_strdup_until(*ranges, p), &uid1) < 0 ||
+			   str_to_uint32(p+1, &uid2) < 0) {
+			i_unreached();
+		}
+		for (uid = uid1; uid <= uid2; uid++) {
+			body = test_mail_body(uid);
+			o_stream_nsend_str(server.output, t_strdup_printf(
+				"* %u FETCH (UID %u BODY[] {%"PRIuSIZE_T"}\r\n%s)\r\n",
+				uid, uid, strlen(body), body));
+		}
+	}
+	o_stream_nsend_str(server.output,
+			   t_strdup_printf("%s OK Fetch completed\r\n", tag));
+}
+
+static void test_server_command(const char *line)
+{
+	const char *const *args = t_strsplit(line, " ");
+	const char *tag = args[0], *cmd = args[1];
+	string_t *str = t_str_new(256);
+	uint32_t uid;
+
+	if (cmd == NULL)
+		i_fatal("Invalid command: %s", line);
+	if (strcasecmp(cmd, "LIST") == 0)
+		str_append(str, "* LIST () \".\" \"\"\r\n");
+	else if (strcasecmp(cmd, "SELECT") == 0 ||
+		 strcasecmp(cmd, "EXAMINE") == 0) {
+		str_printfa(str, "* %u EXISTS\r\n"
+			    "* OK [UIDVALIDITY %u] UIDs valid\r\n"
+			    "* OK [UIDNEXT %u] Predicted next UID\r\n",
+			    test_mail_count, TEST_UIDVALIDITY,
+			    test_mail_count+1);
+	} else if (strcasecmp(cmd, "UID") == 0 && args[2] != NULL &&
+		   strcasecmp(args[2], "FETCH") == 0 && args[3] != NULL &&
+		   args[4] != NULL) {
+		if (strcmp(args[4], "(BODY.PEEK[])") == 0) {
+			test_server_fetch_bodies(tag, args[3]);
+			return;
+		}
+		for (uid = 1; uid <= test_mail_count; uid++) {
+			str_printfa(str, "* %u FETCH (UID %u FLAGS ())\r\n",
+				    uid, uid);
+		}
+	} else if (strcasecmp(cmd, "LOGOUT") == 0)
+		str_append(str, "* BYE Logging out\r\n");
+	str_printfa(str, "%s OK Completed\r\n", tag);
+	o_stream_nsend(server.output, str_data(str), str_len(str));
+}
+
+static void test_server_run(void)
+{
+	const char *line;
+
+	/* handle each session in its own process until killed */
+	if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+		i_fatal("signal(SIGCHLD) failed: %m");
+	for (;;) {
+		server.fd = net_accept(server.fd_listen, NULL, NULL);
+		i_assert(server.fd >= 0);
+		switch (fork()) {
+		case -1:
+			i_fatal("fork() failed: %m");
+		case 0:
+			i_close_fd(&server.fd_listen);
+			break;
+		default:
+			i_close_fd(&server.fd);
+			continue;
+		}
+		fd_set_nonblock(server.fd, FALSE);
+		server.input = i_stream_create_fd(server.fd, (size_t)-1);
+		server.output = o_stream_create_fd(server.fd, (size_t)-1);
+		o_stream_set_no_error_handling(server.output, TRUE);
+
+		o_stream_nsend_str(server.output,
+			"* OK [CAPABILITY IMAP4rev1] ready\r\n");
+		while ((line = i_stream_read_next_line(server.input)) != NULL) T_BEGIN {
+			test_server_command(line);
+		} T_END;
+
+		i_stream_unref(&server.input);
+		o_stream_unref(&server.output);
+		i_close_fd(&server.fd);
+		exit(0);
+	}
+}
+
+static void test_server_start(void)
+{
+	i_zero(&server);
+	server.fd = -1;
+	server.fd_listen = net_listen(&bind_ip, &server.port, 128);
+	if (server.fd_listen == -1)
+		i_fatal("listen(%s) failed: %m", net_ip2addr(&bind_ip));
+	fd_set_nonblock(server.fd_listen, FALSE);
+
+	if ((server.pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server.pid == 0) {
+		/* child: server */
+		hostpid_init();
+		test_server_run();
+		exit(1);
+	}
+	i_close_fd(&server.fd_listen);
+}
+
+static void test_server_kill(void)
+{
+	if (kill(server.pid, SIGKILL) < 0)
+		i_fatal("kill(%ld) failed: %m", (long)server.pid);
+	if (waitpid(server.pid, NULL, 0) < 0)
+		i_fatal("waitpid(%ld) failed: %m", (long)server.pid);
+}
+
+static const char *test_read_fetch_log(void)
+{
+	ARRAY_TYPE(const_string) lines;
+	const char *line;
+	struct istream *input;
+	int fd;
+
+	fd = open(test_fetch_log, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return "";
+		i_fatal("open(%s) failed: %m", test_fetch_log);
+	}
+	t_array_init(&lines, 8);
+	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		line = t_strdup(line);
+		array_append(&lines, &line, 1);
+	}
+	i_stream_unref(&input);
+	i_unlink(test_fetch_log);
+
+	/* FETCHes from different connections may be logged in any order */
+	array_sort(&lines, i_strcmp_p);
+	array_append_zero(&lines);
+	return t_strarray_join(array_idx(&lines, 0), " ");
+}
+
+static struct mail_user *
+test_imapc_user_init(struct mail_storage_service_ctx *storage_service,
+		     const char *const *extra_fields,
+		     struct mail_storage_service_user **service_user_r)
+{
+	ARRAY_TYPE(const_string) userdb_fields;
+	struct mail_storage_service_input input = {
+		.username = "testuser",
+		.no_userdb_lookup = TRUE,
+	};
+	struct mail_user *user;
+	const char *field, *error;
+
+	t_array_init(&userdb_fields, 16);
+	field = "mail=imapc:~/imapc";
+	array_append(&userdb_fields, &field, 1);
+	field = t_strdup_printf("home=%s", test_home);
+	array_append(&userdb_fields, &field, 1);
+	field = "imapc_host=127.0.0.1";
+	array_append(&userdb_fields, &field, 1);
+	field = t_strdup_printf("imapc_port=%u", server.port);
+	array_append(&userdb_fields, &field, 1);
+	field = "imapc_user=testuser";
+	array_append(&userdb_fields, &field, 1);
+	field = "imapc_password=testpass";
+	array_append(&userdb_fields, &field, 1);
+	array_append(&userdb_fields, extra_fields,
+		     str_array_length(extra_fields));
+	array_append_zero(&userdb_fields);
+	input.userdb_fields = array_idx(&userdb_fields, 0);
+
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     service_user_r, &user,
+					     &error) < 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+	return user;
+}
+
+static void test_imapc_read_all(struct mail_user *user)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	string_t *str = t_str_new(128);
+	size_t size;
+	uint32_t count = 0;
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 MAIL_FETCH_STREAM_BODY, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		count++;
+		if (mail_get_stream(mail, NULL, NULL, &input) < 0) {
+			test_assert_idx(FALSE, mail->uid);
+			continue;
+		}
+		str_truncate(str, 0);
+		while (i_stream_read_more(input, &data, &size) > 0) {
+			str_append_data(str, data, size);
+			i_stream_skip(input, size);
+		}
+		test_assert_idx(strcmp(str_c(str),
+				       test_mail_body(mail->uid)) == 0,
+				mail->uid);
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+	test_assert(count == test_mail_count);
+}
+
+static void
+test_imapc_session(struct mail_storage_service_ctx *storage_service,
+		   const char *const *extra_fields)
+{
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+
+	user = test_imapc_user_init(storage_service, extra_fields,
+				    &service_user);
+	test_imapc_read_all(user);
+	mail_user_unref(&user);
+	mail_storage_service_user_unref(&service_user);
+}
+
+static struct mail_storage_service_ctx *
+test_imapc_init(const char *name, uint32_t mail_count)
+{
+	const char *error;
+	char cwd[4096];
+
+	test_begin(name);
+	test_mail_count = mail_count;
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		i_fatal("getcwd() failed: %m");
+	test_cwd = t_strdup(cwd);
+	test_home = t_strdup_printf("%s/"TEST_HOME_NAME, cwd);
+	test_fetch_log = t_strdup_printf("%s/"TEST_HOME_NAME".fetches", cwd);
+	i_unlink_if_exists(test_fetch_log);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0 && errno != ENOENT)
+		i_fatal("%s", error);
+	if (mkdir(test_home, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", test_home);
+	test_server_start();
+
+	test_ioloop = io_loop_create();
+	return mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+}
+
+static void
+test_imapc_deinit(struct mail_storage_service_ctx **storage_service)
+{
+	const char *error;
+
+	mail_storage_service_deinit(storage_service);
+	io_loop_destroy(&test_ioloop);
+	test_server_kill();
+	if (chdir(test_cwd) < 0)
+		i_fatal("chdir(%s) failed: %m", test_cwd);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("%s", error);
+	test_end();
+}
+
+static void test_imapc_fetch_batching_and_body_cache(void)
+{
+	const char *const extra_fields[] = {
+		"imapc_body_cache_size=1M",
+		"mail_prefetch_count=10",
+		NULL
+	};
+	struct mail_storage_service_ctx *storage_service;
+
+	storage_service = test_imapc_init("imapc fetch batching and body cache", 5);
+
+	/* all the prefetched bodies are fetched with a single UID range */
+	test_imapc_session(storage_service, extra_fields);
+	test_assert_strcmp(test_read_fetch_log(), "1:5");
+
+	/* the next session gets the bodies from the on-disk cache */
+	test_imapc_session(storage_service, extra_fields);
+	test_assert_strcmp(test_read_fetch_log(), "");
+
+	test_imapc_deinit(&storage_service);
+}
+
+static void test_imapc_fetch_connections(void)
+{
+	const char *const extra_fields[] = {
+		"imapc_fetch_connections=2",
+		"mail_prefetch_count=40",
+		NULL
+	};
+	struct mail_storage_service_ctx *storage_service;
+
+	storage_service = test_imapc_init("imapc fetch connections", 40);
+
+	/* the prefetched FETCH is split between the two connections */
+	test_imapc_session(storage_service, extra_fields);
+	test_assert_strcmp(test_read_fetch_log(), "1:20 21:40");
+
+	test_imapc_deinit(&storage_service);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_imapc_fetch_batching_and_body_cache,
+		test_imapc_fetch_connections,
+		NULL
+	};
+
+	master_service = master_service_init("test-imapc-storage",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (net_addr2ip("127.0.0.1", &bind_ip) < 0)
+		i_unreached();
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -0,0 +1,166 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "maildir-scan-dir.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-maildir-scan-dir"
+/* long enough names that a small buffer fits only a few of them */
+#define TEST_FNAME_PREFIX "1530000000.M123456P7890.test-host-name,S=1234,W=1260:2,"
+#define TEST_FILE_COUNT 1000
+
+static void test_dir_create(unsigned int file_count)
+{
+	const char *error, *path;
+	unsigned int i;
+	int fd;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_DIR, error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+
+	for (i = 0; i < file_count; i++) {
+		path = t_strdup_printf(TEST_DIR"/"TEST_FNAME_PREFIX"%u", i);
+		fd = creat(path, 0600);
+		if (fd == -1)
+			i_fatal("creat(%s) failed: %m", path);
+		i_close_fd(&fd);
+	}
+	/* dotfiles are left for the caller to skip */
+	fd = creat(TEST_DIR"/.hidden", 0600);
+	if (fd == -1)
+		i_fatal("creat(%s/.hidden) failed: %m", TEST_DIR);
+	i_close_fd(&fd);
+}
+
+static void test_dir_delete(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", TEST_DIR, error);
+}
+
+static void test_dir_scan(size_t buf_size, unsigned int file_count)
+{
+	struct maildir_scan_dir_reader reader;
+	const char *fname;
+	unsigned int idx, found_count = 0;
+	bool *found, hidden_found = FALSE, failed = FALSE;
+	DIR *dirp;
+
+	dirp = opendir(TEST_DIR);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", TEST_DIR);
+
+	found = i_new(bool, file_count + 1);
+	maildir_scan_dir_reader_init(&reader, dirp, buf_size);
+	errno = 0;
+	for (; (fname = maildir_scan_dir_next(&reader)) != NULL; errno = 0) {
+		if (strcmp(fname, ".hidden") == 0) {
+			test_assert(!hidden_found);
+			hidden_found = TRUE;
+		} else if (strncmp(fname, TEST_FNAME_PREFIX,
+				   strlen(TEST_FNAME_PREFIX)) != 0 ||
+			   str_to_uint(fname + strlen(TEST_FNAME_PREFIX),
+				       &idx) < 0 || idx >= file_count ||
+			   found[idx]) {
+			/* includes "." and ".." */
+			failed = TRUE;
+		} else {
+			found[idx] = TRUE;
+			found_count++;
+		}
+	}
+	test_assert(errno == 0);
+	test_assert(!failed);
+	test_assert(hidden_found);
+	test_assert(found_count == file_count);
+
+	/* the end of directory is returned again */
+	errno = 0;
+	test_assert(maildir_scan_dir_next(&reader) == NULL && errno == 0);
+
+	maildir_scan_dir_reader_deinit(&reader);
+	test_assert(reader.buf == NULL);
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", TEST_DIR);
+	i_free(found);
+}
+
+static void test_maildir_scan_dir_getdents(void)
+{
+	test_begin("maildir scan dir getdents");
+	test_dir_create(TEST_FILE_COUNT);
+	test_dir_scan(MAILDIR_SCAN_DIR_BUF_SIZE, TEST_FILE_COUNT);
+	test_dir_delete();
+	test_end();
+}
+
+static void test_maildir_scan_dir_refill(void)
+{
+	test_begin("maildir scan dir buffer refill");
+	test_dir_create(TEST_FILE_COUNT);
+	/* the buffer fits only a few entries, so it's refilled hundreds of
+	   times */
+	test_dir_scan(512, TEST_FILE_COUNT);
+	test_dir_delete();
+	test_end();
+}
+
+static void test_maildir_scan_dir_readdir(void)
+{
+	test_begin("maildir scan dir readdir");
+	test_dir_create(TEST_FILE_COUNT);
+	test_dir_scan(0, TEST_FILE_COUNT);
+	test_dir_delete();
+	test_end();
+}
+
+static void test_maildir_scan_dir_empty(void)
+{
+	struct maildir_scan_dir_reader reader;
+	DIR *dirp;
+
+	test_begin("maildir scan dir empty");
+	test_dir_create(0);
+	test_dir_scan(512, 0);
+	test_dir_scan(0, 0);
+
+	/* only "." and ".." */
+	if (unlink(TEST_DIR"/.hidden") < 0)
+		i_fatal("unlink(%s/.hidden) failed: %m", TEST_DIR);
+	dirp = opendir(TEST_DIR);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", TEST_DIR);
+	maildir_scan_dir_reader_init(&reader, dirp, 512);
+	errno = 0;
+	test_assert(maildir_scan_dir_next(&reader) == NULL && errno == 0);
+	maildir_scan_dir_reader_deinit(&reader);
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", TEST_DIR);
+
+	test_dir_delete();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_maildir_scan_dir_getdents,
+		test_maildir_scan_dir_refill,
+		test_maildir_scan_dir_readdir,
+		test_maildir_scan_dir_empty,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,429 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "byteorder.h"
+#include "ioloop.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "maildir-storage.h"
+#include "maildir-uidlist.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_HOME_NAME ".test-maildir-uidlist"
+
+/* these match the binary format described in maildir-uidlist.c */
+#define TEST_BINARY_HDR_SIZE_OFFSET 4
+#define TEST_BINARY_BLOCK_HDR_SIZE 8
+#define TEST_BINARY_REC_SIZE 12
+
+static const char *test_cwd, *test_home, *test_uidlist_path;
+static struct mail_storage_service_ctx *test_storage_service;
+static struct ioloop *test_ioloop;
+static unsigned int test_mail_count;
+
+static void test_maildir_add_mails(unsigned int count)
+{
+	const char *path;
+	int fd;
+
+	for (; count > 0; count--) {
+		test_mail_count++;
+		path = t_strdup_printf("%s/Maildir/cur/%u.M%uP1.test:2,",
+				       test_home, test_mail_count,
+				       test_mail_count);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd == -1)
+			i_fatal("open(%s) failed: %m", path);
+		if (write(fd, "Subject: test\n\nbody\n", 20) != 20)
+			i_fatal("write(%s) failed: %m", path);
+		i_close_fd(&fd);
+	}
+}
+
+static struct mail_user *
+test_maildir_user_init(bool binary,
+		       struct mail_storage_service_user **service_user_r)
+{
+	const char *const userdb_fields[] = {
+		"mail=maildir:~/Maildir",
+		t_strdup_printf("home=%s", test_home),
+		t_strdup_printf("maildir_binary_uidlist=%s",
+				binary ? "yes" : "no"),
+		NULL
+	};
+	struct mail_storage_service_input input = {
+		.username = "testuser",
+		.no_userdb_lookup = TRUE,
+		.userdb_fields = userdb_fields,
+	};
+	struct mail_user *user;
+	const char *error;
+
+	if (mail_storage_service_lookup_next(test_storage_service, &input,
+					     service_user_r, &user,
+					     &error) < 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+	return user;
+}
+
+static struct mailbox *test_maildir_inbox_open(struct mail_user *user)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box;
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	return box;
+}
+
+/* Returns the uidlist records as "<uid> <filename>\n" lines. */
+static const char *test_maildir_uidlist_dump(struct maildir_uidlist *uidlist)
+{
+	struct maildir_uidlist_iter_ctx *iter;
+	enum maildir_uidlist_rec_flag flags;
+	string_t *str = t_str_new(256);
+	const char *filename;
+	uint32_t uid;
+
+	iter = maildir_uidlist_iter_init(uidlist);
+	while (maildir_uidlist_iter_next(iter, &uid, &flags, &filename))
+		str_printfa(str, "%u %s\n", uid, filename);
+	maildir_uidlist_iter_deinit(&iter);
+	return str_c(str);
+}
+
+/* Sync INBOX and return its uidlist contents as read by a new session. */
+static const char *test_maildir_session(bool binary)
+{
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+	struct mailbox *box;
+	struct maildir_mailbox *mbox;
+	const char *dump = "";
+
+	user = test_maildir_user_init(binary, &service_user);
+	box = test_maildir_inbox_open(user);
+	test_assert(mailbox_sync(box, MAILBOX_SYNC_FLAG_FULL_READ) == 0);
+	mailbox_free(&box);
+	mail_user_unref(&user);
+	mail_storage_service_user_unref(&service_user);
+
+	user = test_maildir_user_init(binary, &service_user);
+	box = test_maildir_inbox_open(user);
+	mbox = MAILDIR_MAILBOX(box);
+	test_assert(maildir_uidlist_refresh(mbox->uidlist) == 1);
+	dump = test_maildir_uidlist_dump(mbox->uidlist);
+	mailbox_free(&box);
+	mail_user_unref(&user);
+	mail_storage_service_user_unref(&service_user);
+	return dump;
+}
+
+/* Refresh INBOX's uidlist in a new session. Returns the refresh result. */
+static int test_maildir_refresh(const char **dump_r)
+{
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+	struct mailbox *box;
+	struct maildir_mailbox *mbox;
+	int ret;
+
+	user = test_maildir_user_init(TRUE, &service_user);
+	box = test_maildir_inbox_open(user);
+	mbox = MAILDIR_MAILBOX(box);
+	ret = maildir_uidlist_refresh(mbox->uidlist);
+	*dump_r = test_maildir_uidlist_dump(mbox->uidlist);
+	mailbox_free(&box);
+	mail_user_unref(&user);
+	mail_storage_service_user_unref(&service_user);
+	return ret;
+}
+
+static unsigned char test_uidlist_version(void)
+{
+	unsigned char version;
+	int fd;
+
+	fd = open(test_uidlist_path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_uidlist_path);
+	if (read(fd, &version, 1) != 1)
+		i_fatal("read(%s) failed: %m", test_uidlist_path);
+	i_close_fd(&fd);
+	return version;
+}
+
+static buffer_t *test_uidlist_read(void)
+{
+	buffer_t *buf = t_buffer_create(1024);
+	unsigned char data[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = open(test_uidlist_path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_uidlist_path);
+	while ((ret = read(fd, data, sizeof(data))) > 0)
+		buffer_append(buf, data, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", test_uidlist_path);
+	i_close_fd(&fd);
+	return buf;
+}
+
+static void test_uidlist_write(const void *data, size_t size)
+{
+	int fd;
+
+	fd = open(test_uidlist_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_uidlist_path);
+	if (write(fd, data, size) != (ssize_t)size)
+		i_fatal("write(%s) failed: %m", test_uidlist_path);
+	i_close_fd(&fd);
+}
+
+static void test_maildir_init(const char *name)
+{
+	const char *error;
+	char cwd[4096];
+
+	test_begin(name);
+	test_mail_count = 0;
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		i_fatal("getcwd() failed: %m");
+	test_cwd = t_strdup(cwd);
+	test_home = t_strdup_printf("%s/"TEST_HOME_NAME, cwd);
+	test_uidlist_path = t_strdup_printf("%s/Maildir/"MAILDIR_UIDLIST_NAME,
+					    test_home);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0 && errno != ENOENT)
+		i_fatal("%s", error);
+	if (mkdir(test_home, 0700) < 0 ||
+	    mkdir(t_strconcat(test_home, "/Maildir", NULL), 0700) < 0 ||
+	    mkdir(t_strconcat(test_home, "/Maildir/cur", NULL), 0700) < 0 ||
+	    mkdir(t_strconcat(test_home, "/Maildir/new", NULL), 0700) < 0 ||
+	    mkdir(t_strconcat(test_home, "/Maildir/tmp", NULL), 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", test_home);
+
+	test_ioloop = io_loop_create();
+	test_storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+}
+
+static void test_maildir_deinit(void)
+{
+	const char *error;
+
+	mail_storage_service_deinit(&test_storage_service);
+	io_loop_destroy(&test_ioloop);
+	if (chdir(test_cwd) < 0)
+		i_fatal("chdir(%s) failed: %m", test_cwd);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("%s", error);
+	test_end();
+}
+
+static void test_maildir_uidlist_binary_write_read(void)
+{
+	const char *dump, *dump2;
+	struct stat st, st2;
+
+	test_maildir_init("maildir uidlist v4 write and read");
+	test_maildir_add_mails(5);
+	dump = test_maildir_session(TRUE);
+	test_assert(test_uidlist_version() == 4);
+	test_assert(strncmp(dump, "1 ", 2) == 0);
+	test_assert(strstr(dump, "\n5 ") != NULL);
+	test_assert(strstr(dump, "\n6 ") == NULL);
+	if (stat(test_uidlist_path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", test_uidlist_path);
+
+	/* new mails are appended as a new block */
+	test_maildir_add_mails(3);
+	dump2 = test_maildir_session(TRUE);
+	test_assert(test_uidlist_version() == 4);
+	test_assert(strncmp(dump2, dump, strlen(dump)) == 0);
+	test_assert(strstr(dump2, "\n8 ") != NULL);
+	if (stat(test_uidlist_path, &st2) < 0)
+		i_fatal("stat(%s) failed: %m", test_uidlist_path);
+	test_assert(st2.st_ino == st.st_ino);
+	test_assert(st2.st_size > st.st_size);
+
+	/* nothing changes when reading it again */
+	test_assert_strcmp(test_maildir_session(TRUE), dump2);
+	test_maildir_deinit();
+}
+
+static void test_maildir_uidlist_binary_convert(void)
+{
+	const char *dump;
+
+	test_maildir_init("maildir uidlist v3 <-> v4 conversion");
+	test_maildir_add_mails(5);
+	dump = test_maildir_session(FALSE);
+	test_assert(test_uidlist_version() == '3');
+
+	/* the UIDs are preserved in both directions */
+	test_assert_strcmp(test_maildir_session(TRUE), dump);
+	test_assert(test_uidlist_version() == 4);
+	test_assert_strcmp(test_maildir_session(FALSE), dump);
+	test_assert(test_uidlist_version() == '3');
+	test_maildir_deinit();
+}
+
+/* Returns the file offset of the block following the one at offset. */
+static size_t test_uidlist_next_block(const buffer_t *file, size_t offset)
+{
+	const unsigned char *data = file->data;
+	uint32_t count, strings_size;
+
+	i_assert(offset + TEST_BINARY_BLOCK_HDR_SIZE <= file->used);
+	count = le32_to_cpu_unaligned(data + offset);
+	strings_size = le32_to_cpu_unaligned(data + offset + 4);
+	return offset + TEST_BINARY_BLOCK_HDR_SIZE +
+		count * TEST_BINARY_REC_SIZE + strings_size;
+}
+
+static size_t test_uidlist_first_block(const buffer_t *file)
+{
+	return le32_to_cpu_unaligned(CONST_PTR_OFFSET(file->data,
+		TEST_BINARY_HDR_SIZE_OFFSET));
+}
+
+static void test_maildir_uidlist_binary_truncated(void)
+{
+	const char *dump, *dump2, *new_dump;
+	buffer_t *file;
+	size_t block2;
+
+	test_maildir_init("maildir uidlist v4 truncated");
+	test_maildir_add_mails(5);
+	dump = test_maildir_session(TRUE);
+	test_maildir_add_mails(3);
+	dump2 = test_maildir_session(TRUE);
+	file = test_uidlist_read();
+	block2 = test_uidlist_next_block(file, test_uidlist_first_block(file));
+	test_assert(test_uidlist_next_block(file, block2) == file->used);
+
+	/* an incomplete trailing block is ignored until it's fully
+	   written */
+	test_uidlist_write(file->data, file->used - 1);
+	test_assert(test_maildir_refresh(&new_dump) == 1);
+	test_assert_strcmp(new_dump, dump);
+
+	/* so is an incomplete block header */
+	test_uidlist_write(file->data, block2 + TEST_BINARY_BLOCK_HDR_SIZE / 2);
+	test_assert(test_maildir_refresh(&new_dump) == 1);
+	test_assert_strcmp(new_dump, dump);
+
+	test_uidlist_write(file->data, file->used);
+	test_assert(test_maildir_refresh(&new_dump) == 1);
+	test_assert_strcmp(new_dump, dump2);
+
+	/* a truncated header makes the whole file broken */
+	test_uidlist_write(file->data, test_uidlist_first_block(file) - 1);
+	test_expect_error_string("Truncated header");
+	test_assert(test_maildir_refresh(&new_dump) == 0);
+	test_expect_no_more_errors();
+	test_assert_strcmp(new_dump, "");
+	test_maildir_deinit();
+}
+
+static void
+test_maildir_uidlist_corrupt(const buffer_t *file, size_t offset,
+			     uint32_t value, const char *error)
+{
+	buffer_t *corrupted = t_buffer_create(file->used);
+	unsigned char data[sizeof(uint32_t)];
+	const char *dump;
+
+	cpu32_to_le_unaligned(value, data);
+	buffer_append_buf(corrupted, file, 0, (size_t)-1);
+	buffer_write(corrupted, offset, data, sizeof(data));
+	test_uidlist_write(corrupted->data, corrupted->used);
+
+	/* the whole file is treated as broken, even if some records were
+	   read before the corruption */
+	test_expect_error_string(error);
+	test_assert(test_maildir_refresh(&dump) == 0);
+	test_expect_no_more_errors();
+}
+
+static void test_maildir_uidlist_binary_corrupted(void)
+{
+	buffer_t *file;
+	size_t block, rec;
+	uint32_t strings_size;
+
+	test_maildir_init("maildir uidlist v4 corrupted");
+	test_maildir_add_mails(5);
+	(void)test_maildir_session(TRUE);
+	file = test_uidlist_read();
+	block = test_uidlist_first_block(file);
+	rec = block + TEST_BINARY_BLOCK_HDR_SIZE;
+	strings_size = le32_to_cpu_unaligned(CONST_PTR_OFFSET(file->data,
+							      block + 4));
+
+	/* header */
+	test_maildir_uidlist_corrupt(file, TEST_BINARY_HDR_SIZE_OFFSET, 8,
+				     "invalid header size 8");
+	test_maildir_uidlist_corrupt(file, TEST_BINARY_HDR_SIZE_OFFSET,
+				     0x7fffffff, "invalid header size");
+	/* UID validity */
+	test_maildir_uidlist_corrupt(file, 8, 0, "Broken header");
+	/* block header */
+	test_maildir_uidlist_corrupt(file, block, 0, "Invalid block");
+	test_maildir_uidlist_corrupt(file, block + 4, 0x7fffffff,
+				     "Invalid block");
+	/* records */
+	test_maildir_uidlist_corrupt(file, rec, 0, "Invalid record");
+	test_maildir_uidlist_corrupt(file, rec + 4, strings_size,
+				     "Invalid record");
+	test_maildir_uidlist_corrupt(file, rec + 8, strings_size,
+				     "Invalid record");
+	/* extensions offset pointing to the filename, which doesn't begin
+	   with a valid extension key */
+	test_maildir_uidlist_corrupt(file, rec + 8,
+		le32_to_cpu_unaligned(CONST_PTR_OFFSET(file->data, rec + 4)),
+		"Invalid record");
+	/* UIDs must be growing */
+	test_maildir_uidlist_corrupt(file, rec + TEST_BINARY_REC_SIZE, 1,
+				     "UIDs not ordered");
+	test_maildir_deinit();
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_maildir_uidlist_binary_write_read,
+		test_maildir_uidlist_binary_convert,
+		test_maildir_uidlist_binary_truncated,
+		test_maildir_uidlist_binary_corrupted,
+		NULL
+	};
+
+	master_service = master_service_init("test-maildir-uidlist",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "test-common.h"
+#include "mbox-storage.h"
+#include "mbox-sync-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_MBOX_PATH ".test-mbox-move"
+/* larger than mbox_move()'s buffer, so the data is moved in several
+   blocks */
+#define TEST_MBOX_SIZE (1024*1024*5/2)
+
+struct test_move {
+	uoff_t dest, source, size;
+};
+
+static void test_mbox_fill(unsigned char *data, size_t size)
+{
+	size_t i;
+
+	/* a pattern that doesn't repeat at the block size, so misplaced
+	   blocks are noticed */
+	for (i = 0; i < size; i++)
+		data[i] = (i * 7 + i / 251) % 256;
+}
+
+static void test_mbox_move_one(const struct test_move *move)
+{
+	struct mbox_sync_context sync_ctx;
+	unsigned char *expected, *data;
+	size_t file_size, new_size;
+	int fd;
+
+	file_size = TEST_MBOX_SIZE;
+	new_size = I_MAX(file_size, move->dest + move->size);
+	expected = i_malloc(new_size);
+	data = i_malloc(new_size);
+	test_mbox_fill(expected, file_size);
+
+	fd = open(TEST_MBOX_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_MBOX_PATH);
+	if (write_full(fd, expected, file_size) < 0)
+		i_fatal("write(%s) failed: %m", TEST_MBOX_PATH);
+	memmove(expected + move->dest, expected + move->source, move->size);
+
+	i_zero(&sync_ctx);
+	sync_ctx.write_fd = fd;
+	sync_ctx.input = i_stream_create_fd(fd, 1024);
+	test_assert(mbox_move(&sync_ctx, move->dest, move->source,
+			      move->size) == 0);
+	test_assert(sync_ctx.last_stat.st_size == (off_t)new_size);
+
+	test_assert(pread_full(fd, data, new_size, 0) > 0);
+	test_assert(memcmp(data, expected, new_size) == 0);
+
+	i_stream_unref(&sync_ctx.input);
+	if (sync_ctx.move_buf != NULL)
+		buffer_free(&sync_ctx.move_buf);
+	i_close_fd(&fd);
+	i_unlink(TEST_MBOX_PATH);
+	i_free(expected);
+	i_free(data);
+}
+
+static void test_mbox_move_backwards(void)
+{
+	static const struct test_move moves[] = {
+		/* overlapping by more than one block */
+		{ 100, 200, TEST_MBOX_SIZE - 200 },
+		{ 1, 1024*1024 - 1, TEST_MBOX_SIZE - 1024*1024 + 1 },
+		/* overlapping by less than one block */
+		{ 0, 1024*1024 + 10, TEST_MBOX_SIZE - 1024*1024 - 10 },
+		/* small move within one block */
+		{ 10, 20, 1000 },
+		/* not overlapping */
+		{ 0, TEST_MBOX_SIZE / 2, TEST_MBOX_SIZE / 2 },
+	};
+	unsigned int i;
+
+	test_begin("mbox_move() backwards");
+	for (i = 0; i < N_ELEMENTS(moves); i++)
+		test_mbox_move_one(&moves[i]);
+	test_end();
+}
+
+static void test_mbox_move_forwards(void)
+{
+	static const struct test_move moves[] = {
+		/* overlapping by more than one block */
+		{ 200, 100, TEST_MBOX_SIZE - 200 },
+		{ 1024*1024 + 1, 2, TEST_MBOX_SIZE - 1024*1024 - 1 },
+		/* growing the file */
+		{ 300, 0, TEST_MBOX_SIZE },
+		{ 1024*1024 + 10, 0, TEST_MBOX_SIZE },
+		/* small move within one block */
+		{ 20, 10, 1000 },
+		/* not overlapping */
+		{ TEST_MBOX_SIZE / 2, 0, TEST_MBOX_SIZE / 2 },
+	};
+	unsigned int i;
+
+	test_begin("mbox_move() forwards");
+	for (i = 0; i < N_ELEMENTS(moves); i++)
+		test_mbox_move_one(&moves[i]);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_mbox_move_backwards,
+		test_mbox_move_forwards,
+		NULL
+	};
+	return test_run(test_functions);
+}
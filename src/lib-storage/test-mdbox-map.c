@@ -0,0 +1,302 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "event-filter.h"
+#include "lib-event-private.h"
+#include "test-common.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "mdbox-storage.h"
+#include "mdbox-map-private.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_HOME_NAME ".test-mdbox-map"
+#define TEST_SHARD_COUNT 4
+#define TEST_LOCK_EVENT_NAME "mdbox_map_lock_finished"
+
+static const char *test_cwd, *test_home;
+static struct mail_storage_service_ctx *test_storage_service;
+static struct mail_storage_service_user *test_service_user;
+static struct ioloop *test_ioloop;
+/* shard numbers of the sent lock events, separated by spaces */
+static string_t *test_locked_shards;
+
+static bool
+test_lock_event_callback(struct event *event,
+			 enum event_callback_type type,
+			 struct failure_context *ctx ATTR_UNUSED,
+			 const char *fmt ATTR_UNUSED,
+			 va_list args ATTR_UNUSED)
+{
+	const struct event_field *field;
+
+	if (type != EVENT_CALLBACK_TYPE_EVENT ||
+	    null_strcmp(event->sending_name, TEST_LOCK_EVENT_NAME) != 0)
+		return TRUE;
+
+	test_assert(null_strcmp(event_find_field_str(event, "reason"),
+				"test") == 0);
+	test_assert(event_find_field(event, "lock_wait_usecs") != NULL);
+	test_assert(event_find_field(event, "error") == NULL);
+	field = event_find_field(event, "shard");
+	test_assert(field != NULL);
+	if (field != NULL) {
+		if (str_len(test_locked_shards) > 0)
+			str_append_c(test_locked_shards, ' ');
+		str_printfa(test_locked_shards, "%jd", field->value.intmax);
+	}
+	return FALSE;
+}
+
+static struct mail_user *test_mdbox_user_init(void)
+{
+	const char *const userdb_fields[] = {
+		"mail=mdbox:~/mdbox",
+		t_strdup_printf("home=%s", test_home),
+		t_strdup_printf("mdbox_map_shards=%u", TEST_SHARD_COUNT),
+		NULL
+	};
+	struct mail_storage_service_input input = {
+		.username = "testuser",
+		.no_userdb_lookup = TRUE,
+		.userdb_fields = userdb_fields,
+	};
+	struct mail_user *user;
+	const char *error;
+
+	if (mail_storage_service_lookup_next(test_storage_service, &input,
+					     &test_service_user, &user,
+					     &error) < 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+	return user;
+}
+
+static struct mail_user *test_mdbox_init(const char *name)
+{
+	const char *error;
+	char cwd[4096];
+
+	test_begin(name);
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		i_fatal("getcwd() failed: %m");
+	test_cwd = t_strdup(cwd);
+	test_home = t_strdup_printf("%s/"TEST_HOME_NAME, cwd);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0 && errno != ENOENT)
+		i_fatal("%s", error);
+	if (mkdir(test_home, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", test_home);
+
+	test_ioloop = io_loop_create();
+	test_storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+	return test_mdbox_user_init();
+}
+
+static void test_mdbox_deinit(struct mail_user **user)
+{
+	const char *error;
+
+	mail_user_unref(user);
+	mail_storage_service_user_unref(&test_service_user);
+	mail_storage_service_deinit(&test_storage_service);
+	io_loop_destroy(&test_ioloop);
+	if (chdir(test_cwd) < 0)
+		i_fatal("chdir(%s) failed: %m", test_cwd);
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("%s", error);
+	test_end();
+}
+
+static struct mdbox_map *test_mdbox_get_map(struct mail_user *user)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mdbox_storage *mstorage = MDBOX_STORAGE(ns->storage);
+
+	return mstorage->map;
+}
+
+static void test_mdbox_save(struct mail_user *user)
+{
+	struct mail_namespace *ns = mail_namespace_find_inbox(user->namespaces);
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	int ret;
+
+	input = i_stream_create_from_data("Subject: test\n\nbody\n", 20);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	trans = mailbox_transaction_begin(box,
+		MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	test_assert(mailbox_save_begin(&save_ctx, input) == 0);
+	while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+		test_assert(mailbox_save_continue(save_ctx) == 0);
+	}
+	test_assert(mailbox_save_finish(&save_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mailbox_free(&box);
+	i_stream_unref(&input);
+}
+
+static void test_mdbox_map_shard_selection(void)
+{
+	static const struct {
+		uint32_t id;
+		unsigned int shard_idx;
+	} tests[] = {
+		{ 0, 0 },
+		{ 1, 0 },
+		{ MDBOX_MAP_SHARD_ID_RANGE, 0 },
+		{ MDBOX_MAP_SHARD_ID_RANGE + 1, 1 },
+		{ MDBOX_MAP_SHARD_ID_RANGE * 2, 1 },
+		{ MDBOX_MAP_SHARD_ID_RANGE * 3, 2 },
+		{ MDBOX_MAP_SHARD_ID_RANGE * 3 + 1, 3 },
+		/* the last shard owns all the remaining IDs */
+		{ MDBOX_MAP_SHARD_ID_RANGE * 4 + 1, 3 },
+		{ (uint32_t)-1, 3 },
+	};
+	struct mail_user *user;
+	struct mdbox_map *map, *const *shards;
+	unsigned int i, count, save_shard_idx;
+	uint32_t map_uid, file_id;
+	uoff_t offset;
+
+	user = test_mdbox_init("mdbox map shard selection");
+	map = test_mdbox_get_map(user);
+	shards = array_get(&map->shards, &count);
+	test_assert(count == TEST_SHARD_COUNT);
+
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(mdbox_map_get_shard(map, tests[i].id)->shard_idx ==
+				tests[i].shard_idx, i);
+	}
+
+	/* saves go to the shard selected by the PID. the map UID and the
+	   file_id both belong to that shard. */
+	save_shard_idx = (unsigned int)getpid() % TEST_SHARD_COUNT;
+	test_mdbox_save(user);
+	test_assert(mdbox_map_refresh(map) == 0);
+	for (i = 0; i < count; i++) {
+		test_assert_idx(mail_index_view_get_messages_count(shards[i]->view) ==
+				(i == save_shard_idx ? 1 : 0), i);
+	}
+	mail_index_lookup_uid(shards[save_shard_idx]->view, 1, &map_uid);
+	test_assert(mdbox_map_get_shard(map, map_uid) == shards[save_shard_idx]);
+	test_assert(mdbox_map_lookup(map, map_uid, &file_id, &offset) == 1);
+	test_assert(mdbox_map_get_shard(map, file_id) == shards[save_shard_idx]);
+
+	test_mdbox_deinit(&user);
+}
+
+static void test_mdbox_map_lock_order(void)
+{
+	const struct event_filter_query query = {
+		.name = TEST_LOCK_EVENT_NAME,
+	};
+	struct event_filter *filter;
+	struct mail_user *user;
+	struct mdbox_map *map;
+	struct mdbox_map_atomic_context *atomic;
+	struct mdbox_map_append_context *ctx;
+	ARRAY_TYPE(uint32_t) map_uids;
+	uint32_t map_uid;
+
+	user = test_mdbox_init("mdbox map lock order");
+	map = test_mdbox_get_map(user);
+
+	/* send the lock events without logging them */
+	test_locked_shards = t_str_new(64);
+	filter = event_filter_create();
+	event_filter_add(filter, &query);
+	event_set_global_debug_send_filter(filter);
+	event_register_callback(test_lock_event_callback);
+
+	t_array_init(&map_uids, 1);
+	atomic = mdbox_map_atomic_begin(map);
+	ctx = mdbox_map_append_begin(atomic);
+	/* locking a lower shard after a higher one relocks the higher one
+	   after the lower one */
+	map_uid = MDBOX_MAP_SHARD_ID_RANGE * 3 + 1;
+	array_append(&map_uids, &map_uid, 1);
+	test_assert(mdbox_map_append_lock(ctx, &map_uids, "test") == 0);
+	test_assert_strcmp(str_c(test_locked_shards), "3");
+	array_clear(&map_uids);
+	map_uid = MDBOX_MAP_SHARD_ID_RANGE + 1;
+	array_append(&map_uids, &map_uid, 1);
+	test_assert(mdbox_map_append_lock(ctx, &map_uids, "test") == 0);
+	test_assert_strcmp(str_c(test_locked_shards), "3 1 3");
+	test_assert(!mdbox_map_atomic_is_locked(atomic));
+
+	/* locking the whole map locks all the shards in ascending order */
+	str_truncate(test_locked_shards, 0);
+	test_assert(mdbox_map_atomic_lock(atomic, "test") == 0);
+	test_assert_strcmp(str_c(test_locked_shards), "0 1 2 3");
+	test_assert(mdbox_map_atomic_is_locked(atomic));
+	mdbox_map_append_free(&ctx);
+	test_assert(mdbox_map_atomic_finish(&atomic) == 0);
+
+	/* a higher shard can be locked without relocking the lower ones */
+	str_truncate(test_locked_shards, 0);
+	atomic = mdbox_map_atomic_begin(map);
+	ctx = mdbox_map_append_begin(atomic);
+	array_clear(&map_uids);
+	map_uid = 1;
+	array_append(&map_uids, &map_uid, 1);
+	test_assert(mdbox_map_append_lock(ctx, &map_uids, "test") == 0);
+	array_clear(&map_uids);
+	map_uid = MDBOX_MAP_SHARD_ID_RANGE * 2 + 1;
+	array_append(&map_uids, &map_uid, 1);
+	test_assert(mdbox_map_append_lock(ctx, &map_uids, "test") == 0);
+	test_assert_strcmp(str_c(test_locked_shards), "0 2");
+	mdbox_map_append_free(&ctx);
+	test_assert(mdbox_map_atomic_finish(&atomic) == 0);
+
+	/* purging a file locks only the file's shard */
+	str_truncate(test_locked_shards, 0);
+	atomic = mdbox_map_atomic_begin_file(map,
+		MDBOX_MAP_SHARD_ID_RANGE * 2 + 1);
+	test_assert(mdbox_map_atomic_lock(atomic, "test") == 0);
+	test_assert(mdbox_map_atomic_is_locked(atomic));
+	test_assert_strcmp(str_c(test_locked_shards), "2");
+	test_assert(mdbox_map_atomic_finish(&atomic) == 0);
+
+	event_unregister_callback(test_lock_event_callback);
+	event_unset_global_debug_send_filter();
+	event_filter_unref(&filter);
+	test_mdbox_deinit(&user);
+}
+
+int main(int argc, char **argv)
+{
+	int ret;
+	void (*const tests[])(void) = {
+		test_mdbox_map_shard_selection,
+		test_mdbox_map_lock_order,
+		NULL
+	};
+
+	master_service = master_service_init("test-mdbox-map",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	ret = test_run(tests);
+
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -4,6 +4,21 @@
 #include "base64.h"
 #include "buffer.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || \
+	 defined(__clang__))
+#  define HAVE_BASE64_SIMD
+#  include <immintrin.h>
+#  define ATTR_TARGET(arch) __attribute__((target(arch)))
+#endif
+
+#define IS_EMPTY(c) \
+	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
+
+/* base64_decode() decodes to a stack buffer of this size before appending
+   to the destination buffer */
+#define BASE64_DECODE_BUF_SIZE 1536
+
 static const char b64enc[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -43,15 +58,336 @@ static const unsigned char b64dec[256] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
 };
 
+/* The SIMD encoders return the number of bytes they consumed from src. The
+   decoders update *src_pos and return the number of bytes written to dest.
+   They handle only full blocks and leave the rest of the input to the
+   scalar code. The decoders skip over whitespace between quads and stop
+   at anything else that isn't a base64 character. */
+typedef size_t
+base64_encode_simd_t(const unsigned char *src, size_t src_size,
+		     unsigned char *dest);
+typedef size_t
+base64_decode_simd_t(const unsigned char *src, size_t src_size,
+		     size_t *src_pos, unsigned char *dest, size_t dest_size);
+
+static enum base64_simd base64_simd_active = BASE64_SIMD_NONE;
+static base64_encode_simd_t *base64_encode_simd = NULL;
+static base64_decode_simd_t *base64_decode_simd = NULL;
+static bool base64_simd_initialized = FALSE;
+
+#ifdef HAVE_BASE64_SIMD
+static inline bool
+base64_decode_skip_whitespace(const unsigned char *src, size_t src_size,
+			      size_t *src_pos)
+{
+	size_t pos = *src_pos;
+
+	while (pos < src_size && IS_EMPTY(src[pos]))
+		pos++;
+	if (pos == *src_pos)
+		return FALSE;
+	*src_pos = pos;
+	return TRUE;
+}
+
+/* The SIMD algorithms are from Wojciech Muła and Daniel Lemire:
+   "Faster Base64 Encoding and Decoding using AVX2 Instructions" */
+
+static inline __m128i ATTR_TARGET("ssse3")
+base64_encode_block_ssse3(__m128i input)
+{
+	__m128i t0, t1, t2, t3, indices, result, less;
+
+	/* split 12 bytes to 16 6bit indices, one per byte */
+	input = _mm_shuffle_epi8(input, _mm_setr_epi8(
+		1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+	t0 = _mm_and_si128(input, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(input, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	indices = _mm_or_si128(t1, t3);
+
+	/* translate the indices to ASCII by adding an offset, which depends
+	   on the index's range:
+	   0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+	result = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+	less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+	result = _mm_or_si128(result, _mm_and_si128(less, _mm_set1_epi8(13)));
+	result = _mm_shuffle_epi8(_mm_setr_epi8(
+		'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+		'/' - 63, 'A', 0, 0), result);
+	return _mm_add_epi8(result, indices);
+}
+
+static inline size_t ATTR_TARGET("ssse3")
+base64_encode_ssse3(const unsigned char *src, size_t src_size,
+		    unsigned char *dest)
+{
+	size_t src_pos;
+
+	/* 16 bytes are read, but only 12 are used */
+	for (src_pos = 0; src_size - src_pos >= 16;
+	     src_pos += 12, dest += 16) {
+		__m128i input = _mm_loadu_si128((const void *)(src + src_pos));
+
+		_mm_storeu_si128((void *)dest,
+				 base64_encode_block_ssse3(input));
+	}
+	return src_pos;
+}
+
+static size_t ATTR_TARGET("avx2")
+base64_encode_avx2(const unsigned char *src, size_t src_size,
+		   unsigned char *dest)
+{
+	size_t src_pos;
+
+	/* Same as SSSE3, but two blocks at a time. The 12 byte blocks are
+	   loaded to separate 128bit lanes. */
+	for (src_pos = 0; src_size - src_pos >= 28;
+	     src_pos += 24, dest += 32) {
+		__m256i input = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(
+				_mm_loadu_si128((const void *)(src + src_pos))),
+			_mm_loadu_si128((const void *)(src + src_pos + 12)), 1);
+		__m256i t0, t1, t2, t3, indices, result, less;
+
+		input = _mm256_shuffle_epi8(input, _mm256_setr_epi8(
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+			1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+		t0 = _mm256_and_si256(input, _mm256_set1_epi32(0x0fc0fc00));
+		t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+		t2 = _mm256_and_si256(input, _mm256_set1_epi32(0x003f03f0));
+		t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+		indices = _mm256_or_si256(t1, t3);
+
+		result = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+		result = _mm256_or_si256(result,
+			_mm256_and_si256(less, _mm256_set1_epi8(13)));
+		result = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+			'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+			'0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), result);
+		_mm256_storeu_si256((void *)dest,
+				    _mm256_add_epi8(result, indices));
+	}
+	/* one more block fits with SSSE3. it's inlined here, so it's
+	   compiled with the AVX2 encoding and there's no penalty for mixing
+	   SSE and AVX instructions. */
+	return src_pos + base64_encode_ssse3(src + src_pos,
+					     src_size - src_pos, dest);
+}
+
+/* Translate 16 base64 characters to 6bit values. Returns a bitmask of the
+   characters that are something else than base64 characters (including '='
+   and whitespace). */
+static inline unsigned int ATTR_TARGET("ssse3")
+base64_decode_translate_ssse3(__m128i *input)
+{
+	const __m128i mask_2f = _mm_set1_epi8(0x2f);
+	__m128i hi_nibbles, lo_nibbles, lo, hi, eq_2f, roll;
+	unsigned int invalid;
+
+	/* each character's high and low nibble map to bitmasks of
+	   character classes. the character is invalid if they have a
+	   common bit. */
+	hi_nibbles = _mm_and_si128(_mm_srli_epi32(*input, 4), mask_2f);
+	lo_nibbles = _mm_and_si128(*input, mask_2f);
+	lo = _mm_shuffle_epi8(_mm_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo_nibbles);
+	hi = _mm_shuffle_epi8(_mm_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi_nibbles);
+	invalid = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+						   _mm_setzero_si128())) ^ 0xffff;
+
+	/* the offset to add depends on the high nibble, except for '/' */
+	eq_2f = _mm_cmpeq_epi8(*input, mask_2f);
+	roll = _mm_shuffle_epi8(_mm_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71,
+		0, 0, 0, 0, 0, 0, 0, 0), _mm_add_epi8(eq_2f, hi_nibbles));
+	*input = _mm_add_epi8(*input, roll);
+	return invalid;
+}
+
+static inline __m128i ATTR_TARGET("ssse3")
+base64_decode_pack_ssse3(__m128i values)
+{
+	/* merge 4x 6bit values into 3 bytes in each 32bit lane and move the
+	   12 bytes to the beginning */
+	values = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+	values = _mm_madd_epi16(values, _mm_set1_epi32(0x00011000));
+	return _mm_shuffle_epi8(values, _mm_setr_epi8(
+		2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+static inline size_t ATTR_TARGET("ssse3")
+base64_decode_ssse3(const unsigned char *src, size_t src_size,
+		    size_t *src_pos, unsigned char *dest, size_t dest_size)
+{
+	size_t dest_pos = 0;
+	unsigned int quads;
+
+	/* 16 bytes are written, but only 12 are used */
+	while (src_size - *src_pos >= 16 && dest_size - dest_pos >= 16) {
+		__m128i input = _mm_loadu_si128((const void *)(src + *src_pos));
+		unsigned int invalid = base64_decode_translate_ssse3(&input);
+
+		_mm_storeu_si128((void *)(dest + dest_pos),
+				 base64_decode_pack_ssse3(input));
+		if (invalid == 0) {
+			*src_pos += 16;
+			dest_pos += 12;
+			continue;
+		}
+		/* the quads before the invalid character were decoded
+		   fine. continue after it if it was whitespace. */
+		quads = __builtin_ctz(invalid) / 4;
+		*src_pos += quads * 4;
+		dest_pos += quads * 3;
+		if (!base64_decode_skip_whitespace(src, src_size, src_pos))
+			break;
+	}
+	return dest_pos;
+}
+
+static size_t ATTR_TARGET("avx2")
+base64_decode_avx2(const unsigned char *src, size_t src_size,
+		   size_t *src_pos, unsigned char *dest, size_t dest_size)
+{
+	const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+	size_t dest_pos = 0;
+	unsigned int quads;
+
+	/* Same as SSSE3, but 32 bytes at a time. 32 bytes are written, but
+	   only 24 are used. */
+	while (src_size - *src_pos >= 32 && dest_size - dest_pos >= 32) {
+		__m256i input = _mm256_loadu_si256((const void *)(src + *src_pos));
+		__m256i hi_nibbles, lo_nibbles, lo, hi, eq_2f, roll, values;
+		unsigned int invalid;
+
+		hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(input, 4),
+					      mask_2f);
+		lo_nibbles = _mm256_and_si256(input, mask_2f);
+		lo = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+			0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+			0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a),
+			lo_nibbles);
+		hi = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+			0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+			0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10),
+			hi_nibbles);
+		invalid = ~(unsigned int)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi),
+					  _mm256_setzero_si256()));
+
+		eq_2f = _mm256_cmpeq_epi8(input, mask_2f);
+		roll = _mm256_shuffle_epi8(_mm256_setr_epi8(
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0,
+			0, 16, 19, 4, -65, -65, -71, -71,
+			0, 0, 0, 0, 0, 0, 0, 0),
+			_mm256_add_epi8(eq_2f, hi_nibbles));
+		values = _mm256_add_epi8(input, roll);
+
+		values = _mm256_maddubs_epi16(values,
+					      _mm256_set1_epi32(0x01400140));
+		values = _mm256_madd_epi16(values,
+					   _mm256_set1_epi32(0x00011000));
+		values = _mm256_shuffle_epi8(values, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		values = _mm256_permutevar8x32_epi32(values,
+			_mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+		_mm256_storeu_si256((void *)(dest + dest_pos), values);
+		if (invalid == 0) {
+			*src_pos += 32;
+			dest_pos += 24;
+			continue;
+		}
+		quads = __builtin_ctz(invalid) / 4;
+		*src_pos += quads * 4;
+		dest_pos += quads * 3;
+		if (!base64_decode_skip_whitespace(src, src_size, src_pos))
+			return dest_pos;
+	}
+	/* there may still be a 16 byte block (inlined like above) */
+	return dest_pos + base64_decode_ssse3(src, src_size, src_pos,
+					      dest + dest_pos,
+					      dest_size - dest_pos);
+}
+#endif
+
+enum base64_simd base64_simd_get_best(void)
+{
+#ifdef HAVE_BASE64_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return BASE64_SIMD_AVX2;
+	if (__builtin_cpu_supports("ssse3"))
+		return BASE64_SIMD_SSSE3;
+#endif
+	return BASE64_SIMD_NONE;
+}
+
+void base64_simd_set(enum base64_simd simd)
+{
+	i_assert(simd <= base64_simd_get_best());
+
+	base64_simd_initialized = TRUE;
+	base64_simd_active = simd;
+	switch (simd) {
+	case BASE64_SIMD_NONE:
+		base64_encode_simd = NULL;
+		base64_decode_simd = NULL;
+		break;
+#ifdef HAVE_BASE64_SIMD
+	case BASE64_SIMD_SSSE3:
+		base64_encode_simd = base64_encode_ssse3;
+		base64_decode_simd = base64_decode_ssse3;
+		break;
+	case BASE64_SIMD_AVX2:
+		base64_encode_simd = base64_encode_avx2;
+		base64_decode_simd = base64_decode_avx2;
+		break;
+#else
+	default:
+		i_unreached();
+#endif
+	}
+}
+
+enum base64_simd base64_simd_get(void)
+{
+	if (unlikely(!base64_simd_initialized))
+		base64_simd_set(base64_simd_get_best());
+	return base64_simd_active;
+}
+
 void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 {
 	const size_t res_size = MAX_BASE64_ENCODED_SIZE(src_size);
 	unsigned char *start = buffer_append_space_unsafe(dest, res_size);
 	unsigned char *ptr = start;
 	const unsigned char *src_c = src;
-	size_t src_pos;
+	size_t src_pos = 0;
 
-	for (src_pos = 0; src_size - src_pos > 2; src_pos += 3, ptr += 4) {
+	if (base64_simd_get() != BASE64_SIMD_NONE) {
+		src_pos = base64_encode_simd(src_c, src_size, ptr);
+		ptr += src_pos / 3 * 4;
+	}
+
+	for (; src_size - src_pos > 2; src_pos += 3, ptr += 4) {
 		ptr[0] = b64enc[src_c[src_pos] >> 2];
 		ptr[1] = b64enc[((src_c[src_pos] & 0x03) << 4) |
 				(src_c[src_pos+1] >> 4)];
@@ -83,18 +419,39 @@ void base64_encode(const void *src, size_t src_size, buffer_t *dest)
 	}
 }
 
-#define IS_EMPTY(c) \
-	((c) == '\n' || (c) == '\r' || (c) == ' ' || (c) == '\t')
-
 int base64_decode(const void *src, size_t src_size,
 		  size_t *src_pos_r, buffer_t *dest)
 {
 	const unsigned char *src_c = src;
-	size_t src_pos;
-	unsigned char input[4], output[3];
+	unsigned char outbuf[BASE64_DECODE_BUF_SIZE];
+	size_t src_pos, out_pos = 0;
+	unsigned char input[4], *output;
+	bool simd = base64_simd_get() != BASE64_SIMD_NONE;
+	bool try_simd = simd;
 	int ret = 1;
 
 	for (src_pos = 0; src_pos+3 < src_size; ) {
+		if (out_pos > BASE64_DECODE_BUF_SIZE - 3) {
+			buffer_append(dest, outbuf, out_pos);
+			out_pos = 0;
+		}
+		if (try_simd) {
+			/* decode as many blocks as possible until a
+			   non-base64 character is found */
+			if (out_pos > BASE64_DECODE_BUF_SIZE / 2) {
+				buffer_append(dest, outbuf, out_pos);
+				out_pos = 0;
+			}
+			out_pos += base64_decode_simd(src_c, src_size,
+				&src_pos, outbuf + out_pos,
+				sizeof(outbuf) - out_pos);
+			/* continue with the scalar code, unless the SIMD
+			   code stopped only because outbuf became full */
+			try_simd = sizeof(outbuf) - out_pos < 32;
+			continue;
+		}
+		output = outbuf + out_pos;
+
 		input[0] = b64dec[src_c[src_pos]];
 		if (input[0] == 0xff) {
 			if (unlikely(!IS_EMPTY(src_c[src_pos]))) {
@@ -102,6 +459,8 @@ int base64_decode(const void *src, size_t src_size,
 				break;
 			}
 			src_pos++;
+			/* try SIMD again after the whitespace */
+			try_simd = simd && !IS_EMPTY(src_c[src_pos]);
 			continue;
 		}
 
@@ -119,7 +478,7 @@ int base64_decode(const void *src, size_t src_size,
 				ret = -1;
 				break;
 			}
-			buffer_append(dest, output, 1);
+			out_pos++;
 			ret = 0;
 			src_pos += 4;
 			break;
@@ -132,16 +491,17 @@ int base64_decode(const void *src, size_t src_size,
 				ret = -1;
 				break;
 			}
-			buffer_append(dest, output, 2);
+			out_pos += 2;
 			ret = 0;
 			src_pos += 4;
 			break;
 		}
 
 		output[2] = ((input[2] << 6) & 0xc0) | input[3];
-		buffer_append(dest, output, 3);
+		out_pos += 3;
 		src_pos += 4;
 	}
+	buffer_append(dest, outbuf, out_pos);
 
 	for (; src_pos < src_size; src_pos++) {
 		if (!IS_EMPTY(src_c[src_pos]))
@@ -1,6 +1,12 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+enum base64_simd {
+	BASE64_SIMD_NONE = 0,
+	BASE64_SIMD_SSSE3,
+	BASE64_SIMD_AVX2
+};
+
 /* Translates binary data into base64. The src must not point to dest buffer. */
 void base64_encode(const void *src, size_t src_size, buffer_t *dest);
 
@@ -23,6 +29,15 @@ buffer_t *t_base64_decode_str(const char *str);
 /* Returns TRUE if c is a valid base64 encoding character (excluding '=') */
 bool base64_is_valid_char(char c);
 
+/* Returns the best SIMD implementation supported by the CPU. */
+enum base64_simd base64_simd_get_best(void);
+/* Returns the SIMD implementation used by base64_encode() and
+   base64_decode(). By default this is base64_simd_get_best(). */
+enum base64_simd base64_simd_get(void);
+/* Change the SIMD implementation. This is mainly useful for testing. The
+   implementation must be supported by the CPU. */
+void base64_simd_set(enum base64_simd simd);
+
 /* max. buffer size required for base64_encode() */
 #define MAX_BASE64_ENCODED_SIZE(size) \
 	(((size) / 3 + ((size) % 3 > 0)) * 4)
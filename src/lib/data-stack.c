@@ -4,6 +4,7 @@
 
 #include "lib.h"
 #include "data-stack.h"
+#include "mem-accounting.h"
 
 
 /* Initial stack size - this should be kept in a size that doesn't exceed
@@ -26,6 +27,13 @@
 #  define ALLOC_SIZE(size) MEM_ALIGN(size)
 #endif
 
+/* Count the allocations in each frame */
+#ifdef DEBUG
+#  define FRAME_ALLOC_COUNTING TRUE
+#else
+#  define FRAME_ALLOC_COUNTING unlikely(mem_accounting_enabled)
+#endif
+
 struct stack_block {
 	struct stack_block *next;
 
@@ -53,11 +61,9 @@ struct stack_frame_block {
 	size_t block_space_used[BLOCK_FRAME_COUNT];
 	size_t last_alloc_size[BLOCK_FRAME_COUNT];
 	const char *marker[BLOCK_FRAME_COUNT];
-#ifdef DEBUG
-	/* Fairly arbitrary profiling data */
+	/* Fairly arbitrary profiling data, see FRAME_ALLOC_COUNTING */
 	unsigned long long alloc_bytes[BLOCK_FRAME_COUNT];
 	unsigned int alloc_count[BLOCK_FRAME_COUNT];
-#endif
 };
 
 #ifdef STATIC_CHECKER
@@ -78,6 +84,8 @@ static struct stack_frame_block *unused_frame_blocks;
 static struct stack_block *current_block; /* block now used for allocation */
 static struct stack_block *unused_block; /* largest unused block is kept here */
 
+static struct mem_accounting *data_stack_accounting;
+
 static struct stack_block *last_buffer_block;
 static size_t last_buffer_size;
 #ifdef DEBUG
@@ -168,10 +176,8 @@ data_stack_frame_t t_push(const char *marker)
 	current_frame_block->block_space_used[frame_pos] = current_block->left;
 	current_frame_block->last_alloc_size[frame_pos] = 0;
 	current_frame_block->marker[frame_pos] = marker;
-#ifdef DEBUG
 	current_frame_block->alloc_bytes[frame_pos] = 0ULL;
 	current_frame_block->alloc_count[frame_pos] = 0;
-#endif
 
 #ifndef STATIC_CHECKER
 	return data_stack_frame_id++;
@@ -209,6 +215,17 @@ static void block_canary_check(struct stack_block *block)
 }
 #endif
 
+static void mem_block_free(struct stack_block *block)
+{
+	if (block == NULL || block == &outofmem_area.block)
+		return;
+	if (data_stack_accounting != NULL) {
+		mem_accounting_sub(data_stack_accounting,
+				   SIZEOF_MEMBLOCK + block->size);
+	}
+	free(block);
+}
+
 static void free_blocks(struct stack_block *block)
 {
 	struct stack_block *next;
@@ -223,11 +240,10 @@ static void free_blocks(struct stack_block *block)
 			memset(STACK_BLOCK_DATA(block), CLEAR_CHR, block->size);
 
 		if (unused_block == NULL || block->size > unused_block->size) {
-			free(unused_block);
+			mem_block_free(unused_block);
 			unused_block = block;
 		} else {
-			if (block != &outofmem_area.block)
-				free(block);
+			mem_block_free(block);
 		}
 
 		block = next;
@@ -282,6 +298,12 @@ void t_pop_last_unsafe(void)
 #ifdef DEBUG
 	t_pop_verify();
 #endif
+	if (unlikely(mem_accounting_enabled)) {
+		mem_accounting_data_stack_pop(
+			current_frame_block->marker[frame_pos],
+			current_frame_block->alloc_bytes[frame_pos],
+			current_frame_block->alloc_count[frame_pos]);
+	}
 
 	/* update the current block */
 	current_block = current_frame_block->block[frame_pos];
@@ -358,6 +380,10 @@ static struct stack_block *mem_block_alloc(size_t min_size)
 		i_panic("data stack: Out of memory when allocating %"
 			PRIuSIZE_T" bytes", alloc_size + SIZEOF_MEMBLOCK);
 	}
+	if (data_stack_accounting != NULL) {
+		mem_accounting_add(data_stack_accounting,
+				   SIZEOF_MEMBLOCK + alloc_size);
+	}
 	block->size = alloc_size;
 	block->left = 0;
 	block->lowwater = block->size;
@@ -391,12 +417,10 @@ static void *t_malloc_real(size_t size, bool permanent)
 	/* allocate only aligned amount of memory so alignment comes
 	   always properly */
 	alloc_size = ALLOC_SIZE(size);
-#ifdef DEBUG
-	if(permanent) {
+	if (permanent && FRAME_ALLOC_COUNTING) {
 		current_frame_block->alloc_bytes[frame_pos] += alloc_size;
 		current_frame_block->alloc_count[frame_pos]++;
 	}
-#endif
 	data_stack_last_buffer_reset(TRUE);
 
 	/* used for t_try_realloc() */
@@ -506,10 +530,13 @@ bool t_try_realloc(void *mem, size_t size)
 				current_block->lowwater = current_block->left;
 			current_frame_block->last_alloc_size[frame_pos] =
 				new_alloc_size;
-#ifdef DEBUG
 			/* All reallocs are permanent by definition
 			   However, they don't count as a new allocation */
-			current_frame_block->alloc_bytes[frame_pos] += alloc_growth;
+			if (FRAME_ALLOC_COUNTING) {
+				current_frame_block->alloc_bytes[frame_pos] +=
+					alloc_growth;
+			}
+#ifdef DEBUG
 			*(size_t *)PTR_OFFSET(mem, -(ptrdiff_t)MEM_ALIGN(sizeof(size_t))) = size;
 			memset(PTR_OFFSET(mem, size), CLEAR_CHR,
 			       new_alloc_size - size - MEM_ALIGN(sizeof(size_t)));
@@ -577,6 +604,22 @@ void t_buffer_alloc_last_full(void)
 		(void)t_malloc_real(last_buffer_size, TRUE);
 }
 
+void data_stack_frames_foreach(data_stack_frame_callback_t *callback,
+			       void *context)
+{
+	const struct stack_frame_block *frame_block = current_frame_block;
+	int pos = frame_pos;
+
+	for (; frame_block != NULL; frame_block = frame_block->prev) {
+		for (; pos >= 0; pos--) {
+			callback(frame_block->marker[pos],
+				 frame_block->alloc_bytes[pos],
+				 frame_block->alloc_count[pos], context);
+		}
+		pos = BLOCK_FRAME_COUNT-1;
+	}
+}
+
 void data_stack_set_clean_after_pop(bool enable ATTR_UNUSED)
 {
 #ifndef DEBUG
@@ -598,6 +641,7 @@ void data_stack_init(void)
 		sizeof(outofmem_area) - sizeof(outofmem_area.block);
 	outofmem_area.block.canary = BLOCK_CANARY;
 
+	data_stack_accounting = mem_accounting_pool_get("data stack");
 	current_block = mem_block_alloc(INITIAL_STACK_SIZE);
 	current_block->left = current_block->size;
 	current_block->next = NULL;
@@ -625,8 +669,9 @@ void data_stack_deinit(void)
 		free(frame_block);
 	}
 
-	free(current_block);
-	free(unused_block);
+	mem_block_free(current_block);
+	mem_block_free(unused_block);
+	data_stack_accounting = NULL;
 	unused_frame_blocks = NULL;
 	current_block = NULL;
 	unused_block = NULL;
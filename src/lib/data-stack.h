@@ -114,6 +114,17 @@ void t_buffer_alloc(size_t size);
 /* Allocate the last t_buffer_get()ed data entirely. */
 void t_buffer_alloc_last_full(void);
 
+typedef void data_stack_frame_callback_t(const char *marker,
+					 size_t alloc_bytes,
+					 unsigned int alloc_count,
+					 void *context);
+/* Call the callback for each frame in the data stack, starting from the
+   newest one. The marker may be NULL. The allocations are counted only with
+   DEBUG or when memory accounting is enabled. The callback must not use the
+   data stack. */
+void data_stack_frames_foreach(data_stack_frame_callback_t *callback,
+			       void *context);
+
 /* If enabled, all the used memory is cleared after t_pop(). */
 void data_stack_set_clean_after_pop(bool enable);
 
@@ -3,12 +3,47 @@
 #include "lib.h"
 #include "istream.h"
 #include "ostream.h"
+#include "sendfile-util.h"
 #include "file-copy.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
+
+int file_clone_fd(int src_fd, int dest_fd)
+{
+	struct stat st;
+	uoff_t offset = 0;
+	ssize_t ret;
+
+	if (fstat(src_fd, &st) < 0)
+		return -1;
+#ifdef FICLONE
+	/* fails if the filesystem doesn't support reflinks or if the files
+	   are in different filesystems */
+	if (st.st_size > 0 && ioctl(dest_fd, FICLONE, src_fd) == 0) {
+		if (lseek(dest_fd, st.st_size, SEEK_SET) < 0)
+			return -1;
+		return 1;
+	}
+#endif
+	while (offset < (uoff_t)st.st_size) {
+		ret = safe_copy_file_range(dest_fd, src_fd, &offset,
+					   st.st_size - offset);
+		if (ret < 0)
+			return errno == EINVAL && offset == 0 ? 0 : -1;
+		if (ret == 0) {
+			/* file was truncated */
+			break;
+		}
+	}
+	return 1;
+}
 
 static int file_copy_to_tmp(const char *srcpath, const char *tmppath,
 			    bool try_hardlink)
@@ -67,6 +102,19 @@ static int file_copy_to_tmp(const char *srcpath, const char *tmppath,
 	if (fchown(fd_out, (uid_t)-1, st.st_gid) < 0 && errno != EPERM)
 		i_error("fchown(%s) failed: %m", tmppath);
 
+	if ((ret = file_clone_fd(fd_in, fd_out)) != 0) {
+		if (ret < 0) {
+			i_error("file_clone_fd(%s, %s) failed: %m",
+				srcpath, tmppath);
+		}
+		i_close_fd(&fd_in);
+		if (close(fd_out) < 0) {
+			i_error("close(%s) failed: %m", tmppath);
+			ret = -1;
+		}
+		return ret;
+	}
+
 	input = i_stream_create_fd(fd_in, IO_BLOCK_SIZE);
 	output = o_stream_create_fd_file(fd_out, 0, FALSE);
 
@@ -9,4 +9,12 @@
    Returns -1 = error, 0 = source file not found, 1 = ok */
 int file_copy(const char *srcpath, const char *destpath, bool try_hardlink);
 
+/* Copy the whole src_fd to an empty dest_fd without reading the data into
+   userspace. First try to clone the file, which makes the files share the
+   same data blocks on filesystems that support it (btrfs, XFS). Then fallback
+   to copy_file_range(). dest_fd's offset is left at the end of the file.
+   Returns 1 if copied, 0 if neither works for these fds and nothing was
+   written, -1 on error with errno set. */
+int file_clone_fd(int src_fd, int dest_fd);
+
 #endif
@@ -56,6 +56,8 @@ int file_set_size(int fd, off_t size)
 
 		if (err != EINVAL /* Solaris */ &&
 		    err != EOPNOTSUPP /* AOX */) {
+			/* posix_fallocate() doesn't set errno */
+			errno = err;
 			if (!ENOSPACE(err))
 				i_error("posix_fallocate() failed: %m");
 			return -1;
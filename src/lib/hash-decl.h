@@ -17,4 +17,20 @@
 #define HASH_TABLE_TYPE(name) \
 	union hash ## __ ## name
 
+#define HASH_FLAT_UNION(key_type, value_type) { \
+		struct hash_flat *_table; \
+		key_type _key; \
+		key_type *_keyp; \
+		const key_type _const_key; \
+		value_type _value; \
+		value_type *_valuep; \
+	}
+
+#define HASH_FLAT_DEFINE_TYPE(name, key_type, value_type) \
+	union hash_flat ## __ ## name HASH_FLAT_UNION(key_type, value_type)
+#define HASH_FLAT(key_type, value_type) \
+	union HASH_FLAT_UNION(key_type, value_type)
+#define HASH_FLAT_TYPE(name) \
+	union hash_flat ## __ ## name
+
 #endif
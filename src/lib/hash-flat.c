@@ -0,0 +1,468 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "hash-flat.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/* The table is an array of slots with a parallel array of control bytes.
+   A control byte is either one of the special negative values below or 7
+   bits of the hash for a used slot. Lookups probe a group of slots at a
+   time, starting from the slot selected by the hash and continuing with
+   triangular steps until a group with an empty slot is found. Removed slots
+   are marked deleted so that the probe sequences stay intact. They're
+   reused by inserts and cleared when the table is rehashed.
+
+   The first group's control bytes are mirrored after the last slot, so a
+   group can be read with a single unaligned load from any position. */
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+#define HASH_FLAT_MIN_CAPACITY 16
+/* maximum number of used + deleted slots is 7/8 of the capacity */
+#define HASH_FLAT_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+#undef hash_flat_create
+#undef hash_flat_create_direct
+#undef hash_flat_destroy
+#undef hash_flat_clear
+#undef hash_flat_lookup
+#undef hash_flat_lookup_full
+#undef hash_flat_insert
+#undef hash_flat_update
+#undef hash_flat_try_remove
+#undef hash_flat_count
+#undef hash_flat_iterate_init
+#undef hash_flat_iterate
+
+struct hash_flat_slot {
+	void *key;
+	void *value;
+};
+
+struct hash_flat {
+	unsigned int initial_capacity, capacity;
+	unsigned int count;
+	/* number of slots that can still be taken from the empty slots
+	   before the table needs to be rehashed */
+	unsigned int growth_left;
+	int frozen;
+
+	struct hash_flat_slot *slots;
+	/* capacity + GROUP_WIDTH control bytes */
+	int8_t *ctrl;
+
+	hash_callback_t *hash_cb;
+	/* NULL for direct pointer comparisons */
+	hash_cmp_callback_t *key_compare_cb;
+};
+
+struct hash_flat_iterate_context {
+	struct hash_flat *table;
+	unsigned int pos;
+};
+
+#ifdef __SSE2__
+#define GROUP_WIDTH 16
+/* bit n is set if the n'th control byte matches */
+typedef unsigned int group_mask_t;
+
+static inline group_mask_t group_match(const int8_t *ctrl, int8_t h2)
+{
+	__m128i group = _mm_loadu_si128((const void *)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), group));
+}
+
+static inline group_mask_t group_match_empty(const int8_t *ctrl)
+{
+	return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline group_mask_t group_match_empty_or_deleted(const int8_t *ctrl)
+{
+	/* both special values are negative */
+	__m128i group = _mm_loadu_si128((const void *)ctrl);
+	return _mm_movemask_epi8(group);
+}
+
+static inline unsigned int group_mask_first(group_mask_t mask)
+{
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+	return __builtin_ctz(mask);
+#else
+	unsigned int i;
+
+	for (i = 0; (mask & 1) == 0; i++)
+		mask >>= 1;
+	return i;
+#endif
+}
+#else
+#define GROUP_WIDTH 8
+/* the high bit of the n'th byte is set if the n'th control byte matches.
+   group_match() may return false positives for used slots, which are
+   caught by the key comparison. */
+typedef uint64_t group_mask_t;
+
+#define GROUP_LSBS 0x0101010101010101ULL
+#define GROUP_MSBS 0x8080808080808080ULL
+
+static inline uint64_t group_load(const int8_t *ctrl)
+{
+	uint64_t group = 0;
+	unsigned int i;
+
+	for (i = 0; i < GROUP_WIDTH; i++)
+		group |= (uint64_t)(uint8_t)ctrl[i] << (i * 8);
+	return group;
+}
+
+static inline group_mask_t group_match(const int8_t *ctrl, int8_t h2)
+{
+	uint64_t x = group_load(ctrl) ^ (GROUP_LSBS * (uint8_t)h2);
+
+	return (x - GROUP_LSBS) & ~x & GROUP_MSBS;
+}
+
+static inline group_mask_t group_match_empty(const int8_t *ctrl)
+{
+	/* 0x80 is the only special value with bit 1 unset */
+	uint64_t group = group_load(ctrl);
+
+	return group & (~group << 6) & GROUP_MSBS;
+}
+
+static inline group_mask_t group_match_empty_or_deleted(const int8_t *ctrl)
+{
+	return group_load(ctrl) & GROUP_MSBS;
+}
+
+static inline unsigned int group_mask_first(group_mask_t mask)
+{
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+	return __builtin_ctzll(mask) / 8;
+#else
+	unsigned int i;
+
+	for (i = 0; (mask & 0x80) == 0; i++)
+		mask >>= 8;
+	return i;
+#endif
+}
+#endif
+
+static inline group_mask_t group_mask_next(group_mask_t mask)
+{
+	return mask & (mask - 1);
+}
+
+static inline unsigned int hash_flat_hash(const struct hash_flat *table,
+					  const void *key)
+{
+	/* murmurhash3's finalizer. str_hash() and direct pointer hashes have
+	   most of their entropy in the low bits, while both the low bits
+	   (slot) and high bits (control byte) are used here. */
+	unsigned int h = table->hash_cb(key);
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline int8_t hash_flat_h2(unsigned int hash)
+{
+	return (int8_t)(hash >> 25);
+}
+
+static inline void
+hash_flat_set_ctrl(struct hash_flat *table, unsigned int idx, int8_t value)
+{
+	table->ctrl[idx] = value;
+	if (idx < GROUP_WIDTH)
+		table->ctrl[table->capacity + idx] = value;
+}
+
+static inline bool
+hash_flat_key_equals(const struct hash_flat *table,
+		     const void *key1, const void *key2)
+{
+	if (table->key_compare_cb == NULL)
+		return key1 == key2;
+	return table->key_compare_cb(key1, key2) == 0;
+}
+
+static bool
+hash_flat_find(const struct hash_flat *table, const void *key,
+	       unsigned int hash, unsigned int *idx_r)
+{
+	const unsigned int mask = table->capacity - 1;
+	int8_t h2 = hash_flat_h2(hash);
+	unsigned int pos = hash & mask, step = 0, idx;
+	group_mask_t match;
+
+	for (;;) {
+		const int8_t *group = table->ctrl + pos;
+
+		for (match = group_match(group, h2); match != 0;
+		     match = group_mask_next(match)) {
+			idx = (pos + group_mask_first(match)) & mask;
+			if (hash_flat_key_equals(table, table->slots[idx].key,
+						 key)) {
+				*idx_r = idx;
+				return TRUE;
+			}
+		}
+		if (group_match_empty(group) != 0)
+			return FALSE;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+	}
+}
+
+static unsigned int
+hash_flat_find_free(const struct hash_flat *table, unsigned int hash)
+{
+	const unsigned int mask = table->capacity - 1;
+	unsigned int pos = hash & mask, step = 0;
+	group_mask_t match;
+
+	for (;;) {
+		match = group_match_empty_or_deleted(table->ctrl + pos);
+		if (match != 0)
+			return (pos + group_mask_first(match)) & mask;
+		step += GROUP_WIDTH;
+		pos = (pos + step) & mask;
+	}
+}
+
+static void hash_flat_alloc(struct hash_flat *table, unsigned int capacity)
+{
+	i_assert(bits_is_power_of_two(capacity));
+	i_assert(capacity >= GROUP_WIDTH);
+
+	table->capacity = capacity;
+	table->slots = i_new(struct hash_flat_slot, capacity);
+	table->ctrl = i_malloc(capacity + GROUP_WIDTH);
+	memset(table->ctrl, CTRL_EMPTY, capacity + GROUP_WIDTH);
+	table->growth_left = HASH_FLAT_MAX_LOAD(capacity);
+}
+
+static unsigned int hash_flat_capacity_for(unsigned int count)
+{
+	/* leave room for growth after the given count */
+	size_t capacity = nearest_power((size_t)count * 2);
+
+	i_assert(capacity <= INT_MAX);
+	return I_MAX(capacity, HASH_FLAT_MIN_CAPACITY);
+}
+
+static void hash_flat_rehash(struct hash_flat *table, unsigned int capacity)
+{
+	struct hash_flat_slot *old_slots = table->slots;
+	int8_t *old_ctrl = table->ctrl;
+	unsigned int i, idx, hash, old_capacity = table->capacity;
+
+	i_assert(table->frozen == 0);
+	i_assert(table->count < HASH_FLAT_MAX_LOAD(capacity));
+
+	hash_flat_alloc(table, capacity);
+	for (i = 0; i < old_capacity; i++) {
+		if (old_ctrl[i] < 0)
+			continue;
+
+		hash = hash_flat_hash(table, old_slots[i].key);
+		idx = hash_flat_find_free(table, hash);
+		hash_flat_set_ctrl(table, idx, hash_flat_h2(hash));
+		table->slots[idx] = old_slots[i];
+	}
+	table->growth_left -= table->count;
+	i_free(old_slots);
+	i_free(old_ctrl);
+}
+
+void hash_flat_create(struct hash_flat **table_r, unsigned int initial_size,
+		      hash_callback_t *hash_cb,
+		      hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_flat *table;
+
+	table = i_new(struct hash_flat, 1);
+	table->initial_capacity = hash_flat_capacity_for(initial_size);
+	table->hash_cb = hash_cb;
+	table->key_compare_cb = key_compare_cb;
+	hash_flat_alloc(table, table->initial_capacity);
+	*table_r = table;
+}
+
+static unsigned int direct_hash(const void *p)
+{
+	/* NOTE: may truncate the value, but that doesn't matter. */
+	return POINTER_CAST_TO(p, unsigned int);
+}
+
+void hash_flat_create_direct(struct hash_flat **table_r,
+			     unsigned int initial_size)
+{
+	hash_flat_create(table_r, initial_size, direct_hash, NULL);
+}
+
+void hash_flat_destroy(struct hash_flat **_table)
+{
+	struct hash_flat *table = *_table;
+
+	*_table = NULL;
+
+	i_assert(table->frozen == 0);
+	i_free(table->slots);
+	i_free(table->ctrl);
+	i_free(table);
+}
+
+void hash_flat_clear(struct hash_flat *table)
+{
+	i_assert(table->frozen == 0);
+
+	memset(table->slots, 0, sizeof(*table->slots) * table->capacity);
+	memset(table->ctrl, CTRL_EMPTY, table->capacity + GROUP_WIDTH);
+	table->count = 0;
+	table->growth_left = HASH_FLAT_MAX_LOAD(table->capacity);
+}
+
+void *hash_flat_lookup(const struct hash_flat *table, const void *key)
+{
+	unsigned int idx;
+
+	if (!hash_flat_find(table, key, hash_flat_hash(table, key), &idx))
+		return NULL;
+	return table->slots[idx].value;
+}
+
+bool hash_flat_lookup_full(const struct hash_flat *table,
+			   const void *lookup_key,
+			   void **orig_key_r, void **value_r)
+{
+	unsigned int idx;
+
+	if (!hash_flat_find(table, lookup_key,
+			    hash_flat_hash(table, lookup_key), &idx))
+		return FALSE;
+
+	*orig_key_r = table->slots[idx].key;
+	*value_r = table->slots[idx].value;
+	return TRUE;
+}
+
+static void
+hash_flat_insert_node(struct hash_flat *table, void *key, void *value,
+		      bool update)
+{
+	unsigned int hash, idx;
+
+	i_assert(key != NULL);
+
+	hash = hash_flat_hash(table, key);
+	if (hash_flat_find(table, key, hash, &idx)) {
+		i_assert(update);
+		table->slots[idx].value = value;
+		return;
+	}
+	i_assert(table->frozen == 0);
+
+	idx = hash_flat_find_free(table, hash);
+	if (table->growth_left == 0 && table->ctrl[idx] == CTRL_EMPTY) {
+		/* if most of the used slots are deleted, rehashing is enough
+		   to get rid of them. otherwise grow. */
+		if (table->count < HASH_FLAT_MAX_LOAD(table->capacity) / 2)
+			hash_flat_rehash(table, table->capacity);
+		else
+			hash_flat_rehash(table, table->capacity * 2);
+		idx = hash_flat_find_free(table, hash);
+	}
+	if (table->ctrl[idx] == CTRL_EMPTY)
+		table->growth_left--;
+	hash_flat_set_ctrl(table, idx, hash_flat_h2(hash));
+	table->slots[idx].key = key;
+	table->slots[idx].value = value;
+	table->count++;
+}
+
+void hash_flat_insert(struct hash_flat *table, void *key, void *value)
+{
+	hash_flat_insert_node(table, key, value, FALSE);
+}
+
+void hash_flat_update(struct hash_flat *table, void *key, void *value)
+{
+	hash_flat_insert_node(table, key, value, TRUE);
+}
+
+bool hash_flat_try_remove(struct hash_flat *table, const void *key)
+{
+	unsigned int idx;
+
+	if (!hash_flat_find(table, key, hash_flat_hash(table, key), &idx))
+		return FALSE;
+
+	hash_flat_set_ctrl(table, idx, CTRL_DELETED);
+	table->slots[idx].key = NULL;
+	table->slots[idx].value = NULL;
+	table->count--;
+
+	/* shrink when the table has become mostly empty */
+	if (table->frozen == 0 && table->capacity > table->initial_capacity &&
+	    table->count < table->capacity / 8) {
+		hash_flat_rehash(table, I_MAX(table->capacity / 2,
+					      table->initial_capacity));
+	}
+	return TRUE;
+}
+
+unsigned int hash_flat_count(const struct hash_flat *table)
+{
+	return table->count;
+}
+
+struct hash_flat_iterate_context *hash_flat_iterate_init(struct hash_flat *table)
+{
+	struct hash_flat_iterate_context *ctx;
+
+	table->frozen++;
+
+	ctx = i_new(struct hash_flat_iterate_context, 1);
+	ctx->table = table;
+	return ctx;
+}
+
+bool hash_flat_iterate(struct hash_flat_iterate_context *ctx,
+		       void **key_r, void **value_r)
+{
+	const struct hash_flat *table = ctx->table;
+
+	for (; ctx->pos < table->capacity; ctx->pos++) {
+		if (table->ctrl[ctx->pos] >= 0) {
+			*key_r = table->slots[ctx->pos].key;
+			*value_r = table->slots[ctx->pos].value;
+			ctx->pos++;
+			return TRUE;
+		}
+	}
+	*key_r = *value_r = NULL;
+	return FALSE;
+}
+
+void hash_flat_iterate_deinit(struct hash_flat_iterate_context **_ctx)
+{
+	struct hash_flat_iterate_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+	i_assert(ctx->table->frozen > 0);
+	ctx->table->frozen--;
+	i_free(ctx);
+}
@@ -0,0 +1,150 @@
+#ifndef HASH_FLAT_H
+#define HASH_FLAT_H
+
+#include "hash.h"
+
+/* Open addressing hash table with the same pointer key/value API as
+   hash_table_*(). The keys and values are stored directly in a single
+   array, so there are no per-node allocations. Each slot also has a
+   one byte control value containing 7 bits of the key's hash, which are
+   compared a group of slots at a time (with SSE2 when available) before
+   calling the key comparison callback.
+
+   This is faster and uses less memory than hash_table_*() for large tables
+   with frequent lookups. The differences to hash_table_*() are:
+
+    - All memory is allocated from the system pool, so there's no pool
+      parameter.
+    - Nodes may be removed while iterating, but new nodes must not be added.
+    - The hash callback's result is mixed further, so e.g. direct pointer or
+      integer keys are distributed well without a separate hash function. */
+
+struct hash_flat;
+
+void hash_flat_create(struct hash_flat **table_r, unsigned int initial_size,
+		      hash_callback_t *hash_cb,
+		      hash_cmp_callback_t *key_compare_cb);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_flat_create(table, size, hash_cb, key_cmp_cb) \
+	({(void)COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)); \
+	(void)COMPILE_ERROR_IF_TRUE( \
+		!__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+			int (*)(typeof((*table)._key), typeof((*table)._key))) && \
+		!__builtin_types_compatible_p(typeof(&key_cmp_cb), \
+			int (*)(typeof((*table)._const_key), typeof((*table)._const_key)))); \
+	(void)COMPILE_ERROR_IF_TRUE( \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+			unsigned int (*)(typeof((*table)._key))) && \
+		!__builtin_types_compatible_p(typeof(&hash_cb), \
+			unsigned int (*)(typeof((*table)._const_key)))); \
+	hash_flat_create(&(*table)._table, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb);})
+#else
+#  define hash_flat_create(table, size, hash_cb, key_cmp_cb) \
+	hash_flat_create(&(*table)._table, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb)
+#endif
+
+/* Create hash table where comparisons are done directly with the pointers. */
+void hash_flat_create_direct(struct hash_flat **table_r,
+			     unsigned int initial_size);
+#if defined (__GNUC__) && !defined(__cplusplus)
+#  define hash_flat_create_direct(table, size) \
+	({(void)COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)); \
+	hash_flat_create_direct(&(*table)._table, size);})
+#else
+#  define hash_flat_create_direct(table, size) \
+	hash_flat_create_direct(&(*table)._table, size)
+#endif
+
+#define hash_flat_is_created(table) \
+	((table)._table != NULL)
+
+void hash_flat_destroy(struct hash_flat **table);
+#define hash_flat_destroy(table) \
+	hash_flat_destroy(&(*table)._table)
+/* Remove all nodes from hash table. */
+void hash_flat_clear(struct hash_flat *table);
+#define hash_flat_clear(table) \
+	hash_flat_clear((table)._table)
+
+void *hash_flat_lookup(const struct hash_flat *table, const void *key) ATTR_PURE;
+#define hash_flat_lookup(table, key) \
+	HASH_VALUE_CAST(table)hash_flat_lookup((table)._table, \
+		(const void *)((const char *)(key) + COMPILE_ERROR_IF_TYPES2_NOT_COMPATIBLE((table)._key, (table)._const_key, key)))
+
+bool hash_flat_lookup_full(const struct hash_flat *table,
+			   const void *lookup_key,
+			   void **orig_key_r, void **value_r);
+#ifndef __cplusplus
+#  define hash_flat_lookup_full(table, lookup_key, orig_key_r, value_r) \
+	hash_flat_lookup_full((table)._table, \
+		(void *)((const char *)(lookup_key) + \
+			 COMPILE_ERROR_IF_TYPES2_NOT_COMPATIBLE((table)._const_key, (table)._key, lookup_key)), \
+		(void *)((orig_key_r) + \
+			 COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._keyp, orig_key_r) + \
+			 COMPILE_ERROR_IF_TRUE(sizeof(*(orig_key_r)) != sizeof(void *))), \
+		(void *)((value_r) + \
+			 COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._valuep, value_r) + \
+			 COMPILE_ERROR_IF_TRUE(sizeof(*(value_r)) != sizeof(void *))))
+#else
+#  define hash_flat_lookup_full(table, lookup_key, orig_key_r, value_r) \
+	hash_flat_lookup_full((table)._table, lookup_key, orig_key_r, value_r)
+#endif
+
+/* Insert a new key-value node to the hash table. If the key already exists,
+   assert-crash. */
+void hash_flat_insert(struct hash_flat *table, void *key, void *value);
+/* If the key doesn't exist, do the same as hash_flat_insert(). If the key
+   already exists, preserve the original key and update only the value. */
+void hash_flat_update(struct hash_flat *table, void *key, void *value);
+#define hash_flat_insert(table, key, value) \
+	hash_flat_insert((table)._table, \
+		(void *)((char*)(key) + COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._key, key)), \
+		(void *)((char*)(value) + COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._value, value)))
+#define hash_flat_update(table, key, value) \
+	hash_flat_update((table)._table, \
+		(void *)((char *)(key) + COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._key, key)), \
+		(void *)((char *)(value) + COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._value, value)))
+
+bool hash_flat_try_remove(struct hash_flat *table, const void *key);
+#define hash_flat_try_remove(table, key) \
+	hash_flat_try_remove((table)._table, \
+		(const void *)((const char *)(key) + COMPILE_ERROR_IF_TYPES2_NOT_COMPATIBLE((table)._const_key, (table)._key, key)))
+#define hash_flat_remove(table, key) \
+	STMT_START { \
+		if (unlikely(!hash_flat_try_remove(table, key))) \
+			i_panic("key not found from hash"); \
+	} STMT_END
+unsigned int hash_flat_count(const struct hash_flat *table) ATTR_PURE;
+#define hash_flat_count(table) \
+	hash_flat_count((table)._table)
+
+/* Iterates through all nodes in hash table. Nodes may be removed while
+   iterating, but no new nodes may be added. */
+struct hash_flat_iterate_context *hash_flat_iterate_init(struct hash_flat *table);
+#define hash_flat_iterate_init(table) \
+	hash_flat_iterate_init((table)._table)
+bool hash_flat_iterate(struct hash_flat_iterate_context *ctx,
+		       void **key_r, void **value_r);
+#ifndef __cplusplus
+#  define hash_flat_iterate(ctx, table, key_r, value_r) \
+	hash_flat_iterate(ctx, \
+		(void *)((key_r) + \
+			 COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._keyp, key_r) + \
+			 COMPILE_ERROR_IF_TRUE(sizeof(*(key_r)) != sizeof(void *)) + \
+			 COMPILE_ERROR_IF_TRUE(sizeof(*(value_r)) != sizeof(void *))), \
+		(void *)((value_r) + COMPILE_ERROR_IF_TYPES_NOT_COMPATIBLE((table)._valuep, value_r)))
+#else
+#  define hash_flat_iterate(ctx, table, key_r, value_r) \
+	hash_flat_iterate(ctx, key_r, value_r)
+#endif
+void hash_flat_iterate_deinit(struct hash_flat_iterate_context **ctx);
+
+#endif
@@ -7,6 +7,7 @@
 #include "env-util.h"
 #include "hostpid.h"
 #include "ipwd.h"
+#include "mem-accounting.h"
 #include "process-title.h"
 #include "var-expand-private.h"
 #include "randgen.h"
@@ -135,6 +136,7 @@ void lib_init(void)
 {
 	i_assert(!lib_initialized);
 	random_init();
+	mem_accounting_init();
 	data_stack_init();
 	hostpid_init();
 	lib_open_non_stdio_dev_null();
@@ -162,6 +164,7 @@ void lib_deinit(void)
 	lib_event_deinit();
 	i_close_fd(&dev_null_fd);
 	data_stack_deinit();
+	mem_accounting_deinit();
 	env_deinit();
 	failures_deinit();
 	process_title_deinit();
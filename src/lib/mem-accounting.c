@@ -0,0 +1,170 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "mem-accounting.h"
+
+#define MEM_ACCOUNTING_UNNAMED_MARKER "unnamed"
+
+struct mem_accounting_snapshot {
+	enum mem_accounting_type type;
+	struct mem_accounting acc;
+};
+
+/* The accounting itself is allocated from system_pool, which isn't
+   accounted, and it must not use the data stack since it's called by
+   t_pop(). */
+HASH_TABLE_DEFINE_TYPE(mem_accounting, char *, struct mem_accounting *);
+static HASH_TABLE_TYPE(mem_accounting) pool_accounting;
+static HASH_TABLE_TYPE(mem_accounting) data_stack_accounting;
+
+bool mem_accounting_enabled = FALSE;
+
+static struct mem_accounting *
+mem_accounting_get(HASH_TABLE_TYPE(mem_accounting) *hash, const char *name)
+{
+	struct mem_accounting *acc;
+	char *key;
+
+	acc = hash_table_lookup(*hash, name);
+	if (acc == NULL) {
+		acc = i_new(struct mem_accounting, 1);
+		key = i_strdup(name);
+		acc->name = key;
+		hash_table_insert(*hash, key, acc);
+	}
+	return acc;
+}
+
+struct mem_accounting *mem_accounting_pool_get(const char *name)
+{
+	if (!mem_accounting_enabled)
+		return NULL;
+
+	if (strncmp(name, MEMPOOL_GROWING, strlen(MEMPOOL_GROWING)) == 0)
+		name += strlen(MEMPOOL_GROWING);
+	return mem_accounting_get(&pool_accounting, name);
+}
+
+void mem_accounting_data_stack_pop(const char *marker, size_t alloc_bytes,
+				   unsigned int alloc_count)
+{
+	struct mem_accounting *acc;
+
+	if (!mem_accounting_enabled)
+		return;
+	if (marker == NULL)
+		marker = MEM_ACCOUNTING_UNNAMED_MARKER;
+
+	acc = mem_accounting_get(&data_stack_accounting, marker);
+	acc->alloc_count += alloc_count;
+	if (acc->peak_bytes < alloc_bytes)
+		acc->peak_bytes = alloc_bytes;
+}
+
+static void
+mem_accounting_add_frame(const char *marker, size_t alloc_bytes,
+			 unsigned int alloc_count ATTR_UNUSED,
+			 void *context ATTR_UNUSED)
+{
+	struct mem_accounting *acc;
+
+	if (marker == NULL)
+		marker = MEM_ACCOUNTING_UNNAMED_MARKER;
+	acc = mem_accounting_get(&data_stack_accounting, marker);
+	acc->bytes += alloc_bytes;
+	if (acc->peak_bytes < alloc_bytes)
+		acc->peak_bytes = alloc_bytes;
+}
+
+static unsigned int
+mem_accounting_snapshot_add(HASH_TABLE_TYPE(mem_accounting) hash,
+			    enum mem_accounting_type type,
+			    struct mem_accounting_snapshot *snapshot)
+{
+	struct hash_iterate_context *iter;
+	struct mem_accounting *acc;
+	char *key;
+	unsigned int count = 0;
+
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &acc)) {
+		snapshot[count].type = type;
+		snapshot[count].acc = *acc;
+		count++;
+	}
+	hash_table_iterate_deinit(&iter);
+	return count;
+}
+
+void mem_accounting_foreach(mem_accounting_callback_t *callback,
+			    void *context)
+{
+	struct mem_accounting_snapshot *snapshot;
+	struct hash_iterate_context *iter;
+	struct mem_accounting *acc;
+	char *key;
+	unsigned int i, count;
+
+	if (!mem_accounting_enabled)
+		return;
+
+	/* the data stack bytes are the frames that currently exist */
+	iter = hash_table_iterate_init(data_stack_accounting);
+	while (hash_table_iterate(iter, data_stack_accounting, &key, &acc))
+		acc->bytes = 0;
+	hash_table_iterate_deinit(&iter);
+	data_stack_frames_foreach(mem_accounting_add_frame, NULL);
+
+	/* the callback may allocate memory, which changes the accounting.
+	   take a snapshot first. */
+	count = hash_table_count(pool_accounting) +
+		hash_table_count(data_stack_accounting);
+	snapshot = i_new(struct mem_accounting_snapshot, count + 1);
+	i = mem_accounting_snapshot_add(pool_accounting,
+					MEM_ACCOUNTING_TYPE_POOL, snapshot);
+	i += mem_accounting_snapshot_add(data_stack_accounting,
+					 MEM_ACCOUNTING_TYPE_DATA_STACK,
+					 snapshot + i);
+	i_assert(i == count);
+
+	for (i = 0; i < count; i++)
+		callback(snapshot[i].type, &snapshot[i].acc, context);
+	i_free(snapshot);
+}
+
+void mem_accounting_init(void)
+{
+	if (getenv("MEMORY_ACCOUNTING") == NULL)
+		return;
+
+	hash_table_create(&pool_accounting, default_pool, 0, str_hash, strcmp);
+	hash_table_create(&data_stack_accounting, default_pool, 0,
+			  str_hash, strcmp);
+	mem_accounting_enabled = TRUE;
+}
+
+static void mem_accounting_hash_free(HASH_TABLE_TYPE(mem_accounting) *hash)
+{
+	struct hash_iterate_context *iter;
+	struct mem_accounting *acc;
+	char *key;
+
+	iter = hash_table_iterate_init(*hash);
+	while (hash_table_iterate(iter, *hash, &key, &acc)) {
+		i_free(key);
+		i_free(acc);
+	}
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(hash);
+}
+
+void mem_accounting_deinit(void)
+{
+	if (!mem_accounting_enabled)
+		return;
+
+	mem_accounting_enabled = FALSE;
+	mem_accounting_hash_free(&pool_accounting);
+	mem_accounting_hash_free(&data_stack_accounting);
+}
@@ -0,0 +1,69 @@
+#ifndef MEM_ACCOUNTING_H
+#define MEM_ACCOUNTING_H
+
+/* Memory accounting tracks how much memory is used by memory pools (grouped
+   by the pool name) and data stack frames (grouped by the t_push() marker).
+   It's enabled by setting the MEMORY_ACCOUNTING environment variable before
+   lib_init(). When disabled, the only overhead is checking
+   mem_accounting_enabled or a NULL accounting pointer.
+
+   Only alloconly, allocfree and slab pools are accounted. The memory used
+   by the data stack itself is accounted as the "data stack" pool. */
+
+enum mem_accounting_type {
+	MEM_ACCOUNTING_TYPE_POOL,
+	MEM_ACCOUNTING_TYPE_DATA_STACK,
+};
+
+struct mem_accounting {
+	/* Pool name or data stack frame marker */
+	const char *name;
+	/* Pools: System memory currently allocated for the pools.
+	   Data stack: Memory currently allocated by the frames in the data
+	   stack, excluding their child frames. */
+	size_t bytes;
+	/* Pools: The highest bytes value seen.
+	   Data stack: The most memory allocated by a single frame. */
+	size_t peak_bytes;
+	/* Number of allocations done from the pools or frames */
+	unsigned long long alloc_count;
+};
+
+typedef void
+mem_accounting_callback_t(enum mem_accounting_type type,
+			  const struct mem_accounting *acc, void *context);
+
+extern bool mem_accounting_enabled;
+
+/* Returns the accounting for pools with the given name, or NULL if memory
+   accounting isn't enabled. */
+struct mem_accounting *mem_accounting_pool_get(const char *name);
+
+static inline void
+mem_accounting_add(struct mem_accounting *acc, size_t size)
+{
+	acc->bytes += size;
+	if (acc->peak_bytes < acc->bytes)
+		acc->peak_bytes = acc->bytes;
+}
+
+static inline void
+mem_accounting_sub(struct mem_accounting *acc, size_t size)
+{
+	i_assert(acc->bytes >= size);
+	acc->bytes -= size;
+}
+
+/* Called by t_pop() to add the frame's allocations to the marker. */
+void mem_accounting_data_stack_pop(const char *marker, size_t alloc_bytes,
+				   unsigned int alloc_count);
+
+/* Call the callback for each pool name and data stack marker. The callback
+   may allocate memory. */
+void mem_accounting_foreach(mem_accounting_callback_t *callback,
+			    void *context);
+
+void mem_accounting_init(void);
+void mem_accounting_deinit(void);
+
+#endif
@@ -4,6 +4,7 @@
 #include "lib.h"
 #include "safe-memset.h"
 #include "mempool.h"
+#include "mem-accounting.h"
 #include "llist.h"
 
 #define MAX_ALLOC_SIZE SSIZE_T_MAX
@@ -15,6 +16,8 @@ struct allocfree_pool {
 	size_t total_alloc_used;
 
 	struct pool_block *blocks;
+	/* NULL unless memory accounting is enabled */
+	struct mem_accounting *acc;
 #ifdef DEBUG
 	char *name;
 #endif
@@ -63,7 +66,7 @@ static const struct pool static_allocfree_pool = {
 	.datastack_pool = FALSE
 };
 
-pool_t pool_allocfree_create(const char *name ATTR_UNUSED)
+pool_t pool_allocfree_create(const char *name)
 {
 	struct allocfree_pool *pool;
 	pool = calloc(1, SIZEOF_ALLOCFREE_POOL);
@@ -75,6 +78,7 @@ pool_t pool_allocfree_create(const char *name ATTR_UNUSED)
 #endif
 	pool->pool = static_allocfree_pool;
 	pool->refcount = 1;
+	pool->acc = mem_accounting_pool_get(name);
 	return &pool->pool;
 }
 
@@ -144,6 +148,8 @@ static void *pool_block_attach(struct allocfree_pool *apool, struct pool_block *
 	block->block = PTR_OFFSET(block,SIZEOF_POOLBLOCK);
 	apool->total_alloc_used += block->size;
 	apool->total_alloc_count++;
+	if (apool->acc != NULL)
+		mem_accounting_add(apool->acc, SIZEOF_POOLBLOCK + block->size);
 	return block->block;
 }
 
@@ -162,6 +168,8 @@ pool_block_detach(struct allocfree_pool *apool, unsigned char *mem)
 	DLLIST_REMOVE(&apool->blocks, block);
 	apool->total_alloc_used -= block->size;
 	apool->total_alloc_count--;
+	if (apool->acc != NULL)
+		mem_accounting_sub(apool->acc, SIZEOF_POOLBLOCK + block->size);
 
 	return block;
 }
@@ -179,6 +187,8 @@ static void *pool_allocfree_malloc(pool_t pool, size_t size)
 		i_fatal_status(FATAL_OUTOFMEM, "calloc(1, %"PRIuSIZE_T"): Out of memory",
 			       SIZEOF_POOLBLOCK + size);
 	block->size = size;
+	if (apool->acc != NULL)
+		apool->acc->alloc_count++;
 	return pool_block_attach(apool, block);
 }
 
@@ -4,6 +4,7 @@
 #include "lib.h"
 #include "safe-memset.h"
 #include "mempool.h"
+#include "mem-accounting.h"
 
 #ifndef DEBUG
 #  define POOL_ALLOCONLY_MAX_EXTRA MEM_ALIGN(1)
@@ -17,6 +18,8 @@ struct alloconly_pool {
 	int refcount;
 
 	struct pool_block *block;
+	/* NULL unless memory accounting is enabled */
+	struct mem_accounting *acc;
 #ifdef DEBUG
 	const char *name;
 	size_t base_size;
@@ -117,7 +120,7 @@ static void check_sentries(struct pool_block *block)
 }
 #endif
 
-pool_t pool_alloconly_create(const char *name ATTR_UNUSED, size_t size)
+pool_t pool_alloconly_create(const char *name, size_t size)
 {
 	struct alloconly_pool apool, *new_apool;
 	size_t min_alloc = SIZEOF_POOLBLOCK +
@@ -132,6 +135,7 @@ pool_t pool_alloconly_create(const char *name ATTR_UNUSED, size_t size)
 	i_zero(&apool);
 	apool.pool = static_alloconly_pool;
 	apool.refcount = 1;
+	apool.acc = mem_accounting_pool_get(name);
 
 	if (size < min_alloc)
 		size = nearest_power(size + min_alloc);
@@ -178,6 +182,10 @@ static void pool_alloconly_destroy(struct alloconly_pool *apool)
 
 	/* destroy the last block */
 	block = apool->block;
+	if (apool->acc != NULL) {
+		mem_accounting_sub(apool->acc,
+				   SIZEOF_POOLBLOCK + apool->block->size);
+	}
 #ifdef DEBUG
 	safe_memset(block, CLEAR_CHR, SIZEOF_POOLBLOCK + apool->block->size);
 #else
@@ -258,6 +266,8 @@ static void block_alloc(struct alloconly_pool *apool, size_t size)
 	}
 	block->prev = apool->block;
 	apool->block = block;
+	if (apool->acc != NULL)
+		mem_accounting_add(apool->acc, size);
 
 	block->size = size - SIZEOF_POOLBLOCK;
 	block->left = block->size;
@@ -282,6 +292,8 @@ static void *pool_alloconly_malloc(pool_t pool, size_t size)
 		/* we need a new block */
 		block_alloc(apool, alloc_size + SIZEOF_POOLBLOCK);
 	}
+	if (apool->acc != NULL)
+		apool->acc->alloc_count++;
 
 	mem = POOL_BLOCK_DATA(apool->block) +
 		(apool->block->size - apool->block->left);
@@ -374,6 +386,10 @@ static void pool_alloconly_clear(pool_t pool)
 	while (apool->block->prev != NULL) {
 		block = apool->block;
 		apool->block = block->prev;
+		if (apool->acc != NULL) {
+			mem_accounting_sub(apool->acc,
+					   SIZEOF_POOLBLOCK + block->size);
+		}
 
 #ifdef DEBUG
 		safe_memset(block, CLEAR_CHR, SIZEOF_POOLBLOCK + block->size);
@@ -0,0 +1,527 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+#include "mempool.h"
+#include "mem-accounting.h"
+
+/* Slabs are allocated aligned to their size, so the slab header can be found
+   from the object's address. Large allocations are plain malloc()s with a
+   header before the memory. They are tracked in a hash table, so freeing
+   them never needs to look at memory outside the allocation. */
+#define SLAB_SIZE (16*1024)
+#define SLAB_FROM_MEM(mem) \
+	((struct slab *)((uintptr_t)(mem) & ~(uintptr_t)(SLAB_SIZE-1)))
+#define SIZEOF_SLAB MEM_ALIGN(sizeof(struct slab))
+#define SIZEOF_SLAB_POOL MEM_ALIGN(sizeof(struct slab_pool))
+#define SIZEOF_SLAB_LARGE MEM_ALIGN(sizeof(struct slab_large))
+
+#define SLAB_OBJECT_COUNT(sclass) \
+	((SLAB_SIZE - SIZEOF_SLAB) / (sclass)->object_size)
+
+static const unsigned int slab_class_sizes[POOL_SLAB_CLASS_COUNT] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536,
+	POOL_SLAB_MAX_OBJECT_SIZE
+};
+
+struct slab_class {
+	/* slabs with free objects are in partial_slabs */
+	struct slab *partial_slabs, *full_slabs;
+	size_t object_size;
+
+	unsigned int slab_count, used_count;
+	/* number of slabs in partial_slabs that have no objects in use */
+	unsigned int empty_slab_count;
+};
+
+struct slab {
+	struct slab *prev, *next;
+	struct slab_class *sclass;
+
+	/* freed objects, linked via their first bytes */
+	void *free_list;
+	/* offset to the first object that hasn't been used yet */
+	size_t unused_offset;
+	unsigned int used_count;
+};
+
+struct slab_large {
+	struct slab_large *prev, *next;
+	size_t size;
+};
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+	char *name;
+	/* NULL unless memory accounting is enabled */
+	struct mem_accounting *acc;
+
+	struct slab_class classes[POOL_SLAB_CLASS_COUNT];
+
+	/* memory => struct slab_large. Created on the first large
+	   allocation. */
+	HASH_TABLE(void *, struct slab_large *) large_hash;
+	struct slab_large *large_blocks;
+	unsigned int large_count;
+	size_t large_size;
+};
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+pool_t pool_slab_create(const char *name)
+{
+	struct slab_pool *spool;
+	unsigned int i;
+
+	spool = calloc(1, SIZEOF_SLAB_POOL);
+	if (spool == NULL) {
+		i_fatal_status(FATAL_OUTOFMEM, "calloc(1, %"PRIuSIZE_T"): Out of memory",
+			       SIZEOF_SLAB_POOL);
+	}
+	if ((spool->name = strdup(name)) == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "strdup(): Out of memory");
+	for (i = 0; i < POOL_SLAB_CLASS_COUNT; i++) {
+		i_assert(slab_class_sizes[i] % MEM_ALIGN_SIZE == 0);
+		spool->classes[i].object_size = slab_class_sizes[i];
+	}
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+	spool->acc = mem_accounting_pool_get(name);
+	return &spool->pool;
+}
+
+static void pool_slab_destroy(struct slab_pool *spool)
+{
+	pool_slab_clear(&spool->pool);
+	if (hash_table_is_created(spool->large_hash))
+		hash_table_destroy(&spool->large_hash);
+	free(spool->name);
+	free(spool);
+}
+
+static const char *pool_slab_get_name(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	return spool->name;
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *_pool)
+{
+	pool_t pool = *_pool;
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+
+	/* erase the pointer before freeing anything, as the pointer may
+	   exist inside the pool's memory area */
+	*_pool = NULL;
+
+	if (--spool->refcount > 0)
+		return;
+
+	pool_slab_destroy(spool);
+}
+
+static struct slab *
+pool_slab_alloc_aligned(struct slab_pool *spool, size_t size)
+{
+	void *mem;
+
+	if (posix_memalign(&mem, SLAB_SIZE, size) != 0) {
+		i_fatal_status(FATAL_OUTOFMEM,
+			       "posix_memalign(%u, %"PRIuSIZE_T"): Out of memory",
+			       SLAB_SIZE, size);
+	}
+	if (spool->acc != NULL)
+		mem_accounting_add(spool->acc, size);
+	return mem;
+}
+
+static void pool_slab_free_aligned(struct slab_pool *spool, struct slab *slab)
+{
+	if (spool->acc != NULL)
+		mem_accounting_sub(spool->acc, SLAB_SIZE);
+	free(slab);
+}
+
+static struct slab_class *
+pool_slab_find_class(struct slab_pool *spool, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; slab_class_sizes[i] < size; i++)
+		i_assert(i+1 < POOL_SLAB_CLASS_COUNT);
+	return &spool->classes[i];
+}
+
+static bool slab_is_full(const struct slab *slab)
+{
+	return slab->free_list == NULL &&
+		slab->unused_offset + slab->sclass->object_size > SLAB_SIZE;
+}
+
+static struct slab *
+pool_slab_class_add_slab(struct slab_pool *spool, struct slab_class *sclass)
+{
+	struct slab *slab;
+
+	slab = pool_slab_alloc_aligned(spool, SLAB_SIZE);
+	memset(slab, 0, SIZEOF_SLAB);
+	slab->sclass = sclass;
+	slab->unused_offset = SIZEOF_SLAB;
+	DLLIST_PREPEND(&sclass->partial_slabs, slab);
+	sclass->slab_count++;
+	sclass->empty_slab_count++;
+	return slab;
+}
+
+static void *pool_slab_large_mem(struct slab_large *large)
+{
+	return PTR_OFFSET(large, SIZEOF_SLAB_LARGE);
+}
+
+static struct slab_large *
+pool_slab_large_lookup(struct slab_pool *spool, void *mem)
+{
+	if (spool->large_count == 0)
+		return NULL;
+	return hash_table_lookup(spool->large_hash, mem);
+}
+
+static void *pool_slab_large_malloc(struct slab_pool *spool, size_t size)
+{
+	struct slab_large *large;
+	void *mem;
+
+	large = calloc(1, SIZEOF_SLAB_LARGE + size);
+	if (large == NULL) {
+		i_fatal_status(FATAL_OUTOFMEM,
+			       "calloc(1, %"PRIuSIZE_T"): Out of memory",
+			       SIZEOF_SLAB_LARGE + size);
+	}
+	large->size = size;
+	mem = pool_slab_large_mem(large);
+
+	if (!hash_table_is_created(spool->large_hash))
+		hash_table_create_direct(&spool->large_hash, default_pool, 0);
+	hash_table_insert(spool->large_hash, mem, large);
+	DLLIST_PREPEND(&spool->large_blocks, large);
+	spool->large_count++;
+	spool->large_size += size;
+	if (spool->acc != NULL) {
+		mem_accounting_add(spool->acc, SIZEOF_SLAB_LARGE + size);
+		spool->acc->alloc_count++;
+	}
+	return mem;
+}
+
+static void
+pool_slab_large_free_block(struct slab_pool *spool, struct slab_large *large)
+{
+	if (spool->acc != NULL)
+		mem_accounting_sub(spool->acc, SIZEOF_SLAB_LARGE + large->size);
+	free(large);
+}
+
+static void pool_slab_large_free(struct slab_pool *spool,
+				 struct slab_large *large)
+{
+	i_assert(spool->large_count > 0);
+	i_assert(spool->large_size >= large->size);
+
+	hash_table_remove(spool->large_hash, pool_slab_large_mem(large));
+	DLLIST_REMOVE(&spool->large_blocks, large);
+	spool->large_count--;
+	spool->large_size -= large->size;
+	pool_slab_large_free_block(spool, large);
+}
+
+static void *
+pool_slab_large_realloc(struct slab_pool *spool, struct slab_large *large,
+			size_t new_size)
+{
+	struct slab_large *new_large;
+	size_t old_size = large->size;
+	void *mem;
+
+	/* large allocations aren't aligned, so they can be realloc()ed */
+	hash_table_remove(spool->large_hash, pool_slab_large_mem(large));
+	DLLIST_REMOVE(&spool->large_blocks, large);
+
+	new_large = realloc(large, SIZEOF_SLAB_LARGE + new_size);
+	if (new_large == NULL) {
+		i_fatal_status(FATAL_OUTOFMEM,
+			       "realloc(%"PRIuSIZE_T"): Out of memory",
+			       SIZEOF_SLAB_LARGE + new_size);
+	}
+	new_large->size = new_size;
+	mem = pool_slab_large_mem(new_large);
+	if (new_size > old_size)
+		memset(PTR_OFFSET(mem, old_size), 0, new_size - old_size);
+
+	hash_table_insert(spool->large_hash, mem, new_large);
+	DLLIST_PREPEND(&spool->large_blocks, new_large);
+	spool->large_size = spool->large_size - old_size + new_size;
+	if (spool->acc != NULL) {
+		mem_accounting_sub(spool->acc, old_size);
+		mem_accounting_add(spool->acc, new_size);
+	}
+	return mem;
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_class *sclass;
+	struct slab *slab;
+	void *mem;
+
+	if (unlikely(size == 0 || size > SSIZE_T_MAX - SIZEOF_SLAB))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", size);
+
+	if (size > POOL_SLAB_MAX_OBJECT_SIZE)
+		return pool_slab_large_malloc(spool, size);
+
+	sclass = pool_slab_find_class(spool, size);
+	slab = sclass->partial_slabs;
+	if (slab == NULL)
+		slab = pool_slab_class_add_slab(spool, sclass);
+	if (slab->used_count == 0) {
+		i_assert(sclass->empty_slab_count > 0);
+		sclass->empty_slab_count--;
+	}
+
+	if (slab->free_list != NULL) {
+		mem = slab->free_list;
+		slab->free_list = *(void **)mem;
+	} else {
+		mem = PTR_OFFSET(slab, slab->unused_offset);
+		slab->unused_offset += sclass->object_size;
+	}
+	slab->used_count++;
+	sclass->used_count++;
+	if (spool->acc != NULL)
+		spool->acc->alloc_count++;
+
+	if (slab_is_full(slab)) {
+		DLLIST_REMOVE(&sclass->partial_slabs, slab);
+		DLLIST_PREPEND(&sclass->full_slabs, slab);
+	}
+	memset(mem, 0, size);
+	return mem;
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_class *sclass;
+	struct slab_large *large;
+	struct slab *slab;
+
+	if (mem == NULL)
+		return;
+
+	large = pool_slab_large_lookup(spool, mem);
+	if (large != NULL) {
+		pool_slab_large_free(spool, large);
+		return;
+	}
+	slab = SLAB_FROM_MEM(mem);
+	sclass = slab->sclass;
+
+	/* make sure the memory was allocated from this pool */
+	i_assert(sclass >= spool->classes &&
+		 sclass < spool->classes + POOL_SLAB_CLASS_COUNT);
+	i_assert(slab->used_count > 0 && sclass->used_count > 0);
+
+	if (slab_is_full(slab)) {
+		DLLIST_REMOVE(&sclass->full_slabs, slab);
+		DLLIST_PREPEND(&sclass->partial_slabs, slab);
+	}
+	*(void **)mem = slab->free_list;
+	slab->free_list = mem;
+	slab->used_count--;
+	sclass->used_count--;
+
+	if (slab->used_count > 0)
+		return;
+	/* keep one empty slab around so that allocating and freeing a single
+	   object doesn't keep allocating and freeing the whole slab */
+	if (sclass->empty_slab_count == 0)
+		sclass->empty_slab_count++;
+	else {
+		DLLIST_REMOVE(&sclass->partial_slabs, slab);
+		sclass->slab_count--;
+		pool_slab_free_aligned(spool, slab);
+	}
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_large *large;
+	void *new_mem;
+
+	if (unlikely(new_size == 0 || new_size > SSIZE_T_MAX - SIZEOF_SLAB))
+		i_panic("Trying to allocate %"PRIuSIZE_T" bytes", new_size);
+
+	if (mem == NULL)
+		return pool_slab_malloc(pool, new_size);
+
+	large = pool_slab_large_lookup(spool, mem);
+	if (large != NULL) {
+		i_assert(large->size == old_size);
+		if (new_size > POOL_SLAB_MAX_OBJECT_SIZE)
+			return pool_slab_large_realloc(spool, large, new_size);
+	} else if (new_size <= POOL_SLAB_MAX_OBJECT_SIZE &&
+		   pool_slab_find_class(spool, new_size) ==
+		   SLAB_FROM_MEM(mem)->sclass) {
+		/* the size class stays the same */
+		if (new_size > old_size) {
+			memset(PTR_OFFSET(mem, old_size), 0,
+			       new_size - old_size);
+		}
+		return mem;
+	}
+
+	/* The slabs can't be realloc()ed, so move the memory between the
+	   size classes or between a slab and a large allocation. */
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, I_MIN(old_size, new_size));
+	pool_slab_free(pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_free_list(struct slab_pool *spool, struct slab **list)
+{
+	struct slab *slab;
+
+	while (*list != NULL) {
+		slab = *list;
+		DLLIST_REMOVE(list, slab);
+		pool_slab_free_aligned(spool, slab);
+	}
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_class *sclass;
+	unsigned int i;
+
+	for (i = 0; i < POOL_SLAB_CLASS_COUNT; i++) {
+		sclass = &spool->classes[i];
+		pool_slab_free_list(spool, &sclass->partial_slabs);
+		pool_slab_free_list(spool, &sclass->full_slabs);
+		sclass->slab_count = 0;
+		sclass->used_count = 0;
+		sclass->empty_slab_count = 0;
+	}
+	while (spool->large_blocks != NULL) {
+		struct slab_large *large = spool->large_blocks;
+
+		DLLIST_REMOVE(&spool->large_blocks, large);
+		pool_slab_large_free_block(spool, large);
+	}
+	if (hash_table_is_created(spool->large_hash))
+		hash_table_clear(spool->large_hash, TRUE);
+	spool->large_count = 0;
+	spool->large_size = 0;
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	const struct slab_class *sclass;
+	struct pool_slab_class_stats *class_stats;
+	unsigned int i;
+
+	i_assert(pool->v == &static_slab_pool_vfuncs);
+
+	i_zero(stats_r);
+	stats_r->alloc_size = SIZEOF_SLAB_POOL;
+	for (i = 0; i < POOL_SLAB_CLASS_COUNT; i++) {
+		sclass = &spool->classes[i];
+		class_stats = &stats_r->classes[i];
+
+		class_stats->object_size = sclass->object_size;
+		class_stats->slab_count = sclass->slab_count;
+		class_stats->used_count = sclass->used_count;
+		class_stats->free_count =
+			sclass->slab_count * SLAB_OBJECT_COUNT(sclass) -
+			sclass->used_count;
+
+		stats_r->used_size += sclass->used_count * sclass->object_size;
+		stats_r->alloc_size += sclass->slab_count * SLAB_SIZE;
+		stats_r->slab_count += sclass->slab_count;
+	}
+	stats_r->large_count = spool->large_count;
+	stats_r->large_size = spool->large_size;
+	stats_r->used_size += spool->large_size;
+	stats_r->alloc_size += spool->large_size +
+		SIZEOF_SLAB_LARGE * spool->large_count;
+}
+
+size_t pool_slab_get_total_used_size(pool_t pool)
+{
+	struct pool_slab_stats stats;
+
+	pool_slab_get_stats(pool, &stats);
+	return stats.used_size;
+}
+
+size_t pool_slab_get_total_alloc_size(pool_t pool)
+{
+	struct pool_slab_stats stats;
+
+	pool_slab_get_stats(pool, &stats);
+	return stats.alloc_size;
+}
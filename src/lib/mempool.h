@@ -76,6 +76,14 @@ pool_t pool_allocfree_create(const char *name);
    See pool_alloconly_create_clean. */
 pool_t pool_allocfree_create_clean(const char *name);
 
+/* Create a new slab pool. Allocations up to POOL_SLAB_MAX_OBJECT_SIZE are
+   rounded up to a size class and allocated from slabs containing only objects
+   of the same class. Freed objects are reused by later allocations, and slabs
+   that become unused are returned to the system, so this pool is suitable for
+   long-lived objects that are allocated and freed in random order without
+   fragmenting the heap. Larger allocations are malloc()ed separately. */
+pool_t pool_slab_create(const char *name);
+
 /* Similar to nearest_power(), but try not to exceed buffer's easy
    allocation size. If you don't have any explicit minimum size, use
    old_size + 1. */
@@ -157,6 +165,38 @@ size_t pool_allocfree_get_total_used_size(pool_t pool);
 /* Returns how much system memory has been allocated for this pool. */
 size_t pool_allocfree_get_total_alloc_size(pool_t pool);
 
+#define POOL_SLAB_CLASS_COUNT 14
+#define POOL_SLAB_MAX_OBJECT_SIZE 2048
+
+struct pool_slab_class_stats {
+	size_t object_size;
+	/* number of slabs allocated for this class */
+	unsigned int slab_count;
+	/* number of objects allocated and still free in the slabs */
+	unsigned int used_count, free_count;
+};
+
+struct pool_slab_stats {
+	/* Memory allocated from the pool, with allocations rounded up to
+	   their size class. */
+	size_t used_size;
+	/* System memory allocated for the pool. */
+	size_t alloc_size;
+	unsigned int slab_count;
+	/* Allocations larger than POOL_SLAB_MAX_OBJECT_SIZE */
+	unsigned int large_count;
+	size_t large_size;
+
+	struct pool_slab_class_stats classes[POOL_SLAB_CLASS_COUNT];
+};
+
+/* These functions are only for pools created with pool_slab_create(): */
+void pool_slab_get_stats(pool_t pool, struct pool_slab_stats *stats_r);
+/* Returns how much memory has been allocated from this pool. */
+size_t pool_slab_get_total_used_size(pool_t pool);
+/* Returns how much system memory has been allocated for this pool. */
+size_t pool_slab_get_total_alloc_size(pool_t pool);
+
 /* private: */
 void pool_system_free(pool_t pool, void *mem);
 
@@ -25,6 +25,7 @@ struct file_ostream {
 	bool socket_cork_set:1;
 	bool no_socket_cork:1;
 	bool no_sendfile:1;
+	bool no_copy_file_range:1;
 	bool autoclose_fd:1;
 };
 
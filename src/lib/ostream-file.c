@@ -705,6 +705,7 @@ io_stream_sendfile(struct ostream_private *outstream,
 {
 	struct file_ostream *foutstream = (struct file_ostream *)outstream;
 	uoff_t in_size, offset, send_size, v_offset, abs_start_offset;
+	const char *func;
 	ssize_t ret;
 	bool sendfile_not_supported = FALSE;
 
@@ -739,8 +740,27 @@ io_stream_sendfile(struct ostream_private *outstream,
 		offset = abs_start_offset + v_offset;
 		send_size = in_size - v_offset;
 
-		ret = safe_sendfile(foutstream->fd, in_fd, &offset,
-				    MAX_SSIZE_T(send_size));
+		if (foutstream->file && !foutstream->no_copy_file_range) {
+			/* file to file copy. this allows the filesystem to
+			   share the blocks or do the copy server-side. */
+			func = "copy_file_range()";
+			ret = safe_copy_file_range(foutstream->fd, in_fd,
+						   &offset,
+						   MAX_SSIZE_T(send_size));
+			if (ret < 0 && errno == EINVAL) {
+				/* not supported, fallback to sendfile() */
+				foutstream->no_copy_file_range = TRUE;
+				continue;
+			}
+		} else if (foutstream->no_sendfile) {
+			ret = -1;
+			sendfile_not_supported = TRUE;
+			break;
+		} else {
+			func = "sendfile()";
+			ret = safe_sendfile(foutstream->fd, in_fd, &offset,
+					    MAX_SSIZE_T(send_size));
+		}
 		if (ret <= 0) {
 			if (ret == 0)
 				break;
@@ -759,7 +779,7 @@ io_stream_sendfile(struct ostream_private *outstream,
 				sendfile_not_supported = TRUE;
 			else {
 				io_stream_set_error(&outstream->iostream,
-						    "sendfile() failed: %m");
+						    "%s failed: %m", func);
 				outstream->ostream.stream_errno = errno;
 				/* close only if error wasn't because
 				   sendfile() isn't supported */
@@ -920,14 +940,16 @@ o_stream_file_send_istream(struct ostream_private *outstream,
 	enum ostream_send_istream_result res;
 
 	in_fd = !instream->readable_fd ? -1 : i_stream_get_fd(instream);
-	if (!foutstream->no_sendfile && in_fd != -1 &&
-	    in_fd != foutstream->fd && instream->seekable) {
+	if ((!foutstream->no_sendfile ||
+	     (foutstream->file && !foutstream->no_copy_file_range)) &&
+	    in_fd != -1 && in_fd != foutstream->fd && instream->seekable) {
 		if (io_stream_sendfile(outstream, instream, in_fd, &res))
 			return res;
 
-		/* sendfile() not supported (with this fd), fallback to
-		   regular sending. */
+		/* sendfile() or copy_file_range() not supported (with this
+		   fd), fallback to regular sending. */
 		foutstream->no_sendfile = TRUE;
+		foutstream->no_copy_file_range = TRUE;
 	}
 
 	same_stream = i_stream_get_fd(instream) == foutstream->fd &&
@@ -955,6 +977,7 @@ o_stream_create_file_common(struct file_ostream *fstream,
 	fstream->fd = fd;
 	fstream->autoclose_fd = autoclose_fd;
 	fstream->optimal_block_size = DEFAULT_OPTIMAL_BLOCK_SIZE;
+	fstream->no_copy_file_range = TRUE;
 
 	fstream->ostream.iostream.close = o_stream_file_close;
 	fstream->ostream.iostream.destroy = o_stream_file_destroy;
@@ -1071,3 +1094,15 @@ struct ostream *o_stream_create_fd_file_autoclose(int *fd, uoff_t offset)
 	*fd = -1;
 	return output;
 }
+
+void o_stream_file_set_copy_file_range(struct ostream *stream, bool set)
+{
+	struct file_ostream *fstream;
+
+	if (stream->real_stream->send_istream != o_stream_file_send_istream) {
+		/* not a file ostream */
+		return;
+	}
+	fstream = (struct file_ostream *)stream->real_stream;
+	fstream->no_copy_file_range = !set || !fstream->file;
+}
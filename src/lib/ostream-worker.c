@@ -0,0 +1,500 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ostream-private.h"
+#include "ostream-worker.h"
+
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#  include <signal.h>
+#endif
+
+/* Maximum number of blocks queued for the worker thread. While the thread
+   processes one block, the next one can be filled. */
+#define OSTREAM_WORKER_MAX_JOBS 2
+
+struct ostream_worker_job {
+	/* block_size buffer */
+	unsigned char *input;
+	size_t input_size;
+	bool final;
+
+	/* malloc()ed, since it may be grown by the worker thread */
+	unsigned char *output;
+	size_t output_alloc, output_used;
+
+	int ret;
+	const char *error;
+	bool done;
+};
+
+struct worker_ostream {
+	struct ostream_private ostream;
+
+	struct ostream_worker_settings set;
+	char *name;
+	const struct ostream_worker_vfuncs *v;
+	void *context;
+
+	/* block_size buffer */
+	unsigned char *inbuf;
+	size_t inbuf_used;
+
+	/* processed output that is being sent to the parent */
+	unsigned char *outbuf;
+	size_t outbuf_alloc, outbuf_offset, outbuf_used;
+
+#ifdef HAVE_PTHREAD
+	/* The thread only calls process() with the jobs' buffers and the
+	   context. Everything else is done by the ostream's thread. */
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t job_cond, done_cond;
+	struct ostream_worker_job jobs[OSTREAM_WORKER_MAX_JOBS];
+	/* queued jobs are jobs[job_first..job_first+job_count-1] */
+	unsigned int job_first, job_count;
+	bool thread_started:1;
+	bool thread_failed:1;
+	bool thread_quit:1;
+#endif
+
+	bool final_processed:1;
+};
+
+static void o_stream_worker_job_run(struct worker_ostream *wstream,
+				    struct ostream_worker_job *job)
+{
+	struct ostream_worker_block block;
+	unsigned char *output;
+	size_t alloc;
+	bool grow = job->output_alloc == 0;
+	int ret;
+
+	/* this may be running in the worker thread - use only plain libc */
+	i_zero(&block);
+	block.input = job->input;
+	block.input_size = job->input_size;
+	block.final = job->final;
+	job->output_used = 0;
+	job->error = NULL;
+	for (;;) {
+		if (grow) {
+			alloc = job->output_alloc == 0 ? wstream->set.output_size :
+				job->output_alloc * 2;
+			output = realloc(job->output, alloc);
+			if (output == NULL) {
+				job->error = "Out of memory";
+				ret = -1;
+				break;
+			}
+			job->output = output;
+			job->output_alloc = alloc;
+		}
+		block.output = job->output + job->output_used;
+		block.output_size = job->output_alloc - job->output_used;
+		ret = wstream->v->process(wstream->context, &block,
+					  &job->error);
+		job->output_used = block.output - job->output;
+		if (ret != 0)
+			break;
+		/* more output space needed */
+		grow = TRUE;
+	}
+	job->ret = ret;
+}
+
+static int o_stream_worker_job_finish(struct worker_ostream *wstream,
+				      struct ostream_worker_job *job)
+{
+	unsigned char *output = wstream->outbuf;
+	size_t alloc = wstream->outbuf_alloc;
+
+	i_assert(wstream->outbuf_used == 0);
+
+	if (job->ret < 0) {
+		io_stream_set_error(&wstream->ostream.iostream,
+			"%s.write(%s): %s", wstream->name,
+			o_stream_get_name(&wstream->ostream.ostream),
+			job->error);
+		wstream->ostream.ostream.stream_errno = EIO;
+		return -1;
+	}
+	/* swap the buffers instead of copying the output */
+	wstream->outbuf = job->output;
+	wstream->outbuf_alloc = job->output_alloc;
+	wstream->outbuf_used = job->output_used;
+	job->output = output;
+	job->output_alloc = alloc;
+	return 0;
+}
+
+static int o_stream_worker_send_outbuf(struct worker_ostream *wstream)
+{
+	ssize_t ret;
+	size_t size;
+
+	if (wstream->outbuf_used == 0)
+		return 1;
+
+	size = wstream->outbuf_used - wstream->outbuf_offset;
+	i_assert(size > 0);
+	ret = o_stream_send(wstream->ostream.parent,
+			    wstream->outbuf + wstream->outbuf_offset, size);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&wstream->ostream);
+		return -1;
+	}
+	if ((size_t)ret != size) {
+		wstream->outbuf_offset += ret;
+		return 0;
+	}
+	wstream->outbuf_offset = 0;
+	wstream->outbuf_used = 0;
+	return 1;
+}
+
+#ifdef HAVE_PTHREAD
+static void *o_stream_worker_thread(void *context)
+{
+	struct worker_ostream *wstream = context;
+	struct ostream_worker_job *job = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&wstream->mutex);
+	while (!wstream->thread_quit) {
+		/* jobs are finished in order */
+		for (i = 0; i < wstream->job_count; i++) {
+			job = &wstream->jobs[(wstream->job_first + i) %
+					     OSTREAM_WORKER_MAX_JOBS];
+			if (!job->done)
+				break;
+		}
+		if (i == wstream->job_count) {
+			pthread_cond_wait(&wstream->job_cond, &wstream->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&wstream->mutex);
+
+		o_stream_worker_job_run(wstream, job);
+
+		pthread_mutex_lock(&wstream->mutex);
+		job->done = TRUE;
+		pthread_cond_signal(&wstream->done_cond);
+	}
+	pthread_mutex_unlock(&wstream->mutex);
+	return NULL;
+}
+
+static bool o_stream_worker_thread_start(struct worker_ostream *wstream)
+{
+	sigset_t sigset, old_sigset;
+	int ret;
+
+	i_assert(!wstream->thread_started);
+
+	pthread_mutex_init(&wstream->mutex, NULL);
+	pthread_cond_init(&wstream->job_cond, NULL);
+	pthread_cond_init(&wstream->done_cond, NULL);
+
+	/* signals must be handled by the main thread */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &old_sigset);
+	ret = pthread_create(&wstream->thread, NULL,
+			     o_stream_worker_thread, wstream);
+	pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+	if (ret != 0) {
+		/* process in the calling thread instead */
+		i_error("%s: pthread_create() failed: %s",
+			wstream->name, strerror(ret));
+		pthread_cond_destroy(&wstream->done_cond);
+		pthread_cond_destroy(&wstream->job_cond);
+		pthread_mutex_destroy(&wstream->mutex);
+		wstream->thread_failed = TRUE;
+		return FALSE;
+	}
+	wstream->thread_started = TRUE;
+	return TRUE;
+}
+
+static void o_stream_worker_thread_stop(struct worker_ostream *wstream)
+{
+	unsigned int i;
+
+	if (wstream->thread_started) {
+		pthread_mutex_lock(&wstream->mutex);
+		wstream->thread_quit = TRUE;
+		pthread_cond_signal(&wstream->job_cond);
+		pthread_mutex_unlock(&wstream->mutex);
+		pthread_join(wstream->thread, NULL);
+
+		pthread_cond_destroy(&wstream->done_cond);
+		pthread_cond_destroy(&wstream->job_cond);
+		pthread_mutex_destroy(&wstream->mutex);
+		wstream->thread_started = FALSE;
+	}
+	for (i = 0; i < OSTREAM_WORKER_MAX_JOBS; i++) {
+		i_free(wstream->jobs[i].input);
+		free(wstream->jobs[i].output);
+	}
+}
+
+static int
+o_stream_worker_jobs_collect(struct worker_ostream *wstream,
+			     unsigned int max_jobs_left)
+{
+	struct ostream_worker_job *job;
+	bool done;
+	int ret;
+
+	/* move the finished output to outbuf and send it in order. wait for
+	   the thread until at most max_jobs_left jobs are queued. */
+	while (wstream->job_count > 0) {
+		if ((ret = o_stream_worker_send_outbuf(wstream)) <= 0)
+			return ret;
+
+		job = &wstream->jobs[wstream->job_first];
+		pthread_mutex_lock(&wstream->mutex);
+		while (!job->done && wstream->job_count > max_jobs_left)
+			pthread_cond_wait(&wstream->done_cond, &wstream->mutex);
+		done = job->done;
+		if (done) {
+			job->done = FALSE;
+			wstream->job_first = (wstream->job_first + 1) %
+				OSTREAM_WORKER_MAX_JOBS;
+			wstream->job_count--;
+		}
+		pthread_mutex_unlock(&wstream->mutex);
+		if (!done)
+			break;
+
+		if (o_stream_worker_job_finish(wstream, job) < 0)
+			return -1;
+	}
+	return o_stream_worker_send_outbuf(wstream);
+}
+
+static int
+o_stream_worker_process_async(struct worker_ostream *wstream, bool final)
+{
+	struct ostream_worker_job *job;
+	unsigned char *input;
+	int ret;
+
+	if ((ret = o_stream_worker_jobs_collect(wstream,
+					OSTREAM_WORKER_MAX_JOBS - 1)) <= 0)
+		return ret;
+	i_assert(wstream->job_count < OSTREAM_WORKER_MAX_JOBS);
+
+	job = &wstream->jobs[(wstream->job_first + wstream->job_count) %
+			     OSTREAM_WORKER_MAX_JOBS];
+	if (job->input == NULL)
+		job->input = i_malloc(wstream->set.block_size);
+	/* the thread isn't accessing the job, since it's not queued */
+	input = job->input;
+	job->input = wstream->inbuf;
+	job->input_size = wstream->inbuf_used;
+	job->final = final;
+	wstream->inbuf = input;
+	wstream->inbuf_used = 0;
+
+	pthread_mutex_lock(&wstream->mutex);
+	wstream->job_count++;
+	pthread_cond_signal(&wstream->job_cond);
+	pthread_mutex_unlock(&wstream->mutex);
+	return 1;
+}
+#endif
+
+static int o_stream_worker_process(struct worker_ostream *wstream, bool final)
+{
+	struct ostream_worker_job job;
+	int ret;
+
+	i_assert(!wstream->final_processed);
+
+#ifdef HAVE_PTHREAD
+	/* use the thread only for large streams, i.e. once the first block
+	   is full */
+	if (!wstream->thread_started && !wstream->thread_failed &&
+	    wstream->inbuf_used == wstream->set.block_size)
+		(void)o_stream_worker_thread_start(wstream);
+	if (wstream->thread_started) {
+		if ((ret = o_stream_worker_process_async(wstream, final)) > 0)
+			wstream->final_processed = final;
+		return ret;
+	}
+#endif
+	if ((ret = o_stream_worker_send_outbuf(wstream)) <= 0)
+		return ret;
+
+	i_zero(&job);
+	job.input = wstream->inbuf;
+	job.input_size = wstream->inbuf_used;
+	job.final = final;
+	/* the job owns outbuf until it's finished */
+	job.output = wstream->outbuf;
+	job.output_alloc = wstream->outbuf_alloc;
+	wstream->outbuf = NULL;
+	wstream->outbuf_alloc = 0;
+
+	o_stream_worker_job_run(wstream, &job);
+	ret = o_stream_worker_job_finish(wstream, &job);
+	i_assert(job.output == NULL);
+	if (ret < 0)
+		return -1;
+	wstream->inbuf_used = 0;
+	wstream->final_processed = final;
+	return 1;
+}
+
+static ssize_t
+o_stream_worker_send_chunk(struct worker_ostream *wstream,
+			   const void *data, size_t size)
+{
+	size_t max_size;
+	ssize_t added_bytes = 0;
+	int ret;
+
+	do {
+		max_size = I_MIN(size, wstream->set.block_size -
+				 wstream->inbuf_used);
+		memcpy(wstream->inbuf + wstream->inbuf_used, data, max_size);
+		wstream->inbuf_used += max_size;
+
+		data = CONST_PTR_OFFSET(data, max_size);
+		size -= max_size;
+		added_bytes += max_size;
+
+		if (wstream->inbuf_used == wstream->set.block_size) {
+			ret = o_stream_worker_process(wstream, FALSE);
+			if (ret <= 0)
+				return added_bytes != 0 ? added_bytes : ret;
+		}
+	} while (size > 0);
+
+	return added_bytes;
+}
+
+static ssize_t
+o_stream_worker_sendv(struct ostream_private *stream,
+		      const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct worker_ostream *wstream = (struct worker_ostream *)stream;
+	ssize_t ret, bytes = 0;
+	unsigned int i;
+
+	if ((ret = o_stream_worker_send_outbuf(wstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+	for (i = 0; i < iov_count; i++) {
+		ret = o_stream_worker_send_chunk(wstream, iov[i].iov_base,
+						 iov[i].iov_len);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+static int o_stream_worker_flush(struct ostream_private *stream)
+{
+	struct worker_ostream *wstream = (struct worker_ostream *)stream;
+	int ret;
+
+	if (!wstream->final_processed &&
+	    (wstream->inbuf_used > 0 || stream->finished)) {
+		ret = o_stream_worker_process(wstream, stream->finished);
+		if (ret <= 0)
+			return ret;
+	}
+#ifdef HAVE_PTHREAD
+	if ((ret = o_stream_worker_jobs_collect(wstream, 0)) <= 0)
+		return ret;
+#endif
+	if ((ret = o_stream_worker_send_outbuf(wstream)) <= 0)
+		return ret;
+	return o_stream_flush_parent(stream);
+}
+
+static size_t
+o_stream_worker_get_buffer_used_size(const struct ostream_private *stream)
+{
+	const struct worker_ostream *wstream =
+		(const struct worker_ostream *)stream;
+
+	/* outbuf has already processed data that we're trying to send to the
+	   parent stream. inbuf and the queued jobs aren't included in the
+	   return value, because they need to be filled up or flushed. */
+	return (wstream->outbuf_used - wstream->outbuf_offset) +
+		o_stream_get_buffer_used_size(stream->parent);
+}
+
+static size_t
+o_stream_worker_get_buffer_avail_size(const struct ostream_private *stream)
+{
+	const struct worker_ostream *wstream =
+		(const struct worker_ostream *)stream;
+
+	/* We're only guaranteed to accept data to inbuf. The parent stream
+	   might have space, but since processed data gets written there it's
+	   not really known how much we can actually write there. */
+	return wstream->set.block_size - wstream->inbuf_used;
+}
+
+static void o_stream_worker_close(struct iostream_private *stream,
+				  bool close_parent)
+{
+	struct worker_ostream *wstream = (struct worker_ostream *)stream;
+
+	if (close_parent)
+		o_stream_close(wstream->ostream.parent);
+}
+
+static void o_stream_worker_destroy(struct iostream_private *stream)
+{
+	struct worker_ostream *wstream = (struct worker_ostream *)stream;
+
+#ifdef HAVE_PTHREAD
+	o_stream_worker_thread_stop(wstream);
+#endif
+	wstream->v->destroy(wstream->context);
+	i_free(wstream->inbuf);
+	free(wstream->outbuf);
+	i_free(wstream->name);
+	o_stream_unref(&wstream->ostream.parent);
+}
+
+struct ostream *
+o_stream_create_worker(struct ostream *output,
+		       const struct ostream_worker_settings *set,
+		       const struct ostream_worker_vfuncs *v, void *context)
+{
+	struct worker_ostream *wstream;
+
+	i_assert(set->block_size > 0);
+	i_assert(set->output_size > 0);
+
+	wstream = i_new(struct worker_ostream, 1);
+	wstream->ostream.sendv = o_stream_worker_sendv;
+	wstream->ostream.flush = o_stream_worker_flush;
+	wstream->ostream.get_buffer_used_size =
+		o_stream_worker_get_buffer_used_size;
+	wstream->ostream.get_buffer_avail_size =
+		o_stream_worker_get_buffer_avail_size;
+	wstream->ostream.iostream.close = o_stream_worker_close;
+	wstream->ostream.iostream.destroy = o_stream_worker_destroy;
+
+	wstream->set = *set;
+	wstream->name = i_strdup(set->name);
+	wstream->set.name = wstream->name;
+	wstream->v = v;
+	wstream->context = context;
+	wstream->inbuf = i_malloc(set->block_size);
+	return o_stream_create(&wstream->ostream, output,
+			       o_stream_get_fd(output));
+}
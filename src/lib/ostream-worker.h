@@ -0,0 +1,51 @@
+#ifndef OSTREAM_WORKER_H
+#define OSTREAM_WORKER_H
+
+/* Ostream that transforms (e.g. compresses or encrypts) the written data in
+   blocks. Once the first full block has been written, the blocks are
+   processed in a separate thread, so the caller can keep writing the next
+   block meanwhile. Small streams are processed in the calling thread. The
+   output is written to the parent stream in the original order. */
+
+struct ostream_worker_block {
+	/* Input that hasn't been processed yet */
+	const unsigned char *input;
+	size_t input_size;
+	/* Space available for the output */
+	unsigned char *output;
+	size_t output_size;
+	/* This is the last block of the stream. Everything, including any
+	   trailer, must be written out. */
+	bool final;
+};
+
+/* process() may be called from a separate thread. It must not use anything
+   from lib that isn't thread-safe, such as data stack, pools, logging or
+   ioloop. Only the context and the block's memory may be accessed. */
+struct ostream_worker_vfuncs {
+	/* Process the block, updating its input and output fields. Returns 1
+	   when the whole input was processed, 0 if more output space is
+	   needed, or -1 with *error_r set to a static string on error. */
+	int (*process)(void *context, struct ostream_worker_block *block,
+		       const char **error_r);
+	/* Free the context. Called from the ostream's thread. */
+	void (*destroy)(void *context);
+};
+
+struct ostream_worker_settings {
+	/* Used in error messages, e.g. "zstd" */
+	const char *name;
+	/* process() is called with blocks of this size, except for the
+	   final block and the blocks written by o_stream_flush(). */
+	size_t block_size;
+	/* Initial output buffer size for a block. It's grown when process()
+	   needs more space. */
+	size_t output_size;
+};
+
+struct ostream *
+o_stream_create_worker(struct ostream *output,
+		       const struct ostream_worker_settings *set,
+		       const struct ostream_worker_vfuncs *v, void *context);
+
+#endif
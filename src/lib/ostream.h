@@ -59,6 +59,12 @@ struct ostream *o_stream_create_fd_autoclose(int *fd, size_t max_buffer_size);
 struct ostream *
 o_stream_create_fd_file(int fd, uoff_t offset, bool autoclose_fd);
 struct ostream *o_stream_create_fd_file_autoclose(int *fd, uoff_t offset);
+/* Copy data sent from file istreams to this file ostream with
+   copy_file_range(). The filesystem may then share the data blocks with the
+   source file (reflink) or do the copy server-side (NFS). This is disabled by
+   default, since it changes how the written file is laid out on disk. Does
+   nothing if the stream isn't a file ostream. */
+void o_stream_file_set_copy_file_range(struct ostream *stream, bool set);
 /* Create an output stream to a buffer. */
 struct ostream *o_stream_create_buffer(buffer_t *buf);
 /* Create an output streams that always fails the writes. */
@@ -8,6 +8,7 @@
 #ifdef HAVE_LINUX_SENDFILE
 #  undef _FILE_OFFSET_BITS
 #endif
+#define _GNU_SOURCE /* for copy_file_range() */
 
 #include "lib.h"
 #include "sendfile-util.h"
@@ -141,3 +142,45 @@ ssize_t safe_sendfile(int out_fd ATTR_UNUSED, int in_fd ATTR_UNUSED,
 }
 
 #endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+
+#include <unistd.h>
+
+ssize_t safe_copy_file_range(int out_fd, int in_fd, uoff_t *offset,
+			     size_t count)
+{
+	loff_t in_offset;
+	ssize_t ret;
+
+	if (count == 0)
+		return 0;
+	if (*offset >= (uoff_t)OFF_T_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	in_offset = (loff_t)*offset;
+	ret = copy_file_range(in_fd, &in_offset, out_fd, NULL, count, 0);
+	if (ret < 0) {
+		if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+		    errno == EBADF) {
+			/* different filesystems, old kernel or out_fd is
+			   opened with O_APPEND. behave as if it wasn't
+			   supported at all. */
+			errno = EINVAL;
+		}
+		return -1;
+	}
+	*offset = (uoff_t)in_offset;
+	return ret;
+}
+#else
+ssize_t safe_copy_file_range(int out_fd ATTR_UNUSED, int in_fd ATTR_UNUSED,
+			     uoff_t *offset ATTR_UNUSED,
+			     size_t count ATTR_UNUSED)
+{
+	errno = EINVAL;
+	return -1;
+}
+#endif
@@ -5,5 +5,11 @@
    it isn't supported for some reason (out_fd isn't a socket, offset is too
    large, or there simply is no sendfile()). */
 ssize_t safe_sendfile(int out_fd, int in_fd, uoff_t *offset, size_t count);
+/* Copy data between two files with copy_file_range(). The data is written to
+   out_fd's current file offset. Filesystems supporting it may share the data
+   blocks (reflink) or do the copy server-side (NFS). Returns -1 and
+   errno=EINVAL if it isn't supported for these fds. */
+ssize_t safe_copy_file_range(int out_fd, int in_fd, uoff_t *offset,
+			     size_t count);
 
 #endif
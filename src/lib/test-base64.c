@@ -2,8 +2,15 @@
 
 #include "test-lib.h"
 #include "str.h"
+#include "time-util.h"
 #include "base64.h"
 
+#include <stdio.h>
+#include <sys/time.h>
+
+static const char *const base64_simd_names[] = {
+	"scalar", "ssse3", "avx2"
+};
 
 static void test_base64_encode(void)
 {
@@ -20,7 +27,8 @@ static void test_base64_encode(void)
 	string_t *str;
 	unsigned int i;
 
-	test_begin("base64_encode()");
+	test_begin(t_strdup_printf("base64_encode() %s",
+				   base64_simd_names[base64_simd_get()]));
 	str = t_str_new(256);
 	for (i = 0; i < N_ELEMENTS(input); i++) {
 		str_truncate(str, 0);
@@ -59,7 +67,8 @@ static void test_base64_decode(void)
 	size_t src_pos;
 	int ret;
 
-	test_begin("base64_decode()");
+	test_begin(t_strdup_printf("base64_decode() %s",
+				   base64_simd_names[base64_simd_get()]));
 	str = t_str_new(256);
 	for (i = 0; i < N_ELEMENTS(input); i++) {
 		str_truncate(str, 0);
@@ -85,7 +94,8 @@ static void test_base64_random(void)
 	str = t_str_new(256);
 	dest = t_str_new(256);
 
-	test_begin("base64 encode/decode with random input");
+	test_begin(t_strdup_printf("base64 encode/decode with random input %s",
+				   base64_simd_names[base64_simd_get()]));
 	for (i = 0; i < 1000; i++) {
 		max = i_rand_limit(sizeof(buf));
 		for (j = 0; j < max; j++)
@@ -101,9 +111,188 @@ static void test_base64_random(void)
 	test_end();
 }
 
+static void
+test_base64_decode_scalar(const void *src, size_t src_size,
+			  size_t *src_pos_r, buffer_t *dest, int *ret_r)
+{
+	enum base64_simd simd = base64_simd_get();
+
+	base64_simd_set(BASE64_SIMD_NONE);
+	*ret_r = base64_decode(src, src_size, src_pos_r, dest);
+	base64_simd_set(simd);
+}
+
+static void test_base64_long(void)
+{
+	string_t *input, *encoded, *dest, *dest2, *lines;
+	unsigned int i, j, len, line_len;
+	size_t src_pos, src_pos2, pos;
+	int ret, ret2;
+
+	input = t_str_new(8192);
+	encoded = t_str_new(8192);
+	lines = t_str_new(8192);
+	dest = t_str_new(8192);
+	dest2 = t_str_new(8192);
+
+	/* the SIMD code handles only long runs of base64 characters, so
+	   compare against the scalar code with long inputs that have line
+	   feeds, whitespace, padding and invalid characters in random
+	   places */
+	test_begin(t_strdup_printf("base64 long input %s",
+				   base64_simd_names[base64_simd_get()]));
+	for (i = 0; i < 1000; i++) {
+		str_truncate(input, 0);
+		str_truncate(encoded, 0);
+		len = i_rand_limit(5000);
+		for (j = 0; j < len; j++)
+			str_append_c(input, i_rand());
+		base64_encode(str_data(input), len, encoded);
+
+		str_truncate(dest, 0);
+		test_assert_idx(base64_decode(str_data(encoded),
+					      str_len(encoded), &src_pos,
+					      dest) >= 0, i);
+		test_assert_idx(src_pos == str_len(encoded), i);
+		test_assert_idx(buffer_cmp(input, dest), i);
+
+		/* split to lines */
+		str_truncate(lines, 0);
+		line_len = (i_rand_limit(40) + 1) * 4;
+		for (pos = 0; pos < str_len(encoded); pos += line_len) {
+			str_append_data(lines, str_data(encoded) + pos,
+				I_MIN(line_len, str_len(encoded) - pos));
+			str_append(lines, i % 2 == 0 ? "\r\n" : "\n");
+		}
+		str_truncate(dest, 0);
+		test_assert_idx(base64_decode(str_data(lines), str_len(lines),
+					      &src_pos, dest) >= 0, i);
+		test_assert_idx(src_pos == str_len(lines), i);
+		test_assert_idx(buffer_cmp(input, dest), i);
+
+		/* corrupt a random position */
+		if (str_len(lines) == 0)
+			continue;
+		pos = i_rand_limit(str_len(lines));
+		buffer_write(lines, pos, "\0 =!\t\r\n\x80" + i_rand_limit(8), 1);
+		str_truncate(dest, 0);
+		str_truncate(dest2, 0);
+		ret = base64_decode(str_data(lines), str_len(lines),
+				    &src_pos, dest);
+		test_base64_decode_scalar(str_data(lines), str_len(lines),
+					  &src_pos2, dest2, &ret2);
+		test_assert_idx(ret == ret2, i);
+		test_assert_idx(src_pos == src_pos2, i);
+		test_assert_idx(buffer_cmp(dest, dest2), i);
+	}
+	test_end();
+}
+
+static void test_base64_benchmark_start(struct timeval *start_r)
+{
+	if (gettimeofday(start_r, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void
+test_base64_benchmark_print(const char *name, size_t size,
+			    const struct timeval *start)
+{
+	struct timeval now;
+	long long usecs;
+
+	test_base64_benchmark_start(&now);
+	usecs = timeval_diff_usecs(&now, start);
+	printf("%-24s %8.1f MB/s\n", name,
+	       usecs == 0 ? 0 : size / (double)usecs);
+}
+
+static void test_base64_benchmark(unsigned int mb)
+{
+	const size_t size = 64*1024;
+	const unsigned int count = mb * 1024*1024 / size;
+	buffer_t *input, *encoded, *lines, *dest;
+	struct timeval start;
+	unsigned int i;
+	size_t pos;
+
+	input = buffer_create_dynamic(default_pool, size);
+	encoded = buffer_create_dynamic(default_pool,
+					MAX_BASE64_ENCODED_SIZE(size));
+	lines = buffer_create_dynamic(default_pool,
+				      MAX_BASE64_ENCODED_SIZE(size) * 2);
+	dest = buffer_create_dynamic(default_pool,
+				     MAX_BASE64_DECODED_SIZE(size * 2));
+	for (i = 0; i < size; i++)
+		buffer_append_c(input, i_rand());
+	base64_encode(input->data, input->used, encoded);
+	for (pos = 0; pos < encoded->used; pos += 76) {
+		buffer_append(lines, CONST_PTR_OFFSET(encoded->data, pos),
+			      I_MIN(76, encoded->used - pos));
+		buffer_append(lines, "\r\n", 2);
+	}
+
+	test_base64_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		buffer_set_used_size(encoded, 0);
+		base64_encode(input->data, input->used, encoded);
+	}
+	test_base64_benchmark_print(t_strdup_printf("encode %s",
+		base64_simd_names[base64_simd_get()]),
+		(size_t)count * size, &start);
+
+	test_base64_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		buffer_set_used_size(dest, 0);
+		if (base64_decode(encoded->data, encoded->used,
+				  NULL, dest) < 0)
+			i_unreached();
+	}
+	test_base64_benchmark_print(t_strdup_printf("decode %s",
+		base64_simd_names[base64_simd_get()]),
+		(size_t)count * size, &start);
+
+	test_base64_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		buffer_set_used_size(dest, 0);
+		if (base64_decode(lines->data, lines->used, NULL, dest) < 0)
+			i_unreached();
+	}
+	test_base64_benchmark_print(t_strdup_printf("decode lines %s",
+		base64_simd_names[base64_simd_get()]),
+		(size_t)count * size, &start);
+	test_assert(buffer_cmp(input, dest));
+
+	buffer_free(&input);
+	buffer_free(&encoded);
+	buffer_free(&lines);
+	buffer_free(&dest);
+}
+
 void test_base64(void)
 {
-	test_base64_encode();
-	test_base64_decode();
-	test_base64_random();
+	enum base64_simd simd, best = base64_simd_get_best();
+	const char *value;
+	unsigned int mb = 0;
+
+	/* BASE64_BENCHMARK=<MB> measures the throughput of each
+	   implementation */
+	value = getenv("BASE64_BENCHMARK");
+	if (value != NULL && str_to_uint(value, &mb) == 0 && mb > 0)
+		printf("%u MB of random data:\n", mb);
+
+	for (simd = BASE64_SIMD_NONE; simd <= best; simd++) {
+		base64_simd_set(simd);
+		test_base64_encode();
+		test_base64_decode();
+		test_base64_random();
+		test_base64_long();
+		if (mb > 0) {
+			test_begin(t_strdup_printf("base64 benchmark %s",
+						   base64_simd_names[simd]));
+			test_base64_benchmark(mb);
+			test_end();
+		}
+	}
+	base64_simd_set(best);
 }
@@ -0,0 +1,118 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "file-copy.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_SRC_PATH ".test-file-copy.src"
+#define TEST_DEST_PATH ".test-file-copy.dest"
+#define TEST_FILE_SIZE (256*1024 + 123)
+
+static void create_src_file(void)
+{
+	unsigned char buf[1024];
+	unsigned int i;
+	int fd;
+
+	fd = open(TEST_SRC_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", TEST_SRC_PATH);
+	for (i = 0; i < TEST_FILE_SIZE; i += sizeof(buf)) {
+		memset(buf, 'a' + (i / sizeof(buf)) % 26, sizeof(buf));
+		if (write(fd, buf, I_MIN(sizeof(buf), TEST_FILE_SIZE - i)) < 0)
+			i_fatal("write(%s) failed: %m", TEST_SRC_PATH);
+	}
+	i_close_fd(&fd);
+}
+
+static bool files_are_equal(const char *path1, const char *path2)
+{
+	unsigned char buf1[4096], buf2[4096];
+	ssize_t ret1, ret2;
+	int fd1, fd2;
+	bool equal = TRUE;
+
+	fd1 = open(path1, O_RDONLY);
+	if (fd1 == -1)
+		i_fatal("open(%s) failed: %m", path1);
+	fd2 = open(path2, O_RDONLY);
+	if (fd2 == -1)
+		i_fatal("open(%s) failed: %m", path2);
+	do {
+		ret1 = read(fd1, buf1, sizeof(buf1));
+		ret2 = read(fd2, buf2, sizeof(buf2));
+		if (ret1 != ret2 || (ret1 > 0 && memcmp(buf1, buf2, ret1) != 0))
+			equal = FALSE;
+	} while (equal && ret1 > 0);
+	i_close_fd(&fd1);
+	i_close_fd(&fd2);
+	return equal;
+}
+
+static void test_file_clone_fd(void)
+{
+	struct stat st;
+	int src_fd, dest_fd, ret;
+
+	test_begin("file_clone_fd()");
+	create_src_file();
+	src_fd = open(TEST_SRC_PATH, O_RDONLY);
+	if (src_fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_SRC_PATH);
+	dest_fd = open(TEST_DEST_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (dest_fd == -1)
+		i_fatal("creat(%s) failed: %m", TEST_DEST_PATH);
+
+	ret = file_clone_fd(src_fd, dest_fd);
+	test_assert(ret >= 0);
+	if (fstat(dest_fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", TEST_DEST_PATH);
+	if (ret > 0) {
+		test_assert(st.st_size == TEST_FILE_SIZE);
+		test_assert(lseek(dest_fd, 0, SEEK_CUR) == TEST_FILE_SIZE);
+		test_assert(files_are_equal(TEST_SRC_PATH, TEST_DEST_PATH));
+	} else {
+		/* not supported - nothing must have been written */
+		test_assert(st.st_size == 0);
+	}
+	i_close_fd(&src_fd);
+	i_close_fd(&dest_fd);
+
+	/* empty source file */
+	src_fd = open(TEST_SRC_PATH, O_RDWR | O_TRUNC);
+	if (src_fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_SRC_PATH);
+	dest_fd = open(TEST_DEST_PATH, O_WRONLY | O_TRUNC);
+	if (dest_fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_DEST_PATH);
+	test_assert(file_clone_fd(src_fd, dest_fd) >= 0);
+	test_assert(lseek(dest_fd, 0, SEEK_CUR) == 0);
+	i_close_fd(&src_fd);
+	i_close_fd(&dest_fd);
+
+	i_unlink(TEST_SRC_PATH);
+	i_unlink(TEST_DEST_PATH);
+	test_end();
+}
+
+static void test_file_copy_no_hardlink(void)
+{
+	test_begin("file_copy() without hardlinking");
+	create_src_file();
+	test_assert(file_copy(TEST_SRC_PATH, TEST_DEST_PATH, FALSE) == 1);
+	test_assert(files_are_equal(TEST_SRC_PATH, TEST_DEST_PATH));
+	i_unlink(TEST_SRC_PATH);
+	i_unlink(TEST_DEST_PATH);
+
+	test_assert(file_copy(TEST_SRC_PATH, TEST_DEST_PATH, FALSE) == 0);
+	test_end();
+}
+
+void test_file_copy(void)
+{
+	test_file_clone_fd();
+	test_file_copy_no_hardlink();
+}
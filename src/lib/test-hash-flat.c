@@ -0,0 +1,304 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "time-util.h"
+#include "hash-flat.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+static void test_hash_flat_random(void)
+{
+#define KEYMAX 100000
+	HASH_TABLE(void *, void *) ref;
+	HASH_FLAT(void *, void *) hash;
+	struct hash_flat_iterate_context *iter;
+	void *key, *value;
+	unsigned int i, count, keyval;
+
+	test_begin("hash flat random");
+	/* hash_table_*() is the reference */
+	hash_table_create_direct(&ref, default_pool, 0);
+	hash_flat_create_direct(&hash, 0);
+	for (i = 0; i < KEYMAX; i++) {
+		keyval = (i_rand() % (KEYMAX / 10)) + 1;
+		key = POINTER_CAST(keyval);
+		value = POINTER_CAST(i + 1);
+		if (i_rand() % 3 > 0) {
+			if (hash_table_lookup(ref, key) == NULL) {
+				hash_table_insert(ref, key, value);
+				hash_flat_insert(hash, key, value);
+			} else {
+				hash_table_update(ref, key, value);
+				hash_flat_update(hash, key, value);
+			}
+		} else {
+			test_assert_idx(hash_table_try_remove(ref, key) ==
+					hash_flat_try_remove(hash, key), i);
+		}
+		test_assert_idx(hash_flat_lookup(hash, key) ==
+				hash_table_lookup(ref, key), i);
+	}
+	test_assert(hash_flat_count(hash) == hash_table_count(ref));
+
+	/* all the keys are found and iterated */
+	count = 0;
+	iter = hash_flat_iterate_init(hash);
+	while (hash_flat_iterate(iter, hash, &key, &value)) {
+		test_assert(hash_table_lookup(ref, key) == value);
+		count++;
+	}
+	hash_flat_iterate_deinit(&iter);
+	test_assert(count == hash_table_count(ref));
+
+	/* removing everything while iterating */
+	iter = hash_flat_iterate_init(hash);
+	while (hash_flat_iterate(iter, hash, &key, &value))
+		hash_flat_remove(hash, key);
+	hash_flat_iterate_deinit(&iter);
+	test_assert(hash_flat_count(hash) == 0);
+	for (i = 1; i <= KEYMAX / 10; i++)
+		test_assert_idx(hash_flat_lookup(hash, POINTER_CAST(i)) == NULL, i);
+
+	hash_table_destroy(&ref);
+	hash_flat_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_flat_strings(void)
+{
+	HASH_FLAT(char *, char *) hash;
+	char *keys[1000], *orig_key, *value;
+	char key5_buf[] = "key5", key1_buf[] = "key1";
+	char *key5 = key5_buf, *key1 = key1_buf;
+	unsigned int i;
+
+	test_begin("hash flat strings");
+	hash_flat_create(&hash, 0, str_hash, strcmp);
+	for (i = 0; i < N_ELEMENTS(keys); i++) {
+		keys[i] = i_strdup_printf("key%u", i);
+		hash_flat_insert(hash, keys[i], keys[i]);
+	}
+	test_assert(hash_flat_count(hash) == N_ELEMENTS(keys));
+
+	/* lookups are done with different pointers */
+	for (i = 0; i < N_ELEMENTS(keys); i++) T_BEGIN {
+		const char *key = t_strdup_printf("key%u", i);
+
+		test_assert_idx(hash_flat_lookup(hash, key) == keys[i], i);
+		test_assert_idx(hash_flat_lookup_full(hash, key, &orig_key,
+						      &value), i);
+		test_assert_idx(orig_key == keys[i] && value == keys[i], i);
+	} T_END;
+	test_assert(hash_flat_lookup(hash, t_strdup("key1000")) == NULL);
+	test_assert(!hash_flat_lookup_full(hash, t_strdup("nonexistent"),
+					   &orig_key, &value));
+
+	/* update keeps the original key */
+	hash_flat_update(hash, key5, keys[6]);
+	test_assert(hash_flat_lookup_full(hash, key5, &orig_key, &value));
+	test_assert(orig_key == keys[5] && value == keys[6]);
+	test_assert(hash_flat_count(hash) == N_ELEMENTS(keys));
+
+	test_assert(hash_flat_try_remove(hash, key5));
+	test_assert(!hash_flat_try_remove(hash, key5));
+	test_assert(hash_flat_lookup(hash, key5) == NULL);
+	test_assert(hash_flat_count(hash) == N_ELEMENTS(keys) - 1);
+
+	hash_flat_clear(hash);
+	test_assert(hash_flat_count(hash) == 0);
+	test_assert(hash_flat_lookup(hash, key1) == NULL);
+	hash_flat_insert(hash, keys[1], keys[1]);
+	test_assert(hash_flat_lookup(hash, key1) == keys[1]);
+
+	hash_flat_destroy(&hash);
+	test_assert(!hash_flat_is_created(hash));
+	for (i = 0; i < N_ELEMENTS(keys); i++)
+		i_free(keys[i]);
+	test_end();
+}
+
+static void test_hash_flat_churn(void)
+{
+	HASH_FLAT(void *, void *) hash;
+	unsigned int i, j;
+
+	test_begin("hash flat churn");
+	/* insert and remove keys continuously in a small table. the deleted
+	   slots must not make the lookups loop forever. */
+	hash_flat_create_direct(&hash, 10);
+	for (i = 1; i < 10000; i++) {
+		hash_flat_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+		if (i > 10)
+			hash_flat_remove(hash, POINTER_CAST(i - 10));
+		test_assert_idx(hash_flat_count(hash) == I_MIN(i, 10), i);
+	}
+	for (j = i - 10; j < i; j++)
+		test_assert_idx(hash_flat_lookup(hash, POINTER_CAST(j)) == POINTER_CAST(j), j);
+	test_assert(hash_flat_lookup(hash, POINTER_CAST(i)) == NULL);
+	test_assert(hash_flat_lookup(hash, POINTER_CAST(i - 11)) == NULL);
+
+	/* grow a lot and then shrink back */
+	for (i = 10000; i < 100000; i++)
+		hash_flat_insert(hash, POINTER_CAST(i), POINTER_CAST(i));
+	for (i = 10000; i < 100000; i++)
+		hash_flat_remove(hash, POINTER_CAST(i));
+	test_assert(hash_flat_count(hash) == 10);
+	for (j = 9990; j < 10000; j++)
+		test_assert_idx(hash_flat_lookup(hash, POINTER_CAST(j)) == POINTER_CAST(j), j);
+	hash_flat_destroy(&hash);
+	test_end();
+}
+
+static void test_hash_benchmark_start(struct timeval *start_r)
+{
+	if (gettimeofday(start_r, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static long long test_hash_benchmark_usecs(const struct timeval *start)
+{
+	struct timeval now;
+
+	test_hash_benchmark_start(&now);
+	return timeval_diff_usecs(&now, start);
+}
+
+static void
+test_hash_benchmark_print(const char *name, unsigned int count,
+			  long long usecs)
+{
+	printf("%-36s %8.1f ns/op\n", name, usecs * 1000.0 / count);
+}
+
+static void test_hash_flat_benchmark(unsigned int count)
+{
+	HASH_TABLE(char *, char *) hash;
+	HASH_FLAT(char *, char *) flat;
+	HASH_TABLE(void *, void *) hash_direct;
+	HASH_FLAT(void *, void *) flat_direct;
+	struct timeval start;
+	char **keys, **missing_keys;
+	void **direct_keys;
+	unsigned int i, *order, found = 0;
+
+	/* pre-generate the keys so that only the hash table operations are
+	   measured. the lookups are done in random order. the direct keys
+	   are random integers like director's username hashes. */
+	keys = i_new(char *, count);
+	missing_keys = i_new(char *, count);
+	direct_keys = i_new(void *, count);
+	order = i_new(unsigned int, count);
+	for (i = 0; i < count; i++) {
+		keys[i] = i_strdup_printf("user%u@example.com", i);
+		missing_keys[i] = i_strdup_printf("missing%u@example.com", i);
+		direct_keys[i] = POINTER_CAST(i_rand() | 1);
+		order[i] = i_rand_limit(count);
+	}
+
+	printf("%u keys:\n", count);
+	hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, keys[i], keys[i]);
+	test_hash_benchmark_print("hash_table string insert", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		found += hash_table_lookup(hash, keys[order[i]]) != NULL;
+	test_hash_benchmark_print("hash_table string lookup", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		found += hash_table_lookup(hash, missing_keys[i]) != NULL;
+	test_hash_benchmark_print("hash_table string lookup missing", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, keys[i]);
+	test_hash_benchmark_print("hash_table string remove", count,
+				  test_hash_benchmark_usecs(&start));
+	hash_table_destroy(&hash);
+
+	hash_flat_create(&flat, 0, str_hash, strcmp);
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_flat_insert(flat, keys[i], keys[i]);
+	test_hash_benchmark_print("hash_flat string insert", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		found += hash_flat_lookup(flat, keys[order[i]]) != NULL;
+	test_hash_benchmark_print("hash_flat string lookup", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		found += hash_flat_lookup(flat, missing_keys[i]) != NULL;
+	test_hash_benchmark_print("hash_flat string lookup missing", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_flat_remove(flat, keys[i]);
+	test_hash_benchmark_print("hash_flat string remove", count,
+				  test_hash_benchmark_usecs(&start));
+	hash_flat_destroy(&flat);
+
+	hash_table_create_direct(&hash_direct, default_pool, 0);
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_table_update(hash_direct, direct_keys[i], direct_keys[i]);
+	test_hash_benchmark_print("hash_table direct insert", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		found += hash_table_lookup(hash_direct,
+					   direct_keys[order[i]]) != NULL;
+	}
+	test_hash_benchmark_print("hash_table direct lookup", count,
+				  test_hash_benchmark_usecs(&start));
+	hash_table_destroy(&hash_direct);
+
+	hash_flat_create_direct(&flat_direct, 0);
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++)
+		hash_flat_update(flat_direct, direct_keys[i], direct_keys[i]);
+	test_hash_benchmark_print("hash_flat direct insert", count,
+				  test_hash_benchmark_usecs(&start));
+	test_hash_benchmark_start(&start);
+	for (i = 0; i < count; i++) {
+		found += hash_flat_lookup(flat_direct,
+					  direct_keys[order[i]]) != NULL;
+	}
+	test_hash_benchmark_print("hash_flat direct lookup", count,
+				  test_hash_benchmark_usecs(&start));
+	hash_flat_destroy(&flat_direct);
+
+	test_assert(found == count * 4);
+	for (i = 0; i < count; i++) {
+		i_free(keys[i]);
+		i_free(missing_keys[i]);
+	}
+	i_free(keys);
+	i_free(missing_keys);
+	i_free(direct_keys);
+	i_free(order);
+}
+
+void test_hash_flat(void)
+{
+	const char *value;
+	unsigned int count;
+
+	test_hash_flat_random();
+	test_hash_flat_strings();
+	test_hash_flat_churn();
+
+	/* HASH_BENCHMARK=<key count> compares the performance against
+	   hash_table_*() */
+	value = getenv("HASH_BENCHMARK");
+	if (value != NULL && str_to_uint(value, &count) == 0 && count > 0) {
+		test_begin("hash flat benchmark");
+		test_hash_flat_benchmark(count);
+		test_end();
+	}
+}
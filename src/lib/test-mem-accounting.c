@@ -0,0 +1,147 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "env-util.h"
+#include "mem-accounting.h"
+
+struct test_mem_accounting_lookup {
+	enum mem_accounting_type type;
+	const char *name;
+	struct mem_accounting acc;
+	bool found;
+};
+
+static void
+test_mem_accounting_callback(enum mem_accounting_type type,
+			     const struct mem_accounting *acc, void *context)
+{
+	struct test_mem_accounting_lookup *lookup = context;
+
+	if (type == lookup->type && strcmp(acc->name, lookup->name) == 0) {
+		test_assert(!lookup->found);
+		lookup->acc = *acc;
+		lookup->found = TRUE;
+	}
+}
+
+static bool
+test_mem_accounting_get(enum mem_accounting_type type, const char *name,
+			struct mem_accounting *acc_r)
+{
+	struct test_mem_accounting_lookup lookup;
+
+	i_zero(&lookup);
+	lookup.type = type;
+	lookup.name = name;
+	mem_accounting_foreach(test_mem_accounting_callback, &lookup);
+	*acc_r = lookup.acc;
+	return lookup.found;
+}
+
+static void test_mem_accounting_pools(void)
+{
+	struct mem_accounting acc;
+	unsigned long long alloc_count;
+	pool_t pool, pool2;
+	unsigned int i;
+
+	test_begin("mem accounting pools");
+	pool = pool_alloconly_create(MEMPOOL_GROWING"test pool", 1024);
+	pool2 = pool_alloconly_create("test pool", 1024);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					    "test pool", &acc));
+	alloc_count = acc.alloc_count;
+	for (i = 0; i < 10; i++) {
+		(void)p_malloc(pool, 100);
+		(void)p_malloc(pool2, 50);
+	}
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					    "test pool", &acc));
+	test_assert(acc.alloc_count == alloc_count + 20);
+	test_assert(acc.bytes == pool_alloconly_get_total_alloc_size(pool) +
+		    pool_alloconly_get_total_alloc_size(pool2));
+	test_assert(acc.peak_bytes == acc.bytes);
+
+	pool_unref(&pool);
+	pool_unref(&pool2);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					    "test pool", &acc));
+	test_assert(acc.bytes == 0);
+	test_assert(acc.peak_bytes > 2048);
+
+	pool = pool_slab_create("test slab");
+	for (i = 0; i < 10; i++)
+		(void)p_malloc(pool, 100);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					    "test slab", &acc));
+	test_assert(acc.alloc_count == 10);
+	test_assert(acc.bytes > 10*100 &&
+		    acc.bytes < pool_slab_get_total_alloc_size(pool));
+	pool_unref(&pool);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					    "test slab", &acc));
+	test_assert(acc.bytes == 0 && acc.peak_bytes > 0);
+	test_end();
+}
+
+static void test_mem_accounting_data_stack(void)
+{
+	struct mem_accounting acc;
+	data_stack_frame_t frame, frame2;
+	unsigned int i;
+
+	test_begin("mem accounting data stack");
+	frame = t_push("test marker");
+	for (i = 0; i < 3; i++)
+		(void)t_malloc_no0(1000);
+	frame2 = t_push("test marker 2");
+	(void)t_malloc_no0(100);
+
+	/* frames in the data stack are counted as the current bytes */
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_DATA_STACK,
+					    "test marker", &acc));
+	test_assert(acc.bytes >= 3000 && acc.bytes < 4000);
+	test_assert(acc.alloc_count == 0);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_DATA_STACK,
+					    "test marker 2", &acc));
+	test_assert(acc.bytes >= 100 && acc.bytes < 1000);
+
+	test_assert(t_pop(&frame2));
+	test_assert(t_pop(&frame));
+
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_DATA_STACK,
+					    "test marker", &acc));
+	test_assert(acc.bytes == 0);
+	test_assert(acc.peak_bytes >= 3000 && acc.peak_bytes < 4000);
+	test_assert(acc.alloc_count == 3);
+	test_assert(test_mem_accounting_get(MEM_ACCOUNTING_TYPE_DATA_STACK,
+					    "test marker 2", &acc));
+	test_assert(acc.alloc_count == 1);
+	test_end();
+}
+
+void test_mem_accounting(void)
+{
+	struct mem_accounting acc;
+	pool_t pool;
+
+	if (mem_accounting_enabled) {
+		/* MEMORY_ACCOUNTING environment is set. The tests assume
+		   that the accounting starts empty. */
+		return;
+	}
+
+	test_begin("mem accounting disabled");
+	pool = pool_alloconly_create("test pool", 1024);
+	test_assert(!test_mem_accounting_get(MEM_ACCOUNTING_TYPE_POOL,
+					     "test pool", &acc));
+	pool_unref(&pool);
+	test_end();
+
+	env_put("MEMORY_ACCOUNTING=1");
+	mem_accounting_init();
+	test_mem_accounting_pools();
+	test_mem_accounting_data_stack();
+	mem_accounting_deinit();
+	env_remove("MEMORY_ACCOUNTING");
+}
@@ -0,0 +1,201 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+static bool mem_has_bytes(const void *mem, size_t size, uint8_t b)
+{
+	const uint8_t *bytes = mem;
+	unsigned int i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != b) {
+			i_debug("bytes[%u] != %u", i, b);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void test_mempool_slab_alloc(void)
+{
+	pool_t pool;
+	struct pool_slab_stats stats;
+	void *mem[1000];
+	size_t sizes[1000], used = 0;
+	unsigned int i, j;
+
+	test_begin("mempool_slab alloc");
+	pool = pool_slab_create("test");
+	test_assert_strcmp(pool_get_name(pool), "test");
+
+	for (i = 0; i < N_ELEMENTS(mem); i++) {
+		/* mixed small and large allocations */
+		sizes[i] = (i % 50) == 0 ? POOL_SLAB_MAX_OBJECT_SIZE + 1 + i :
+			i * 7 % 2000 + 1;
+		mem[i] = p_malloc(pool, sizes[i]);
+		test_assert_idx(mem_has_bytes(mem[i], sizes[i], 0), i);
+		memset(mem[i], i % 256, sizes[i]);
+		if (sizes[i] > POOL_SLAB_MAX_OBJECT_SIZE)
+			used += sizes[i];
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.large_count == N_ELEMENTS(mem) / 50);
+	test_assert(stats.large_size == used);
+	test_assert(stats.used_size >= used + 1000);
+	test_assert(stats.alloc_size >= stats.used_size);
+
+	/* free every other one and allocate them again */
+	for (i = 0; i < N_ELEMENTS(mem); i += 2)
+		p_free(pool, mem[i]);
+	for (i = 0; i < N_ELEMENTS(mem); i += 2) {
+		mem[i] = p_malloc(pool, sizes[i]);
+		test_assert_idx(mem_has_bytes(mem[i], sizes[i], 0), i);
+		memset(mem[i], i % 256, sizes[i]);
+	}
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		test_assert_idx(mem_has_bytes(mem[i], sizes[i], i % 256), i);
+
+	/* freeing everything returns the slabs, except for one empty slab
+	   per size class */
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		p_free(pool, mem[i]);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_size == 0);
+	test_assert(stats.large_count == 0);
+	for (j = 0; j < POOL_SLAB_CLASS_COUNT; j++) {
+		test_assert_idx(stats.classes[j].used_count == 0, j);
+		test_assert_idx(stats.classes[j].slab_count <= 1, j);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_reuse(void)
+{
+	pool_t pool;
+	struct pool_slab_stats stats;
+	void *mem[1000], *mem2;
+	unsigned int i, slab_count;
+
+	test_begin("mempool_slab reuse");
+	pool = pool_slab_create("test");
+
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		mem[i] = p_malloc(pool, 100);
+	pool_slab_get_stats(pool, &stats);
+	slab_count = stats.slab_count;
+	test_assert(stats.used_size == N_ELEMENTS(mem) * 128);
+	test_assert(stats.classes[5].object_size == 128);
+	test_assert(stats.classes[5].used_count == N_ELEMENTS(mem));
+	test_assert(stats.classes[5].slab_count == slab_count);
+
+	/* freed objects are reused without allocating new slabs */
+	for (i = 0; i < N_ELEMENTS(mem); i += 3)
+		p_free(pool, mem[i]);
+	for (i = 0; i < N_ELEMENTS(mem); i += 3)
+		mem[i] = p_malloc(pool, 128);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.slab_count == slab_count);
+
+	/* allocating and freeing a single object in an empty slab keeps the
+	   slab */
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		p_free(pool, mem[i]);
+	for (i = 0; i < 10; i++) {
+		mem2 = p_malloc(pool, 100);
+		p_free(pool, mem2);
+	}
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.slab_count == 1);
+	test_assert(stats.classes[5].free_count > 0);
+
+	/* clearing frees everything */
+	for (i = 0; i < N_ELEMENTS(mem); i++)
+		mem[i] = p_malloc(pool, 1 + i * 3);
+	p_clear(pool);
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.used_size == 0 && stats.slab_count == 0);
+	mem2 = p_malloc(pool, 10);
+	p_free(pool, mem2);
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_realloc(void)
+{
+	pool_t pool;
+	struct pool_slab_stats stats;
+	unsigned char *mem = NULL, *mem2;
+	unsigned int i;
+
+	test_begin("mempool_slab realloc");
+	pool = pool_slab_create("test");
+
+	for (i = 1; i < 5000; i++) {
+		mem = p_realloc(pool, mem, i-1, i);
+		test_assert_idx(mem_has_bytes(mem, i-1, 0xde), i);
+		test_assert_idx(mem[i-1] == 0, i);
+		memset(mem, 0xde, i);
+	}
+	/* large allocations are realloc()ed without copying them through
+	   the slabs */
+	pool_slab_get_stats(pool, &stats);
+	test_assert(stats.large_count == 1);
+	test_assert(stats.large_size == i-1);
+	test_assert(stats.slab_count <= POOL_SLAB_CLASS_COUNT);
+	/* shrinking moves the data to a smaller size class */
+	mem2 = p_realloc(pool, mem, i-1, 10);
+	test_assert(mem2 != mem);
+	test_assert(mem_has_bytes(mem2, 10, 0xde));
+	/* growing within the same size class doesn't */
+	mem = p_realloc(pool, mem2, 10, 16);
+	test_assert(mem == mem2);
+	test_assert(mem_has_bytes(mem, 10, 0xde));
+	test_assert(mem_has_bytes(mem + 10, 6, 0));
+	p_free(pool, mem);
+
+	test_assert(pool_slab_get_total_used_size(pool) == 0);
+	pool_unref(&pool);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_alloc();
+	test_mempool_slab_reuse();
+	test_mempool_slab_realloc();
+}
+
+enum fatal_test_state fatal_mempool_slab(unsigned int stage)
+{
+	static pool_t pool;
+
+	if (pool == NULL && stage != 0)
+		return FATAL_TEST_FAILURE;
+
+	switch(stage) {
+	case 0: /* forbidden size */
+		test_begin("fatal_mempool_slab");
+		pool = pool_slab_create("fatal");
+		test_expect_fatal_string("Trying to allocate 0 bytes");
+		(void)p_malloc(pool, 0);
+		return FATAL_TEST_FAILURE;
+
+	case 1: /* logically impossible size */
+		test_expect_fatal_string("Trying to allocate");
+		(void)p_malloc(pool, SSIZE_T_MAX + 1ULL);
+		return FATAL_TEST_FAILURE;
+
+#if SSIZE_T_MAX > 2147483648 /* malloc(SSIZE_T_MAX) may succeed with 32bit */
+	case 2: /* physically impossible size */
+		test_expect_fatal_string("Out of memory");
+		(void)p_malloc(pool, SSIZE_T_MAX - 1024);
+		return FATAL_TEST_FAILURE;
+#endif
+	}
+
+	/* Either our tests have finished, or the test suite has got confused. */
+	pool_unref(&pool);
+	test_end();
+	return FATAL_TEST_FINISHED;
+}
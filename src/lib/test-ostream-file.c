@@ -173,9 +173,62 @@ static void test_ostream_file_send_istream_sendfile(void)
 	test_end();
 }
 
+static void test_ostream_file_send_istream_copy_file_range(void)
+{
+	struct istream *input, *input2;
+	struct ostream *output;
+	char buf[32];
+	int fd, out_fd;
+
+	test_begin("ostream file send istream copy_file_range()");
+
+	fd = open(".temp.istream", O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(.temp.istream) failed: %m");
+	test_assert(write(fd, "abcdefghij", 10) == 10);
+	input = i_stream_create_fd_autoclose(&fd, 1024);
+
+	out_fd = open(".temp.ostream", O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (out_fd == -1)
+		i_fatal("creat(.temp.ostream) failed: %m");
+	output = o_stream_create_fd_file(out_fd, 0, FALSE);
+	o_stream_file_set_copy_file_range(output, TRUE);
+	o_stream_cork(output);
+
+	/* buffered data must be written before the copied data */
+	o_stream_nsend_str(output, "12");
+	i_stream_seek(input, 3);
+	input2 = i_stream_create_limit(input, 4);
+	test_assert(o_stream_send_istream(output, input2) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
+	test_assert(output->offset == 6);
+	i_stream_unref(&input2);
+
+	/* writing continues after the copied data, also after seeking */
+	o_stream_nsend_str(output, "34");
+	test_assert(o_stream_seek(output, 1) > 0);
+	i_stream_seek(input, 0);
+	input2 = i_stream_create_limit(input, 2);
+	test_assert(o_stream_send_istream(output, input2) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
+	test_assert(output->offset == 3);
+	i_stream_unref(&input2);
+	test_assert(o_stream_finish(output) > 0);
+
+	test_assert(pread(out_fd, buf, sizeof(buf), 0) == 8 &&
+		    memcmp(buf, "1abefg34", 8) == 0);
+
+	i_stream_unref(&input);
+	o_stream_destroy(&output);
+	i_close_fd(&out_fd);
+
+	i_unlink(".temp.istream");
+	i_unlink(".temp.ostream");
+	test_end();
+}
+
 void test_ostream_file(void)
 {
 	test_ostream_file_random();
 	test_ostream_file_send_istream_file();
 	test_ostream_file_send_istream_sendfile();
+	test_ostream_file_send_istream_copy_file_range();
 }
@@ -0,0 +1,202 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "str.h"
+#include "ioloop.h"
+#include "ostream.h"
+#include "ostream-worker.h"
+
+#define TEST_BLOCK_SIZE 1024
+
+struct test_worker_context {
+	unsigned int blocks_left_until_failure;
+	bool destroyed;
+};
+
+static int
+test_worker_process(void *context, struct ostream_worker_block *block,
+		    const char **error_r)
+{
+	struct test_worker_context *ctx = context;
+	size_t i, size = block->input_size + 1 + (block->final ? 1 : 0);
+
+	if (ctx->blocks_left_until_failure > 0 &&
+	    --ctx->blocks_left_until_failure == 0) {
+		*error_r = "test failure";
+		return -1;
+	}
+	/* each block is written as rot1(input) + "|", and the final block is
+	   followed by "$". ask for more space until the whole block fits. */
+	if (block->output_size < size)
+		return 0;
+	for (i = 0; i < block->input_size; i++)
+		block->output[i] = block->input[i] + 1;
+	block->output[i++] = '|';
+	if (block->final)
+		block->output[i++] = '$';
+	block->input += block->input_size;
+	block->input_size = 0;
+	block->output += i;
+	block->output_size -= i;
+	return 1;
+}
+
+static void test_worker_destroy(void *context)
+{
+	struct test_worker_context *ctx = context;
+
+	ctx->destroyed = TRUE;
+}
+
+static const struct ostream_worker_vfuncs test_worker_vfuncs = {
+	.process = test_worker_process,
+	.destroy = test_worker_destroy,
+};
+
+static struct ostream *
+test_worker_create(struct ostream *output, struct test_worker_context *ctx)
+{
+	const struct ostream_worker_settings set = {
+		.name = "test",
+		.block_size = TEST_BLOCK_SIZE,
+		/* small enough that the output buffer needs to grow */
+		.output_size = 16,
+	};
+
+	i_zero(ctx);
+	return o_stream_create_worker(output, &set, &test_worker_vfuncs, ctx);
+}
+
+static void
+test_worker_expected(string_t *dest, const unsigned char *data, size_t size)
+{
+	size_t i, n;
+
+	while (size > 0) {
+		n = I_MIN(size, TEST_BLOCK_SIZE);
+		for (i = 0; i < n; i++)
+			str_append_c(dest, data[i] + 1);
+		str_append_c(dest, '|');
+		data += n;
+		size -= n;
+	}
+	/* the last block was the final one */
+	str_append_c(dest, '$');
+}
+
+static void test_ostream_worker_small(void)
+{
+	struct test_worker_context ctx;
+	buffer_t *output = t_buffer_create(256);
+	struct ostream *test_output, *woutput;
+
+	test_begin("ostream worker small");
+	test_output = o_stream_create_buffer(output);
+	woutput = test_worker_create(test_output, &ctx);
+	test_assert(o_stream_send_str(woutput, "hello") == 5);
+	/* nothing is written until the block is full or flushed */
+	test_assert(output->used == 0);
+	test_assert(o_stream_flush(woutput) > 0);
+	test_assert(strcmp(str_c(output), "ifmmp|") == 0);
+	test_assert(o_stream_send_str(woutput, "abc") == 3);
+	test_assert(o_stream_finish(woutput) > 0);
+	test_assert(strcmp(str_c(output), "ifmmp|bcd|$") == 0);
+	o_stream_destroy(&woutput);
+	o_stream_destroy(&test_output);
+	test_assert(ctx.destroyed);
+
+	/* an empty stream still gets the final block */
+	buffer_set_used_size(output, 0);
+	test_output = o_stream_create_buffer(output);
+	woutput = test_worker_create(test_output, &ctx);
+	test_assert(o_stream_finish(woutput) > 0);
+	test_assert(strcmp(str_c(output), "|$") == 0);
+	o_stream_destroy(&woutput);
+	o_stream_destroy(&test_output);
+	test_end();
+}
+
+static void test_ostream_worker_large(void)
+{
+	struct test_worker_context ctx;
+	buffer_t *output = t_buffer_create(TEST_BLOCK_SIZE * 16);
+	string_t *input = t_str_new(TEST_BLOCK_SIZE * 16);
+	string_t *expected = t_str_new(TEST_BLOCK_SIZE * 16);
+	struct ostream *test_output, *woutput;
+	struct ioloop *ioloop;
+	size_t pos = 0, max_output = 0;
+	ssize_t ret;
+	unsigned int i;
+
+	/* large streams are processed in a separate thread. make sure the
+	   blocks are still written in the right order when the parent stream
+	   accepts only a little bit of output at a time. */
+	test_begin("ostream worker large");
+	for (i = 0; i < TEST_BLOCK_SIZE * 10 + 123; i++)
+		str_append_c(input, 'a' + i % 25);
+	test_worker_expected(expected, str_data(input), str_len(input));
+
+	ioloop = io_loop_create();
+	test_output = test_ostream_create_nonblocking(output, 128);
+	test_ostream_set_max_output_size(test_output, max_output);
+	woutput = test_worker_create(test_output, &ctx);
+	while (pos < str_len(input)) {
+		ret = o_stream_send(woutput, str_data(input) + pos,
+				    I_MIN(str_len(input) - pos, 700));
+		test_assert(ret >= 0);
+		pos += ret;
+		if (ret == 0) {
+			max_output += 500;
+			test_ostream_set_max_output_size(test_output,
+							 max_output);
+		}
+	}
+	while ((ret = o_stream_finish(woutput)) == 0) {
+		max_output += 500;
+		test_ostream_set_max_output_size(test_output, max_output);
+	}
+	test_assert(ret > 0);
+	o_stream_destroy(&woutput);
+	o_stream_destroy(&test_output);
+	io_loop_destroy(&ioloop);
+
+	test_assert(output->used == str_len(expected) &&
+		    memcmp(output->data, str_data(expected), output->used) == 0);
+	test_end();
+}
+
+static void test_ostream_worker_error(void)
+{
+	struct test_worker_context ctx;
+	buffer_t *output = t_buffer_create(TEST_BLOCK_SIZE * 8);
+	struct ostream *test_output, *woutput;
+	unsigned char data[TEST_BLOCK_SIZE];
+	unsigned int i;
+	int ret = 0;
+
+	test_begin("ostream worker error");
+	memset(data, 'x', sizeof(data));
+	test_output = o_stream_create_buffer(output);
+	woutput = test_worker_create(test_output, &ctx);
+	ctx.blocks_left_until_failure = 3;
+	for (i = 0; i < 5 && ret >= 0; i++)
+		ret = o_stream_send(woutput, data, sizeof(data));
+	if (ret >= 0)
+		ret = o_stream_finish(woutput);
+	test_assert(ret < 0);
+	test_assert(woutput->stream_errno == EIO);
+	test_assert(strstr(o_stream_get_error(woutput),
+			   "test.write(") != NULL);
+	test_assert(strstr(o_stream_get_error(woutput),
+			   "test failure") != NULL);
+	o_stream_destroy(&woutput);
+	o_stream_destroy(&test_output);
+	test_end();
+}
+
+void test_ostream_worker(void)
+{
+	test_ostream_worker_small();
+	test_ostream_worker_large();
+	test_ostream_worker_error();
+}
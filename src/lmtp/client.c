@@ -311,6 +311,11 @@ static bool client_connection_is_trusted(void *context)
 	return FALSE;
 }
 
+unsigned int clients_get_count(void)
+{
+	return clients_count;
+}
+
 void clients_destroy(void)
 {
 	while (clients != NULL) {
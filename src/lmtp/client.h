@@ -56,6 +56,7 @@ void client_disconnect(struct client *client, const char *enh_code,
 const char *client_state_get_name(struct client *client);
 void client_state_reset(struct client *client);
 
+unsigned int clients_get_count(void);
 void clients_destroy(void);
 
 #endif
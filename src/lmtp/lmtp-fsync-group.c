@@ -0,0 +1,283 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#define _GNU_SOURCE /* for syncfs() */
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "time-util.h"
+#include "smtp-server.h"
+#include "master-service.h"
+#include "client.h"
+#include "main.h"
+#include "lmtp-fsync-group.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct lmtp_fsync_group_fs {
+	dev_t dev;
+	int fd;
+	const char *path;
+};
+
+struct lmtp_fsync_group_reply {
+	struct smtp_server_cmd_ctx *cmd;
+	unsigned int rcpt_idx;
+	const char *rcpt_to;
+	const char *session_id;
+};
+
+struct lmtp_fsync_group {
+	pool_t pool;
+	struct event *event;
+
+	ARRAY(struct lmtp_fsync_group_fs) filesystems;
+	ARRAY(struct lmtp_fsync_group_reply) replies;
+	/* DATA commands waiting for the flush */
+	ARRAY(struct smtp_server_cmd_ctx *) cmds;
+
+	struct timeout *to;
+	struct timeval first_added;
+	bool failed;
+};
+
+static struct lmtp_fsync_group *fsync_group = NULL;
+
+static void lmtp_fsync_group_init_arrays(struct lmtp_fsync_group *group)
+{
+	p_array_init(&group->filesystems, group->pool, 4);
+	p_array_init(&group->replies, group->pool, 16);
+	p_array_init(&group->cmds, group->pool, 8);
+}
+
+static struct lmtp_fsync_group *lmtp_fsync_group_get(void)
+{
+	if (fsync_group != NULL)
+		return fsync_group;
+
+	fsync_group = i_new(struct lmtp_fsync_group, 1);
+	fsync_group->pool = pool_alloconly_create("lmtp fsync group", 1024);
+	fsync_group->event = event_create(NULL);
+	event_add_category(fsync_group->event, &event_category_lmtp);
+	event_set_append_log_prefix(fsync_group->event, "fsync group: ");
+	lmtp_fsync_group_init_arrays(fsync_group);
+	return fsync_group;
+}
+
+static void lmtp_fsync_group_start(struct lmtp_fsync_group *group)
+{
+	if (array_count(&group->filesystems) > 0 ||
+	    array_count(&group->replies) > 0)
+		return;
+	io_loop_time_refresh();
+	group->first_added = ioloop_timeval;
+}
+
+void lmtp_fsync_group_add_path(const char *path)
+{
+	struct lmtp_fsync_group *group = lmtp_fsync_group_get();
+	const struct lmtp_fsync_group_fs *fs;
+	struct lmtp_fsync_group_fs *new_fs;
+	struct stat st;
+	int fd;
+
+	lmtp_fsync_group_start(group);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return;
+		e_error(group->event, "open(%s) failed: %m", path);
+		group->failed = TRUE;
+		return;
+	}
+	if (fstat(fd, &st) < 0) {
+		e_error(group->event, "fstat(%s) failed: %m", path);
+		group->failed = TRUE;
+		i_close_fd(&fd);
+		return;
+	}
+	array_foreach(&group->filesystems, fs) {
+		if (fs->dev == st.st_dev) {
+			i_close_fd(&fd);
+			return;
+		}
+	}
+	new_fs = array_append_space(&group->filesystems);
+	new_fs->dev = st.st_dev;
+	new_fs->fd = fd;
+	new_fs->path = p_strdup(group->pool, path);
+}
+
+static void lmtp_fsync_group_cmd_destroy(struct smtp_server_cmd_ctx *cmd)
+{
+	struct lmtp_fsync_group *group = fsync_group;
+	struct smtp_server_cmd_ctx *const *cmds;
+	const struct lmtp_fsync_group_reply *replies;
+	unsigned int i, count;
+
+	/* the connection was closed while waiting for the flush */
+	i_assert(group != NULL);
+
+	replies = array_get(&group->replies, &count);
+	for (i = count; i > 0; i--) {
+		if (replies[i-1].cmd == cmd)
+			array_delete(&group->replies, i-1, 1);
+	}
+	cmds = array_get(&group->cmds, &count);
+	for (i = 0; i < count; i++) {
+		if (cmds[i] == cmd) {
+			array_delete(&group->cmds, i, 1);
+			break;
+		}
+	}
+}
+
+void lmtp_fsync_group_add_reply(struct smtp_server_cmd_ctx *cmd,
+				unsigned int rcpt_idx, const char *rcpt_to,
+				const char *session_id)
+{
+	struct lmtp_fsync_group *group = lmtp_fsync_group_get();
+	struct smtp_server_cmd_ctx *const *cmdp;
+	struct lmtp_fsync_group_reply *reply;
+
+	lmtp_fsync_group_start(group);
+
+	reply = array_append_space(&group->replies);
+	reply->cmd = cmd;
+	reply->rcpt_idx = rcpt_idx;
+	reply->rcpt_to = p_strdup(group->pool, rcpt_to);
+	reply->session_id = p_strdup(group->pool, session_id);
+
+	array_foreach(&group->cmds, cmdp) {
+		if (*cmdp == cmd)
+			return;
+	}
+	array_append(&group->cmds, &cmd, 1);
+	i_assert(cmd->hook_destroy == NULL);
+	cmd->hook_destroy = lmtp_fsync_group_cmd_destroy;
+}
+
+static void lmtp_fsync_group_flush(struct lmtp_fsync_group *group)
+{
+	ARRAY(struct lmtp_fsync_group_reply) replies;
+	struct smtp_server_cmd_ctx *const *cmdp;
+	const struct lmtp_fsync_group_reply *reply;
+	struct lmtp_fsync_group_fs *fs;
+	struct timeval flush_started;
+	unsigned int fs_count, cmd_count;
+	int wait_msecs, flush_msecs;
+	bool failed;
+	pool_t pool;
+
+	timeout_remove(&group->to);
+
+	io_loop_time_refresh();
+	flush_started = ioloop_timeval;
+	array_foreach_modifiable(&group->filesystems, fs) {
+#ifdef HAVE_SYNCFS
+		if (syncfs(fs->fd) < 0) {
+			e_error(group->event, "syncfs(%s) failed: %m",
+				fs->path);
+			group->failed = TRUE;
+		}
+#else
+		/* lmtp_settings_check() requires syncfs() */
+		i_unreached();
+#endif
+		i_close_fd(&fs->fd);
+	}
+	io_loop_time_refresh();
+	wait_msecs = timeval_diff_msecs(&flush_started, &group->first_added);
+	flush_msecs = timeval_diff_msecs(&ioloop_timeval, &flush_started);
+	fs_count = array_count(&group->filesystems);
+	cmd_count = array_count(&group->cmds);
+
+	/* replying may destroy the commands or start new deliveries, so
+	   detach everything from the group first */
+	t_array_init(&replies, array_count(&group->replies));
+	array_append_array(&replies, &group->replies);
+	array_foreach(&group->cmds, cmdp)
+		(*cmdp)->hook_destroy = NULL;
+	pool = group->pool;
+	group->pool = pool_alloconly_create("lmtp fsync group", 1024);
+	lmtp_fsync_group_init_arrays(group);
+	failed = group->failed;
+	group->failed = FALSE;
+
+	e_debug(event_create_passthrough(group->event)->
+		set_name("lmtp_fsync_group_flushed")->
+		add_int("transactions", cmd_count)->
+		add_int("recipients", array_count(&replies))->
+		add_int("filesystems", fs_count)->
+		add_int("wait_msecs", wait_msecs)->
+		add_int("flush_msecs", flush_msecs)->event(),
+		"Flushed %u filesystems for %u recipients in %u transactions "
+		"(waited %d ms, flush took %d ms)", fs_count,
+		array_count(&replies), cmd_count, wait_msecs, flush_msecs);
+
+	/* The mails are already committed, but they may not survive a crash.
+	   Fail them the same way as when fsync() fails without the group:
+	   the client delivers them again, which is better than losing
+	   them. */
+	if (failed) {
+		e_error(group->event, "Failed to flush filesystems - "
+			"failing %u recipients with a temporary error",
+			array_count(&replies));
+	}
+	array_foreach(&replies, reply) {
+		if (failed) {
+			smtp_server_reply_index(reply->cmd, reply->rcpt_idx,
+				451, "4.3.0", "<%s> Temporary internal error",
+				reply->rcpt_to);
+		} else {
+			smtp_server_reply_index(reply->cmd, reply->rcpt_idx,
+				250, "2.0.0", "<%s> %s Saved",
+				reply->rcpt_to, reply->session_id);
+		}
+	}
+	pool_unref(&pool);
+}
+
+static void lmtp_fsync_group_timeout(struct lmtp_fsync_group *group)
+{
+	T_BEGIN {
+		lmtp_fsync_group_flush(group);
+	} T_END;
+}
+
+void lmtp_fsync_group_commit(unsigned int max_delay_msecs)
+{
+	struct lmtp_fsync_group *group = fsync_group;
+
+	if (group == NULL ||
+	    (array_count(&group->replies) == 0 &&
+	     array_count(&group->filesystems) == 0))
+		return;
+
+	if (max_delay_msecs == 0 ||
+	    array_count(&group->cmds) >= clients_get_count()) {
+		/* nobody else can join this group */
+		lmtp_fsync_group_flush(group);
+	} else if (group->to == NULL) {
+		group->to = timeout_add(max_delay_msecs,
+					lmtp_fsync_group_timeout, group);
+	}
+}
+
+void lmtp_fsync_group_deinit(void)
+{
+	struct lmtp_fsync_group *group = fsync_group;
+
+	if (group == NULL)
+		return;
+	fsync_group = NULL;
+
+	T_BEGIN {
+		lmtp_fsync_group_flush(group);
+	} T_END;
+	event_unref(&group->event);
+	pool_unref(&group->pool);
+	i_free(group);
+}
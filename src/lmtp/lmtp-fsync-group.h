@@ -0,0 +1,24 @@
+#ifndef LMTP_FSYNC_GROUP_H
+#define LMTP_FSYNC_GROUP_H
+
+struct smtp_server_cmd_ctx;
+
+/* Add the filesystem containing the path to be flushed by the next group
+   commit. This needs to be called while still having the permissions to
+   access the path. */
+void lmtp_fsync_group_add_path(const char *path);
+/* Delay the successful reply to the recipient until the next group commit
+   has flushed the filesystems. If the flush fails, the recipient gets a
+   temporary failure instead, although the mail is already committed. */
+void lmtp_fsync_group_add_reply(struct smtp_server_cmd_ctx *cmd,
+				unsigned int rcpt_idx, const char *rcpt_to,
+				const char *session_id);
+/* All recipients of the DATA command have been added. Flush immediately if
+   all the connections are now waiting for the flush, otherwise wait for
+   more commands for at most max_delay_msecs. */
+void lmtp_fsync_group_commit(unsigned int max_delay_msecs);
+
+/* Flush any pending filesystems and free the group. */
+void lmtp_fsync_group_deinit(void);
+
+#endif
@@ -30,6 +30,7 @@
 #include "main.h"
 #include "lmtp-common.h"
 #include "lmtp-settings.h"
+#include "lmtp-fsync-group.h"
 #include "lmtp-local.h"
 
 struct lmtp_local_recipient {
@@ -460,6 +461,31 @@ void lmtp_local_add_headers(struct lmtp_local *local,
 	}
 }
 
+static void lmtp_local_fsync_group_add_user(struct mail_user *user)
+{
+	static const enum mailbox_list_path_type path_types[] = {
+		MAILBOX_LIST_PATH_TYPE_MAILBOX,
+		MAILBOX_LIST_PATH_TYPE_ALT_MAILBOX,
+		MAILBOX_LIST_PATH_TYPE_CONTROL,
+		MAILBOX_LIST_PATH_TYPE_INDEX,
+	};
+	struct mail_namespace *ns;
+	const char *path;
+	unsigned int i;
+
+	for (ns = user->namespaces; ns != NULL; ns = ns->next) {
+		if (ns->type != MAIL_NAMESPACE_TYPE_PRIVATE)
+			continue;
+		for (i = 0; i < N_ELEMENTS(path_types); i++) {
+			if (mailbox_list_get_root_path(ns->list, path_types[i],
+						       &path))
+				lmtp_fsync_group_add_path(path);
+		}
+		if (ns->mail_set->mail_attachment_dir[0] != '\0')
+			lmtp_fsync_group_add_path(ns->mail_set->mail_attachment_dir);
+	}
+}
+
 static int
 lmtp_local_deliver(struct lmtp_local *local,
 		   struct smtp_server_cmd_ctx *cmd,
@@ -490,6 +516,7 @@ lmtp_local_deliver(struct lmtp_local *local,
 	const char *line, *error, *username;
 	string_t *str;
 	enum mail_error mail_error;
+	bool fsync_group;
 	int ret;
 
 	input = mail_storage_service_user_get_input(service_user);
@@ -513,6 +540,14 @@ lmtp_local_deliver(struct lmtp_local *local,
 		if (settings_parse_line(set_parser, line) < 0)
 			i_unreached();
 	}
+	fsync_group = client->lmtp_set->lmtp_fsync_group &&
+		mail_set->parsed_fsync_mode != FSYNC_MODE_NEVER;
+	if (fsync_group) {
+		/* the filesystems are flushed once for all the recipients
+		   after the mail has been delivered */
+		if (settings_parse_line(set_parser, "mail_fsync=never") < 0)
+			i_unreached();
+	}
 
 	/* get the timestamp before user is created, since it starts the I/O */
 	io_loop_time_refresh();
@@ -612,9 +647,17 @@ lmtp_local_deliver(struct lmtp_local *local,
 			i_assert(local->first_saved_mail == NULL);
 			local->first_saved_mail = dctx.dest_mail;
 		}
-		smtp_server_reply_index(cmd, rcpt_idx,
-			250, "2.0.0", "<%s> %s Saved",
-			smtp_address_encode(rcpt_to), rcpt->session_id);
+		if (fsync_group) {
+			lmtp_local_fsync_group_add_user(rcpt_user);
+			lmtp_fsync_group_add_reply(cmd, rcpt_idx,
+				smtp_address_encode(rcpt_to),
+				rcpt->session_id);
+		} else {
+			smtp_server_reply_index(cmd, rcpt_idx,
+				250, "2.0.0", "<%s> %s Saved",
+				smtp_address_encode(rcpt_to),
+				rcpt->session_id);
+		}
 		ret = 0;
 	} else if (dctx.tempfail_error != NULL) {
 		smtp_server_reply_index(cmd, rcpt_idx,
@@ -770,6 +813,8 @@ void lmtp_local_data(struct client *client,
 		mail_user_unref(&user);
 	}
 
+	lmtp_fsync_group_commit(client->lmtp_set->lmtp_fsync_group_max_delay);
+
 	if (old_uid == 0) {
 		/* switch back to running as root, since that's what we're
 		   practically doing anyway. it's also important in case we
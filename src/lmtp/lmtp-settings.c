@@ -62,6 +62,8 @@ static const struct setting_define lmtp_setting_defines[] = {
 	DEF(SET_BOOL, lmtp_proxy),
 	DEF(SET_BOOL, lmtp_save_to_detail_mailbox),
 	DEF(SET_BOOL, lmtp_rcpt_check_quota),
+	DEF(SET_BOOL, lmtp_fsync_group),
+	DEF(SET_TIME_MSECS, lmtp_fsync_group_max_delay),
 	DEF(SET_UINT, lmtp_user_concurrency_limit),
 	DEF(SET_ENUM, lmtp_hdr_delivery_address),
 	DEF(SET_STR_VARS, login_greeting),
@@ -74,6 +76,8 @@ static const struct lmtp_settings lmtp_default_settings = {
 	.lmtp_proxy = FALSE,
 	.lmtp_save_to_detail_mailbox = FALSE,
 	.lmtp_rcpt_check_quota = FALSE,
+	.lmtp_fsync_group = FALSE,
+	.lmtp_fsync_group_max_delay = 10,
 	.lmtp_user_concurrency_limit = 0,
 	.lmtp_hdr_delivery_address = "final:none:original",
 	.login_greeting = PACKAGE_NAME" ready.",
@@ -119,6 +123,12 @@ static bool lmtp_settings_check(void *_set, pool_t pool ATTR_UNUSED,
 					   set->lmtp_hdr_delivery_address);
 		return FALSE;
 	}
+#ifndef HAVE_SYNCFS
+	if (set->lmtp_fsync_group) {
+		*error_r = "lmtp_fsync_group=yes isn't supported by this OS";
+		return FALSE;
+	}
+#endif
 	return TRUE;
 }
 /* </settings checks> */
@@ -17,6 +17,7 @@
 #include "lmtp-settings.h"
 #include "client.h"
 #include "main.h"
+#include "lmtp-fsync-group.h"
 
 #include <unistd.h>
 
@@ -32,6 +33,10 @@ struct anvil_client *anvil;
 
 struct smtp_server *lmtp_server;
 
+struct event_category event_category_lmtp = {
+	.name = "lmtp",
+};
+
 void lmtp_anvil_init(void)
 {
 	if (anvil == NULL) {
@@ -94,6 +99,7 @@ static void main_init(void)
 static void main_deinit(void)
 {
 	clients_destroy();
+	lmtp_fsync_group_deinit();
 	if (anvil != NULL)
 		anvil_client_deinit(&anvil);
 	i_free(dns_client_socket_path);
@@ -6,6 +6,7 @@ extern struct mail_storage_service_ctx *storage_service;
 extern struct anvil_client *anvil;
 
 extern struct smtp_server *lmtp_server;
+extern struct event_category event_category_lmtp;
 
 void lmtp_anvil_init(void);
 
@@ -0,0 +1,293 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "smtp-server.h"
+#include "master-service.h"
+#include "test-common.h"
+#include "client.h"
+#include "main.h"
+#include "lmtp-fsync-group.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-lmtp-fsync-group"
+
+struct test_reply {
+	struct smtp_server_cmd_ctx *cmd;
+	unsigned int rcpt_idx;
+	unsigned int status;
+	const char *text;
+};
+
+struct event_category event_category_lmtp = {
+	.name = "lmtp",
+};
+
+static struct ioloop *test_ioloop;
+static unsigned int test_clients_count;
+static ARRAY(struct test_reply) test_replies;
+static pool_t test_pool;
+
+unsigned int clients_get_count(void)
+{
+	return test_clients_count;
+}
+
+void smtp_server_reply_index(struct smtp_server_cmd_ctx *cmd,
+			     unsigned int index, unsigned int status,
+			     const char *enh_code ATTR_UNUSED,
+			     const char *fmt, ...)
+{
+	struct test_reply *reply;
+	va_list args;
+
+	va_start(args, fmt);
+	reply = array_append_space(&test_replies);
+	reply->cmd = cmd;
+	reply->rcpt_idx = index;
+	reply->status = status;
+	reply->text = p_strdup_vprintf(test_pool, fmt, args);
+	va_end(args);
+
+	io_loop_stop(current_ioloop);
+}
+
+static void test_fsync_group_init(unsigned int clients_count)
+{
+	const char *error;
+
+	test_ioloop = io_loop_create();
+	test_clients_count = clients_count;
+	test_pool = pool_alloconly_create("test replies", 1024);
+	p_array_init(&test_replies, test_pool, 8);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_fsync_group_deinit(void)
+{
+	const char *error;
+
+	lmtp_fsync_group_deinit();
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	pool_unref(&test_pool);
+	io_loop_destroy(&test_ioloop);
+}
+
+static void
+test_assert_reply(unsigned int idx, struct smtp_server_cmd_ctx *cmd,
+		  unsigned int rcpt_idx, unsigned int status)
+{
+	const struct test_reply *reply;
+
+	if (idx >= array_count(&test_replies)) {
+		test_assert_idx(idx < array_count(&test_replies), idx);
+		return;
+	}
+	reply = array_idx(&test_replies, idx);
+	test_assert_idx(reply->cmd == cmd, idx);
+	test_assert_idx(reply->rcpt_idx == rcpt_idx, idx);
+	test_assert_idx(reply->status == status, idx);
+}
+
+static void test_lmtp_fsync_group_batch(void)
+{
+	struct smtp_server_cmd_ctx cmd1, cmd2;
+	const struct test_reply *reply;
+
+	test_begin("lmtp fsync group batch");
+	test_fsync_group_init(2);
+	i_zero(&cmd1);
+	i_zero(&cmd2);
+
+	/* the first connection's recipients wait for the other connection */
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 1, "user2@example.com", "id1");
+	lmtp_fsync_group_commit(1000);
+	test_assert(array_count(&test_replies) == 0);
+
+	/* all the connections are waiting now, so the group is flushed
+	   without waiting for the timeout */
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd2, 0, "user3@example.com", "id2");
+	lmtp_fsync_group_commit(1000);
+	test_assert(array_count(&test_replies) == 3);
+	test_assert_reply(0, &cmd1, 0, 250);
+	test_assert_reply(1, &cmd1, 1, 250);
+	test_assert_reply(2, &cmd2, 0, 250);
+	test_assert(cmd1.hook_destroy == NULL && cmd2.hook_destroy == NULL);
+	if (array_count(&test_replies) == 3) {
+		reply = array_idx(&test_replies, 2);
+		test_assert_strcmp(reply->text,
+				   "<user3@example.com> id2 Saved");
+	}
+
+	/* the group is empty after the flush */
+	array_clear(&test_replies);
+	lmtp_fsync_group_commit(0);
+	test_assert(array_count(&test_replies) == 0);
+
+	/* with no delay the group is flushed immediately */
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id3");
+	lmtp_fsync_group_commit(0);
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd1, 0, 250);
+
+	test_fsync_group_deinit();
+	test_end();
+}
+
+static void test_lmtp_fsync_group_timeout_abort(struct ioloop *ioloop)
+{
+	test_assert(FALSE);
+	io_loop_stop(ioloop);
+}
+
+static void test_lmtp_fsync_group_timeout(void)
+{
+	struct smtp_server_cmd_ctx cmd1;
+	struct timeout *to;
+
+	test_begin("lmtp fsync group timeout");
+	test_fsync_group_init(2);
+	i_zero(&cmd1);
+
+	/* the other connection doesn't deliver anything, so the group is
+	   flushed after the delay */
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_commit(10);
+	test_assert(array_count(&test_replies) == 0);
+
+	to = timeout_add(5000, test_lmtp_fsync_group_timeout_abort,
+			 test_ioloop);
+	io_loop_run(test_ioloop);
+	timeout_remove(&to);
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd1, 0, 250);
+
+	test_fsync_group_deinit();
+	test_end();
+}
+
+static void test_lmtp_fsync_group_destroyed(void)
+{
+	struct smtp_server_cmd_ctx cmd1, cmd2;
+
+	test_begin("lmtp fsync group destroyed");
+	test_fsync_group_init(2);
+	i_zero(&cmd1);
+	i_zero(&cmd2);
+
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_add_reply(&cmd1, 1, "user2@example.com", "id1");
+	lmtp_fsync_group_commit(1000);
+	lmtp_fsync_group_add_reply(&cmd2, 0, "user3@example.com", "id2");
+
+	/* the first connection disconnected while waiting */
+	test_assert(cmd1.hook_destroy != NULL);
+	cmd1.hook_destroy(&cmd1);
+	test_clients_count = 1;
+
+	lmtp_fsync_group_commit(1000);
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd2, 0, 250);
+
+	test_fsync_group_deinit();
+	test_end();
+}
+
+static void test_lmtp_fsync_group_failure(void)
+{
+	struct smtp_server_cmd_ctx cmd1, cmd2;
+	const char *path;
+	int fd;
+
+	test_begin("lmtp fsync group failure");
+	test_fsync_group_init(2);
+	i_zero(&cmd1);
+	i_zero(&cmd2);
+
+	/* a missing path is skipped */
+	lmtp_fsync_group_add_path(TEST_DIR"/nonexistent");
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_commit(0);
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd1, 0, 250);
+	array_clear(&test_replies);
+
+	/* the whole group fails if any path can't be flushed, even when the
+	   failure is in another connection's recipient */
+	path = TEST_DIR"/file";
+	fd = creat(path, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_commit(1000);
+	test_expect_error_string("open("TEST_DIR"/file/dir) failed");
+	lmtp_fsync_group_add_path(TEST_DIR"/file/dir");
+	lmtp_fsync_group_add_reply(&cmd2, 0, "user2@example.com", "id2");
+	test_expect_error_string("Failed to flush filesystems");
+	lmtp_fsync_group_commit(1000);
+	test_expect_no_more_errors();
+	test_assert(array_count(&test_replies) == 2);
+	test_assert_reply(0, &cmd1, 0, 451);
+	test_assert_reply(1, &cmd2, 0, 451);
+
+	/* the failure doesn't affect the next group */
+	array_clear(&test_replies);
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id3");
+	lmtp_fsync_group_commit(0);
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd1, 0, 250);
+
+	test_fsync_group_deinit();
+	test_end();
+}
+
+static void test_lmtp_fsync_group_deinit(void)
+{
+	struct smtp_server_cmd_ctx cmd1;
+
+	test_begin("lmtp fsync group deinit");
+	test_fsync_group_init(2);
+	i_zero(&cmd1);
+
+	/* pending replies are sent at deinit */
+	lmtp_fsync_group_add_path(TEST_DIR);
+	lmtp_fsync_group_add_reply(&cmd1, 0, "user1@example.com", "id1");
+	lmtp_fsync_group_commit(1000);
+	test_assert(array_count(&test_replies) == 0);
+	lmtp_fsync_group_deinit();
+	test_assert(array_count(&test_replies) == 1);
+	test_assert_reply(0, &cmd1, 0, 250);
+
+	test_fsync_group_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_lmtp_fsync_group_batch,
+		test_lmtp_fsync_group_timeout,
+		test_lmtp_fsync_group_destroyed,
+		test_lmtp_fsync_group_failure,
+		test_lmtp_fsync_group_deinit,
+		NULL
+	};
+	return test_run(test_functions);
+}
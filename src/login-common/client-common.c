@@ -597,8 +597,14 @@ int client_get_plaintext_fd(struct client *client, int *fd_r, bool *close_fd_r)
 		*close_fd_r = FALSE;
 		return 0;
 	}
-
-	/* We'll have to start proxying from now on until either side
+	/* Even with kTLS the fd can't be given to the post-login process.
+	   With receive offload the kernel still passes TLS alerts and
+	   TLS 1.3 KeyUpdate messages to userspace, which plain read()s can't
+	   handle. Without it the input isn't plaintext at all. kTLS still
+	   helps by moving the encryption of the proxied data into the
+	   kernel.
+
+	   We'll have to start proxying from now on until either side
 	   disconnects. Create a socketpair where login process is proxying on
 	   one side and the other side is sent to the post-login process. */
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
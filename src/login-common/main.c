@@ -19,6 +19,7 @@
 #include "auth-client.h"
 #include "dsasl-client.h"
 #include "master-service-ssl-settings.h"
+#include "ssl-session-cache-client.h"
 #include "login-proxy.h"
 
 #include <unistd.h>
@@ -57,6 +58,7 @@ static struct timeout *auth_client_to;
 static const char *post_login_socket;
 static bool shutting_down = FALSE;
 static bool ssl_connections = FALSE;
+static struct ssl_session_cache_client *ssl_session_cache;
 static bool auth_connected_once = FALSE;
 
 static void login_access_lookup_next(struct login_access_lookup *lookup);
@@ -364,6 +366,29 @@ static void login_load_modules(void)
 	module_dir_init(modules);
 }
 
+static void ssl_session_cache_disconnect_callback(void)
+{
+	/* we can't reconnect since we're chrooted. the already cached
+	   ticket keys keep working, but stop accepting new connections so
+	   a new process with a working cache gets started. */
+	master_service_stop_new_connections(master_service);
+}
+
+static void login_ssl_session_cache_init(void)
+{
+	ssl_session_cache =
+		ssl_session_cache_client_init("ssl-session-cache",
+			ssl_session_cache_disconnect_callback);
+	if (ssl_session_cache_client_connect(ssl_session_cache) < 0) {
+		/* the service isn't configured - use OpenSSL's internal
+		   per-process cache */
+		ssl_session_cache_client_deinit(&ssl_session_cache);
+		return;
+	}
+	ssl_iostream_set_session_cache(&ssl_session_cache_client_vfuncs,
+				       ssl_session_cache);
+}
+
 static void login_ssl_init(void)
 {
 	struct ssl_iostream_settings ssl_set;
@@ -378,6 +403,7 @@ static void login_ssl_init(void)
 	if (io_stream_ssl_global_init(&ssl_set, &error) < 0)
 		i_fatal("Failed to initialize SSL library: %s", error);
 	login_ssl_initialized = TRUE;
+	login_ssl_session_cache_init();
 }
 
 static void main_preinit(void)
@@ -484,6 +510,10 @@ static void main_deinit(void)
 
 	if (anvil != NULL)
 		anvil_client_deinit(&anvil);
+	if (ssl_session_cache != NULL) {
+		ssl_iostream_set_session_cache(NULL, NULL);
+		ssl_session_cache_client_deinit(&ssl_session_cache);
+	}
 	timeout_remove(&auth_client_to);
 	client_common_deinit();
 	dsasl_clients_deinit();
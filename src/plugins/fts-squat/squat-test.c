@@ -31,6 +31,22 @@ static void result_print(ARRAY_TYPE(seq_range) *result)
 	printf("\n");
 }
 
+static long long
+squat_test_lookup(struct squat_trie *trie, const char *str,
+		  ARRAY_TYPE(seq_range) *definite_uids,
+		  ARRAY_TYPE(seq_range) *maybe_uids)
+{
+	struct timeval tv_start, tv_end;
+
+	gettimeofday(&tv_start, NULL);
+	if (squat_trie_lookup(trie, str, SQUAT_INDEX_TYPE_HEADER |
+			      SQUAT_INDEX_TYPE_BODY,
+			      definite_uids, maybe_uids) < 0)
+		return -1;
+	gettimeofday(&tv_end, NULL);
+	return timeval_diff_usecs(&tv_end, &tv_start);
+}
+
 int main(int argc ATTR_UNUSED, char *argv[])
 {
 	const char *trie_path = "/tmp/squat-test-index.search";
@@ -44,6 +60,9 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	buffer_t *valid;
 	int ret, fd;
 	unsigned int last = 0, seq = 1, node_count, uidlist_count;
+	unsigned int i, iterations = 1, lookup_count = 0;
+	long long usecs = 0, lookup_usecs = 0;
+	long long lookup_min_usecs = -1, lookup_max_usecs = 0;
 	size_t len;
 	enum squat_index_type index_type;
 	bool data_header = TRUE, first = TRUE, skip_body = FALSE;
@@ -54,6 +73,14 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	double cputime;
 
 	lib_init();
+	if (argv[1] == NULL) {
+		fprintf(stderr, "Usage: squat-test <mbox> [<lookup iterations>]\n"
+			"The searched strings are read from stdin.\n");
+		return 1;
+	}
+	if (argv[2] != NULL && (str_to_uint(argv[2], &iterations) < 0 ||
+				iterations == 0))
+		i_fatal("Invalid lookup iterations: %s", argv[2]);
 	i_unlink_if_exists(trie_path);
 	i_unlink_if_exists(uidlist_path);
 	trie = squat_trie_init(trie_path, time(NULL),
@@ -177,21 +204,39 @@ int main(int argc ATTR_UNUSED, char *argv[])
 		ret = strlen(str)-1;
 		str[ret] = 0;
 
-		gettimeofday(&tv_start, NULL);
-		ret = squat_trie_lookup(trie, str, SQUAT_INDEX_TYPE_HEADER |
-					SQUAT_INDEX_TYPE_BODY,
-					&definite_uids, &maybe_uids);
-		if (ret < 0)
+		/* each lookup is timed separately, so the statistics have
+		   the real minimum and maximum. "Search took" is the time of
+		   the first lookup, as without the iterations. */
+		for (i = 0; i < iterations; i++) {
+			usecs = squat_test_lookup(trie, str, &definite_uids,
+						  &maybe_uids);
+			if (usecs < 0)
+				break;
+			if (i == 0) {
+				printf(" - Search took %.05f CPU seconds\n",
+				       usecs/1000000.0);
+			}
+			lookup_count++;
+			lookup_usecs += usecs;
+			if (lookup_min_usecs < 0 || lookup_min_usecs > usecs)
+				lookup_min_usecs = usecs;
+			if (lookup_max_usecs < usecs)
+				lookup_max_usecs = usecs;
+		}
+		if (usecs < 0)
 			printf("error\n");
 		else {
-			gettimeofday(&tv_end, NULL);
-			printf(" - Search took %.05f CPU seconds\n",
-			       timeval_diff_usecs(&tv_end, &tv_start)/1000000.0);
 			printf(" - definite uids: ");
 			result_print(&definite_uids);
 			printf(" - maybe uids: ");
 			result_print(&maybe_uids);
 		}
 	}
+	if (lookup_count > 0) {
+		fprintf(stderr, " - %u lookups: %.02f usecs average, "
+			"%lld usecs min, %lld usecs max\n", lookup_count,
+			lookup_usecs / (double)lookup_count,
+			lookup_min_usecs, lookup_max_usecs);
+	}
 	return 0;
 }
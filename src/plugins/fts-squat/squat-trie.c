@@ -410,6 +410,40 @@ node_add_child(struct squat_trie *trie, struct squat_node *node,
 	return node->child_count - 1;
 }
 
+static inline bool
+node_find_child(const struct squat_node *node, unsigned char chr,
+		unsigned int *idx_r)
+{
+	const unsigned char *chars, *p;
+	unsigned int start;
+
+	if (node->have_sequential) {
+		i_assert(node->child_count >= SEQUENTIAL_COUNT);
+		if (chr < SEQUENTIAL_COUNT) {
+			*idx_r = chr;
+			return TRUE;
+		}
+		start = SEQUENTIAL_COUNT;
+	} else {
+		start = 0;
+	}
+	if (start >= node->child_count)
+		return FALSE;
+
+	/* The children chars aren't sorted: they're in the order they were
+	   added, and the same order is written to the trie file and used for
+	   the UID lists. Sorting them would need a new file format version,
+	   which isn't worth it for a deprecated index. memchr() is vectorized
+	   in most libcs, which makes this much faster than a byte-by-byte
+	   loop for nodes with many children. */
+	chars = NODE_CHILDREN_CHARS(node);
+	p = memchr(chars + start, chr, node->child_count - start);
+	if (p == NULL)
+		return FALSE;
+	*idx_r = p - chars;
+	return TRUE;
+}
+
 static int
 trie_file_cache_read(struct squat_trie *trie, size_t offset, size_t size)
 {
@@ -729,7 +763,6 @@ static int squat_build_add(struct squat_trie_build_context *ctx, uint32_t uid,
 	struct squat_trie *trie = ctx->trie;
 	struct squat_node *node = &trie->root;
 	const unsigned char *end = data + size;
-	unsigned char *chars;
 	unsigned int idx;
 	int level = 0;
 
@@ -765,23 +798,8 @@ static int squat_build_add(struct squat_trie_build_context *ctx, uint32_t uid,
 			return 0;
 		level++;
 
-		if (node->have_sequential) {
-			i_assert(node->child_count >= SEQUENTIAL_COUNT);
-			if (*data < SEQUENTIAL_COUNT) {
-				idx = *data;
-				goto found;
-			}
-			idx = SEQUENTIAL_COUNT;
-		} else {
-			idx = 0;
-		}
-		chars = NODE_CHILDREN_CHARS(node);
-		for (; idx < node->child_count; idx++) {
-			if (chars[idx] == *data)
-				goto found;
-		}
-		break;
-	found:
+		if (!node_find_child(node, *data, &idx))
+			break;
 		data++;
 		node = NODE_CHILDREN_NODES(node) + idx;
 	}
@@ -1771,7 +1789,6 @@ squat_trie_lookup_data(struct squat_trie *trie, const unsigned char *data,
 		       unsigned int size, ARRAY_TYPE(seq_range) *uids)
 {
 	struct squat_node *node = &trie->root;
-	unsigned char *chars;
 	unsigned int idx;
 	int level = 0;
 
@@ -1802,22 +1819,9 @@ squat_trie_lookup_data(struct squat_trie *trie, const unsigned char *data,
 			break;
 		level++;
 
-		if (node->have_sequential) {
-			if (*data < SEQUENTIAL_COUNT) {
-				idx = *data;
-				goto found;
-			}
-			idx = SEQUENTIAL_COUNT;
-		} else {
-			idx = 0;
-		}
-		chars = NODE_CHILDREN_CHARS(node);
-		for (; idx < node->child_count; idx++) {
-			if (chars[idx] == *data)
-				goto found;
-		}
-		return 0;
-	found:
+		if (!node_find_child(node, *data, &idx))
+			return 0;
+
 		/* follow to children */
 		if (level == 1) {
 			/* root level, add all UIDs */
@@ -1,6 +1,7 @@
 /* Copyright (c) 2006-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "istream.h"
 #include "buffer.h"
 #include "str.h"
@@ -12,6 +13,7 @@
 #include "index-mail.h"
 #include "fts-parser.h"
 #include "fts-user.h"
+#include "fts-language-cache.h"
 #include "fts-language.h"
 #include "fts-tokenizer.h"
 #include "fts-filter.h"
@@ -34,6 +36,14 @@ struct fts_mail_build_context {
 
 	buffer_t *word_buf, *pending_input;
 	struct fts_user_language *cur_user_lang;
+
+	/* keys for the language cache, taken from the mail's top-level
+	   headers. The cache is looked up and updated only once per mail. */
+	struct fts_language_cache_keys lang_cache_keys;
+	const struct fts_language *lang_cache_lang;
+	bool lang_cache_keys_ready:1;
+	bool lang_cache_looked_up:1;
+	bool lang_cache_added:1;
 };
 
 static int fts_build_data(struct fts_mail_build_context *ctx,
@@ -74,6 +84,15 @@ static void fts_parse_mail_header(struct fts_mail_build_context *ctx,
 {
 	const struct message_header_line *hdr = raw_block->hdr;
 
+	if (raw_block->part->parent == NULL && !ctx->lang_cache_keys_ready &&
+	    (ctx->update_ctx->backend->flags &
+	     FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0) {
+		if (hdr->eoh)
+			ctx->lang_cache_keys_ready = TRUE;
+		else
+			fts_language_cache_keys_parse(&ctx->lang_cache_keys, hdr);
+	}
+
 	if (strcasecmp(hdr->name, "Content-Type") == 0)
 		fts_build_parse_content_type(ctx, hdr);
 	else if (strcasecmp(hdr->name, "Content-Disposition") == 0)
@@ -292,6 +311,39 @@ fts_build_add_tokens_with_filter(struct fts_mail_build_context *ctx,
 	return ret;
 }
 
+static const struct fts_language *
+fts_detect_language_cached(struct fts_mail_build_context *ctx)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+	struct fts_language_cache *cache = fts_user_get_language_cache(user);
+
+	if (cache == NULL || !ctx->lang_cache_keys_ready)
+		return NULL;
+
+	if (!ctx->lang_cache_looked_up) {
+		ctx->lang_cache_looked_up = TRUE;
+		ctx->lang_cache_lang =
+			fts_language_cache_lookup(cache, &ctx->lang_cache_keys);
+	}
+	return ctx->lang_cache_lang;
+}
+
+static void
+fts_detect_language_cache_add(struct fts_mail_build_context *ctx,
+			      const struct fts_language *lang)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+	struct fts_language_cache *cache = fts_user_get_language_cache(user);
+
+	/* add only the first detected language after the lookup, so each
+	   mail counts as one detection */
+	if (cache == NULL || !ctx->lang_cache_looked_up ||
+	    ctx->lang_cache_added)
+		return;
+	ctx->lang_cache_added = TRUE;
+	fts_language_cache_add(cache, &ctx->lang_cache_keys, lang);
+}
+
 static int
 fts_detect_language(struct fts_mail_build_context *ctx,
 		    const unsigned char *data, size_t size, bool last,
@@ -300,11 +352,28 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 	struct mail_user *user = ctx->update_ctx->backend->ns->user;
 	struct fts_language_list *lang_list = fts_user_get_language_list(user);
 	const struct fts_language *lang;
+	bool continued = ctx->pending_input->used > 0;
+
+	if (continued) {
+		/* continue detection from the input that was too short.
+		   The detection looks only at the beginning of the input, so
+		   the sample stays small. */
+		buffer_append(ctx->pending_input, data, size);
+		data = ctx->pending_input->data;
+		size = ctx->pending_input->used;
+	} else if (array_count(fts_language_list_get_all(lang_list)) > 1) {
+		/* first input for this field - try the cache first */
+		if ((lang = fts_detect_language_cached(ctx)) != NULL) {
+			*lang_r = lang;
+			return 1;
+		}
+	}
 
 	switch (fts_language_detect(lang_list, data, size, &lang)) {
 	case FTS_LANGUAGE_RESULT_SHORT:
 		/* save the input so far and try again later */
-		buffer_append(ctx->pending_input, data, size);
+		if (!continued)
+			buffer_append(ctx->pending_input, data, size);
 		if (last) {
 			/* we've run out of data. use the default language. */
 			*lang_r = fts_language_list_get_first(lang_list);
@@ -316,6 +385,8 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 		*lang_r = fts_language_list_get_first(lang_list);
 		return 1;
 	case FTS_LANGUAGE_RESULT_OK:
+		if (array_count(fts_language_list_get_all(lang_list)) > 1)
+			fts_detect_language_cache_add(ctx, lang);
 		*lang_r = lang;
 		return 1;
 	case FTS_LANGUAGE_RESULT_ERROR:
@@ -333,6 +404,7 @@ fts_build_tokenized(struct fts_mail_build_context *ctx,
 {
 	struct mail_user *user = ctx->update_ctx->backend->ns->user;
 	const struct fts_language *lang;
+	bool data_added = FALSE;
 	int ret;
 
 	if (ctx->cur_user_lang != NULL) {
@@ -346,15 +418,19 @@ fts_build_tokenized(struct fts_mail_build_context *ctx,
 		fts_mail_build_ctx_set_lang(ctx, fts_user_language_find(user, lang));
 
 		if (ctx->pending_input->used > 0) {
+			/* pending input already contains the current data */
 			if (fts_build_add_tokens_with_filter(ctx,
 					ctx->pending_input->data,
 					ctx->pending_input->used) < 0)
 				return -1;
 			buffer_set_used_size(ctx->pending_input, 0);
+			data_added = TRUE;
 		}
 	}
-	if (fts_build_add_tokens_with_filter(ctx, data, size) < 0)
-		return -1;
+	if (!data_added) {
+		if (fts_build_add_tokens_with_filter(ctx, data, size) < 0)
+			return -1;
+	}
 	if (last) {
 		if (fts_build_add_tokens_with_filter(ctx, NULL, 0) < 0)
 			return -1;
@@ -601,6 +677,7 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	message_decoder_deinit(&decoder);
 	i_free(ctx.content_type);
 	i_free(ctx.content_disposition);
+	fts_language_cache_keys_free(&ctx.lang_cache_keys);
 	buffer_free(&ctx.word_buf);
 	buffer_free(&ctx.pending_input);
 	return ret < 0 ? -1 : 1;
@@ -0,0 +1,146 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "net.h"
+#include "str.h"
+#include "hash.h"
+#include "write-full.h"
+#include "fts-indexer-queue.h"
+
+struct fts_indexer_queue {
+	char *path;
+	string_t *cmds;
+	/* key => TRUE for the requests already in cmds */
+	HASH_TABLE(char *, void *) requests;
+	unsigned int count, max_count;
+
+	struct ioloop *ioloop;
+	struct timeout *to;
+};
+
+static struct fts_indexer_queue *fts_indexer_queue = NULL;
+
+static void
+fts_indexer_queue_send(const char *path, const void *data, size_t size)
+{
+	int fd;
+
+	fd = net_connect_unix(path);
+	if (fd == -1) {
+		i_error("net_connect_unix(%s) failed: %m", path);
+		return;
+	}
+	if (write_full(fd, data, size) < 0)
+		i_error("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void fts_indexer_queue_clear(struct fts_indexer_queue *queue)
+{
+	struct hash_iterate_context *iter;
+	char *key;
+	void *value;
+
+	iter = hash_table_iterate_init(queue->requests);
+	while (hash_table_iterate(iter, queue->requests, &key, &value))
+		i_free(key);
+	hash_table_iterate_deinit(&iter);
+	hash_table_clear(queue->requests, TRUE);
+
+	str_truncate(queue->cmds, 0);
+	str_append(queue->cmds, INDEXER_HANDSHAKE);
+	queue->count = 0;
+	timeout_remove(&queue->to);
+	queue->ioloop = NULL;
+}
+
+void fts_indexer_queue_flush(void)
+{
+	struct fts_indexer_queue *queue = fts_indexer_queue;
+
+	if (queue == NULL || queue->count == 0)
+		return;
+
+	fts_indexer_queue_send(queue->path, str_data(queue->cmds),
+			       str_len(queue->cmds));
+	fts_indexer_queue_clear(queue);
+}
+
+static void fts_indexer_queue_timeout(struct fts_indexer_queue *queue)
+{
+	i_assert(queue == fts_indexer_queue);
+	fts_indexer_queue_flush();
+}
+
+static struct fts_indexer_queue *
+fts_indexer_queue_get(const char *path, unsigned int max_count)
+{
+	struct fts_indexer_queue *queue = fts_indexer_queue;
+
+	if (queue != NULL && strcmp(queue->path, path) != 0) {
+		/* different base_dir - send the old requests first */
+		fts_indexer_queue_flush();
+		i_free(queue->path);
+		queue->path = i_strdup(path);
+	}
+	if (queue == NULL) {
+		queue = fts_indexer_queue = i_new(struct fts_indexer_queue, 1);
+		queue->path = i_strdup(path);
+		queue->cmds = str_new(default_pool, 1024);
+		hash_table_create(&queue->requests, default_pool, 0,
+				  str_hash, strcmp);
+		fts_indexer_queue_clear(queue);
+	}
+	queue->max_count = max_count;
+	return queue;
+}
+
+void fts_indexer_queue_add(const char *socket_path, const char *key,
+			   const char *cmd, unsigned int delay_msecs,
+			   unsigned int max_count)
+{
+	struct fts_indexer_queue *queue;
+
+	if (delay_msecs == 0 && fts_indexer_queue == NULL) {
+		/* no batching - send the request immediately */
+		cmd = t_strconcat(INDEXER_HANDSHAKE, cmd, NULL);
+		fts_indexer_queue_send(socket_path, cmd, strlen(cmd));
+		return;
+	}
+
+	queue = fts_indexer_queue_get(socket_path, max_count);
+	if (queue->to != NULL && queue->ioloop != current_ioloop) {
+		/* don't leave the timeout behind in a nested ioloop */
+		fts_indexer_queue_flush();
+	}
+
+	if (hash_table_lookup(queue->requests, key) == NULL) {
+		hash_table_insert(queue->requests, i_strdup(key), (void *)1);
+		str_append(queue->cmds, cmd);
+		queue->count++;
+	}
+
+	if (delay_msecs == 0 || queue->count >= queue->max_count)
+		fts_indexer_queue_flush();
+	else if (queue->to == NULL) {
+		queue->ioloop = current_ioloop;
+		queue->to = timeout_add(delay_msecs,
+					fts_indexer_queue_timeout, queue);
+	}
+}
+
+void fts_indexer_queue_deinit(void)
+{
+	struct fts_indexer_queue *queue = fts_indexer_queue;
+
+	if (queue == NULL)
+		return;
+
+	fts_indexer_queue_flush();
+	fts_indexer_queue_clear(queue);
+	hash_table_destroy(&queue->requests);
+	str_free(&queue->cmds);
+	i_free(queue->path);
+	i_free_and_null(fts_indexer_queue);
+}
@@ -0,0 +1,25 @@
+#ifndef FTS_INDEXER_QUEUE_H
+#define FTS_INDEXER_QUEUE_H
+
+#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
+
+/* Queue of indexer service requests that are sent in a single batch.
+
+   The queue exists only in this process's memory. Requests still queued
+   when the process dies without deinitializing the plugin are lost. The
+   mails aren't lost from the index though: the FTS backends remember the
+   last indexed UID, so the next indexing request for the mailbox or a
+   search in it indexes them. */
+
+/* Add an indexer command line to the queue. Commands with the same key are
+   sent only once, in the order in which they were first added. The queue is
+   sent to socket_path after delay_msecs or once it has max_count commands.
+   With delay_msecs=0 the command is sent immediately. */
+void fts_indexer_queue_add(const char *socket_path, const char *key,
+			   const char *cmd, unsigned int delay_msecs,
+			   unsigned int max_count);
+/* Send all the queued requests immediately. */
+void fts_indexer_queue_flush(void);
+void fts_indexer_queue_deinit(void);
+
+#endif
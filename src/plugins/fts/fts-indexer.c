@@ -5,6 +5,7 @@
 #include "net.h"
 #include "istream.h"
 #include "write-full.h"
+#include "str.h"
 #include "strescape.h"
 #include "time-util.h"
 #include "settings-parser.h"
@@ -12,12 +13,13 @@
 #include "mail-storage-private.h"
 #include "fts-api.h"
 #include "fts-indexer.h"
+#include "fts-indexer-queue.h"
 
 #define INDEXER_NOTIFY_INTERVAL_SECS 10
 
 #define INDEXER_SOCKET_NAME "indexer"
 #define INDEXER_WAIT_MSECS 250
-#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
+#define FTS_INDEXER_QUEUE_DEFAULT_MAX 100
 
 struct fts_indexer_context {
 	struct mailbox *box;
@@ -252,3 +254,42 @@ int fts_indexer_more(struct fts_indexer_context *ctx)
 		fts_indexer_notify(ctx);
 	return ret;
 }
+
+void fts_indexer_queue_append(struct mailbox *box)
+{
+	struct mail_user *user = box->storage->user;
+	string_t *str = t_str_new(256);
+	const char *path, *value, *error, *key;
+	unsigned int max_recent_msgs, delay_msecs = 0, max_count;
+
+	path = t_strconcat(user->set->base_dir, "/"INDEXER_SOCKET_NAME, NULL);
+
+	value = mail_user_plugin_getenv(user, "fts_autoindex_max_recent_msgs");
+	if (value == NULL || str_to_uint(value, &max_recent_msgs) < 0)
+		max_recent_msgs = 0;
+
+	value = mail_user_plugin_getenv(user, "fts_autoindex_delay");
+	if (value != NULL &&
+	    settings_get_time_msecs(value, &delay_msecs, &error) < 0) {
+		i_error("Invalid fts_autoindex_delay setting: %s", error);
+		delay_msecs = 0;
+	}
+	value = mail_user_plugin_getenv(user, "fts_autoindex_queue_max");
+	if (value == NULL || str_to_uint(value, &max_count) < 0 ||
+	    max_count == 0)
+		max_count = FTS_INDEXER_QUEUE_DEFAULT_MAX;
+
+	str_append(str, "APPEND\t0\t");
+	str_append_tabescaped(str, user->username);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, box->vname);
+	str_printfa(str, "\t%u", max_recent_msgs);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, user->session_id);
+	str_append_c(str, '\n');
+
+	key = t_strconcat(user->username, "\t", box->vname, NULL);
+	/* the indexer indexes all the new mails in the mailbox, so a single
+	   request per mailbox is enough */
+	fts_indexer_queue_add(path, key, str_c(str), delay_msecs, max_count);
+}
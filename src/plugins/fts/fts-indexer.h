@@ -19,4 +19,11 @@ int fts_indexer_more(struct fts_indexer_context *ctx);
 int fts_indexer_cmd(struct mail_user *user, const char *cmd,
 		    const char **path_r);
 
+/* Request the indexer service to index new mails in the mailbox. If
+   fts_autoindex_delay is set, the requests are queued and sent in a single
+   batch after the delay or once fts_autoindex_queue_max mailboxes are
+   queued. Requests for the same mailbox are merged. The queue is kept only
+   in memory, see fts-indexer-queue.h. */
+void fts_indexer_queue_append(struct mailbox *box);
+
 #endif
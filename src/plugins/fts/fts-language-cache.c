@@ -0,0 +1,239 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "llist.h"
+#include "hash.h"
+#include "message-address.h"
+#include "message-header-parser.h"
+#include "message-id.h"
+#include "fts-language-cache.h"
+
+struct fts_language_cache_entry {
+	struct fts_language_cache_entry *prev, *next;
+
+	char *key;
+	const struct fts_language *lang;
+	/* number of times lang was detected in a row */
+	unsigned int detect_count;
+	unsigned int hits_until_recheck;
+};
+
+struct fts_language_cache {
+	/* LRU of detected languages. The head is the most recently used. */
+	HASH_TABLE(char *, struct fts_language_cache_entry *) entries;
+	struct fts_language_cache_entry *head, *tail;
+	unsigned int count, max_count;
+	unsigned int hits, misses;
+};
+
+struct fts_language_cache *fts_language_cache_init(unsigned int max_count)
+{
+	struct fts_language_cache *cache;
+
+	i_assert(max_count > 0);
+
+	cache = i_new(struct fts_language_cache, 1);
+	cache->max_count = max_count;
+	hash_table_create(&cache->entries, default_pool, 0, str_hash, strcmp);
+	return cache;
+}
+
+static void
+fts_language_cache_remove(struct fts_language_cache *cache,
+			  struct fts_language_cache_entry *entry)
+{
+	hash_table_remove(cache->entries, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->count--;
+	i_free(entry->key);
+	i_free(entry);
+}
+
+void fts_language_cache_deinit(struct fts_language_cache **_cache)
+{
+	struct fts_language_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->head != NULL)
+		fts_language_cache_remove(cache, cache->head);
+	hash_table_destroy(&cache->entries);
+	i_free(cache);
+}
+
+static void
+fts_language_cache_keys_parse_thread(struct fts_language_cache_keys *keys,
+				     const struct message_header_line *hdr,
+				     unsigned int prio)
+{
+	const char *value, *msgid;
+
+	if (prio <= keys->thread_key_prio)
+		return;
+	value = t_strndup(hdr->full_value, hdr->full_value_len);
+	msgid = message_id_get_next(&value);
+	if (msgid == NULL)
+		return;
+	i_free(keys->thread_key);
+	keys->thread_key = i_strconcat("thread:", msgid, NULL);
+	keys->thread_key_prio = prio;
+}
+
+static void
+fts_language_cache_keys_parse_sender(struct fts_language_cache_keys *keys,
+				     const struct message_header_line *hdr)
+{
+	struct message_address *addr;
+
+	addr = message_address_parse(pool_datastack_create(),
+				     hdr->full_value, hdr->full_value_len,
+				     1, FALSE);
+	if (addr == NULL || addr->mailbox == NULL || addr->domain == NULL ||
+	    addr->mailbox[0] == '\0' || addr->domain[0] == '\0')
+		return;
+	i_free(keys->sender_key);
+	keys->sender_key = i_strdup(t_str_lcase(
+		t_strdup_printf("sender:%s@%s", addr->mailbox, addr->domain)));
+}
+
+void fts_language_cache_keys_parse(struct fts_language_cache_keys *keys,
+				   const struct message_header_line *hdr)
+{
+	T_BEGIN {
+		if (strcasecmp(hdr->name, "References") == 0)
+			fts_language_cache_keys_parse_thread(keys, hdr, 3);
+		else if (strcasecmp(hdr->name, "In-Reply-To") == 0)
+			fts_language_cache_keys_parse_thread(keys, hdr, 2);
+		else if (strcasecmp(hdr->name, "Message-ID") == 0)
+			fts_language_cache_keys_parse_thread(keys, hdr, 1);
+		else if (strcasecmp(hdr->name, "From") == 0)
+			fts_language_cache_keys_parse_sender(keys, hdr);
+	} T_END;
+}
+
+void fts_language_cache_keys_free(struct fts_language_cache_keys *keys)
+{
+	i_free(keys->thread_key);
+	i_free(keys->sender_key);
+	keys->thread_key_prio = 0;
+}
+
+static struct fts_language_cache_entry *
+fts_language_cache_lookup_trusted(struct fts_language_cache *cache,
+				  const char *key)
+{
+	struct fts_language_cache_entry *entry;
+
+	if (key == NULL)
+		return NULL;
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry == NULL ||
+	    entry->detect_count < FTS_LANGUAGE_CACHE_MIN_DETECTIONS)
+		return NULL;
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	return entry;
+}
+
+static void
+fts_language_cache_set(struct fts_language_cache *cache, const char *key,
+		       const struct fts_language *lang,
+		       unsigned int detect_count)
+{
+	struct fts_language_cache_entry *entry;
+
+	if (cache->count >= cache->max_count)
+		fts_language_cache_remove(cache, cache->tail);
+
+	entry = i_new(struct fts_language_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->lang = lang;
+	entry->detect_count = detect_count;
+	entry->hits_until_recheck = FTS_LANGUAGE_CACHE_RECHECK_INTERVAL;
+	hash_table_insert(cache->entries, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+}
+
+const struct fts_language *
+fts_language_cache_lookup(struct fts_language_cache *cache,
+			  const struct fts_language_cache_keys *keys)
+{
+	struct fts_language_cache_entry *entry;
+	const struct fts_language *lang;
+	bool sender_only = FALSE;
+
+	entry = fts_language_cache_lookup_trusted(cache, keys->thread_key);
+	if (entry == NULL) {
+		entry = fts_language_cache_lookup_trusted(cache,
+							  keys->sender_key);
+		sender_only = entry != NULL;
+	}
+	if (entry == NULL) {
+		cache->misses++;
+		return NULL;
+	}
+	if (entry->hits_until_recheck == 0) {
+		/* detect the language again to check that it's still the
+		   same. fts_language_cache_add() updates the entry. */
+		entry->hits_until_recheck = FTS_LANGUAGE_CACHE_RECHECK_INTERVAL;
+		cache->misses++;
+		return NULL;
+	}
+	entry->hits_until_recheck--;
+	cache->hits++;
+
+	lang = entry->lang;
+	if (sender_only && keys->thread_key != NULL &&
+	    hash_table_lookup(cache->entries, keys->thread_key) == NULL) {
+		/* the sender's language is trusted, so trust it for the thread
+		   as well. Note that this may drop the sender's entry if the
+		   cache is full. */
+		fts_language_cache_set(cache, keys->thread_key, lang,
+				       FTS_LANGUAGE_CACHE_MIN_DETECTIONS);
+	}
+	return lang;
+}
+
+static void
+fts_language_cache_add_key(struct fts_language_cache *cache, const char *key,
+			   const struct fts_language *lang)
+{
+	struct fts_language_cache_entry *entry;
+
+	if (key == NULL)
+		return;
+
+	entry = hash_table_lookup(cache->entries, key);
+	if (entry == NULL) {
+		fts_language_cache_set(cache, key, lang, 1);
+		return;
+	}
+	if (entry->lang == lang) {
+		if (entry->detect_count < FTS_LANGUAGE_CACHE_MIN_DETECTIONS)
+			entry->detect_count++;
+	} else {
+		/* the language changed, e.g. a sender writing in multiple
+		   languages. don't trust it until it's detected again. */
+		entry->lang = lang;
+		entry->detect_count = 1;
+	}
+	entry->hits_until_recheck = FTS_LANGUAGE_CACHE_RECHECK_INTERVAL;
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+}
+
+void fts_language_cache_add(struct fts_language_cache *cache,
+			    const struct fts_language_cache_keys *keys,
+			    const struct fts_language *lang)
+{
+	fts_language_cache_add_key(cache, keys->thread_key, lang);
+	fts_language_cache_add_key(cache, keys->sender_key, lang);
+}
+
+void fts_language_cache_get_stats(struct fts_language_cache *cache,
+				  unsigned int *hits_r,
+				  unsigned int *misses_r)
+{
+	*hits_r = cache->hits;
+	*misses_r = cache->misses;
+}
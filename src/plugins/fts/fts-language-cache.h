@@ -0,0 +1,52 @@
+#ifndef FTS_LANGUAGE_CACHE_H
+#define FTS_LANGUAGE_CACHE_H
+
+struct message_header_line;
+struct fts_language;
+
+/* A language that was detected this many times in a row for the same key is
+   trusted and returned by fts_language_cache_lookup(). */
+#define FTS_LANGUAGE_CACHE_MIN_DETECTIONS 2
+/* After a key's language was returned this many times, the next lookup
+   returns NULL so the language gets detected again. A different result
+   makes the key untrusted until it's detected again often enough. */
+#define FTS_LANGUAGE_CACHE_RECHECK_INTERVAL 16
+
+/* Cache keys of a mail, parsed from its top-level header */
+struct fts_language_cache_keys {
+	/* "thread:<root Message-ID>" or NULL */
+	char *thread_key;
+	/* "sender:<lowercased From address>" or NULL */
+	char *sender_key;
+	unsigned int thread_key_prio;
+};
+
+struct fts_language_cache *fts_language_cache_init(unsigned int max_count);
+void fts_language_cache_deinit(struct fts_language_cache **cache);
+
+/* Update the keys from a top-level header line. The thread is identified by
+   its root Message-ID, which is the first one in References. In-Reply-To
+   and finally the mail's own Message-ID are used as fallbacks. */
+void fts_language_cache_keys_parse(struct fts_language_cache_keys *keys,
+				   const struct message_header_line *hdr);
+void fts_language_cache_keys_free(struct fts_language_cache_keys *keys);
+
+/* Returns the mail's trusted language from its thread or sender, or NULL if
+   the language needs to be detected. This should be called once per mail.
+   If only the sender is found, its language is cached for the thread as
+   well. */
+const struct fts_language *
+fts_language_cache_lookup(struct fts_language_cache *cache,
+			  const struct fts_language_cache_keys *keys);
+/* Add the language detected for the mail. This should be called at most
+   once per mail. The least recently used entries are dropped when the cache
+   is full. */
+void fts_language_cache_add(struct fts_language_cache *cache,
+			    const struct fts_language_cache_keys *keys,
+			    const struct fts_language *lang);
+
+void fts_language_cache_get_stats(struct fts_language_cache *cache,
+				  unsigned int *hits_r,
+				  unsigned int *misses_r);
+
+#endif
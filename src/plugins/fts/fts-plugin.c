@@ -5,6 +5,7 @@
 #include "fts-filter.h"
 #include "fts-tokenizer.h"
 #include "fts-parser.h"
+#include "fts-indexer-queue.h"
 #include "fts-storage.h"
 #include "fts-user.h"
 #include "fts-plugin.h"
@@ -27,6 +28,7 @@ void fts_plugin_init(struct module *module)
 
 void fts_plugin_deinit(void)
 {
+	fts_indexer_queue_deinit();
 	fts_library_deinit();
 	fts_parsers_unload();
 	mail_storage_hooks_remove(&fts_mail_storage_hooks);
@@ -0,0 +1,191 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "llist.h"
+#include "str.h"
+#include "mail-search.h"
+#include "fts-search-cache.h"
+
+struct fts_search_cache {
+	struct fts_search_cache_entry *head, *tail;
+	unsigned int count, max_count;
+
+	unsigned int hits, refines, misses;
+};
+
+struct fts_search_cache *fts_search_cache_init(unsigned int max_count)
+{
+	struct fts_search_cache *cache;
+
+	i_assert(max_count > 0);
+
+	cache = i_new(struct fts_search_cache, 1);
+	cache->max_count = max_count;
+	return cache;
+}
+
+static void
+fts_search_cache_remove(struct fts_search_cache *cache,
+			struct fts_search_cache_entry *entry)
+{
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->count--;
+	fts_search_cache_entry_free(&entry);
+}
+
+void fts_search_cache_deinit(struct fts_search_cache **_cache,
+			     struct event *event)
+{
+	struct fts_search_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache->hits + cache->refines + cache->misses > 0) {
+		e_debug(event_create_passthrough(event)->
+			set_name("fts_search_cache_finished")->
+			add_int("hits", cache->hits)->
+			add_int("refines", cache->refines)->
+			add_int("misses", cache->misses)->event(),
+			"fts: Search cache: %u hits, %u refines, %u misses",
+			cache->hits, cache->refines, cache->misses);
+	}
+	while (cache->head != NULL)
+		fts_search_cache_remove(cache, cache->head);
+	i_free(cache);
+}
+
+static void
+fts_search_cache_key_append_fuzzy(string_t *dest,
+				  const struct mail_search_arg *args)
+{
+	/* FUZZY isn't written by mail_search_args_to_imap(), but it affects
+	   the backend's results. */
+	for (; args != NULL; args = args->next) {
+		str_append_c(dest, args->fuzzy ? '1' : '0');
+		switch (args->type) {
+		case SEARCH_OR:
+		case SEARCH_SUB:
+		case SEARCH_INTHREAD:
+			str_append_c(dest, '(');
+			fts_search_cache_key_append_fuzzy(dest,
+							  args->value.subargs);
+			str_append_c(dest, ')');
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+bool fts_search_cache_get_key(string_t *dest,
+			      const struct mail_search_arg *args,
+			      enum fts_lookup_flags flags)
+{
+	const char *error;
+
+	str_printfa(dest, "%x\t", flags);
+	if (!mail_search_args_to_imap(dest, args, &error))
+		return FALSE;
+	str_append_c(dest, '\t');
+	fts_search_cache_key_append_fuzzy(dest, args);
+	return TRUE;
+}
+
+struct fts_search_cache_entry *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *key,
+			uint32_t uid_validity, uint32_t last_uid)
+{
+	struct fts_search_cache_entry *entry;
+
+	for (entry = cache->head; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->key, key) == 0)
+			break;
+	}
+	if (entry == NULL)
+		return NULL;
+	if (entry->uid_validity != uid_validity || entry->last_uid > last_uid) {
+		/* the results are no longer valid */
+		fts_search_cache_remove(cache, entry);
+		return NULL;
+	}
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	return entry;
+}
+
+void fts_search_cache_count(struct fts_search_cache *cache, bool hit,
+			    bool refined)
+{
+	if (!hit)
+		cache->misses++;
+	else if (refined)
+		cache->refines++;
+	else
+		cache->hits++;
+}
+
+struct fts_search_cache_entry *
+fts_search_cache_entry_new(const char *key, uint32_t uid_validity,
+			   uint32_t last_uid)
+{
+	struct fts_search_cache_entry *entry;
+	pool_t pool;
+
+	pool = pool_alloconly_create("fts search cache entry", 1024);
+	entry = p_new(pool, struct fts_search_cache_entry, 1);
+	entry->pool = pool;
+	entry->key = p_strdup(pool, key);
+	entry->uid_validity = uid_validity;
+	entry->last_uid = last_uid;
+	p_array_init(&entry->levels, pool, 4);
+	return entry;
+}
+
+void fts_search_cache_entry_add_level(struct fts_search_cache_entry *entry,
+				      const struct fts_result *result,
+				      const buffer_t *args_matches)
+{
+	struct fts_search_cache_level *level;
+
+	level = array_append_space(&entry->levels);
+	p_array_init(&level->definite_uids, entry->pool,
+		     array_count(&result->definite_uids));
+	array_append_array(&level->definite_uids, &result->definite_uids);
+	p_array_init(&level->maybe_uids, entry->pool,
+		     array_count(&result->maybe_uids));
+	array_append_array(&level->maybe_uids, &result->maybe_uids);
+	p_array_init(&level->score_map, entry->pool,
+		     array_count(&result->scores));
+	array_append_array(&level->score_map, &result->scores);
+	level->args_matches =
+		buffer_create_dynamic(entry->pool, args_matches->used);
+	buffer_append_buf(level->args_matches, args_matches, 0, (size_t)-1);
+}
+
+void fts_search_cache_entry_free(struct fts_search_cache_entry **_entry)
+{
+	struct fts_search_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+	pool_unref(&entry->pool);
+}
+
+void fts_search_cache_add(struct fts_search_cache *cache,
+			  struct fts_search_cache_entry **_entry)
+{
+	struct fts_search_cache_entry *entry = *_entry, *old;
+
+	*_entry = NULL;
+	for (old = cache->head; old != NULL; old = old->next) {
+		if (strcmp(old->key, entry->key) == 0) {
+			fts_search_cache_remove(cache, old);
+			break;
+		}
+	}
+	if (cache->count >= cache->max_count)
+		fts_search_cache_remove(cache, cache->tail);
+
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->count++;
+}
@@ -0,0 +1,65 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+#include "seq-range-array.h"
+#include "fts-api.h"
+
+struct fts_search_cache_level {
+	ARRAY_TYPE(seq_range) definite_uids, maybe_uids;
+	ARRAY_TYPE(fts_score_map) score_map;
+	buffer_t *args_matches;
+};
+
+struct fts_search_cache_entry {
+	struct fts_search_cache_entry *prev, *next;
+	pool_t pool;
+
+	const char *key;
+	/* the results are valid only as long as the mailbox's UIDVALIDITY
+	   doesn't change. last_uid is the backend's last indexed UID at the
+	   time of the lookup. */
+	uint32_t uid_validity, last_uid;
+	ARRAY(struct fts_search_cache_level) levels;
+};
+
+/* Create a cache for up to max_count most recently used lookups. */
+struct fts_search_cache *fts_search_cache_init(unsigned int max_count);
+void fts_search_cache_deinit(struct fts_search_cache **cache,
+			     struct event *event);
+
+/* Append the normalized form of the search args to dest. Returns FALSE if
+   the args can't be cached. */
+bool fts_search_cache_get_key(string_t *dest,
+			      const struct mail_search_arg *args,
+			      enum fts_lookup_flags flags);
+
+/* Returns the cached lookup for the key, or NULL if it's not cached. An
+   entry with a different UIDVALIDITY or with a higher last_uid than the
+   backend's current last indexed UID (e.g. the index was rebuilt) is
+   dropped. If the returned entry's last_uid is lower than last_uid, its
+   results don't include the mails indexed since the cached lookup. */
+struct fts_search_cache_entry *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *key,
+			uint32_t uid_validity, uint32_t last_uid);
+/* Count the result of the lookup to statistics. refined means that the
+   cached results were used but the newly indexed mails had to be searched
+   separately. */
+void fts_search_cache_count(struct fts_search_cache *cache, bool hit,
+			    bool refined);
+
+/* Create a new entry. The levels are added to it while the backend lookup
+   is done and it's then added to the cache with fts_search_cache_add(). */
+struct fts_search_cache_entry *
+fts_search_cache_entry_new(const char *key, uint32_t uid_validity,
+			   uint32_t last_uid);
+void fts_search_cache_entry_add_level(struct fts_search_cache_entry *entry,
+				      const struct fts_result *result,
+				      const buffer_t *args_matches);
+void fts_search_cache_entry_free(struct fts_search_cache_entry **entry);
+
+/* Add the entry to cache, replacing any existing entry with the same key
+   and dropping the least recently used entry if the cache is full. */
+void fts_search_cache_add(struct fts_search_cache *cache,
+			  struct fts_search_cache_entry **entry);
+
+#endif
@@ -8,8 +8,17 @@
 #include "fts-api-private.h"
 #include "fts-search-args.h"
 #include "fts-search-serialize.h"
+#include "fts-search-cache.h"
 #include "fts-storage.h"
 
+/* When the backend has indexed more mails since the cached lookup, use the
+   cached results and search the newly indexed mails without the backend as
+   long as there aren't more of them than this and their total size isn't
+   larger than this. Searching them opens and parses the mails, which is
+   slower than a backend lookup for large mails. */
+#define FTS_SEARCH_CACHE_MAX_REFINE_MAILS 100
+#define FTS_SEARCH_CACHE_MAX_REFINE_BYTES (1024*1024)
+
 static void
 uid_range_to_seqs(struct fts_search_context *fctx,
 		  const ARRAY_TYPE(seq_range) *uid_range,
@@ -58,6 +67,11 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
 	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
 	level->score_map = result.scores;
+
+	if (fctx->cache_entry != NULL) {
+		fts_search_cache_entry_add_level(fctx->cache_entry, &result,
+						 level->args_matches);
+	}
 	return 0;
 }
 
@@ -336,9 +350,112 @@ static void fts_search_merge_scores(struct fts_search_context *fctx)
 				      TRUE, &fctx->scores->score_map);
 }
 
+static void
+fts_search_cache_levels_add(struct fts_search_context *fctx,
+			    const struct fts_search_cache_entry *entry)
+{
+	const struct fts_search_cache_level *cache_level;
+	struct fts_search_level *level;
+
+	array_foreach(&entry->levels, cache_level) {
+		level = array_append_space(&fctx->levels);
+		level->args_matches =
+			buffer_create_dynamic(fctx->result_pool,
+					      cache_level->args_matches->used);
+		buffer_append_buf(level->args_matches,
+				  cache_level->args_matches, 0, (size_t)-1);
+		uid_range_to_seqs(fctx, &cache_level->definite_uids,
+				  &level->definite_seqs);
+		uid_range_to_seqs(fctx, &cache_level->maybe_uids,
+				  &level->maybe_seqs);
+		p_array_init(&level->score_map, fctx->result_pool,
+			     array_count(&cache_level->score_map));
+		array_append_array(&level->score_map, &cache_level->score_map);
+	}
+}
+
+static bool
+fts_search_cache_can_refine(struct fts_search_context *fctx,
+			    uint32_t seq1, uint32_t seq2)
+{
+	struct mail *mail;
+	uoff_t size, total_size = 0;
+	uint32_t seq;
+	bool ret = TRUE;
+
+	if (fctx->enforced) {
+		/* the new mails would be searched the same way as unindexed
+		   mails, which isn't wanted if FTS is enforced */
+		return FALSE;
+	}
+	if (seq2 - seq1 + 1 > FTS_SEARCH_CACHE_MAX_REFINE_MAILS)
+		return FALSE;
+
+	/* use only the sizes that are already cached. looking them up could
+	   require opening the mails. */
+	mail = mail_alloc(fctx->t, 0, NULL);
+	mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	for (seq = seq1; seq <= seq2 && ret; seq++) {
+		mail_set_seq(mail, seq);
+		if (mail_get_virtual_size(mail, &size) < 0)
+			ret = FALSE;
+		else {
+			total_size += size;
+			if (total_size > FTS_SEARCH_CACHE_MAX_REFINE_BYTES)
+				ret = FALSE;
+		}
+	}
+	mail_free(&mail);
+	return ret;
+}
+
+static bool
+fts_search_lookup_cached(struct fts_search_context *fctx, uint32_t last_uid)
+{
+	struct fts_search_cache_entry *entry;
+	struct mailbox_status status;
+	uint32_t seq1, seq2;
+	bool refined = FALSE;
+	string_t *key;
+
+	mailbox_get_open_status(fctx->box, STATUS_UIDVALIDITY, &status);
+
+	key = t_str_new(128);
+	if (!fts_search_cache_get_key(key, fctx->args->args, fctx->flags))
+		return FALSE;
+
+	entry = fts_search_cache_lookup(fctx->search_cache, str_c(key),
+					status.uidvalidity, last_uid);
+	if (entry != NULL && entry->last_uid < last_uid) {
+		/* more mails have been indexed since the cached lookup. */
+		mailbox_get_seq_range(fctx->box, entry->last_uid+1, last_uid,
+				      &seq1, &seq2);
+		if (seq1 == 0)
+			;
+		else if (!fts_search_cache_can_refine(fctx, seq1, seq2))
+			entry = NULL;
+		else {
+			fctx->first_unindexed_seq = seq1;
+			refined = TRUE;
+		}
+	}
+	fts_search_cache_count(fctx->search_cache, entry != NULL, refined);
+
+	if (entry == NULL) {
+		fctx->cache_entry =
+			fts_search_cache_entry_new(str_c(key),
+						   status.uidvalidity,
+						   last_uid);
+		return FALSE;
+	}
+	fts_search_cache_levels_add(fctx, entry);
+	return TRUE;
+}
+
 void fts_search_lookup(struct fts_search_context *fctx)
 {
 	uint32_t last_uid, seq1, seq2;
+	bool cached;
 
 	i_assert(array_count(&fctx->levels) == 0);
 	i_assert(fctx->args->simplified);
@@ -357,10 +474,25 @@ void fts_search_lookup(struct fts_search_context *fctx)
 	}
 	fts_search_serialize(fctx->orig_matches, fctx->args->args);
 
-	if (fts_search_lookup_level(fctx, fctx->args->args, TRUE) == 0) {
+	T_BEGIN {
+		cached = fctx->search_cache != NULL &&
+			!fctx->virtual_mailbox &&
+			fts_search_lookup_cached(fctx, last_uid);
+	} T_END;
+
+	if (cached) {
+		fctx->fts_lookup_success = TRUE;
+		fts_search_merge_scores(fctx);
+	} else if (fts_search_lookup_level(fctx, fctx->args->args, TRUE) == 0) {
 		fctx->fts_lookup_success = TRUE;
 		fts_search_merge_scores(fctx);
+		if (fctx->cache_entry != NULL) {
+			fts_search_cache_add(fctx->search_cache,
+					     &fctx->cache_entry);
+		}
 	}
+	if (fctx->cache_entry != NULL)
+		fts_search_cache_entry_free(&fctx->cache_entry);
 
 	fts_search_deserialize(fctx->args->args, fctx->orig_matches);
 	fts_backend_lookup_done(fctx->backend);
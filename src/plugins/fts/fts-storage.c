@@ -2,10 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
-#include "net.h"
 #include "str.h"
-#include "strescape.h"
-#include "write-full.h"
 #include "wildcard-match.h"
 #include "mail-search-build.h"
 #include "mail-storage-private.h"
@@ -15,6 +12,7 @@
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
 #include "fts-search-serialize.h"
+#include "fts-search-cache.h"
 #include "fts-plugin.h"
 #include "fts-storage.h"
 
@@ -30,9 +28,6 @@
 #define FTS_LIST_CONTEXT_REQUIRE(obj) \
 	MODULE_CONTEXT_REQUIRE(obj, fts_mailbox_list_module)
 
-#define INDEXER_SOCKET_NAME "indexer"
-#define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
-
 struct fts_mailbox_list {
 	union mailbox_list_module_context module_ctx;
 	struct fts_backend *backend;
@@ -47,6 +42,7 @@ struct fts_mailbox_list {
 struct fts_mailbox {
 	union mailbox_module_context module_ctx;
 	struct fts_backend_update_context *sync_update_ctx;
+	struct fts_search_cache *search_cache;
 	bool fts_mailbox_excluded;
 };
 
@@ -224,6 +220,7 @@ fts_mailbox_search_init(struct mailbox_transaction_context *t,
 	fctx->enforced =
 		mail_user_plugin_getenv_bool(t->box->storage->user,
 					"fts_enforced");
+	fctx->search_cache = fbox->search_cache;
 	i_array_init(&fctx->levels, 8);
 	fctx->scores = i_new(struct fts_scores, 1);
 	fctx->scores->refcount = 1;
@@ -617,39 +614,6 @@ static void fts_transaction_rollback(struct mailbox_transaction_context *t)
 	fbox->module_ctx.super.transaction_rollback(t);
 }
 
-static void fts_queue_index(struct mailbox *box)
-{
-	struct mail_user *user = box->storage->user;
-	string_t *str = t_str_new(256);
-	const char *path, *value;
-	unsigned int max_recent_msgs;
-	int fd;
-
-	path = t_strconcat(user->set->base_dir, "/"INDEXER_SOCKET_NAME, NULL);
-	fd = net_connect_unix(path);
-	if (fd == -1) {
-		i_error("net_connect_unix(%s) failed: %m", path);
-		return;
-	}
-
-	value = mail_user_plugin_getenv(user, "fts_autoindex_max_recent_msgs");
-	if (value == NULL || str_to_uint(value, &max_recent_msgs) < 0)
-		max_recent_msgs = 0;
-
-	str_append(str, INDEXER_HANDSHAKE);
-	str_append(str, "APPEND\t0\t");
-	str_append_tabescaped(str, user->username);
-	str_append_c(str, '\t');
-	str_append_tabescaped(str, box->vname);
-	str_printfa(str, "\t%u", max_recent_msgs);
-	str_append_c(str, '\t');
-	str_append_tabescaped(str, box->storage->user->session_id);
-	str_append_c(str, '\n');
-	if (write_full(fd, str_data(str), str_len(str)) < 0)
-		i_error("write(%s) failed: %m", path);
-	i_close_fd(&fd);
-}
-
 static int
 fts_transaction_commit(struct mailbox_transaction_context *t,
 		       struct mail_transaction_commit_changes *changes_r)
@@ -677,7 +641,7 @@ fts_transaction_commit(struct mailbox_transaction_context *t,
 		return -1;
 
 	if (autoindex)
-		fts_queue_index(box);
+		fts_indexer_queue_append(box);
 	return 0;
 }
 
@@ -813,6 +777,34 @@ static bool fts_autoindex_exclude_match(struct mailbox *box)
 	return FALSE;
 }
 
+static void fts_mailbox_init_search_cache(struct fts_mailbox *fbox,
+					  struct mailbox *box)
+{
+	const char *value;
+	unsigned int max_count;
+
+	value = mail_user_plugin_getenv(box->storage->user,
+					"fts_search_cache_size");
+	if (value == NULL)
+		return;
+	if (str_to_uint(value, &max_count) < 0) {
+		i_error("fts: Invalid fts_search_cache_size setting: %s",
+			value);
+		return;
+	}
+	if (max_count > 0)
+		fbox->search_cache = fts_search_cache_init(max_count);
+}
+
+static void fts_mailbox_free(struct mailbox *box)
+{
+	struct fts_mailbox *fbox = FTS_CONTEXT_REQUIRE(box);
+
+	if (fbox->search_cache != NULL)
+		fts_search_cache_deinit(&fbox->search_cache, box->event);
+	fbox->module_ctx.super.free(box);
+}
+
 void fts_mailbox_allocated(struct mailbox *box)
 {
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(box->list);
@@ -826,6 +818,7 @@ void fts_mailbox_allocated(struct mailbox *box)
 	fbox->module_ctx.super = *v;
 	box->vlast = &fbox->module_ctx.super;
 	fbox->fts_mailbox_excluded = fts_autoindex_exclude_match(box);
+	fts_mailbox_init_search_cache(fbox, box);
 
 	v->get_status = fts_mailbox_get_status;
 	v->search_init = fts_mailbox_search_init;
@@ -839,6 +832,7 @@ void fts_mailbox_allocated(struct mailbox *box)
 	v->sync_deinit = fts_sync_deinit;
 	v->save_finish = fts_save_finish;
 	v->copy = fts_copy;
+	v->free = fts_mailbox_free;
 
 	MODULE_CONTEXT_SET(box, fts_storage_module, fbox);
 }
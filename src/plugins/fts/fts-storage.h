@@ -35,6 +35,11 @@ struct fts_search_context {
 
 	struct fts_indexer_context *indexer_ctx;
 
+	/* lookup results cache of the mailbox, or NULL if disabled */
+	struct fts_search_cache *search_cache;
+	/* lookup results that are added to search_cache on success */
+	struct fts_search_cache_entry *cache_entry;
+
 	bool virtual_mailbox:1;
 	bool fts_lookup_success:1;
 	bool indexing_timed_out:1;
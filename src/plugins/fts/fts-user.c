@@ -6,6 +6,7 @@
 #include "fts-language.h"
 #include "fts-filter.h"
 #include "fts-tokenizer.h"
+#include "fts-language-cache.h"
 #include "fts-user.h"
 
 #define FTS_USER_CONTEXT(obj) \
@@ -18,6 +19,9 @@ struct fts_user {
 	struct fts_language_list *lang_list;
 	struct fts_user_language *data_lang;
 	ARRAY_TYPE(fts_user_language) languages, data_languages;
+
+	/* NULL if fts_language_cache_size isn't set */
+	struct fts_language_cache *lang_cache;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(fts_user_module,
@@ -336,6 +340,52 @@ struct fts_user_language *fts_user_get_data_lang(struct mail_user *user)
 	return fuser->data_lang;
 }
 
+static void fts_user_init_language_cache(struct mail_user *user,
+					 struct fts_user *fuser)
+{
+	const char *value;
+	unsigned int max_count;
+
+	value = mail_user_plugin_getenv(user, "fts_language_cache_size");
+	if (value == NULL)
+		return;
+	if (str_to_uint(value, &max_count) < 0) {
+		i_error("fts: Invalid fts_language_cache_size setting: %s",
+			value);
+		return;
+	}
+	if (max_count > 0)
+		fuser->lang_cache = fts_language_cache_init(max_count);
+}
+
+struct fts_language_cache *fts_user_get_language_cache(struct mail_user *user)
+{
+	struct fts_user *fuser = FTS_USER_CONTEXT(user);
+
+	i_assert(fuser != NULL);
+	return fuser->lang_cache;
+}
+
+static void fts_user_deinit_language_cache(struct mail_user *user,
+					   struct fts_user *fuser)
+{
+	unsigned int hits, misses;
+
+	if (fuser->lang_cache == NULL)
+		return;
+
+	fts_language_cache_get_stats(fuser->lang_cache, &hits, &misses);
+	if (hits + misses > 0) {
+		e_debug(event_create_passthrough(user->event)->
+			set_name("fts_language_cache_finished")->
+			add_int("hits", hits)->
+			add_int("misses", misses)->event(),
+			"fts: Language cache: %u hits, %u misses",
+			hits, misses);
+	}
+	fts_language_cache_deinit(&fuser->lang_cache);
+}
+
 static void fts_user_language_free(struct fts_user_language *user_lang)
 {
 	if (user_lang->filter != NULL)
@@ -346,10 +396,12 @@ static void fts_user_language_free(struct fts_user_language *user_lang)
 		fts_tokenizer_unref(&user_lang->search_tokenizer);
 }
 
-static void fts_user_free(struct fts_user *fuser)
+static void fts_user_free(struct mail_user *user, struct fts_user *fuser)
 {
 	struct fts_user_language *const *user_langp;
 
+	fts_user_deinit_language_cache(user, fuser);
+
 	if (fuser->lang_list != NULL)
 		fts_language_list_deinit(&fuser->lang_list);
 
@@ -370,14 +422,15 @@ int fts_mail_user_init(struct mail_user *user, const char **error_r)
 	fuser = p_new(user->pool, struct fts_user, 1);
 	fuser->refcount = 1;
 	p_array_init(&fuser->languages, user->pool, 4);
+	fts_user_init_language_cache(user, fuser);
 
 	if (fts_user_init_languages(user, fuser, error_r) < 0 ||
 	    fts_user_init_data_language(user, fuser, error_r) < 0) {
-		fts_user_free(fuser);
+		fts_user_free(user, fuser);
 		return -1;
 	}
 	if (fts_user_languages_fill_all(user, fuser, error_r) < 0) {
-		fts_user_free(fuser);
+		fts_user_free(user, fuser);
 		return -1;
 	}
 
@@ -392,6 +445,6 @@ void fts_mail_user_deinit(struct mail_user *user)
 	if (fuser != NULL) {
 		i_assert(fuser->refcount > 0);
 		if (--fuser->refcount == 0)
-			fts_user_free(fuser);
+			fts_user_free(user, fuser);
 	}
 }
@@ -18,6 +18,10 @@ struct fts_user_language *fts_user_get_data_lang(struct mail_user *user);
 const ARRAY_TYPE(fts_user_language) *
 fts_user_get_data_languages(struct mail_user *user);
 
+/* Returns the user's cache of detected languages, or NULL if
+   fts_language_cache_size isn't set. */
+struct fts_language_cache *fts_user_get_language_cache(struct mail_user *user);
+
 int fts_mail_user_init(struct mail_user *user, const char **error_r);
 void fts_mail_user_deinit(struct mail_user *user);
 
@@ -0,0 +1,152 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "net.h"
+#include "str.h"
+#include "fd-util.h"
+#include "test-common.h"
+#include "fts-indexer-queue.h"
+
+#include <unistd.h>
+
+#define TEST_SOCKET_PATH ".test-fts-indexer-queue.sock"
+
+static int listen_fd;
+
+static bool test_queue_have_request(void)
+{
+	int fd;
+
+	fd = net_accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return FALSE;
+	i_close_fd(&fd);
+	return TRUE;
+}
+
+static const char *test_queue_read_request(void)
+{
+	string_t *str = t_str_new(256);
+	char buf[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = net_accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+	fd_set_nonblock(fd, FALSE);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		str_append_data(str, buf, ret);
+	test_assert(ret == 0);
+	i_close_fd(&fd);
+
+	/* each connection starts with the handshake */
+	test_assert(strncmp(str_c(str), INDEXER_HANDSHAKE,
+			    strlen(INDEXER_HANDSHAKE)) == 0);
+	return str_c(str) + strlen(INDEXER_HANDSHAKE);
+}
+
+static void test_fts_indexer_queue_order(void)
+{
+	test_begin("fts indexer queue order and merging");
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u1\tINBOX",
+			      "APPEND\tu1\tINBOX\n", 1000, 100);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u1\tfoo",
+			      "APPEND\tu1\tfoo\n", 1000, 100);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u1\tINBOX",
+			      "APPEND\tu1\tINBOX\n", 1000, 100);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u2\tINBOX",
+			      "APPEND\tu2\tINBOX\n", 1000, 100);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u1\tfoo",
+			      "APPEND\tu1\tfoo\n", 1000, 100);
+	/* nothing is sent before the delay */
+	test_assert(!test_queue_have_request());
+
+	fts_indexer_queue_flush();
+	test_assert_strcmp(test_queue_read_request(),
+			   "APPEND\tu1\tINBOX\n"
+			   "APPEND\tu1\tfoo\n"
+			   "APPEND\tu2\tINBOX\n");
+	test_assert(!test_queue_have_request());
+
+	/* flushing an empty queue doesn't connect */
+	fts_indexer_queue_flush();
+	test_assert(!test_queue_have_request());
+
+	/* a mailbox can be queued again after the flush */
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "u1\tfoo",
+			      "APPEND\tu1\tfoo\n", 1000, 100);
+	fts_indexer_queue_flush();
+	test_assert_strcmp(test_queue_read_request(), "APPEND\tu1\tfoo\n");
+	fts_indexer_queue_deinit();
+	test_end();
+}
+
+static void test_fts_indexer_queue_max_count(void)
+{
+	test_begin("fts indexer queue max count");
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "1", "APPEND\t1\n", 1000, 2);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "1", "APPEND\t1\n", 1000, 2);
+	test_assert(!test_queue_have_request());
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "2", "APPEND\t2\n", 1000, 2);
+	test_assert_strcmp(test_queue_read_request(),
+			   "APPEND\t1\nAPPEND\t2\n");
+
+	/* the rest are sent at deinit */
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "3", "APPEND\t3\n", 1000, 2);
+	test_assert(!test_queue_have_request());
+	fts_indexer_queue_deinit();
+	test_assert_strcmp(test_queue_read_request(), "APPEND\t3\n");
+	test_end();
+}
+
+static void test_fts_indexer_queue_delay(void)
+{
+	struct timeout *to;
+
+	test_begin("fts indexer queue delay");
+	/* without a delay the request is sent immediately */
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "1", "APPEND\t1\n", 0, 100);
+	test_assert_strcmp(test_queue_read_request(), "APPEND\t1\n");
+
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "2", "APPEND\t2\n", 10, 100);
+	fts_indexer_queue_add(TEST_SOCKET_PATH, "3", "APPEND\t3\n", 10, 100);
+	test_assert(!test_queue_have_request());
+	to = timeout_add_short(200, io_loop_stop, current_ioloop);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert_strcmp(test_queue_read_request(),
+			   "APPEND\t2\nAPPEND\t3\n");
+	fts_indexer_queue_deinit();
+	test_assert(!test_queue_have_request());
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_indexer_queue_order,
+		test_fts_indexer_queue_max_count,
+		test_fts_indexer_queue_delay,
+		NULL
+	};
+	struct ioloop *ioloop;
+	int ret;
+
+	lib_init();
+	i_unlink_if_exists(TEST_SOCKET_PATH);
+	listen_fd = net_listen_unix(TEST_SOCKET_PATH, 16);
+	if (listen_fd == -1)
+		i_fatal("net_listen_unix(%s) failed: %m", TEST_SOCKET_PATH);
+	fd_set_nonblock(listen_fd, TRUE);
+
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+
+	i_close_fd(&listen_fd);
+	i_unlink(TEST_SOCKET_PATH);
+	lib_deinit();
+	return ret;
+}
@@ -0,0 +1,221 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-header-parser.h"
+#include "fts-language.h"
+#include "test-common.h"
+#include "fts-language-cache.h"
+
+static const struct fts_language test_lang_en = { .name = "en" };
+static const struct fts_language test_lang_fi = { .name = "fi" };
+
+static void
+test_keys_parse(struct fts_language_cache_keys *keys,
+		const char *name, const char *value)
+{
+	struct message_header_line hdr;
+
+	i_zero(&hdr);
+	hdr.name = name;
+	hdr.name_len = strlen(name);
+	hdr.full_value = (const unsigned char *)value;
+	hdr.full_value_len = strlen(value);
+	fts_language_cache_keys_parse(keys, &hdr);
+}
+
+static void test_fts_language_cache_keys(void)
+{
+	struct fts_language_cache_keys keys;
+
+	test_begin("fts language cache keys");
+	i_zero(&keys);
+
+	/* the mail's own Message-ID is used only if there's nothing better */
+	test_keys_parse(&keys, "Message-ID", "<own@example.com>");
+	test_assert_strcmp(keys.thread_key, "thread:own@example.com");
+	test_keys_parse(&keys, "In-Reply-To", "<parent@example.com>");
+	test_assert_strcmp(keys.thread_key, "thread:parent@example.com");
+	/* the first References Message-ID is the thread root */
+	test_keys_parse(&keys, "references",
+			"<root@example.com>\n <parent@example.com>");
+	test_assert_strcmp(keys.thread_key, "thread:root@example.com");
+	/* lower priority headers don't replace it, regardless of order */
+	test_keys_parse(&keys, "In-Reply-To", "<other@example.com>");
+	test_keys_parse(&keys, "Message-ID", "<own2@example.com>");
+	test_assert_strcmp(keys.thread_key, "thread:root@example.com");
+	test_assert(keys.sender_key == NULL);
+
+	/* the sender address is lowercased and the display name dropped */
+	test_keys_parse(&keys, "From", "Some User <Some.User@Example.COM>");
+	test_assert_strcmp(keys.sender_key, "sender:some.user@example.com");
+	/* invalid addresses don't replace it */
+	test_keys_parse(&keys, "From", "undisclosed");
+	test_keys_parse(&keys, "From", "<@example.com>");
+	test_assert_strcmp(keys.sender_key, "sender:some.user@example.com");
+	/* other headers are ignored */
+	test_keys_parse(&keys, "Subject", "<subject@example.com>");
+	test_assert_strcmp(keys.thread_key, "thread:root@example.com");
+	fts_language_cache_keys_free(&keys);
+	test_assert(keys.thread_key == NULL && keys.sender_key == NULL &&
+		    keys.thread_key_prio == 0);
+
+	/* invalid Message-IDs are ignored */
+	test_keys_parse(&keys, "References", "garbage");
+	test_assert(keys.thread_key == NULL);
+	fts_language_cache_keys_free(&keys);
+	test_end();
+}
+
+static void
+test_cache_stats(struct fts_language_cache *cache,
+		 unsigned int hits, unsigned int misses)
+{
+	unsigned int hits2, misses2;
+
+	fts_language_cache_get_stats(cache, &hits2, &misses2);
+	test_assert(hits2 == hits);
+	test_assert(misses2 == misses);
+}
+
+static void test_fts_language_cache_trust(void)
+{
+	struct fts_language_cache_keys keys = {
+		.sender_key = "sender:user@example.com",
+	};
+	struct fts_language_cache *cache;
+	unsigned int i;
+
+	test_begin("fts language cache trust");
+	cache = fts_language_cache_init(10);
+
+	/* a single detection isn't trusted yet */
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	fts_language_cache_add(cache, &keys, &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	/* a different language resets the count */
+	fts_language_cache_add(cache, &keys, &test_lang_fi);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	fts_language_cache_add(cache, &keys, &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	fts_language_cache_add(cache, &keys, &test_lang_en);
+	test_cache_stats(cache, 0, 4);
+
+	/* trusted now, until it's time to recheck */
+	for (i = 0; i < FTS_LANGUAGE_CACHE_RECHECK_INTERVAL; i++)
+		test_assert_idx(fts_language_cache_lookup(cache, &keys) == &test_lang_en, i);
+	test_cache_stats(cache, FTS_LANGUAGE_CACHE_RECHECK_INTERVAL, 4);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	/* the recheck detected a different language. it's not trusted until
+	   it's detected again. */
+	fts_language_cache_add(cache, &keys, &test_lang_fi);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	fts_language_cache_add(cache, &keys, &test_lang_fi);
+	test_assert(fts_language_cache_lookup(cache, &keys) == &test_lang_fi);
+
+	/* a recheck without a detection result (e.g. too short input) keeps
+	   the language */
+	for (i = 1; i < FTS_LANGUAGE_CACHE_RECHECK_INTERVAL; i++)
+		test_assert_idx(fts_language_cache_lookup(cache, &keys) == &test_lang_fi, i);
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	test_assert(fts_language_cache_lookup(cache, &keys) == &test_lang_fi);
+
+	fts_language_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_fts_language_cache_thread(void)
+{
+	struct fts_language_cache_keys keys = {
+		.thread_key = "thread:root@example.com",
+		.sender_key = "sender:user@example.com",
+	};
+	struct fts_language_cache_keys sender_keys = {
+		.sender_key = "sender:user@example.com",
+	};
+	struct fts_language_cache_keys other_sender_keys = {
+		.thread_key = "thread:root@example.com",
+		.sender_key = "sender:other@example.com",
+	};
+	struct fts_language_cache *cache;
+
+	test_begin("fts language cache thread");
+	cache = fts_language_cache_init(10);
+
+	fts_language_cache_add(cache, &sender_keys, &test_lang_fi);
+	fts_language_cache_add(cache, &sender_keys, &test_lang_fi);
+
+	/* a thread miss followed by a sender hit is counted as one hit, and
+	   the thread gets the sender's language */
+	test_assert(fts_language_cache_lookup(cache, &keys) == &test_lang_fi);
+	test_cache_stats(cache, 1, 0);
+	test_assert(fts_language_cache_lookup(cache, &other_sender_keys) ==
+		    &test_lang_fi);
+	test_cache_stats(cache, 2, 0);
+
+	/* the thread's language is preferred over the sender's */
+	fts_language_cache_add(cache, &sender_keys, &test_lang_en);
+	fts_language_cache_add(cache, &sender_keys, &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &sender_keys) ==
+		    &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &keys) == &test_lang_fi);
+
+	/* a miss with both keys is counted once */
+	keys.thread_key = "thread:unknown@example.com";
+	keys.sender_key = "sender:unknown@example.com";
+	test_assert(fts_language_cache_lookup(cache, &keys) == NULL);
+	test_cache_stats(cache, 4, 1);
+
+	fts_language_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_fts_language_cache_lru(void)
+{
+	struct fts_language_cache_keys keys1 = { .sender_key = "sender:1" };
+	struct fts_language_cache_keys keys2 = { .sender_key = "sender:2" };
+	struct fts_language_cache_keys keys3 = { .sender_key = "sender:3" };
+	struct fts_language_cache_keys thread_keys = {
+		.thread_key = "thread:1",
+		.sender_key = "sender:1",
+	};
+	struct fts_language_cache *cache;
+
+	test_begin("fts language cache lru");
+	cache = fts_language_cache_init(2);
+	fts_language_cache_add(cache, &keys1, &test_lang_en);
+	fts_language_cache_add(cache, &keys1, &test_lang_en);
+	fts_language_cache_add(cache, &keys2, &test_lang_fi);
+	fts_language_cache_add(cache, &keys2, &test_lang_fi);
+	/* use 1 so that 2 is dropped when 3 is added */
+	test_assert(fts_language_cache_lookup(cache, &keys1) == &test_lang_en);
+	fts_language_cache_add(cache, &keys3, &test_lang_fi);
+	fts_language_cache_add(cache, &keys3, &test_lang_fi);
+	test_assert(fts_language_cache_lookup(cache, &keys2) == NULL);
+	test_assert(fts_language_cache_lookup(cache, &keys3) == &test_lang_fi);
+	test_assert(fts_language_cache_lookup(cache, &keys1) == &test_lang_en);
+	fts_language_cache_deinit(&cache);
+
+	/* filling in the thread may drop the sender that was just found */
+	cache = fts_language_cache_init(1);
+	fts_language_cache_add(cache, &keys1, &test_lang_en);
+	fts_language_cache_add(cache, &keys1, &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &thread_keys) ==
+		    &test_lang_en);
+	test_assert(fts_language_cache_lookup(cache, &keys1) == NULL);
+	test_assert(fts_language_cache_lookup(cache, &thread_keys) ==
+		    &test_lang_en);
+	fts_language_cache_deinit(&cache);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_language_cache_keys,
+		test_fts_language_cache_trust,
+		test_fts_language_cache_thread,
+		test_fts_language_cache_lru,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,197 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "seq-range-array.h"
+#include "mail-search-build.h"
+#include "test-common.h"
+#include "fts-search-cache.h"
+
+static const char *
+test_search_key(enum mail_search_arg_type type, const char *value,
+		bool fuzzy, enum fts_lookup_flags flags)
+{
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	string_t *key = t_str_new(64);
+
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, type);
+	arg->value.str = p_strdup(args->pool, value);
+	arg->fuzzy = fuzzy;
+	test_assert(fts_search_cache_get_key(key, args->args, flags));
+	mail_search_args_unref(&args);
+	return str_c(key);
+}
+
+static void test_fts_search_cache_key(void)
+{
+	const char *key;
+
+	test_begin("fts search cache key");
+	key = test_search_key(SEARCH_BODY, "foo", FALSE, 0);
+	test_assert_strcmp(key, test_search_key(SEARCH_BODY, "foo", FALSE, 0));
+	test_assert(strcmp(key, test_search_key(SEARCH_BODY, "bar", FALSE, 0)) != 0);
+	test_assert(strcmp(key, test_search_key(SEARCH_TEXT, "foo", FALSE, 0)) != 0);
+	/* FUZZY and the lookup flags affect the results, so they're part of
+	   the key */
+	test_assert(strcmp(key, test_search_key(SEARCH_BODY, "foo", TRUE, 0)) != 0);
+	test_assert(strcmp(key, test_search_key(SEARCH_BODY, "foo", FALSE,
+				FTS_LOOKUP_FLAG_AND_ARGS)) != 0);
+	test_end();
+}
+
+static struct fts_search_cache_entry *
+test_entry_new(const char *key, uint32_t uid_validity, uint32_t last_uid,
+	       uint32_t match_uid)
+{
+	struct fts_search_cache_entry *entry;
+	struct fts_result result;
+	buffer_t *args_matches = t_buffer_create(4);
+
+	i_zero(&result);
+	t_array_init(&result.definite_uids, 1);
+	t_array_init(&result.maybe_uids, 1);
+	t_array_init(&result.scores, 1);
+	seq_range_array_add(&result.definite_uids, match_uid);
+	buffer_append_c(args_matches, 1);
+
+	entry = fts_search_cache_entry_new(key, uid_validity, last_uid);
+	fts_search_cache_entry_add_level(entry, &result, args_matches);
+	return entry;
+}
+
+static uint32_t test_entry_match_uid(struct fts_search_cache_entry *entry)
+{
+	const struct fts_search_cache_level *level;
+	const struct seq_range *range;
+
+	if (array_count(&entry->levels) != 1)
+		return 0;
+	level = array_idx(&entry->levels, 0);
+	if (array_count(&level->definite_uids) != 1)
+		return 0;
+	range = array_idx(&level->definite_uids, 0);
+	return range->seq1 == range->seq2 ? range->seq1 : 0;
+}
+
+static void test_fts_search_cache_hit(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_search_cache_entry *entry;
+
+	test_begin("fts search cache hit");
+	cache = fts_search_cache_init(10);
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 10) == NULL);
+	entry = test_entry_new("a", 1, 10, 5);
+	fts_search_cache_add(cache, &entry);
+	test_assert(entry == NULL);
+
+	entry = fts_search_cache_lookup(cache, "a", 1, 10);
+	test_assert(entry != NULL && entry->last_uid == 10 &&
+		    test_entry_match_uid(entry) == 5);
+	test_assert(fts_search_cache_lookup(cache, "b", 1, 10) == NULL);
+
+	/* adding the same key replaces the old entry */
+	entry = test_entry_new("a", 1, 10, 7);
+	fts_search_cache_add(cache, &entry);
+	entry = fts_search_cache_lookup(cache, "a", 1, 10);
+	test_assert(entry != NULL && test_entry_match_uid(entry) == 7);
+	fts_search_cache_deinit(&cache, NULL);
+	test_end();
+}
+
+static void test_fts_search_cache_invalidation(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_search_cache_entry *entry;
+
+	test_begin("fts search cache invalidation");
+	cache = fts_search_cache_init(10);
+
+	/* UIDVALIDITY changed */
+	entry = test_entry_new("a", 1, 10, 5);
+	fts_search_cache_add(cache, &entry);
+	test_assert(fts_search_cache_lookup(cache, "a", 2, 10) == NULL);
+	/* the entry was dropped */
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 10) == NULL);
+
+	/* the backend's last indexed UID dropped, e.g. the index was
+	   rebuilt */
+	entry = test_entry_new("a", 1, 10, 5);
+	fts_search_cache_add(cache, &entry);
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 9) == NULL);
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 10) == NULL);
+	fts_search_cache_deinit(&cache, NULL);
+	test_end();
+}
+
+static void test_fts_search_cache_refine(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_search_cache_entry *entry;
+
+	test_begin("fts search cache refine");
+	cache = fts_search_cache_init(10);
+	entry = test_entry_new("a", 1, 10, 5);
+	fts_search_cache_add(cache, &entry);
+
+	/* more mails were indexed since the lookup. the entry is returned
+	   with its old last_uid, so the caller can search the new mails
+	   separately. */
+	entry = fts_search_cache_lookup(cache, "a", 1, 20);
+	test_assert(entry != NULL && entry->last_uid == 10 &&
+		    test_entry_match_uid(entry) == 5);
+	/* the entry isn't changed by the lookup */
+	entry = fts_search_cache_lookup(cache, "a", 1, 10);
+	test_assert(entry != NULL && entry->last_uid == 10);
+
+	/* a new lookup replaces it */
+	entry = test_entry_new("a", 1, 20, 15);
+	fts_search_cache_add(cache, &entry);
+	entry = fts_search_cache_lookup(cache, "a", 1, 20);
+	test_assert(entry != NULL && entry->last_uid == 20 &&
+		    test_entry_match_uid(entry) == 15);
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 19) == NULL);
+	fts_search_cache_deinit(&cache, NULL);
+	test_end();
+}
+
+static void test_fts_search_cache_lru(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_search_cache_entry *entry;
+
+	test_begin("fts search cache lru");
+	cache = fts_search_cache_init(2);
+	entry = test_entry_new("a", 1, 10, 1);
+	fts_search_cache_add(cache, &entry);
+	entry = test_entry_new("b", 1, 10, 2);
+	fts_search_cache_add(cache, &entry);
+	/* use a so that b is dropped when c is added */
+	test_assert(fts_search_cache_lookup(cache, "a", 1, 10) != NULL);
+	entry = test_entry_new("c", 1, 10, 3);
+	fts_search_cache_add(cache, &entry);
+	test_assert(fts_search_cache_lookup(cache, "b", 1, 10) == NULL);
+	entry = fts_search_cache_lookup(cache, "a", 1, 10);
+	test_assert(entry != NULL && test_entry_match_uid(entry) == 1);
+	entry = fts_search_cache_lookup(cache, "c", 1, 10);
+	test_assert(entry != NULL && test_entry_match_uid(entry) == 3);
+	fts_search_cache_deinit(&cache, NULL);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_search_cache_key,
+		test_fts_search_cache_hit,
+		test_fts_search_cache_invalidation,
+		test_fts_search_cache_refine,
+		test_fts_search_cache_lru,
+		NULL
+	};
+	return test_run(test_functions);
+}
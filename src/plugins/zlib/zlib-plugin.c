@@ -10,6 +10,7 @@
 #include "index-storage.h"
 #include "index-mail.h"
 #include "compression.h"
+#include "iostream-zstd.h"
 #include "zlib-plugin.h"
 
 #include <fcntl.h>
@@ -46,6 +47,10 @@ struct zlib_user {
 
 	const struct compression_handler *save_handler;
 	unsigned int save_level;
+
+	/* zstd dictionaries that can be used for reading mails. The first
+	   one is used for saving new mails. */
+	ARRAY(struct zstd_dict *) zstd_dicts;
 };
 
 const char *zlib_plugin_version = DOVECOT_ABI_VERSION;
@@ -64,6 +69,25 @@ static bool zlib_mailbox_is_permail(struct mailbox *box)
 		(class_flags & MAIL_STORAGE_CLASS_FLAG_BINARY_DATA) != 0;
 }
 
+static bool zlib_handler_is_zstd(const struct compression_handler *handler)
+{
+	return strcmp(handler->name, "zstd") == 0;
+}
+
+static struct istream *
+zlib_create_istream(struct zlib_user *zuser,
+		    const struct compression_handler *handler,
+		    struct istream *input)
+{
+	if (zlib_handler_is_zstd(handler) &&
+	    array_count(&zuser->zstd_dicts) > 0) {
+		return i_stream_create_zstd_dicts(input, TRUE,
+			array_idx(&zuser->zstd_dicts, 0),
+			array_count(&zuser->zstd_dicts));
+	}
+	return handler->create_istream(input, TRUE);
+}
+
 static void zlib_mail_cache_close(struct zlib_user *zuser)
 {
 	struct zlib_mail_cache *cache = &zuser->cache;
@@ -150,10 +174,18 @@ static int zlib_istream_opened(struct mail *_mail, struct istream **stream)
 		}
 
 		input = *stream;
-		*stream = handler->create_istream(input, TRUE);
+		*stream = zlib_create_istream(zuser, handler, input);
 		i_stream_unref(&input);
-		/* dont cache the stream if _mail->uid is 0 */
-		*stream = zlib_mail_cache_open(zuser, _mail, *stream, (_mail->uid > 0));
+		if (zlib_handler_is_zstd(handler) &&
+		    i_stream_zstd_has_seek_table(*stream)) {
+			/* seeking decompresses only the frame containing the
+			   wanted offset, so there's no need to copy the mail
+			   to a temp file. */
+		} else {
+			/* dont cache the stream if _mail->uid is 0 */
+			*stream = zlib_mail_cache_open(zuser, _mail, *stream,
+						       (_mail->uid > 0));
+		}
 	}
 	return zmail->module_ctx.super.istream_opened(_mail, stream);
 }
@@ -233,8 +265,17 @@ zlib_mail_save_compress_begin(struct mail_save_context *ctx,
 	if (zbox->super.save_begin(ctx, input) < 0)
 		return -1;
 
-	output = zuser->save_handler->create_ostream(ctx->data.output,
-						     zuser->save_level);
+	if (zlib_handler_is_zstd(zuser->save_handler) &&
+	    array_count(&zuser->zstd_dicts) > 0) {
+		struct zstd_dict *const *dictp =
+			array_idx(&zuser->zstd_dicts, 0);
+
+		output = o_stream_create_zstd_dict(ctx->data.output,
+						   zuser->save_level, *dictp);
+	} else {
+		output = zuser->save_handler->create_ostream(ctx->data.output,
+							     zuser->save_level);
+	}
 	o_stream_unref(&ctx->data.output);
 	ctx->data.output = output;
 	o_stream_cork(ctx->data.output);
@@ -255,6 +296,7 @@ zlib_permail_alloc_init(struct mailbox *box, struct mailbox_vfuncs *v)
 
 static void zlib_mailbox_open_input(struct mailbox *box)
 {
+	struct zlib_user *zuser = ZLIB_USER_CONTEXT(box->storage->user);
 	const struct compression_handler *handler;
 	struct istream *input;
 	struct stat st;
@@ -281,7 +323,7 @@ static void zlib_mailbox_open_input(struct mailbox *box)
 		}
 		input = i_stream_create_fd_autoclose(&fd, MAX_INBUF_SIZE);
 		i_stream_set_name(input, box_path);
-		box->input = handler->create_istream(input, TRUE);
+		box->input = zlib_create_istream(zuser, handler, input);
 		i_stream_unref(&input);
 		box->flags |= MAILBOX_FLAG_READONLY;
 	}
@@ -329,11 +371,36 @@ static void zlib_mailbox_allocated(struct mailbox *box)
 static void zlib_mail_user_deinit(struct mail_user *user)
 {
 	struct zlib_user *zuser = ZLIB_USER_CONTEXT(user);
+	struct zstd_dict **dictp;
 
 	zlib_mail_cache_close(zuser);
+	array_foreach_modifiable(&zuser->zstd_dicts, dictp)
+		zstd_dict_unref(dictp);
 	zuser->module_ctx.super.deinit(user);
 }
 
+static void zlib_mail_user_init_zstd_dicts(struct zlib_user *zuser,
+					   struct mail_user *user)
+{
+	struct zstd_dict *dict;
+	const char *set_name, *path, *error;
+	unsigned int i;
+
+	p_array_init(&zuser->zstd_dicts, user->pool, 2);
+	for (i = 1;; i++) {
+		set_name = i == 1 ? "zlib_zstd_dict" :
+			t_strdup_printf("zlib_zstd_dict%u", i);
+		path = mail_user_plugin_getenv(user, set_name);
+		if (path == NULL || path[0] == '\0')
+			break;
+		path = mail_user_home_expand(user, path);
+		if (zstd_dict_create_file(path, &dict, &error) < 0)
+			i_error("%s: %s", set_name, error);
+		else
+			array_append(&zuser->zstd_dicts, &dict, 1);
+	}
+}
+
 static void zlib_mail_user_created(struct mail_user *user)
 {
 	struct mail_user_vfuncs *v = user->vlast;
@@ -365,6 +432,7 @@ static void zlib_mail_user_created(struct mail_user *user)
 	}
 	if (zuser->save_level == 0)
 		zuser->save_level = ZLIB_PLUGIN_DEFAULT_LEVEL;
+	zlib_mail_user_init_zstd_dicts(zuser, user);
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 
@@ -0,0 +1,10 @@
+#ifndef COMMON_H
+#define COMMON_H
+
+#include "lib.h"
+
+extern struct session_cache *session_cache;
+extern struct ticket_keys *ticket_keys;
+extern struct event *ssl_session_cache_event;
+
+#endif
@@ -0,0 +1,95 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "common.h"
+#include "lib-signals.h"
+#include "restrict-access.h"
+#include "master-service.h"
+#include "master-service-settings.h"
+#include "session-cache.h"
+#include "ticket-keys.h"
+#include "ssl-session-cache-connection.h"
+#include "ssl-session-cache-settings.h"
+
+#include <signal.h>
+
+struct session_cache *session_cache;
+struct ticket_keys *ticket_keys;
+struct event *ssl_session_cache_event;
+
+static void sig_session_cache_stats(const siginfo_t *si ATTR_UNUSED,
+				    void *context ATTR_UNUSED)
+{
+	struct session_cache_stats stats;
+	unsigned int total_count;
+
+	session_cache_get_stats(session_cache, &stats);
+	total_count = stats.hit_count + stats.miss_count;
+	i_info("SSL session cache hits %u/%u (%u%%), "
+	       "%u entries using %"PRIuSIZE_T" bytes "
+	       "(%"PRIuSIZE_T" bytes allocated)",
+	       stats.hit_count, total_count,
+	       total_count == 0 ? 100 : (stats.hit_count * 100 / total_count),
+	       stats.entries, stats.size, stats.alloc_size);
+}
+
+static void client_connected(struct master_service_connection *conn)
+{
+	master_service_client_connection_accept(conn);
+	ssl_session_cache_connection_create(conn->fd);
+}
+
+static void main_init(void)
+{
+	void **sets = master_service_settings_get_others(master_service);
+	const struct ssl_session_cache_settings *set = sets[0];
+
+	ssl_session_cache_event = event_create(NULL);
+	session_cache = session_cache_init(set->ssl_session_cache_size);
+	ticket_keys = ticket_keys_init(set->ssl_session_ticket_key_rotate_interval);
+	ssl_session_cache_connections_init();
+	lib_signals_set_handler(SIGUSR2, LIBSIG_FLAGS_SAFE,
+				sig_session_cache_stats, NULL);
+}
+
+static void main_deinit(void)
+{
+	lib_signals_unset_handler(SIGUSR2, sig_session_cache_stats, NULL);
+	ssl_session_cache_connections_deinit();
+	ticket_keys_deinit(&ticket_keys);
+	session_cache_deinit(&session_cache);
+	event_unref(&ssl_session_cache_event);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct setting_parser_info *set_roots[] = {
+		&ssl_session_cache_setting_parser_info,
+		NULL
+	};
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_UPDATE_PROCTITLE;
+	const char *error;
+
+	master_service = master_service_init("ssl-session-cache",
+					     service_flags, &argc, &argv, "");
+	if (master_getopt(master_service) > 0)
+		return FATAL_DEFAULT;
+	if (master_service_settings_read_simple(master_service, set_roots,
+						&error) < 0)
+		i_fatal("Error reading configuration: %s", error);
+	master_service_init_log(master_service, "ssl-session-cache: ");
+
+	restrict_access_by_env(RESTRICT_ACCESS_FLAG_ALLOW_ROOT, NULL);
+	restrict_access_allow_coredumps(TRUE);
+
+	/* the sessions and ticket keys are lost if we die, so stay alive
+	   until all the login processes are gone */
+	master_service_set_die_with_master(master_service, FALSE);
+
+	master_service_init_finish(master_service);
+	main_init();
+	master_service_run(master_service, client_connected);
+	main_deinit();
+	master_service_deinit(&master_service);
+	return 0;
+}
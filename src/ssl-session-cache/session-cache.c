@@ -0,0 +1,175 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "hash.h"
+#include "session-cache.h"
+
+struct session_cache_node {
+	struct session_cache_node *prev, *next;
+
+	time_t expire_time;
+	size_t alloc_size;
+	char data[4]; /* id \0 data \0 */
+};
+
+struct session_cache {
+	pool_t node_pool;
+	HASH_TABLE(char *, struct session_cache_node *) hash;
+	/* head is the most recently used node, tail the least */
+	struct session_cache_node *head, *tail;
+
+	size_t max_size, size_left;
+	unsigned int hit_count, miss_count;
+};
+
+struct session_cache *session_cache_init(size_t max_size)
+{
+	struct session_cache *cache;
+
+	cache = i_new(struct session_cache, 1);
+	cache->node_pool = pool_slab_create("ssl session cache nodes");
+	hash_table_create(&cache->hash, cache->node_pool, 0, str_hash, strcmp);
+	cache->max_size = max_size;
+	cache->size_left = max_size;
+	return cache;
+}
+
+static void
+session_cache_node_unlink(struct session_cache *cache,
+			  struct session_cache_node *node)
+{
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else {
+		/* unlinking tail */
+		cache->tail = node->next;
+	}
+
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	else {
+		/* unlinking head */
+		cache->head = node->prev;
+	}
+}
+
+static void
+session_cache_node_link_head(struct session_cache *cache,
+			     struct session_cache_node *node)
+{
+	node->prev = cache->head;
+	node->next = NULL;
+
+	cache->head = node;
+	if (node->prev != NULL)
+		node->prev->next = node;
+	else
+		cache->tail = node;
+}
+
+static void
+session_cache_node_destroy(struct session_cache *cache,
+			   struct session_cache_node *node)
+{
+	char *key = node->data;
+
+	session_cache_node_unlink(cache, node);
+
+	cache->size_left += node->alloc_size;
+	hash_table_remove(cache->hash, key);
+	p_free(cache->node_pool, node);
+}
+
+void session_cache_deinit(struct session_cache **_cache)
+{
+	struct session_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->tail != NULL)
+		session_cache_node_destroy(cache, cache->tail);
+	hash_table_destroy(&cache->hash);
+	pool_unref(&cache->node_pool);
+	i_free(cache);
+}
+
+void session_cache_add(struct session_cache *cache, const char *id,
+		       time_t expire_time, const char *data)
+{
+	struct session_cache_node *node;
+	size_t id_len = strlen(id), data_len = strlen(data);
+	size_t alloc_size;
+	char *key;
+
+	if (expire_time <= ioloop_time)
+		return;
+
+	alloc_size = sizeof(*node) - sizeof(node->data) +
+		id_len + 1 + data_len + 1;
+	if (alloc_size > cache->max_size)
+		return;
+
+	node = hash_table_lookup(cache->hash, id);
+	if (node != NULL) {
+		/* replace the old session */
+		session_cache_node_destroy(cache, node);
+	}
+	/* make sure we have enough space */
+	while (cache->size_left < alloc_size)
+		session_cache_node_destroy(cache, cache->tail);
+
+	/* @UNSAFE */
+	node = p_malloc(cache->node_pool, alloc_size);
+	node->expire_time = expire_time;
+	node->alloc_size = alloc_size;
+	memcpy(node->data, id, id_len);
+	memcpy(node->data + id_len + 1, data, data_len);
+
+	session_cache_node_link_head(cache, node);
+	cache->size_left -= alloc_size;
+	key = node->data;
+	hash_table_insert(cache->hash, key, node);
+}
+
+const char *session_cache_lookup(struct session_cache *cache, const char *id)
+{
+	struct session_cache_node *node;
+
+	node = hash_table_lookup(cache->hash, id);
+	if (node != NULL && node->expire_time <= ioloop_time) {
+		session_cache_node_destroy(cache, node);
+		node = NULL;
+	}
+	if (node == NULL) {
+		cache->miss_count++;
+		return NULL;
+	}
+
+	cache->hit_count++;
+	if (node != cache->head) {
+		/* move to head */
+		session_cache_node_unlink(cache, node);
+		session_cache_node_link_head(cache, node);
+	}
+	return node->data + strlen(node->data) + 1;
+}
+
+void session_cache_remove(struct session_cache *cache, const char *id)
+{
+	struct session_cache_node *node;
+
+	node = hash_table_lookup(cache->hash, id);
+	if (node != NULL)
+		session_cache_node_destroy(cache, node);
+}
+
+void session_cache_get_stats(struct session_cache *cache,
+			     struct session_cache_stats *stats_r)
+{
+	i_zero(stats_r);
+	stats_r->hit_count = cache->hit_count;
+	stats_r->miss_count = cache->miss_count;
+	stats_r->entries = hash_table_count(cache->hash);
+	stats_r->size = cache->max_size - cache->size_left;
+	stats_r->alloc_size = pool_slab_get_total_alloc_size(cache->node_pool);
+}
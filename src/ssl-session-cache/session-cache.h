@@ -0,0 +1,28 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+struct session_cache_stats {
+	unsigned int hit_count, miss_count;
+	unsigned int entries;
+	size_t size;
+	/* memory allocated from the system for the entries */
+	size_t alloc_size;
+};
+
+/* Create a new LRU cache for TLS sessions. The oldest sessions are dropped
+   once the cache uses more than max_size bytes of memory. */
+struct session_cache *session_cache_init(size_t max_size);
+void session_cache_deinit(struct session_cache **cache);
+
+/* Add session data for the given session ID. The session is forgotten after
+   expire_time. */
+void session_cache_add(struct session_cache *cache, const char *id,
+		       time_t expire_time, const char *data);
+/* Returns the session data or NULL if it's not found or has expired. */
+const char *session_cache_lookup(struct session_cache *cache, const char *id);
+void session_cache_remove(struct session_cache *cache, const char *id);
+
+void session_cache_get_stats(struct session_cache *cache,
+			     struct session_cache_stats *stats_r);
+
+#endif
@@ -0,0 +1,169 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "common.h"
+#include "base64.h"
+#include "str.h"
+#include "strescape.h"
+#include "connection.h"
+#include "ostream.h"
+#include "master-service.h"
+#include "iostream-ssl.h"
+#include "session-cache.h"
+#include "ticket-keys.h"
+#include "ssl-session-cache-connection.h"
+
+/* session data is base64-encoded. the sessions are typically less than 2 kB,
+   but they may contain client certificates. */
+#define MAX_INBUF_SIZE (64*1024)
+
+static struct connection_list *ssl_session_cache_connections = NULL;
+
+void ssl_session_cache_connection_create(int fd)
+{
+	struct connection *conn;
+
+	conn = i_new(struct connection, 1);
+	connection_init_server(ssl_session_cache_connections, conn,
+			       "ssl-session-cache", fd, fd);
+}
+
+static void ssl_session_cache_connection_destroy(struct connection *conn)
+{
+	connection_deinit(conn);
+	i_free(conn);
+
+	master_service_client_connection_destroyed(master_service);
+}
+
+static int
+ssl_session_cache_input_add(struct connection *conn, const char *const *args)
+{
+	time_t expire_time;
+
+	/* <session id> <expire time> <data> */
+	if (str_array_length(args) < 3 || args[0][0] == '\0' ||
+	    args[2][0] == '\0' || str_to_time(args[1], &expire_time) < 0) {
+		i_error("%s: ADD: Invalid parameters", conn->name);
+		return -1;
+	}
+	session_cache_add(session_cache, args[0], expire_time, args[2]);
+	return 1;
+}
+
+static int
+ssl_session_cache_input_lookup(struct connection *conn,
+			       const char *const *args)
+{
+	const char *data;
+
+	/* <session id> */
+	if (args[0] == NULL) {
+		i_error("%s: LOOKUP: Invalid parameters", conn->name);
+		return -1;
+	}
+	data = session_cache_lookup(session_cache, args[0]);
+	e_debug(event_create_passthrough(ssl_session_cache_event)->
+		set_name("ssl_session_cache_lookup")->
+		add_str("result", data != NULL ? "hit" : "miss")->event(),
+		"Session %s: %s", args[0], data != NULL ? "hit" : "miss");
+
+	/* reply with an empty line if not found */
+	o_stream_nsend_str(conn->output,
+			   t_strconcat(data == NULL ? "" : data, "\n", NULL));
+	return 1;
+}
+
+static int
+ssl_session_cache_input_remove(struct connection *conn,
+			       const char *const *args)
+{
+	/* <session id> */
+	if (args[0] == NULL) {
+		i_error("%s: REMOVE: Invalid parameters", conn->name);
+		return -1;
+	}
+	session_cache_remove(session_cache, args[0]);
+	return 1;
+}
+
+static int ssl_session_cache_input_ticket_keys(struct connection *conn)
+{
+	const struct ssl_iostream_ticket_key *keys;
+	unsigned int i, count, refresh_secs;
+	string_t *str = t_str_new(256);
+
+	/* reply: <secs until keys should be refreshed> <key1> [<key2> ...] */
+	keys = ticket_keys_get(ticket_keys, &count, &refresh_secs);
+	str_printfa(str, "%u", refresh_secs);
+	for (i = 0; i < count; i++) {
+		str_append_c(str, '\t');
+		base64_encode(&keys[i], sizeof(keys[i]), str);
+	}
+	str_append_c(str, '\n');
+	o_stream_nsend(conn->output, str_data(str), str_len(str));
+	return 1;
+}
+
+static int
+ssl_session_cache_input_ticket(struct connection *conn,
+			       const char *const *args)
+{
+	/* <hit|renew|miss> */
+	if (args[0] == NULL) {
+		i_error("%s: TICKET: Invalid parameters", conn->name);
+		return -1;
+	}
+	e_debug(event_create_passthrough(ssl_session_cache_event)->
+		set_name("ssl_session_ticket_decrypted")->
+		add_str("result", args[0])->event(),
+		"Session ticket: %s", args[0]);
+	return 1;
+}
+
+static int
+ssl_session_cache_input_args(struct connection *conn, const char *const *args)
+{
+	const char *cmd = args[0];
+
+	args++;
+	if (strcmp(cmd, "ADD") == 0)
+		return ssl_session_cache_input_add(conn, args);
+	else if (strcmp(cmd, "LOOKUP") == 0)
+		return ssl_session_cache_input_lookup(conn, args);
+	else if (strcmp(cmd, "REMOVE") == 0)
+		return ssl_session_cache_input_remove(conn, args);
+	else if (strcmp(cmd, "TICKET-KEYS") == 0)
+		return ssl_session_cache_input_ticket_keys(conn);
+	else if (strcmp(cmd, "TICKET") == 0)
+		return ssl_session_cache_input_ticket(conn, args);
+	i_error("%s: Unknown command: %s", conn->name, cmd);
+	return -1;
+}
+
+static struct connection_settings ssl_session_cache_connection_set = {
+	.service_name_in = "ssl-session-cache-client",
+	.service_name_out = "ssl-session-cache-server",
+	.major_version = 1,
+	.minor_version = 0,
+	.dont_send_version = TRUE,
+	.input_max_size = MAX_INBUF_SIZE,
+	.output_max_size = (size_t)-1,
+	.client = FALSE,
+};
+
+static const struct connection_vfuncs ssl_session_cache_connection_vfuncs = {
+	.destroy = ssl_session_cache_connection_destroy,
+	.input_args = ssl_session_cache_input_args,
+};
+
+void ssl_session_cache_connections_init(void)
+{
+	ssl_session_cache_connections =
+		connection_list_init(&ssl_session_cache_connection_set,
+				     &ssl_session_cache_connection_vfuncs);
+}
+
+void ssl_session_cache_connections_deinit(void)
+{
+	connection_list_deinit(&ssl_session_cache_connections);
+}
@@ -0,0 +1,9 @@
+#ifndef SSL_SESSION_CACHE_CONNECTION_H
+#define SSL_SESSION_CACHE_CONNECTION_H
+
+void ssl_session_cache_connection_create(int fd);
+
+void ssl_session_cache_connections_init(void);
+void ssl_session_cache_connections_deinit(void);
+
+#endif
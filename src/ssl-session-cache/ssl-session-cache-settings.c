@@ -0,0 +1,102 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "settings-parser.h"
+#include "service-settings.h"
+#include "ssl-session-cache-settings.h"
+
+static bool ssl_session_cache_settings_check(void *_set, pool_t pool,
+					     const char **error_r);
+
+/* <settings checks> */
+static struct file_listener_settings ssl_session_cache_unix_listeners_array[] = {
+	{ "ssl-session-cache", 0600, "", "" }
+};
+static struct file_listener_settings *ssl_session_cache_unix_listeners[] = {
+	&ssl_session_cache_unix_listeners_array[0]
+};
+static buffer_t ssl_session_cache_unix_listeners_buf = {
+	ssl_session_cache_unix_listeners,
+	sizeof(ssl_session_cache_unix_listeners), { NULL, }
+};
+/* </settings checks> */
+
+struct service_settings ssl_session_cache_service_settings = {
+	.name = "ssl-session-cache",
+	.protocol = "",
+	.type = "",
+	.executable = "ssl-session-cache",
+	.user = "$default_internal_user",
+	.group = "",
+	.privileged_group = "",
+	.extra_groups = "",
+	.chroot = "empty",
+
+	.drop_priv_before_exec = FALSE,
+
+	.process_min_avail = 0,
+	.process_limit = 1,
+	.client_limit = 0,
+	.service_count = 0,
+	.idle_kill = UINT_MAX,
+	.vsz_limit = (uoff_t)-1,
+
+	.unix_listeners = { { &ssl_session_cache_unix_listeners_buf,
+			      sizeof(ssl_session_cache_unix_listeners[0]) } },
+	.fifo_listeners = ARRAY_INIT,
+	.inet_listeners = ARRAY_INIT,
+
+	.process_limit_1 = TRUE
+};
+
+#undef DEF
+#define DEF(type, name) \
+	{ type, #name, offsetof(struct ssl_session_cache_settings, name), NULL }
+
+static const struct setting_define ssl_session_cache_setting_defines[] = {
+	DEF(SET_SIZE, ssl_session_cache_size),
+	DEF(SET_TIME, ssl_session_ticket_key_rotate_interval),
+
+	SETTING_DEFINE_LIST_END
+};
+
+static const struct ssl_session_cache_settings ssl_session_cache_default_settings = {
+	.ssl_session_cache_size = 10*1024*1024,
+	.ssl_session_ticket_key_rotate_interval = 60*60
+};
+
+const struct setting_parser_info ssl_session_cache_setting_parser_info = {
+	.module_name = "ssl-session-cache",
+	.defines = ssl_session_cache_setting_defines,
+	.defaults = &ssl_session_cache_default_settings,
+
+	.type_offset = (size_t)-1,
+	.struct_size = sizeof(struct ssl_session_cache_settings),
+
+	.parent_offset = (size_t)-1,
+
+	.check_func = ssl_session_cache_settings_check
+};
+
+/* <settings checks> */
+/* the rotation is done with a timeout, which can't be longer than this */
+#define SSL_SESSION_TICKET_KEY_ROTATE_INTERVAL_MAX (UINT_MAX / 1000)
+
+static bool ssl_session_cache_settings_check(void *_set,
+					     pool_t pool ATTR_UNUSED,
+					     const char **error_r)
+{
+	struct ssl_session_cache_settings *set = _set;
+
+	if (set->ssl_session_ticket_key_rotate_interval >
+	    SSL_SESSION_TICKET_KEY_ROTATE_INTERVAL_MAX) {
+		*error_r = t_strdup_printf(
+			"ssl_session_ticket_key_rotate_interval can't be "
+			"larger than %u secs",
+			SSL_SESSION_TICKET_KEY_ROTATE_INTERVAL_MAX);
+		return FALSE;
+	}
+	return TRUE;
+}
+/* </settings checks> */
@@ -0,0 +1,11 @@
+#ifndef SSL_SESSION_CACHE_SETTINGS_H
+#define SSL_SESSION_CACHE_SETTINGS_H
+
+struct ssl_session_cache_settings {
+	uoff_t ssl_session_cache_size;
+	unsigned int ssl_session_ticket_key_rotate_interval;
+};
+
+extern const struct setting_parser_info ssl_session_cache_setting_parser_info;
+
+#endif
@@ -0,0 +1,97 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "session-cache.h"
+#include "test-common.h"
+
+static void test_session_cache_lookup(void)
+{
+	struct session_cache *cache;
+	struct session_cache_stats stats;
+
+	test_begin("session cache lookup");
+	ioloop_time = 1000000;
+	cache = session_cache_init(1024*1024);
+
+	test_assert(session_cache_lookup(cache, "id1") == NULL);
+	session_cache_add(cache, "id1", ioloop_time + 10, "data1");
+	session_cache_add(cache, "id2", ioloop_time + 20, "data2");
+	test_assert_strcmp(session_cache_lookup(cache, "id1"), "data1");
+	test_assert_strcmp(session_cache_lookup(cache, "id2"), "data2");
+
+	/* replace */
+	session_cache_add(cache, "id1", ioloop_time + 10, "data1b");
+	test_assert_strcmp(session_cache_lookup(cache, "id1"), "data1b");
+
+	/* remove */
+	session_cache_remove(cache, "id2");
+	test_assert(session_cache_lookup(cache, "id2") == NULL);
+	session_cache_remove(cache, "id2");
+
+	/* already expired sessions aren't added */
+	session_cache_add(cache, "id3", ioloop_time, "data3");
+	test_assert(session_cache_lookup(cache, "id3") == NULL);
+
+	session_cache_get_stats(cache, &stats);
+	test_assert(stats.hit_count == 3);
+	test_assert(stats.miss_count == 3);
+	test_assert(stats.entries == 1);
+
+	/* expire */
+	ioloop_time += 10;
+	test_assert(session_cache_lookup(cache, "id1") == NULL);
+	session_cache_get_stats(cache, &stats);
+	test_assert(stats.entries == 0);
+	test_assert(stats.size == 0);
+
+	session_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_session_cache_lru(void)
+{
+	struct session_cache *cache;
+	struct session_cache_stats stats;
+	char data[101], big_data[1025];
+	unsigned int i;
+
+	memset(data, 'x', sizeof(data)-1);
+	data[sizeof(data)-1] = '\0';
+	memset(big_data, 'x', sizeof(big_data)-1);
+	big_data[sizeof(big_data)-1] = '\0';
+
+	test_begin("session cache lru");
+	ioloop_time = 1000000;
+	cache = session_cache_init(1024);
+
+	for (i = 0; i < 100; i++) {
+		session_cache_add(cache, t_strdup_printf("id%u", i),
+				  ioloop_time + 10, data);
+		/* keep the first session in use */
+		test_assert(session_cache_lookup(cache, "id0") != NULL);
+	}
+	session_cache_get_stats(cache, &stats);
+	test_assert(stats.size <= 1024);
+	test_assert(stats.entries > 1 && stats.entries < 10);
+	test_assert(session_cache_lookup(cache, "id99") != NULL);
+	test_assert(session_cache_lookup(cache, "id1") == NULL);
+
+	/* too large sessions aren't added */
+	session_cache_add(cache, "big", ioloop_time + 10, big_data);
+	test_assert(session_cache_lookup(cache, "big") == NULL);
+	test_assert(session_cache_lookup(cache, "id0") != NULL);
+
+	session_cache_deinit(&cache);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_session_cache_lookup,
+		test_session_cache_lru,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "randgen.h"
+#include "safe-memset.h"
+#include "iostream-ssl.h"
+#include "ticket-keys.h"
+
+/* the keys are never rotated, but the clients still check them
+   occasionally in case we get restarted */
+#define TICKET_KEYS_NO_ROTATE_REFRESH_SECS (60*60)
+
+struct ticket_keys {
+	/* newest key first */
+	struct ssl_iostream_ticket_key keys[TICKET_KEYS_COUNT];
+	unsigned int count;
+
+	unsigned int rotate_interval;
+	time_t next_rotate;
+	struct timeout *to_rotate;
+};
+
+static void ticket_keys_rotate(struct ticket_keys *keys)
+{
+	if (keys->count == TICKET_KEYS_COUNT)
+		keys->count--;
+	memmove(keys->keys + 1, keys->keys,
+		sizeof(keys->keys[0]) * keys->count);
+	random_fill(&keys->keys[0], sizeof(keys->keys[0]));
+	keys->count++;
+
+	keys->next_rotate = ioloop_time + keys->rotate_interval;
+}
+
+struct ticket_keys *ticket_keys_init(unsigned int rotate_interval)
+{
+	struct ticket_keys *keys;
+
+	keys = i_new(struct ticket_keys, 1);
+	keys->rotate_interval = rotate_interval;
+	ticket_keys_rotate(keys);
+	if (rotate_interval > 0) {
+		keys->to_rotate = timeout_add(rotate_interval * 1000,
+					      ticket_keys_rotate, keys);
+	}
+	return keys;
+}
+
+void ticket_keys_deinit(struct ticket_keys **_keys)
+{
+	struct ticket_keys *keys = *_keys;
+
+	*_keys = NULL;
+	timeout_remove(&keys->to_rotate);
+	safe_memset(keys->keys, 0, sizeof(keys->keys));
+	i_free(keys);
+}
+
+const struct ssl_iostream_ticket_key *
+ticket_keys_get(struct ticket_keys *keys, unsigned int *count_r,
+		unsigned int *refresh_secs_r)
+{
+	if (keys->rotate_interval == 0)
+		*refresh_secs_r = TICKET_KEYS_NO_ROTATE_REFRESH_SECS;
+	else if (keys->next_rotate <= ioloop_time)
+		*refresh_secs_r = 1;
+	else
+		*refresh_secs_r = keys->next_rotate - ioloop_time;
+	*count_r = keys->count;
+	return keys->keys;
+}
@@ -0,0 +1,24 @@
+#ifndef TICKET_KEYS_H
+#define TICKET_KEYS_H
+
+struct ssl_iostream_ticket_key;
+
+/* Number of keys that are kept. Tickets encrypted with the previous keys can
+   still be decrypted, so they stay valid for at least
+   (TICKET_KEYS_COUNT-1) * rotate_interval. */
+#define TICKET_KEYS_COUNT 3
+
+/* Generate new random TLS session ticket keys. A new key is added and the
+   oldest key is dropped every rotate_interval seconds. 0 means the keys are
+   never rotated. */
+struct ticket_keys *ticket_keys_init(unsigned int rotate_interval);
+void ticket_keys_deinit(struct ticket_keys **keys);
+
+/* Returns the current keys. The first key is used for encrypting new
+   tickets. refresh_secs_r is set to the number of seconds until the keys are
+   rotated next time. */
+const struct ssl_iostream_ticket_key *
+ticket_keys_get(struct ticket_keys *keys, unsigned int *count_r,
+		unsigned int *refresh_secs_r);
+
+#endif